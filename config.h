@@ -3,8 +3,9 @@
 
 #define FUSE_USE_VERSION 26
 
-// need this to get pwrite().  I have to use setvbuf() instead of
+// need this to get pwrite(), and the Linux specific calls (statx,
+// getdents64, openat and friends).  I have to use setvbuf() instead of
 // setlinebuf() later in consequence.
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #endif
@@ -1,20 +1,62 @@
 #include "config.h"
+#include "undofs_cachepolicy.h"
+#include "undofs_clone.h"
 #include "undofs_fops.h"
+#include "undofs_meta.h"
+#include "undofs_opwrap.h"
 #include "undofs_util.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
 #include <fuse.h>
+#include <fuse_opt.h>
+#include <unistd.h>
+
+#define UNDOFS_OPT(t, p, v) { t, offsetof(undofs_state, p), v }
+
+static struct fuse_opt undofs_opts[] = {
+    UNDOFS_OPT("trace=%s", trace_path, 0),
+    UNDOFS_OPT("trace_size=%lu", trace_size_mb, 0),
+    UNDOFS_OPT("capture=%s", capture_path, 0),
+    UNDOFS_OPT("syscall_stats", syscall_stats, 1),
+    UNDOFS_OPT("slow_ms=%lu", slow_ms, 0),
+    UNDOFS_OPT("clone_threads=%d", clone_threads, 0),
+    UNDOFS_OPT("clone=%s", clone_method, 0),
+    UNDOFS_OPT("clone_cache=%s", clone_cache, 0),
+    UNDOFS_OPT("cache_policy=%s", cache_policy, 0),
+    UNDOFS_OPT("cache_rules=%s", cache_rules, 0),
+    UNDOFS_OPT("mirror=%s", mirror_path, 0),
+    UNDOFS_OPT("scrub_rate=%lu", scrub_rate_mb, 0),
+    UNDOFS_OPT("scrub_quarantine", scrub_quarantine, 1),
+    UNDOFS_OPT("inline_max=%lu", inline_max, 0),
+    FUSE_OPT_END
+};
+
+// fuse changes to / when it daemonizes, so relative paths won't do.
+static void make_absolute(char **path)
+{
+    char cwd[PATH_MAX], *absolute;
+
+    if(*path == NULL || (*path)[0] == '/')
+        return;
+
+    absolute = malloc(PATH_MAX);
+    if(getcwd(cwd, PATH_MAX) == NULL || absolute == NULL)
+        exit(1);
+    snprintf(absolute, PATH_MAX, "%s/%s", cwd, *path);
+    *path = absolute;
+}
 
 int main(int argc, char *argv[])
 {
     int fuse_stat;
-    void *priv_data;
+    undofs_state *priv_data;
 
     if(argc < 3)
     {
-        fprintf(stderr, "Usage: undofs [fuse options] <source root> <mountpoint>\n");
+        fprintf(stderr, "Usage: undofs [fuse options] [-o trace=<file>,trace_size=<MiB>] [-o capture=<file>] [-o syscall_stats] [-o slow_ms=<ms>] [-o clone_threads=<n>] [-o clone=auto|reflink|copy_range|readwrite] [-o clone_cache=keep|drop|direct] [-o cache_policy=both|direct_io|drop_backing,cache_rules=<file>] [-o mirror=<dir>] [-o scrub_rate=<MiB/s>,scrub_quarantine] [-o inline_max=<bytes>] <source root> <mountpoint>\n");
         exit(1);
     }
 
@@ -25,9 +67,61 @@ int main(int argc, char *argv[])
     argv[argc-1] = NULL;
     argc--;
 
+    // Pick out the undofs options, and pass the rest on to fuse.
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if(fuse_opt_parse(&args, priv_data, undofs_opts, NULL) == -1)
+        exit(1);
+    // Files report the inode number of their node, see undofs_scan.h.
+    fuse_opt_add_arg(&args, "-ouse_ino");
+
+    if(priv_data->clone_threads < 1 || priv_data->clone_threads > UNDOFS_CLONE_MAX_THREADS)
+    {
+        fprintf(stderr, "clone_threads must be between 1 and %d\n", UNDOFS_CLONE_MAX_THREADS);
+        exit(1);
+    }
+    if(priv_data->clone_method && undofs_clone_method_parse(priv_data->clone_method) < 0)
+    {
+        fprintf(stderr, "clone must be one of auto, reflink, copy_range or readwrite\n");
+        exit(1);
+    }
+    if(priv_data->clone_cache && undofs_clone_cache_parse(priv_data->clone_cache) < 0)
+    {
+        fprintf(stderr, "clone_cache must be one of keep, drop or direct\n");
+        exit(1);
+    }
+    if(priv_data->cache_policy && undofs_cachepolicy_parse(priv_data->cache_policy) < 0)
+    {
+        fprintf(stderr, "cache_policy must be one of both, direct_io or drop_backing\n");
+        exit(1);
+    }
+    if(priv_data->cache_policy)
+        undofs_cachepolicy_set_default(undofs_cachepolicy_parse(priv_data->cache_policy));
+    if(priv_data->cache_rules)
+    {
+        int line;
+        if(undofs_cachepolicy_load(priv_data->cache_rules, &line) != 0)
+        {
+            if(line > 0)
+                fprintf(stderr, "%s:%d: expected <pattern> both|direct_io|drop_backing\n", priv_data->cache_rules, line);
+            else
+                perror(priv_data->cache_rules);
+            exit(1);
+        }
+    }
+    if(priv_data->inline_max > UNDOFS_META_INLINE_LIMIT)
+    {
+        fprintf(stderr, "inline_max can be at most %d\n", UNDOFS_META_INLINE_LIMIT);
+        exit(1);
+    }
+
+    make_absolute(&priv_data->trace_path);
+    make_absolute(&priv_data->capture_path);
+    make_absolute(&priv_data->mirror_path);
+
     fprintf(stderr, "Calling fuse_main.\n");
-    fuse_stat = fuse_main(argc, argv, undofs_operations(), priv_data);
+    fuse_stat = fuse_main(args.argc, args.argv, undofs_opwrap(undofs_operations()), priv_data);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
-    
+
+    fuse_opt_free_args(&args);
     return fuse_stat;
 }
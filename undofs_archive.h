@@ -0,0 +1,64 @@
+#ifndef __UNDOFS_ARCHIVE_H_
+#define __UNDOFS_ARCHIVE_H_
+#include "config.h"
+
+#include <stdint.h>
+
+/*
+ * Archive format, shared between undofs-export and undofs-import.
+ *
+ * An archive is a header followed by a stream of entries, each a fixed
+ * size entry header, a path relative to the store root (not terminated),
+ * and for files a payload of exactly size bytes. Node directories come
+ * before anything inside them. The markers of a node ("dir", "deleted",
+ * and the purge and born generations) are fields of its entry rather than
+ * files of their own.
+ *
+ * All integers are in host byte order: archives are meant to be restored
+ * on the same kind of machine.
+ */
+
+#define UNDOFS_ARCHIVE_MAGIC "UNDOARCH"
+#define UNDOFS_ARCHIVE_FORMAT 2
+
+enum undofs_archive_kind {
+    UNDOFS_ARCHIVE_NODE = 1,    // a node directory
+    UNDOFS_ARCHIVE_FILE = 2,    // a version, or the meta file of a node
+    UNDOFS_ARCHIVE_END = 3,     // size holds the number of entries before it
+};
+
+enum undofs_archive_node_flags {
+    UNDOFS_ARCHIVE_DIR = 1,
+    UNDOFS_ARCHIVE_DELETED = 2,
+};
+
+/**
+ * Archive header, 32 bytes.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t entry_size;
+    int64_t since_ns;           // only changes after this time, 0 for a full archive
+    int64_t snapshot_ns;        // when the export started
+} undofs_archive_header;
+
+/**
+ * Entry header, 64 bytes.
+ */
+typedef struct {
+    uint32_t kind;              // enum undofs_archive_kind
+    uint32_t mode;              // including the file type
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t flags;             // nodes: enum undofs_archive_node_flags
+    uint32_t path_len;
+    int64_t atime_ns;
+    int64_t mtime_ns;
+    uint32_t purge_gen;         // nodes: see UNDOFS_PURGE_MARKER, 0 without one
+    uint32_t born;              // nodes: see UNDOFS_BORN_MARKER, 0 without one
+    uint64_t rdev;              // device files
+    uint64_t size;              // payload: file data, or the target of a symbolic link
+} undofs_archive_entry;
+
+#endif
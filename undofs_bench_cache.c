@@ -0,0 +1,131 @@
+#include "config.h"
+#include "undofs_cache.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmark for node cache lookups from many threads, the way fuse worker
+// threads do them: each thread looks up random cached nodes, with and
+// without a thread that keeps invalidating nodes at the same time.
+//
+// usage: undofs-bench-cache [nodes] [workdir]
+//
+// The workdir gets the generation file and snapshot of the cache, which
+// are removed afterwards.
+
+#define LOOKUPS 500000
+#define MAX_THREADS 16
+
+static char root[PATH_MAX];
+static long nodes;
+static volatile int writing;
+
+static double monotonic_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void node_path(char *path, long i)
+{
+    snprintf(path, PATH_MAX, "%s/dir%ld.node/file%ld.node", root, i % 100, i);
+}
+
+static void *lookup_worker(void *arg)
+{
+    unsigned seed = (unsigned) (long) arg;
+    char path[PATH_MAX];
+    undofs_node_info info;
+    long i, found = 0;
+
+    for(i = 0; i < LOOKUPS; i++)
+    {
+        node_path(path, rand_r(&seed) % nodes);
+        found += undofs_cache_lookup(path, &info) > 0;
+    }
+    return (void *) found;
+}
+
+static void *invalidate_worker(void *arg)
+{
+    unsigned seed = 1;
+    char path[PATH_MAX];
+    undofs_node_info info = { 1, 0, 0 };
+
+    while(writing)
+    {
+        node_path(path, rand_r(&seed) % nodes);
+        undofs_cache_invalidate(path);
+        undofs_cache_store(path, &info, undofs_cache_ticket());
+    }
+    return NULL;
+}
+
+static double run(int threads, int with_writer)
+{
+    pthread_t workers[MAX_THREADS], writer;
+    double start = monotonic_s();
+    int i;
+
+    writing = with_writer;
+    if(with_writer)
+        pthread_create(&writer, NULL, invalidate_worker, NULL);
+    for(i = 0; i < threads; i++)
+        pthread_create(&workers[i], NULL, lookup_worker, (void *) (long) (i + 1));
+    for(i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+    double elapsed = monotonic_s() - start;
+    writing = 0;
+    if(with_writer)
+        pthread_join(writer, NULL);
+    return (double) threads * LOOKUPS / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    char path[PATH_MAX];
+    int threads[] = { 1, 2, 4, 8, 16 };
+    undofs_node_info info = { 1, 0, 0 };
+    unsigned i;
+    long n;
+
+    nodes = argc > 1 ? atol(argv[1]) : 100000;
+    snprintf(root, PATH_MAX, "%s", argc > 2 ? argv[2] : ".");
+    if(nodes < 1 || undofs_cache_open(root) != 0)
+    {
+        perror(root);
+        return 1;
+    }
+    for(n = 0; n < nodes; n++)
+    {
+        node_path(path, n);
+        undofs_cache_store(path, &info, undofs_cache_ticket());
+    }
+
+    printf("%ld cached nodes, %ld online CPUs\n", nodes, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-28s %14s %14s\n", "Benchmark", "Lookups/s", "Per thread");
+    printf("------------------------------------------------------------\n");
+    for(i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+    {
+        char name[40];
+        double rate = run(threads[i], 0);
+        snprintf(name, sizeof(name), "lookup/threads:%d", threads[i]);
+        printf("%-28s %14.0f %14.0f\n", name, rate, rate / threads[i]);
+        rate = run(threads[i], 1);
+        snprintf(name, sizeof(name), "lookup+writer/threads:%d", threads[i]);
+        printf("%-28s %14.0f %14.0f\n", name, rate, rate / threads[i]);
+    }
+
+    undofs_cache_close();
+    snprintf(path, PATH_MAX, "%s/" UNDOFS_CACHE_SNAPSHOT, root);
+    unlink(path);
+    snprintf(path, PATH_MAX, "%s/" UNDOFS_CACHE_GENERATION, root);
+    unlink(path);
+    return 0;
+}
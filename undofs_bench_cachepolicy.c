@@ -0,0 +1,202 @@
+#include "config.h"
+#include "undofs_cachepolicy.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Benchmark for the hit rate and memory trade-off of the cache policies.
+// The cache of the mount is modelled by an LRU of pages with a fixed size
+// in front of a real file in the store, whose page cache is the real one:
+// a read that misses the LRU reads the file, and counts as a hit in the
+// store if mincore() saw the page cached. Reads are skewed, 90% of them go
+// to 10% of the file.
+//
+// usage: undofs-bench-cachepolicy [file MiB] [mount cache MiB] [workdir]
+//
+// The memory column adds up the pages held by both caches at the end.
+
+#define PAGE 4096
+#define READS 400000
+
+static long npages;
+static long *lru_prev, *lru_next;
+static char *in_lru;
+static long lru_head, lru_tail, lru_size, lru_capacity;
+
+static double monotonic_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_file(const char *path, long mib)
+{
+    char *buf = malloc(1024 * 1024);
+    long i, j;
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(fd < 0 || buf == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    for(i = 0; i < mib; i++)
+    {
+        for(j = 0; j < 1024 * 1024; j += 8)
+            memcpy(buf + j, &(uint64_t) { i * 1024 * 1024 + j }, 8);
+        if(write(fd, buf, 1024 * 1024) != 1024 * 1024)
+        {
+            perror(path);
+            exit(1);
+        }
+    }
+    fsync(fd);
+    close(fd);
+    free(buf);
+}
+
+static void lru_unlink(long page)
+{
+    if(lru_prev[page] >= 0)
+        lru_next[lru_prev[page]] = lru_next[page];
+    else
+        lru_head = lru_next[page];
+    if(lru_next[page] >= 0)
+        lru_prev[lru_next[page]] = lru_prev[page];
+    else
+        lru_tail = lru_prev[page];
+}
+
+static void lru_push(long page)
+{
+    lru_prev[page] = -1;
+    lru_next[page] = lru_head;
+    if(lru_head >= 0)
+        lru_prev[lru_head] = page;
+    else
+        lru_tail = page;
+    lru_head = page;
+}
+
+// Look a page up in the mount cache, adding it on a miss.
+static int lru_lookup(long page)
+{
+    if(in_lru[page])
+    {
+        lru_unlink(page);
+        lru_push(page);
+        return 1;
+    }
+    if(lru_size == lru_capacity)
+    {
+        long victim = lru_tail;
+        lru_unlink(victim);
+        in_lru[victim] = 0;
+        lru_size--;
+    }
+    in_lru[page] = 1;
+    lru_push(page);
+    lru_size++;
+    return 0;
+}
+
+static long resident_pages(void *map)
+{
+    unsigned char *vec = malloc(npages);
+    long i, resident = 0;
+    if(vec != NULL && mincore(map, npages * PAGE, vec) == 0)
+        for(i = 0; i < npages; i++)
+            resident += vec[i] & 1;
+    free(vec);
+    return resident;
+}
+
+static void run(int policy, int fd, void *map)
+{
+    char buf[PAGE], name[40];
+    unsigned seed = 1;
+    long i, mount_hits = 0, store_reads = 0, store_hits = 0;
+
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    memset(in_lru, 0, npages);
+    lru_head = lru_tail = -1;
+    lru_size = 0;
+
+    double start = monotonic_s();
+    for(i = 0; i < READS; i++)
+    {
+        long r = (long) rand_r(&seed) << 16 ^ rand_r(&seed);
+        long page = rand_r(&seed) % 10 ? r % (npages / 10 + 1) : r % npages;
+        unsigned char cached = 0;
+
+        if(policy != UNDOFS_CACHEPOLICY_DIRECT_IO && lru_lookup(page))
+        {
+            mount_hits++;
+            continue;
+        }
+        mincore((char *) map + page * PAGE, PAGE, &cached);
+        store_hits += cached & 1;
+        store_reads++;
+        if(pread(fd, buf, PAGE, page * PAGE) != PAGE)
+        {
+            perror("pread");
+            exit(1);
+        }
+        if(policy == UNDOFS_CACHEPOLICY_DROP_BACKING)
+            posix_fadvise(fd, page * PAGE, PAGE, POSIX_FADV_DONTNEED);
+    }
+    double elapsed = monotonic_s() - start;
+
+    long memory = lru_size + resident_pages(map);
+    snprintf(name, sizeof(name), "policy/%s", undofs_cachepolicy_name(policy));
+    printf("%-22s %9.1f%% %9.1f%% %9.1f%% %8.0f MiB %10.0f\n", name,
+           100.0 * mount_hits / READS, store_reads ? 100.0 * store_hits / store_reads : 0.0,
+           100.0 * (store_reads - store_hits) / READS, (double) memory * PAGE / (1024 * 1024),
+           READS / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+    long mib = argc > 1 ? atol(argv[1]) : 256;
+    long cache_mib = argc > 2 ? atol(argv[2]) : 64;
+    const char *workdir = argc > 3 ? argv[3] : ".";
+    char path[PATH_MAX];
+    int policy, fd;
+    void *map;
+
+    snprintf(path, PATH_MAX, "%s/undofs-bench-cachepolicy.dat", workdir);
+    printf("Creating a %ld MiB file in %s, mount cache of %ld MiB...\n", mib, workdir, cache_mib);
+    make_file(path, mib);
+
+    npages = mib * 1024 * 1024 / PAGE;
+    lru_capacity = cache_mib * 1024 * 1024 / PAGE;
+    lru_prev = malloc(npages * sizeof(long));
+    lru_next = malloc(npages * sizeof(long));
+    in_lru = malloc(npages);
+    fd = open(path, O_RDONLY);
+    map = fd >= 0 ? mmap(NULL, npages * PAGE, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(lru_prev == NULL || lru_next == NULL || in_lru == NULL || map == MAP_FAILED || lru_capacity < 1)
+    {
+        perror(path);
+        return 1;
+    }
+
+    printf("%-22s %10s %10s %10s %12s %10s\n", "Benchmark", "Mount hit", "Store hit", "Disk", "Memory", "Reads/s");
+    printf("------------------------------------------------------------------------------\n");
+    for(policy = UNDOFS_CACHEPOLICY_BOTH; policy <= UNDOFS_CACHEPOLICY_DROP_BACKING; policy++)
+        run(policy, fd, map);
+
+    munmap(map, npages * PAGE);
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include "config.h"
+#include "undofs_clone.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Benchmark for cloning a large file for a new version: the old cp -a,
+// undofs_clone at 1, 4 and 16 threads, and each clone method at 4 threads
+// next to the one the probe picks for the workdir.
+//
+// usage: undofs-bench-clone [size in MiB] [workdir]
+//
+// Run it on the filesystem that holds the store. The source stays in the
+// page cache between runs, so this measures the write side of the clone.
+
+#define RUNS 3
+
+static double monotonic_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int clone_cp(const char *src, const char *dst, int threads)
+{
+    int status;
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        execl("/bin/cp", "/bin/cp", "-a", src, dst, (char *)0);
+        _exit(127);
+    }
+    if(pid < 0 || waitpid(pid, &status, 0) < 0)
+        return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static void make_source(const char *path, long mib)
+{
+    char *buf = malloc(1024 * 1024);
+    long i, j;
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(fd < 0 || buf == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    for(i = 0; i < mib; i++)
+    {
+        for(j = 0; j < 1024 * 1024; j += 8)
+            memcpy(buf + j, &(uint64_t) { i * 1024 * 1024 + j }, 8);
+        if(write(fd, buf, 1024 * 1024) != 1024 * 1024)
+        {
+            perror(path);
+            exit(1);
+        }
+    }
+    fsync(fd);
+    close(fd);
+    free(buf);
+}
+
+static double time_clone(int (*clone)(const char *, const char *, int), int threads,
+                         const char *src, const char *dst)
+{
+    double best = 0;
+    int run;
+    for(run = 0; run < RUNS; run++)
+    {
+        unlink(dst);
+        sync();
+        double start = monotonic_s();
+        int fd;
+        if(clone(src, dst, threads) != 0)
+        {
+            perror("clone");
+            exit(1);
+        }
+        // Count the time to get the data to disk, not just into the cache.
+        fd = open(dst, O_RDONLY);
+        fsync(fd);
+        close(fd);
+        double elapsed = monotonic_s() - start;
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+    }
+    unlink(dst);
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    long mib = argc > 1 ? atol(argv[1]) : 1024;
+    const char *workdir = argc > 2 ? argv[2] : ".";
+    char src[PATH_MAX], dst[PATH_MAX];
+    int threads[] = { 1, 4, 16 };
+    unsigned i;
+
+    snprintf(src, PATH_MAX, "%s/undofs-bench-clone.src", workdir);
+    snprintf(dst, PATH_MAX, "%s/undofs-bench-clone.dst", workdir);
+    printf("Creating a %ld MiB file in %s...\n", mib, workdir);
+    make_source(src, mib);
+
+    printf("%-24s %10s %12s %10s\n", "Benchmark", "Time", "Bandwidth", "Speedup");
+    printf("------------------------------------------------------------\n");
+    double base = time_clone(clone_cp, 0, src, dst);
+    printf("%-24s %8.3f s %7.0f MiB/s\n", "clone/cp", base, mib / base);
+    for(i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+    {
+        char name[32];
+        double t = time_clone(undofs_clone, threads[i], src, dst);
+        snprintf(name, sizeof(name), "clone/threads:%d", threads[i]);
+        printf("%-24s %8.3f s %7.0f MiB/s %9.2fx\n", name, t, mib / t, base / t);
+    }
+
+    char probed[128];
+    int method, chosen = undofs_clone_probe(workdir, probed, sizeof(probed));
+    for(method = UNDOFS_CLONE_REFLINK; method <= UNDOFS_CLONE_READWRITE; method++)
+    {
+        char name[32];
+        undofs_clone_set_method(method);
+        double t = time_clone(undofs_clone, 4, src, dst);
+        snprintf(name, sizeof(name), "clone/%s%s", undofs_clone_method_name(method), method == chosen ? "*" : "");
+        printf("%-24s %8.3f s %7.0f MiB/s %9.2fx\n", name, t, mib / t, base / t);
+    }
+    printf("* probed: %s\n", probed);
+
+    unlink(src);
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include "config.h"
+#include "undofs_clone.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Benchmark for what cloning a large file does to everyone else's page
+// cache: a reader keeps reading random blocks of a warm working set while a
+// cold file is cloned, once for each clone_cache mode. It reports the read
+// rate during the clone, how much of the working set is still cached after
+// it, and how much of the two copies the clone left behind in the cache.
+//
+// usage: undofs-bench-clone-cache [clone MiB] [working set MiB] [workdir]
+//
+// Run it on the filesystem that holds the store. With plenty of free memory
+// nothing gets evicted, and only the leftover copies show the difference;
+// to see the working set go, run it in a memory limited cgroup, e.g.
+// systemd-run --scope -p MemoryMax=<clone MiB>M undofs-bench-clone-cache.
+
+#define BLOCK 4096
+
+static const char *hot_path;
+static volatile int reading;
+
+static double monotonic_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_file(const char *path, long mib)
+{
+    char *buf = malloc(1024 * 1024);
+    long i, j;
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if(fd < 0 || buf == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    for(i = 0; i < mib; i++)
+    {
+        for(j = 0; j < 1024 * 1024; j += 8)
+            memcpy(buf + j, &(uint64_t) { i * 1024 * 1024 + j }, 8);
+        if(write(fd, buf, 1024 * 1024) != 1024 * 1024)
+        {
+            perror(path);
+            exit(1);
+        }
+    }
+    fsync(fd);
+    close(fd);
+    free(buf);
+}
+
+// Drop a file from the page cache, or read all of it in.
+static void set_cached(const char *path, int cached)
+{
+    char buf[128 * 1024];
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return;
+    if(cached)
+        while(read(fd, buf, sizeof(buf)) > 0)
+            ;
+    else
+    {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+}
+
+// The number of pages of a file in the page cache.
+static long resident_pages(const char *path, long *total)
+{
+    struct stat st;
+    unsigned char *vec;
+    long pages, i, resident = 0;
+    long page = sysconf(_SC_PAGESIZE);
+    void *map;
+    int fd = open(path, O_RDONLY);
+
+    *total = 0;
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        if(fd >= 0)
+            close(fd);
+        return 0;
+    }
+    pages = (st.st_size + page - 1) / page;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    vec = malloc(pages);
+    if(map != MAP_FAILED && vec != NULL && mincore(map, st.st_size, vec) == 0)
+        for(i = 0; i < pages; i++)
+            resident += vec[i] & 1;
+    if(map != MAP_FAILED)
+        munmap(map, st.st_size);
+    free(vec);
+    close(fd);
+    *total = pages;
+    return resident;
+}
+
+static void *read_worker(void *arg)
+{
+    char buf[BLOCK];
+    unsigned seed = 1;
+    long blocks = *(long *) arg, reads = 0;
+    int fd = open(hot_path, O_RDONLY);
+
+    if(fd < 0)
+        return NULL;
+    while(reading)
+    {
+        off_t block = ((off_t) rand_r(&seed) << 16 ^ rand_r(&seed)) % blocks;
+        if(pread(fd, buf, BLOCK, block * BLOCK) > 0)
+            reads++;
+    }
+    close(fd);
+    *(long *) arg = reads;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    long mib = argc > 1 ? atol(argv[1]) : 1024;
+    long hot_mib = argc > 2 ? atol(argv[2]) : 256;
+    const char *workdir = argc > 3 ? argv[3] : ".";
+    char src[PATH_MAX], dst[PATH_MAX], hot[PATH_MAX], probed[128];
+    long page = sysconf(_SC_PAGESIZE);
+    int mode;
+
+    snprintf(src, PATH_MAX, "%s/undofs-bench-clone-cache.src", workdir);
+    snprintf(dst, PATH_MAX, "%s/undofs-bench-clone-cache.dst", workdir);
+    snprintf(hot, PATH_MAX, "%s/undofs-bench-clone-cache.hot", workdir);
+    hot_path = hot;
+    printf("Creating a %ld MiB file and a %ld MiB working set in %s...\n", mib, hot_mib, workdir);
+    make_file(src, mib);
+    make_file(hot, hot_mib);
+
+    undofs_clone_set_method(undofs_clone_probe(workdir, probed, sizeof(probed)));
+    printf("Cloning with 4 threads (%s)\n", probed);
+    printf("%-20s %10s %12s %12s %14s\n", "Benchmark", "Clone", "Reads/s", "Working set", "Clone cached");
+    printf("----------------------------------------------------------------------\n");
+    for(mode = UNDOFS_CLONE_CACHE_KEEP; mode <= UNDOFS_CLONE_CACHE_DIRECT; mode++)
+    {
+        pthread_t reader;
+        long arg = hot_mib * 1024 * 1024 / BLOCK, total, src_total, dst_total;
+        char name[32];
+
+        unlink(dst);
+        set_cached(src, 0);
+        set_cached(hot, 1);
+        undofs_clone_set_cache(mode);
+
+        reading = 1;
+        pthread_create(&reader, NULL, read_worker, &arg);
+        double start = monotonic_s();
+        if(undofs_clone(src, dst, 4) != 0)
+        {
+            perror("clone");
+            exit(1);
+        }
+        // Count the time to get the data to disk, not just into the cache.
+        int fd = open(dst, O_RDONLY);
+        fsync(fd);
+        close(fd);
+        double elapsed = monotonic_s() - start;
+        reading = 0;
+        pthread_join(reader, NULL);
+
+        long hot_resident = resident_pages(hot, &total);
+        long cached = resident_pages(src, &src_total) + resident_pages(dst, &dst_total);
+        snprintf(name, sizeof(name), "clone_cache/%s", undofs_clone_cache_name(mode));
+        printf("%-20s %8.3f s %12.0f %11.1f%% %10.0f MiB\n", name, elapsed, arg / elapsed,
+               total ? 100.0 * hot_resident / total : 0.0, (double) cached * page / (1024 * 1024));
+    }
+
+    unlink(dst);
+    unlink(src);
+    unlink(hot);
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Benchmark for how lookups scale with the history of a file: files with
+// 1, 10, 100, 1k, 10k and 100k versions, and directories whose children
+// have that many, with the latency of getattr, open, readdir and opening
+// for writing at each depth.
+//
+// usage: undofs-bench-depth <mountpoint> [max versions] [children]
+//
+// Run it on a mounted undofs, with -o attr_timeout=0,entry_timeout=0 so
+// the kernel asks undofs every time. Histories are written through the
+// mount with truncating opens, which don't copy. "First" is the median of
+// the first getattr of each file in the directory, after all histories were
+// written and before anything else looked at them; the other columns are
+// medians of RUNS calls on one of them. Each write-open adds a version, RUNS
+// at most. The last line divides the deepest row by the shallowest one:
+// flat lookups stay close to 1.
+
+#define RUNS 101
+#define MAX_DEPTHS 8
+
+typedef struct {
+    long depth;
+    double first_getattr, getattr, open, readdir, write_open;
+} depth_row;
+
+static volatile long sink;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fail(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+// Open path with flags and close it again.
+static void open_close(const char *path, int flags)
+{
+    int fd = open(path, flags, 0644);
+    if(fd < 0)
+        fail(path);
+    close(fd);
+}
+
+// A file with versions 0 .. depth-1.
+static void make_history(const char *path, long depth)
+{
+    long i;
+    open_close(path, O_CREAT | O_WRONLY | O_TRUNC);
+    for(i = 1; i < depth; i++)
+        open_close(path, O_WRONLY | O_TRUNC);
+}
+
+// A timed call on path, arg is up to the call.
+typedef uint64_t (*timed_call)(const char *path, int arg);
+
+static uint64_t time_stat(const char *path, int arg)
+{
+    struct stat st;
+    uint64_t start = monotonic_ns();
+    if(stat(path, &st) != 0)
+        fail(path);
+    return monotonic_ns() - start;
+}
+
+static uint64_t time_open(const char *path, int flags)
+{
+    uint64_t start = monotonic_ns();
+    open_close(path, flags);
+    return monotonic_ns() - start;
+}
+
+static uint64_t time_readdir(const char *path, int arg)
+{
+    struct dirent *de;
+    uint64_t start = monotonic_ns();
+    DIR *dir = opendir(path);
+    if(dir == NULL)
+        fail(path);
+    while((de = readdir(dir)) != NULL)
+        sink += de->d_name[0];
+    closedir(dir);
+    return monotonic_ns() - start;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// The median of a timing, in microseconds.
+static double median_us(uint64_t *samples, int count)
+{
+    qsort(samples, count, sizeof(uint64_t), by_value);
+    return samples[count / 2] / 1e3;
+}
+
+// The median of RUNS calls of call on path, in microseconds.
+static double time_median_us(timed_call call, const char *path, int arg)
+{
+    uint64_t samples[RUNS];
+    int run;
+
+    for(run = 0; run < RUNS; run++)
+        samples[run] = call(path, arg);
+    return median_us(samples, RUNS);
+}
+
+static void measure(const char *root, long depth, int children, depth_row *row)
+{
+    char dir[PATH_MAX], file[PATH_MAX];
+    uint64_t *first = malloc(children * sizeof(uint64_t));
+    int i;
+
+    if(first == NULL)
+        fail("malloc");
+    snprintf(dir, PATH_MAX, "%s/d%ld", root, depth);
+    if(mkdir(dir, 0755) != 0)
+        fail(dir);
+    for(i = 0; i < children; i++)
+    {
+        snprintf(file, PATH_MAX, "%s/f%d", dir, i);
+        make_history(file, depth);
+    }
+    for(i = 0; i < children; i++)
+    {
+        snprintf(file, PATH_MAX, "%s/f%d", dir, i);
+        first[i] = time_stat(file, 0);
+    }
+    snprintf(file, PATH_MAX, "%s/f0", dir);
+
+    row->depth = depth;
+    row->first_getattr = median_us(first, children);
+    row->getattr = time_median_us(time_stat, file, 0);
+    row->open = time_median_us(time_open, file, O_RDONLY);
+    row->readdir = time_median_us(time_readdir, dir, 0);
+    row->write_open = time_median_us(time_open, file, O_WRONLY);
+    free(first);
+}
+
+static void print_row(const char *name, const depth_row *row)
+{
+    printf("%-12s %10.1f %10.1f %10.1f %10.1f %12.1f\n", name, row->first_getattr, row->getattr,
+           row->open, row->readdir, row->write_open);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+    depth_row rows[MAX_DEPTHS], growth;
+    char root[PATH_MAX], name[32];
+    long max_depth, depth;
+    int children, count = 0;
+
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: undofs-bench-depth <mountpoint> [max versions] [children]\n");
+        return 1;
+    }
+    max_depth = argc > 2 ? atol(argv[2]) : 100000;
+    children = argc > 3 ? atoi(argv[3]) : 5;
+    if(children < 1)
+        children = 1;
+
+    snprintf(root, PATH_MAX, "%s/undofs-bench-depth.XXXXXX", argv[1]);
+    if(mkdtemp(root) == NULL)
+        fail(root);
+
+    printf("Histories of up to %ld versions, %d files per directory, in %s\n", max_depth, children, root);
+    printf("%-12s %10s %10s %10s %10s %12s\n", "Versions", "First us", "Getattr us", "Open us", "Readdir us",
+           "Write-open us");
+    printf("---------------------------------------------------------------------\n");
+    for(depth = 1; depth <= max_depth && count < MAX_DEPTHS; depth *= 10)
+    {
+        measure(root, depth, children, &rows[count]);
+        snprintf(name, sizeof(name), "%ld", depth);
+        print_row(name, &rows[count]);
+        count++;
+    }
+
+    if(count > 1)
+    {
+        const depth_row *first = &rows[0], *last = &rows[count - 1];
+        growth.first_getattr = last->first_getattr / first->first_getattr;
+        growth.getattr = last->getattr / first->getattr;
+        growth.open = last->open / first->open;
+        growth.readdir = last->readdir / first->readdir;
+        growth.write_open = last->write_open / first->write_open;
+        printf("---------------------------------------------------------------------\n");
+        print_row("growth", &growth);
+    }
+    return nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0;
+}
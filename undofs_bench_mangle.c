@@ -0,0 +1,165 @@
+#include "config.h"
+#include "undofs_mangle.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmark for path mangling and demangling, in the style of
+// Google Benchmark: every case runs until it has taken at least
+// MIN_TIME_NS, and the time per iteration is reported.
+
+#define MIN_TIME_NS 500000000ULL
+#define ROOTDIR "/srv/undofs/store"
+
+static const char *impl_names[] = { "auto", "scalar", "portable", "sse2", "avx2" };
+
+static volatile int sink;
+
+static unsigned long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void make_path(char *path, int components, int component_len)
+{
+    char *p = path;
+    int c, i;
+    for(c = 0; c < components; c++)
+    {
+        *p++ = '/';
+        for(i = 0; i < component_len; i++)
+            *p++ = 'a' + (c + i) % 26;
+    }
+    *p = 0;
+}
+
+static double time_case(int demangle, const char *input, unsigned long long *iterations_out)
+{
+    char out[PATH_MAX];
+    unsigned long long iterations = 1, start, elapsed, i;
+
+    for(;;)
+    {
+        start = monotonic_ns();
+        for(i = 0; i < iterations; i++)
+        {
+            if(demangle)
+                sink += undofs_demangle(out, ROOTDIR, input);
+            else
+                sink += undofs_mangle(out, ROOTDIR, input);
+            sink += out[0];
+        }
+        elapsed = monotonic_ns() - start;
+        if(elapsed >= MIN_TIME_NS)
+            break;
+        iterations *= elapsed < MIN_TIME_NS / 100 ? 10 : 2;
+    }
+    *iterations_out = iterations;
+    return (double) elapsed / iterations;
+}
+
+static int check_one(int impl, const char *input)
+{
+    char expected[PATH_MAX], actual[PATH_MAX];
+    int e_res, a_res, failures = 0;
+
+    if(input[0] == '/')
+    {
+        undofs_mangle_select(UNDOFS_MANGLE_SCALAR);
+        e_res = undofs_mangle(expected, ROOTDIR, input);
+        undofs_mangle_select(impl);
+        a_res = undofs_mangle(actual, ROOTDIR, input);
+        if(e_res != a_res || strcmp(expected, actual))
+        {
+            fprintf(stderr, "%s mangle mismatch for '%s': '%s' vs '%s'\n", impl_names[impl], input, expected, actual);
+            failures++;
+        }
+    }
+
+    undofs_mangle_select(UNDOFS_MANGLE_SCALAR);
+    e_res = undofs_demangle(expected, ROOTDIR, input);
+    undofs_mangle_select(impl);
+    a_res = undofs_demangle(actual, ROOTDIR, input);
+    if(e_res != a_res || strcmp(expected, actual))
+    {
+        fprintf(stderr, "%s demangle mismatch for '%s': '%s' (%d) vs '%s' (%d)\n",
+                impl_names[impl], input, expected, e_res, actual, a_res);
+        failures++;
+    }
+    return failures;
+}
+
+// Compare every implementation against the original on odd inputs.
+static int check_equivalence()
+{
+    static const char *cases[] = {
+        "/", "//", "/a", "/a/", "/a//b", "//a/b", "/a.node", "/a/.node/b",
+        "/x.node.node", "/a///b///", ROOTDIR "/a.node/b.node", ROOTDIR "/a/b.node",
+        ROOTDIR "//a.node", ROOTDIR "/.node", "a.node", "a", ""
+    };
+    char path[PATH_MAX];
+    int impl, i, failures = 0;
+
+    for(impl = UNDOFS_MANGLE_PORTABLE; impl <= UNDOFS_MANGLE_AVX2; impl++)
+    {
+        if(undofs_mangle_select(impl) != 0)
+            continue;
+        for(i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++)
+            failures += check_one(impl, cases[i]);
+        for(i = 0; i < 200; i++)
+        {
+            make_path(path, 1 + i % 9, 1 + (i * 7) % 70);
+            failures += check_one(impl, path);
+        }
+    }
+    return failures;
+}
+
+int main()
+{
+    struct { const char *name; int components, component_len; } shapes[] = {
+        { "short", 3, 6 },
+        { "deep", 48, 4 },
+        { "long_component", 4, 240 },
+    };
+    char path[PATH_MAX], mangled[PATH_MAX];
+    unsigned s;
+    int impl;
+
+    if(check_equivalence() != 0)
+        return 1;
+
+    printf("%-36s %13s %12s %10s\n", "Benchmark", "Time", "Iterations", "Speedup");
+    printf("-------------------------------------------------------------------------------\n");
+    for(s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+    {
+        make_path(path, shapes[s].components, shapes[s].component_len);
+        undofs_mangle_select(UNDOFS_MANGLE_SCALAR);
+        undofs_mangle(mangled, ROOTDIR, path);
+
+        int demangle;
+        for(demangle = 0; demangle <= 1; demangle++)
+        {
+            double baseline = 0;
+            for(impl = UNDOFS_MANGLE_SCALAR; impl <= UNDOFS_MANGLE_AVX2; impl++)
+            {
+                if(undofs_mangle_select(impl) != 0)
+                    continue;
+                char name[64];
+                unsigned long long iterations;
+                snprintf(name, sizeof(name), "%s/%s/%s", demangle ? "demangle" : "mangle",
+                         shapes[s].name, impl_names[impl]);
+                double t = time_case(demangle, demangle ? mangled : path, &iterations);
+                if(impl == UNDOFS_MANGLE_SCALAR)
+                    baseline = t;
+                printf("%-36s %10.1f ns %12llu %9.2fx\n", name, t, iterations, baseline / t);
+            }
+        }
+    }
+    return 0;
+}
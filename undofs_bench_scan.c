@@ -0,0 +1,248 @@
+#include "config.h"
+#include "undofs_scan.h"
+#include "undofs_syscount.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Benchmark for scanning huge node directories: finding the latest of
+// many versions, and listing a directory with many children, with the
+// original readdir + strtol + lstat code and with undofs_scan.
+//
+// usage: undofs-bench-scan [entries] [workdir]
+//
+// The syscalls column counts the system calls of one undofs_scan run, as
+// undofs_syscount does in the mount; the buffered readdir code has none to
+// compare.
+
+#define RUNS 5
+
+static volatile long sink;
+static uint64_t run_syscalls;
+
+static unsigned long long monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t syscalls()
+{
+    uint64_t calls[UNDOFS_SYS_COUNT], total = 0;
+    int i;
+    undofs_syscount_read(-1, NULL, calls, NULL);
+    for(i = 0; i < UNDOFS_SYS_COUNT; i++)
+        total += calls[i];
+    return total;
+}
+
+static void touch_at(const char *path)
+{
+    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if(fd < 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+}
+
+// A file node with versions 0 .. entries-1.
+static void make_versions(const char *node, long entries)
+{
+    char path[PATH_MAX];
+    long i;
+    mkdir(node, 0755);
+    for(i = 0; i < entries; i++)
+    {
+        snprintf(path, PATH_MAX, "%s/%ld", node, i);
+        touch_at(path);
+    }
+}
+
+// A directory node with entries file nodes of one version each.
+static void make_children(const char *node, long entries)
+{
+    char path[PATH_MAX];
+    long i;
+    mkdir(node, 0755);
+    snprintf(path, PATH_MAX, "%s/dir", node);
+    touch_at(path);
+    for(i = 0; i < entries; i++)
+    {
+        snprintf(path, PATH_MAX, "%s/f%ld.node", node, i);
+        mkdir(path, 0755);
+        snprintf(path, PATH_MAX, "%s/f%ld.node/0", node, i);
+        touch_at(path);
+    }
+}
+
+// The original undofs_latest_version, with readdir() for the deprecated
+// readdir_r(); both make the same system calls.
+static long latest_readdir(const char *fpath)
+{
+    long max_file = -1;
+    struct dirent *entry;
+    DIR *dirp = opendir(fpath);
+    if(dirp == NULL)
+        return -1;
+
+    for(;;)
+    {
+        errno = 0;
+        entry = readdir(dirp);
+        if(entry == NULL)
+        {
+            if(errno != 0)
+                max_file = -1;
+            break;
+        }
+        long curr_file = strtol(entry->d_name, NULL, 10);
+        if(curr_file > max_file)
+            max_file = curr_file;
+    }
+    closedir(dirp);
+    return max_file;
+}
+
+static long latest_scan(const char *fpath)
+{
+    undofs_node_info info;
+    if(undofs_scan_node(AT_FDCWD, fpath, &info) != 0)
+        return -1;
+    return info.latest;
+}
+
+// The original readdir: per child, check the markers and the latest
+// version by absolute path.
+static long list_readdir(const char *dirpath)
+{
+    DIR *dp = opendir(dirpath);
+    struct dirent *de;
+    long listed = 0;
+    if(dp == NULL)
+        return -1;
+
+    while((de = readdir(dp)) != NULL)
+    {
+        char fpath[PATH_MAX], marker[PATH_MAX];
+        struct stat st;
+        snprintf(fpath, PATH_MAX, "%s/%s", dirpath, de->d_name);
+        snprintf(marker, PATH_MAX, "%s/dir", fpath);
+        if(access(marker, F_OK) == 0)
+            continue;
+        long version = latest_readdir(fpath);
+        snprintf(marker, PATH_MAX, "%s/deleted", fpath);
+        if(access(marker, F_OK) == 0)
+            version++;
+        snprintf(marker, PATH_MAX, "%s/%ld", fpath, version);
+        if(lstat(marker, &st) == 0)
+            listed++;
+    }
+    closedir(dp);
+    return listed;
+}
+
+static long list_scan(const char *dirpath)
+{
+    undofs_dirscan scan;
+    const char *entry;
+    long listed = 0;
+    int dirfd = open(dirpath, O_RDONLY | O_DIRECTORY);
+    if(dirfd < 0 || undofs_dirscan_start(&scan, dirfd) != 0)
+        return -1;
+
+    while((entry = undofs_dirscan_next(&scan, NULL)) != NULL)
+    {
+        char version_path[PATH_MAX];
+        undofs_node_info info;
+        struct stat st;
+        size_t len = strlen(entry);
+        if(len <= 5 || memcmp(entry + len - 5, ".node", 5) != 0)
+            continue;
+        if(undofs_scan_node(dirfd, entry, &info) != 0 || info.is_dir || info.deleted || info.latest < 0)
+            continue;
+        snprintf(version_path, PATH_MAX, "%s/%ld", entry, info.latest);
+        if(undofs_stat_type(dirfd, version_path, &st) == 0)
+            listed++;
+    }
+    undofs_dirscan_end(&scan);
+    close(dirfd);
+    return listed;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static double time_runs(long (*fn)(const char *), const char *path, long expected)
+{
+    double best = 0;
+    int run;
+    for(run = 0; run < RUNS; run++)
+    {
+        uint64_t calls = syscalls();
+        unsigned long long start = monotonic_ns();
+        long result = fn(path);
+        double elapsed = (monotonic_ns() - start) / 1e6;
+        run_syscalls = syscalls() - calls;
+        if(result != expected)
+        {
+            fprintf(stderr, "%s: got %ld, expected %ld\n", path, result, expected);
+            exit(1);
+        }
+        if(run == 0 || elapsed < best)
+            best = elapsed;
+        sink += result;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    long entries = argc > 1 ? atol(argv[1]) : 100000;
+    const char *workdir = argc > 2 ? argv[2] : ".";
+    char root[PATH_MAX], versions[PATH_MAX], children[PATH_MAX];
+
+    snprintf(root, PATH_MAX, "%s/undofs-bench-scan.XXXXXX", workdir);
+    if(mkdtemp(root) == NULL)
+    {
+        perror(root);
+        return 1;
+    }
+    snprintf(versions, PATH_MAX, "%s/versions.node", root);
+    snprintf(children, PATH_MAX, "%s/children.node", root);
+
+    printf("Creating %ld versions and %ld children in %s...\n", entries, entries, root);
+    make_versions(versions, entries);
+    make_children(children, entries);
+
+    printf("%-28s %12s %10s %10s\n", "Benchmark", "Time", "Speedup", "Syscalls");
+    printf("-----------------------------------------------------------------\n");
+
+    undofs_syscount_enable(1);
+    double base = time_runs(latest_readdir, versions, entries - 1);
+    double fast = time_runs(latest_scan, versions, entries - 1);
+    printf("%-28s %9.2f ms\n", "latest_version/readdir", base);
+    printf("%-28s %9.2f ms %9.2fx %10llu\n", "latest_version/getdents64", fast, base / fast,
+           (unsigned long long) run_syscalls);
+
+    base = time_runs(list_readdir, children, entries);
+    fast = time_runs(list_scan, children, entries);
+    printf("%-28s %9.2f ms\n", "readdir/readdir+lstat", base);
+    printf("%-28s %9.2f ms %9.2fx %10llu\n", "readdir/getdents64+statx", fast, base / fast,
+           (unsigned long long) run_syscalls);
+
+    return nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0;
+}
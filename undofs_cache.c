@@ -0,0 +1,772 @@
+#include "undofs_cache.h"
+#include "undofs_fdcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BUCKETS (1 << 16)
+#define READERS 256             // threads that can read without the lock at once
+#define RECLAIM_BATCH 64        // retired objects to collect before reclaiming
+
+/*
+ * Lookups never take a lock. Entries are immutable once they are in the
+ * table: a change publishes a new entry in place of the old one, and the
+ * old one is retired. A retired object is freed once no reader can still
+ * be looking at it, which readers announce by publishing the epoch they
+ * started in, each in a slot of its own. Writers take cache_lock.
+ */
+
+typedef struct retired {
+    struct retired *next;
+    uint64_t epoch;             // in which it was unpublished
+    void (*release)(struct retired *);
+} retired;
+
+enum entry_state { ENTRY_NODE, ENTRY_MISSING, ENTRY_INVALID };
+
+typedef struct cache_entry {
+    retired retire;
+    struct cache_entry *next;
+    uint64_t hash;
+    int state;                  // enum entry_state
+    undofs_node_info info;
+    char path[];                // relative to the store root
+} cache_entry;
+
+// The snapshot of the previous mount, mapped.
+typedef struct {
+    retired retire;
+    const undofs_cache_header *header;
+    size_t size;
+    const undofs_cache_slot *slots;
+    const char *strings;
+} snapshot_map;
+
+// One per reading thread, on a cache line of its own.
+typedef struct {
+    uint64_t epoch;             // while reading, the epoch it started in; 0 otherwise
+    int in_use;
+    unsigned long long hits, snapshot_hits, misses;
+} __attribute__((aligned(64))) reader_slot;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry **buckets = NULL;
+static size_t entries = 0;
+static uint64_t invalidations = 0;
+
+static char *root = NULL;
+static size_t root_len;
+static uint64_t generation;
+
+// NULL if there is none, or it was dropped.
+static snapshot_map *snapshot = NULL;
+
+static uint64_t global_epoch = 1;
+static reader_slot readers[READERS];
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static __thread reader_slot *my_slot = NULL;
+static __thread int no_slot = 0;
+
+static retired *retired_list = NULL;
+static size_t retired_count = 0;
+
+static struct {
+    unsigned long long invalidations, clears, reclaimed;
+} stats;
+
+static uint64_t hash_path(const char *path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for(i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+    return hash ? hash : 1;
+}
+
+// The key of a node: its path relative to the store root.
+static const char *relative(const char *nodedir)
+{
+    if(root == NULL || strncmp(nodedir, root, root_len) != 0
+       || (nodedir[root_len] != '/' && nodedir[root_len] != 0))
+        return NULL;
+    nodedir += root_len;
+    while(*nodedir == '/')
+        nodedir++;
+    return nodedir;
+}
+
+static void set_info(undofs_node_info *info, const undofs_cache_slot *slot)
+{
+    info->latest = slot->latest;
+    info->ino = slot->ino;
+    info->is_dir = (slot->flags & UNDOFS_CACHE_DIR) != 0;
+    info->deleted = (slot->flags & UNDOFS_CACHE_DELETED) != 0;
+    info->purge_gen = slot->purge_gen;
+    info->born = slot->born;
+}
+
+// The slot of a node, or of a negative entry if info is NULL, without its path.
+static void set_slot(undofs_cache_slot *slot, uint64_t hash, const undofs_node_info *info)
+{
+    memset(slot, 0, sizeof(*slot));
+    slot->hash = hash;
+    slot->latest = -1;
+    if(info == NULL)
+        return;
+    slot->latest = info->latest;
+    slot->flags = UNDOFS_CACHE_EXISTS | (info->is_dir ? UNDOFS_CACHE_DIR : 0) | (info->deleted ? UNDOFS_CACHE_DELETED : 0);
+    slot->purge_gen = info->purge_gen;
+    slot->ino = info->ino;
+    slot->born = info->born;
+}
+
+static void release_slot(void *slot)
+{
+    __atomic_store_n(&((reader_slot *) slot)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_reader_key()
+{
+    pthread_key_create(&reader_key, release_slot);
+}
+
+// The slot of the calling thread, claimed the first time it reads. NULL
+// if all are taken, then the thread reads under the lock.
+static reader_slot *reader()
+{
+    int i;
+
+    if(my_slot != NULL || no_slot)
+        return my_slot;
+    pthread_once(&reader_once, make_reader_key);
+    for(i = 0; i < READERS; i++)
+    {
+        int expected = 0;
+        if(__atomic_compare_exchange_n(&readers[i].in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            // Threads come and go, the slot goes back when this one exits.
+            my_slot = &readers[i];
+            pthread_setspecific(reader_key, my_slot);
+            return my_slot;
+        }
+    }
+    no_slot = 1;
+    return NULL;
+}
+
+static void read_begin(reader_slot *slot)
+{
+    if(slot == NULL)
+    {
+        pthread_mutex_lock(&cache_lock);
+        return;
+    }
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    // The announcement has to be visible before the table is read.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void read_end(reader_slot *slot)
+{
+    if(slot == NULL)
+        pthread_mutex_unlock(&cache_lock);
+    else
+        __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Only the owning thread writes its counters.
+static void count(unsigned long long *counter)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+// The functions below that change anything must be called with cache_lock held.
+
+// Free what no reader can still see: everything unpublished before the
+// oldest epoch a reader is in.
+static void reclaim()
+{
+    uint64_t oldest = UINT64_MAX;
+    retired **link;
+    int i;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(i = 0; i < READERS; i++)
+    {
+        uint64_t epoch = __atomic_load_n(&readers[i].epoch, __ATOMIC_ACQUIRE);
+        if(epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    for(link = &retired_list; *link != NULL;)
+    {
+        retired *item = *link;
+        if(item->epoch < oldest)
+        {
+            *link = item->next;
+            item->release(item);
+            retired_count--;
+            stats.reclaimed++;
+        } else
+            link = &item->next;
+    }
+}
+
+// Hand an unpublished object over for freeing once readers are done with it.
+static void retire(retired *item)
+{
+    item->epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    item->next = retired_list;
+    retired_list = item;
+    if(++retired_count >= RECLAIM_BATCH)
+        reclaim();
+}
+
+static void release_entry(retired *item)
+{
+    free(item);
+}
+
+static void release_snapshot(retired *item)
+{
+    snapshot_map *map = (snapshot_map *) item;
+    munmap((void *) map->header, map->size);
+    free(map);
+}
+
+static const undofs_cache_slot *snapshot_find(const snapshot_map *map, const char *path, size_t len, uint64_t hash)
+{
+    uint64_t mask, i;
+
+    if(map == NULL)
+        return NULL;
+    mask = map->header->slots - 1;
+    for(i = hash & mask;; i = (i + 1) & mask)
+    {
+        const undofs_cache_slot *slot = &map->slots[i];
+        if(slot->hash == 0)
+            return NULL;
+        if(slot->hash == hash && slot->path_len == len
+           && (uint64_t) slot->path_offset + len <= map->header->strings_size
+           && memcmp(map->strings + slot->path_offset, path, len) == 0)
+            return slot;
+    }
+}
+
+// Safe without the lock, inside read_begin() and read_end().
+static cache_entry *find(const char *path, uint64_t hash)
+{
+    cache_entry *entry;
+    for(entry = __atomic_load_n(&buckets[hash % BUCKETS], __ATOMIC_ACQUIRE); entry != NULL;
+        entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE))
+        if(entry->hash == hash && strcmp(entry->path, path) == 0)
+            return entry;
+    return NULL;
+}
+
+static void drop_snapshot()
+{
+    snapshot_map *map = snapshot;
+    if(map == NULL)
+        return;
+    __atomic_store_n(&snapshot, NULL, __ATOMIC_RELEASE);
+    retire(&map->retire);
+}
+
+static void drop_entries()
+{
+    size_t i;
+    for(i = 0; i < BUCKETS; i++)
+    {
+        // Readers still in the chain can finish walking it: nothing in it
+        // is freed before they are done.
+        cache_entry *entry = __atomic_exchange_n(&buckets[i], NULL, __ATOMIC_ACQ_REL);
+        while(entry != NULL)
+        {
+            cache_entry *next = entry->next;
+            retire(&entry->retire);
+            entry = next;
+        }
+    }
+    entries = 0;
+}
+
+static void set_entry(const char *path, uint64_t hash, int state, const undofs_node_info *info)
+{
+    cache_entry **link, *old, *entry;
+    size_t len = strlen(path);
+
+    for(link = &buckets[hash % BUCKETS]; (old = *link) != NULL; link = &old->next)
+        if(old->hash == hash && strcmp(old->path, path) == 0)
+            break;
+
+    if(old == NULL && entries >= UNDOFS_CACHE_MAX_ENTRIES)
+    {
+        // Dropping the table also unshadows the snapshot, so it has to go too.
+        drop_entries();
+        drop_snapshot();
+        stats.clears++;
+        link = &buckets[hash % BUCKETS];
+    }
+
+    entry = malloc(sizeof(cache_entry) + len + 1);
+    if(entry == NULL)
+    {
+        // Without room for a tombstone the snapshot can't be trusted, and
+        // the old entry no longer holds.
+        drop_snapshot();
+        if(old != NULL)
+        {
+            __atomic_store_n(link, old->next, __ATOMIC_RELEASE);
+            retire(&old->retire);
+            entries--;
+        }
+        return;
+    }
+    memcpy(entry->path, path, len + 1);
+    entry->retire.release = release_entry;
+    entry->hash = hash;
+    entry->state = state;
+    if(info != NULL)
+        entry->info = *info;
+    else
+        memset(&entry->info, 0, sizeof(entry->info));
+
+    // Fully built before readers can reach it.
+    if(old != NULL)
+    {
+        entry->next = old->next;
+        __atomic_store_n(link, entry, __ATOMIC_RELEASE);
+        retire(&old->retire);
+    } else {
+        entry->next = buckets[hash % BUCKETS];
+        __atomic_store_n(&buckets[hash % BUCKETS], entry, __ATOMIC_RELEASE);
+        entries++;
+    }
+}
+
+static uint64_t read_generation()
+{
+    char path[PATH_MAX], text[32];
+    unsigned long long value = 0;
+    ssize_t got;
+
+    snprintf(path, PATH_MAX, "%s/" UNDOFS_CACHE_GENERATION, root);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+    got = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if(got <= 0)
+        return 0;
+    text[got] = 0;
+    sscanf(text, "%llu", &value);
+    return value;
+}
+
+// Make the renames in the store root stick, fsync on the files alone
+// doesn't cover their names.
+static int sync_root()
+{
+    int retval = -1;
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    if(fsync(fd) == 0)
+        retval = 0;
+    close(fd);
+    return retval;
+}
+
+static int write_generation(uint64_t value)
+{
+    char path[PATH_MAX], tmp[PATH_MAX], text[32];
+    int len, retval = -1;
+
+    snprintf(path, PATH_MAX, "%s/" UNDOFS_CACHE_GENERATION, root);
+    snprintf(tmp, PATH_MAX, "%s.new", path);
+    len = snprintf(text, sizeof(text), "%llu\n", (unsigned long long) value);
+
+    int fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd < 0)
+        return -1;
+    if(write(fd, text, len) == len && fsync(fd) == 0)
+        retval = 0;
+    close(fd);
+    if(retval == 0)
+        retval = rename(tmp, path);
+    else
+        unlink(tmp);
+    // The snapshot can't be trusted before the new generation is on disk.
+    if(retval == 0)
+        retval = sync_root();
+    return retval;
+}
+
+static snapshot_map *load_snapshot(const char *path)
+{
+    struct stat st;
+    const undofs_cache_header *header;
+    snapshot_map *map;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return NULL;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(undofs_cache_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(header == MAP_FAILED)
+        return NULL;
+
+    map = malloc(sizeof(snapshot_map));
+    if(map == NULL
+       || memcmp(header->magic, UNDOFS_CACHE_MAGIC, sizeof(header->magic)) != 0
+       || header->format != UNDOFS_CACHE_FORMAT || header->slot_size != sizeof(undofs_cache_slot)
+       || header->generation != generation
+       || header->slots == 0 || (header->slots & (header->slots - 1)) != 0
+       || header->slots > (uint64_t) st.st_size / sizeof(undofs_cache_slot)
+       || header->strings_offset != sizeof(*header) + header->slots * sizeof(undofs_cache_slot)
+       || header->strings_offset + header->strings_size != (uint64_t) st.st_size)
+    {
+        free(map);
+        munmap((void *) header, st.st_size);
+        return NULL;
+    }
+
+    // Lookups touch a slot or two each, all over the table.
+    madvise((void *) header, st.st_size, MADV_RANDOM);
+    map->retire.release = release_snapshot;
+    map->header = header;
+    map->size = st.st_size;
+    map->slots = (const undofs_cache_slot *) (header + 1);
+    map->strings = (const char *) header + header->strings_offset;
+    return map;
+}
+
+int undofs_cache_open(const char *rootdir)
+{
+    char path[PATH_MAX];
+
+    buckets = calloc(BUCKETS, sizeof(*buckets));
+    root = strdup(rootdir);
+    if(buckets == NULL || root == NULL)
+        return -1;
+    root_len = strlen(root);
+    while(root_len > 1 && root[root_len - 1] == '/')
+        root[--root_len] = 0;
+
+    generation = read_generation();
+    snprintf(path, PATH_MAX, "%s/" UNDOFS_CACHE_SNAPSHOT, root);
+    __atomic_store_n(&snapshot, load_snapshot(path), __ATOMIC_RELEASE);
+
+    // From here on the snapshot on disk is out of date, until close writes
+    // a new one with this generation.
+    generation++;
+    if(write_generation(generation) != 0)
+    {
+        pthread_mutex_lock(&cache_lock);
+        drop_snapshot();
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *path;
+    size_t len;
+    undofs_cache_slot slot;
+} snapshot_item;
+
+static int add_item(snapshot_item **items, size_t *count, size_t *size, const char *path, size_t len,
+                    const undofs_cache_slot *slot)
+{
+    if(*count == *size)
+    {
+        size_t new_size = *size ? *size * 2 : 4096;
+        snapshot_item *grown = realloc(*items, new_size * sizeof(snapshot_item));
+        if(grown == NULL)
+            return -1;
+        *items = grown;
+        *size = new_size;
+    }
+    snapshot_item *item = &(*items)[(*count)++];
+    item->path = path;
+    item->len = len;
+    item->slot = *slot;
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t res = write(fd, data, size);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data = (const char *) data + res;
+        size -= res;
+    }
+    return 0;
+}
+
+static int write_snapshot()
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snapshot_item *items = NULL;
+    size_t count = 0, size = 0, i, strings_size = 0;
+    undofs_cache_slot *slots = NULL;
+    undofs_cache_header header;
+    const snapshot_map *map = snapshot;
+    uint64_t nslots = 16, j;
+    int fd = -1, retval = -1, saved_errno;
+
+    // Nodes looked up in this mount first, then the ones that are still
+    // valid from the previous snapshot.
+    for(i = 0; i < BUCKETS; i++)
+    {
+        cache_entry *entry;
+        for(entry = buckets[i]; entry != NULL; entry = entry->next)
+        {
+            undofs_cache_slot slot;
+            if(entry->state == ENTRY_INVALID || count >= UNDOFS_CACHE_MAX_ENTRIES)
+                continue;
+            set_slot(&slot, entry->hash, entry->state == ENTRY_NODE ? &entry->info : NULL);
+            if(add_item(&items, &count, &size, entry->path, strlen(entry->path), &slot) != 0)
+                goto out;
+        }
+    }
+    for(j = 0; map != NULL && j < map->header->slots && count < UNDOFS_CACHE_MAX_ENTRIES; j++)
+    {
+        const undofs_cache_slot *slot = &map->slots[j];
+        const char *slot_path = map->strings + slot->path_offset;
+        char key[PATH_MAX];
+        if(slot->hash == 0 || slot->path_len >= PATH_MAX
+           || (uint64_t) slot->path_offset + slot->path_len > map->header->strings_size)
+            continue;
+        memcpy(key, slot_path, slot->path_len);
+        key[slot->path_len] = 0;
+        if(find(key, slot->hash) != NULL)
+            continue;
+        if(add_item(&items, &count, &size, slot_path, slot->path_len, slot) != 0)
+            goto out;
+    }
+
+    while(nslots < 2 * count)
+        nslots *= 2;
+    slots = calloc(nslots, sizeof(undofs_cache_slot));
+    if(slots == NULL)
+        goto out;
+    for(i = 0; i < count; i++)
+    {
+        for(j = items[i].slot.hash & (nslots - 1); slots[j].hash != 0; j = (j + 1) & (nslots - 1))
+            ;
+        slots[j] = items[i].slot;
+        slots[j].path_offset = strings_size;
+        slots[j].path_len = items[i].len;
+        strings_size += items[i].len;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UNDOFS_CACHE_MAGIC, sizeof(header.magic));
+    header.format = UNDOFS_CACHE_FORMAT;
+    header.slot_size = sizeof(undofs_cache_slot);
+    header.generation = generation;
+    header.slots = nslots;
+    header.entries = count;
+    header.strings_offset = sizeof(header) + nslots * sizeof(undofs_cache_slot);
+    header.strings_size = strings_size;
+
+    snprintf(path, PATH_MAX, "%s/" UNDOFS_CACHE_SNAPSHOT, root);
+    snprintf(tmp, PATH_MAX, "%s.new", path);
+    fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd < 0)
+        goto out;
+    if(write_all(fd, &header, sizeof(header)) != 0
+       || write_all(fd, slots, nslots * sizeof(undofs_cache_slot)) != 0)
+        goto out;
+    for(i = 0; i < count; i++)
+        if(write_all(fd, items[i].path, items[i].len) != 0)
+            goto out;
+    if(fsync(fd) != 0)
+        goto out;
+    // The old snapshot may still be mapped, but rename leaves its pages alone.
+    if((retval = rename(tmp, path)) == 0)
+        retval = sync_root();
+
+out:
+    saved_errno = errno;
+    if(fd >= 0)
+        close(fd);
+    if(retval != 0)
+        unlink(tmp);
+    free(slots);
+    free(items);
+    errno = saved_errno;
+    return retval;
+}
+
+int undofs_cache_close()
+{
+    int retval;
+
+    if(root == NULL)
+        return 0;
+    pthread_mutex_lock(&cache_lock);
+    retval = write_snapshot();
+    drop_entries();
+    drop_snapshot();
+    // Unmounting, nobody is reading any more.
+    while(retired_list != NULL)
+    {
+        retired *item = retired_list;
+        retired_list = item->next;
+        item->release(item);
+    }
+    retired_count = 0;
+    free(buckets);
+    buckets = NULL;
+    free(root);
+    root = NULL;
+    pthread_mutex_unlock(&cache_lock);
+    return retval;
+}
+
+int undofs_cache_lookup(const char *nodedir, undofs_node_info *info)
+{
+    const char *path = relative(nodedir);
+    const undofs_cache_slot *slot;
+    reader_slot *me;
+    cache_entry *entry;
+    uint64_t hash;
+    size_t len;
+    int retval = -1;
+
+    if(path == NULL)
+        return -1;
+    len = strlen(path);
+    hash = hash_path(path, len);
+
+    me = reader();
+    read_begin(me);
+    entry = find(path, hash);
+    if(entry != NULL)
+    {
+        if(entry->state != ENTRY_INVALID)
+        {
+            *info = entry->info;
+            retval = entry->state == ENTRY_NODE;
+        }
+    }
+    else if((slot = snapshot_find(__atomic_load_n(&snapshot, __ATOMIC_ACQUIRE), path, len, hash)) != NULL)
+    {
+        set_info(info, slot);
+        retval = (slot->flags & UNDOFS_CACHE_EXISTS) != 0;
+        if(me != NULL)
+            count(&me->snapshot_hits);
+    }
+    read_end(me);
+
+    if(me != NULL)
+    {
+        if(retval < 0)
+            count(&me->misses);
+        else if(entry != NULL)
+            count(&me->hits);
+    }
+    return retval;
+}
+
+uint64_t undofs_cache_ticket()
+{
+    return __atomic_load_n(&invalidations, __ATOMIC_ACQUIRE);
+}
+
+void undofs_cache_store(const char *nodedir, const undofs_node_info *info, uint64_t ticket)
+{
+    const char *path = relative(nodedir);
+    undofs_node_info missing = { -1, 0, 0 };
+
+    if(path == NULL)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    if(invalidations == ticket)
+        set_entry(path, hash_path(path, strlen(path)), info ? ENTRY_NODE : ENTRY_MISSING, info ? info : &missing);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void undofs_cache_invalidate(const char *nodedir)
+{
+    const char *path = relative(nodedir);
+
+    // A cached descriptor of the node is part of its state too.
+    undofs_fdcache_invalidate(nodedir);
+    if(path == NULL)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    __atomic_add_fetch(&invalidations, 1, __ATOMIC_RELEASE);
+    // A tombstone, so the snapshot doesn't answer for the node either.
+    set_entry(path, hash_path(path, strlen(path)), ENTRY_INVALID, NULL);
+    stats.invalidations++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void undofs_cache_clear()
+{
+    undofs_fdcache_clear();
+    if(root == NULL)
+        return;
+    pthread_mutex_lock(&cache_lock);
+    __atomic_add_fetch(&invalidations, 1, __ATOMIC_RELEASE);
+    drop_entries();
+    drop_snapshot();
+    stats.clears++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+size_t undofs_cache_stats(char *buf, size_t size)
+{
+    unsigned long long hits = 0, snapshot_hits = 0, misses = 0;
+    int len, i;
+
+    for(i = 0; i < READERS; i++)
+    {
+        hits += __atomic_load_n(&readers[i].hits, __ATOMIC_RELAXED);
+        snapshot_hits += __atomic_load_n(&readers[i].snapshot_hits, __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&readers[i].misses, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    len = snprintf(buf, size,
+                   "cache_entries %zu\n"
+                   "cache_snapshot_entries %llu\n"
+                   "cache_hits %llu\n"
+                   "cache_snapshot_hits %llu\n"
+                   "cache_misses %llu\n"
+                   "cache_invalidations %llu\n"
+                   "cache_clears %llu\n"
+                   "cache_retired %zu\n"
+                   "cache_reclaimed %llu\n",
+                   entries, snapshot ? (unsigned long long) snapshot->header->entries : 0ULL,
+                   hits, snapshot_hits, misses, stats.invalidations, stats.clears,
+                   retired_count, stats.reclaimed);
+    pthread_mutex_unlock(&cache_lock);
+    return len < 0 ? 0 : (size_t) len >= size ? size - 1 : (size_t) len;
+}
@@ -0,0 +1,128 @@
+#ifndef __UNDOFS_CACHE_H_
+#define __UNDOFS_CACHE_H_
+#include "config.h"
+
+#include "undofs_scan.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cache of node states: the latest version of a node and its markers, as
+ * found by undofs_scan_node(), and negative entries for nodes that don't
+ * exist. The mount is the only writer of the store, so entries stay valid
+ * until the mount changes the node itself.
+ *
+ * When the store is unmounted the cache is written to a snapshot in the
+ * store root. The next mount maps the snapshot and answers lookups from it
+ * right away; the table in memory sits on top of it and shadows every node
+ * that changed since. The snapshot records the store generation, which
+ * every mount advances, so a snapshot that missed changes (a crash, another
+ * mount) is never used. Tools that change an unmounted store remove the
+ * snapshot.
+ *
+ * Nothing in here depends on fuse.
+ */
+
+#define UNDOFS_CACHE_SNAPSHOT "cache.snapshot"
+#define UNDOFS_CACHE_GENERATION "generation"
+#define UNDOFS_CACHE_MAGIC "UNDOSNAP"
+#define UNDOFS_CACHE_FORMAT 3
+#define UNDOFS_CACHE_MAX_ENTRIES (1 << 20)
+
+enum undofs_cache_slot_flags {
+    UNDOFS_CACHE_EXISTS = 1,
+    UNDOFS_CACHE_DIR = 2,
+    UNDOFS_CACHE_DELETED = 4,
+};
+
+/**
+ * Snapshot header, 64 bytes. It is followed by the slots of an open
+ * addressing hash table, and the node paths relative to the store root.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t slot_size;
+    uint64_t generation;
+    uint64_t slots;             // a power of two
+    uint64_t entries;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t reserved;
+} undofs_cache_header;
+
+/**
+ * Snapshot slot, 48 bytes.
+ */
+typedef struct {
+    uint64_t hash;              // of the path, 0 for an empty slot
+    uint32_t path_offset;       // in the strings
+    uint32_t path_len;
+    int64_t latest;
+    uint32_t flags;             // enum undofs_cache_slot_flags
+    uint32_t purge_gen;
+    uint64_t ino;
+    uint32_t born;
+    uint32_t reserved;
+} undofs_cache_slot;
+
+/**
+ * Start caching, and load the snapshot if it is still valid.
+ * Advances the store generation.
+ * @param rootdir the store root.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_cache_open(const char *rootdir);
+
+/**
+ * Write the snapshot and stop caching.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_cache_close();
+
+/**
+ * Look up the state of a node.
+ * @param nodedir the node path, as returned by undofs_versiondir_path().
+ * @param info receives the state of the node.
+ * @return 1 if the node is cached, 0 if it is cached as not existing, -1 if it isn't cached.
+ */
+int undofs_cache_lookup(const char *nodedir, undofs_node_info *info);
+
+/**
+ * Take a ticket before scanning a node, for undofs_cache_store().
+ * @return the ticket.
+ */
+uint64_t undofs_cache_ticket();
+
+/**
+ * Cache the state of a node, unless any node was invalidated since the
+ * ticket was taken: the scan might have seen it halfway.
+ * @param nodedir the node path.
+ * @param info the state of the node, NULL if it doesn't exist.
+ * @param ticket from undofs_cache_ticket(), taken before the scan.
+ */
+void undofs_cache_store(const char *nodedir, const undofs_node_info *info, uint64_t ticket);
+
+/**
+ * Forget the state of a node, after it was changed on disk.
+ * Its cached file descriptor, if any, is dropped as well.
+ * @param nodedir the node path.
+ */
+void undofs_cache_invalidate(const char *nodedir);
+
+/**
+ * Forget everything, including cached file descriptors, after a change
+ * that affects a whole subtree.
+ */
+void undofs_cache_clear();
+
+/**
+ * Describe the state of the cache, one "name value" pair per line.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_cache_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,128 @@
+#include "undofs_cachepolicy.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char *pattern;
+    int whole_path;     // the pattern has a slash
+    int policy;
+} cache_rule;
+
+static const char *policy_names[] = { "both", "direct_io", "drop_backing" };
+
+static int default_policy = UNDOFS_CACHEPOLICY_BOTH;
+static cache_rule *rules = NULL;
+static size_t nrules = 0;
+
+void undofs_cachepolicy_set_default(int policy)
+{
+    if(policy >= UNDOFS_CACHEPOLICY_BOTH && policy <= UNDOFS_CACHEPOLICY_DROP_BACKING)
+        default_policy = policy;
+}
+
+static void free_rules(cache_rule *list, size_t count)
+{
+    size_t i;
+    for(i = 0; i < count; i++)
+        free(list[i].pattern);
+    free(list);
+}
+
+int undofs_cachepolicy_load(const char *file, int *line)
+{
+    cache_rule *loaded = NULL;
+    size_t count = 0, alloc = 0, len = 0;
+    char *text = NULL;
+    FILE *f;
+
+    *line = 0;
+    f = fopen(file, "r");
+    if(f == NULL)
+        return -1;
+
+    while(getline(&text, &len, f) >= 0)
+    {
+        char *pattern, *name, *rest;
+        int policy;
+
+        (*line)++;
+        pattern = strtok_r(text, " \t\r\n", &rest);
+        if(pattern == NULL || pattern[0] == '#')
+            continue;
+        name = strtok_r(NULL, " \t\r\n", &rest);
+        policy = name ? undofs_cachepolicy_parse(name) : -1;
+        if(policy < 0 || strtok_r(NULL, " \t\r\n", &rest) != NULL)
+            goto invalid;
+
+        if(count == alloc)
+        {
+            cache_rule *grown = realloc(loaded, (alloc ? alloc * 2 : 16) * sizeof(cache_rule));
+            if(grown == NULL)
+                goto fail;
+            loaded = grown;
+            alloc = alloc ? alloc * 2 : 16;
+        }
+        loaded[count].pattern = strdup(pattern);
+        if(loaded[count].pattern == NULL)
+            goto fail;
+        loaded[count].whole_path = strchr(pattern, '/') != NULL;
+        loaded[count].policy = policy;
+        count++;
+    }
+    if(ferror(f))
+    {
+        *line = 0;
+        goto fail;
+    }
+
+    free(text);
+    fclose(f);
+    free_rules(rules, nrules);
+    rules = loaded;
+    nrules = count;
+    return 0;
+
+invalid:
+    errno = EINVAL;
+fail:
+    {
+        int saved_errno = errno;
+        free(text);
+        fclose(f);
+        free_rules(loaded, count);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+int undofs_cachepolicy_for(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    size_t i;
+
+    name = name ? name + 1 : path;
+    for(i = 0; i < nrules; i++)
+        if(fnmatch(rules[i].pattern, rules[i].whole_path ? path : name, 0) == 0)
+            return rules[i].policy;
+    return default_policy;
+}
+
+int undofs_cachepolicy_parse(const char *name)
+{
+    size_t i;
+    for(i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+        if(strcmp(name, policy_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *undofs_cachepolicy_name(int policy)
+{
+    if(policy < 0 || policy > UNDOFS_CACHEPOLICY_DROP_BACKING)
+        return "unknown";
+    return policy_names[policy];
+}
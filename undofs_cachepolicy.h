@@ -0,0 +1,74 @@
+#ifndef __UNDOFS_CACHEPOLICY_H_
+#define __UNDOFS_CACHEPOLICY_H_
+#include "config.h"
+
+/*
+ * Which page cache holds file data read through the mount.
+ *
+ * Data read through undofs is cached twice: by the kernel for the mount,
+ * and by the filesystem under the store for the version file. The policy
+ * of a file picks one of them:
+ *
+ *   both           the default, both caches keep the data
+ *   direct_io      the mount doesn't cache, reads go to undofs every time
+ *                  and hit the cache of the store
+ *   drop_backing   the mount caches, and the store's pages are dropped as
+ *                  soon as undofs has read them; the mount keeps its cache
+ *                  across read-only opens of the same version
+ *
+ * Files opened with direct_io can't be mapped shared on older kernels.
+ *
+ * The mount sets a default policy, and a rules file can set it per path,
+ * one "<pattern> <policy>" rule per line, first match wins:
+ *
+ *   # virtual machine images are read once, the store cache is enough
+ *   *.qcow2          direct_io
+ *   /scratch/big-*   drop_backing
+ *
+ * Patterns are matched with fnmatch against the file name, or against the
+ * whole path when they contain a slash. Empty lines and lines starting with
+ * # are skipped.
+ *
+ * The rules are loaded before the mount starts and never change, so looking
+ * them up takes no lock. Nothing in here depends on fuse.
+ */
+
+enum undofs_cachepolicy {
+    UNDOFS_CACHEPOLICY_BOTH = 0,
+    UNDOFS_CACHEPOLICY_DIRECT_IO,
+    UNDOFS_CACHEPOLICY_DROP_BACKING,
+};
+
+/**
+ * Set the policy of files that no rule matches.
+ * @param policy the policy.
+ */
+void undofs_cachepolicy_set_default(int policy);
+
+/**
+ * Load per path rules, replacing those loaded before.
+ * @param file the rules file.
+ * @param line receives the number of the first bad line, or 0 if the file couldn't be read.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_cachepolicy_load(const char *file, int *line);
+
+/**
+ * @param path the path of a file, relative to the mount root.
+ * @return the policy of the file.
+ */
+int undofs_cachepolicy_for(const char *path);
+
+/**
+ * @param name a policy name, as used in the cache_policy= mount option and rules.
+ * @return the policy, or -1 if the name is unknown.
+ */
+int undofs_cachepolicy_parse(const char *name);
+
+/**
+ * @param policy a policy.
+ * @return its name.
+ */
+const char *undofs_cachepolicy_name(int policy);
+
+#endif
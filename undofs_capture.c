@@ -0,0 +1,132 @@
+#include "undofs_capture.h"
+#include "undofs_trace.h"
+#include "undofs_util.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static FILE *capture_file = NULL;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t capture_start_ns;
+static uint64_t capture_key[2];
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Keyed FNV-1a over one path component, with a final mix so similar
+// names don't end up with similar hashes.
+static uint64_t component_hash(const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL ^ capture_key[0];
+    size_t i;
+    for(i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= capture_key[1];
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static void anonymize(char *out, size_t out_size, const char *path)
+{
+    size_t used = 0;
+
+    if(path == NULL)
+    {
+        snprintf(out, out_size, "-");
+        return;
+    }
+
+    out[0] = 0;
+    while(*path && used + 18 < out_size)
+    {
+        while(*path == '/')
+            path++;
+        if(*path == 0)
+            break;
+
+        size_t len = strcspn(path, "/");
+        used += snprintf(out + used, out_size - used, "/%016llx",
+                         (unsigned long long) component_hash(path, len));
+        path += len;
+    }
+    if(used == 0)
+        snprintf(out, out_size, "/");
+}
+
+int undofs_capture_open(const char *path)
+{
+    int fd;
+
+    capture_file = fopen(path, "w");
+    if(capture_file == NULL)
+    {
+        LOG_ERROR("Failed to open capture file %s", path);
+        return -1;
+    }
+    setvbuf(capture_file, NULL, _IOFBF, 1 << 20);
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if(fd < 0 || read(fd, capture_key, sizeof(capture_key)) != sizeof(capture_key))
+    {
+        LOG_ERROR("Failed to get a random key for path anonymization");
+        capture_key[0] = monotonic_ns();
+        capture_key[1] = getpid();
+    }
+    if(fd >= 0)
+        close(fd);
+
+    fprintf(capture_file, "%s\n", UNDOFS_CAPTURE_HEADER);
+    capture_start_ns = monotonic_ns();
+    LOG("Capturing operations to %s.", path);
+    return 0;
+}
+
+void undofs_capture_close()
+{
+    pthread_mutex_lock(&capture_lock);
+    if(capture_file != NULL)
+    {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+int undofs_capture_enabled()
+{
+    return capture_file != NULL;
+}
+
+void undofs_capture_op(const undofs_op_ctx *ctx, int result, uint64_t duration_ns)
+{
+    char path[PATH_MAX], path2[PATH_MAX];
+
+    if(capture_file == NULL)
+        return;
+
+    anonymize(path, PATH_MAX, ctx->path);
+    anonymize(path2, PATH_MAX, ctx->path2);
+
+    pthread_mutex_lock(&capture_lock);
+    if(capture_file != NULL)
+        fprintf(capture_file, "%llu\t%llu\t%s\t%d\t%llu\t%llu\t%lld\t%u\t%u\t%s\t%s\n",
+                (unsigned long long) (ctx->start_ns - capture_start_ns),
+                (unsigned long long) duration_ns,
+                undofs_trace_op_names[ctx->op], result,
+                (unsigned long long) ctx->fh, (unsigned long long) ctx->size,
+                (long long) ctx->offset, ctx->flags, ctx->mode, path, path2);
+    pthread_mutex_unlock(&capture_lock);
+}
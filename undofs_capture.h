@@ -0,0 +1,53 @@
+#ifndef __UNDOFS_CAPTURE_H_
+#define __UNDOFS_CAPTURE_H_
+#include "config.h"
+
+#include "undofs_opwrap.h"
+
+#include <stdint.h>
+
+/*
+ * Workload capture, replayed by undofs-replay.
+ *
+ * A capture file starts with the line "#undofs-capture 1", followed by one
+ * tab-separated line per operation:
+ *
+ *   start_ns duration_ns op result fh size offset flags mode path path2
+ *
+ * start_ns counts from the start of the capture.  Every path component is
+ * replaced by a keyed hash, so the directory structure survives but no
+ * names do; the key is random and never written out.  Missing values are
+ * written as 0, a missing path2 as "-".  Lines are written when operations
+ * complete, so they are not ordered by start_ns.  fh tells open handles
+ * apart, also read-only ones that share a descriptor.
+ */
+
+#define UNDOFS_CAPTURE_HEADER "#undofs-capture 1"
+
+/**
+ * Start capturing operations to a file.
+ * @param path location of the capture file, which is overwritten.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_capture_open(const char *path);
+
+/**
+ * Stop capturing and flush the capture file, if any.
+ */
+void undofs_capture_close();
+
+/**
+ * @return non-zero when operations are being captured.
+ */
+int undofs_capture_enabled();
+
+/**
+ * Write a completed operation to the capture file.  Does nothing when
+ * capturing is off.
+ * @param ctx the operation context.
+ * @param result the return value of the operation.
+ * @param duration_ns how long the operation took.
+ */
+void undofs_capture_op(const undofs_op_ctx *ctx, int result, uint64_t duration_ns);
+
+#endif
@@ -0,0 +1,411 @@
+#include "undofs_clone.h"
+#include "undofs_syscount.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+// Until the store is probed, copy the way that works everywhere.
+static int clone_method = UNDOFS_CLONE_COPY_RANGE;
+
+static int clone_cache = UNDOFS_CLONE_CACHE_KEEP;
+
+static const char *method_names[] = { "auto", "reflink", "copy_range", "readwrite" };
+static const char *cache_names[] = { "keep", "drop", "direct" };
+
+// O_DIRECT wants offsets, lengths and buffers aligned to the logical block
+// size of the device, which is at most this on anything we run on.
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUFFER (1024 * 1024)
+
+typedef struct {
+    int src, dst;
+    int method;
+    int cache;
+    off_t size;
+    off_t next_chunk;       // taken with an atomic add
+    int error;              // first errno seen by any worker
+} clone_job;
+
+// Copy a range without copy_file_range, for filesystems that don't have it.
+static int copy_range_rw(int src, int dst, off_t offset, off_t len)
+{
+    char buf[128 * 1024];
+    while(len > 0)
+    {
+        ssize_t got = sys_pread(src, buf, len < (off_t) sizeof(buf) ? len : (off_t) sizeof(buf), offset);
+        if(got <= 0)
+            return got == 0 ? 0 : -1;
+        ssize_t put = 0;
+        while(put < got)
+        {
+            ssize_t res = sys_pwrite(dst, buf + put, got - put, offset + put);
+            if(res < 0)
+                return -1;
+            put += res;
+        }
+        offset += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int copy_range(int method, int src, int dst, off_t offset, off_t len)
+{
+    loff_t in = offset, out = offset;
+
+    if(method == UNDOFS_CLONE_READWRITE)
+        return copy_range_rw(src, dst, offset, len);
+
+    sys_posix_fadvise(src, offset, len, POSIX_FADV_WILLNEED);
+    while(len > 0)
+    {
+        ssize_t res = sys_copy_file_range(src, &in, dst, &out, len, 0);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+                return copy_range_rw(src, dst, in, len);
+            return -1;
+        }
+        if(res == 0)
+            break; // the source shrank while we were copying
+        len -= res;
+    }
+    return 0;
+}
+
+// Copy a range between descriptors opened with O_DIRECT. The range starts
+// aligned; the end of the file is written in a whole block, and cut off
+// again after all chunks are done.
+static int copy_range_direct(int src, int dst, off_t offset, off_t len)
+{
+    char *buf;
+    int retval = 0;
+
+    if(posix_memalign((void **) &buf, DIRECT_ALIGN, DIRECT_BUFFER) != 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    while(len > 0)
+    {
+        size_t want = len < DIRECT_BUFFER ? len : DIRECT_BUFFER;
+        ssize_t got = sys_pread(src, buf, (want + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1), offset);
+        if(got <= 0)
+        {
+            retval = got == 0 ? 0 : -1;
+            break; // the source shrank while we were copying
+        }
+        size_t whole = (got + DIRECT_ALIGN - 1) & ~(size_t) (DIRECT_ALIGN - 1);
+        memset(buf + got, 0, whole - got);
+        ssize_t put = 0;
+        while(put < (ssize_t) whole)
+        {
+            ssize_t res = sys_pwrite(dst, buf + put, whole - put, offset + put);
+            if(res < 0)
+            {
+                retval = -1;
+                break;
+            }
+            put += res;
+        }
+        if(retval != 0 || got % DIRECT_ALIGN != 0)
+            break; // that was the end of the file
+        offset += got;
+        len -= got;
+    }
+    free(buf);
+    return retval;
+}
+
+// Write back a copied range and drop it from the page cache, in both files.
+static int drop_range(int src, int dst, off_t offset, off_t len)
+{
+    int flags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+    if(sync_file_range(dst, offset, len, flags) != 0)
+        return -1;
+    sys_posix_fadvise(dst, offset, len, POSIX_FADV_DONTNEED);
+    sys_posix_fadvise(src, offset, len, POSIX_FADV_DONTNEED);
+    return 0;
+}
+
+// Open both files of a job for O_DIRECT, or neither.
+static int set_direct(clone_job *job)
+{
+    int src_flags = fcntl(job->src, F_GETFL), dst_flags = fcntl(job->dst, F_GETFL);
+    if(src_flags < 0 || dst_flags < 0 || fcntl(job->src, F_SETFL, src_flags | O_DIRECT) != 0)
+        return -1;
+    if(fcntl(job->dst, F_SETFL, dst_flags | O_DIRECT) != 0)
+    {
+        fcntl(job->src, F_SETFL, src_flags);
+        return -1;
+    }
+    return 0;
+}
+
+static void *clone_worker(void *arg)
+{
+    clone_job *job = arg;
+
+    for(;;)
+    {
+        off_t offset = __atomic_fetch_add(&job->next_chunk, UNDOFS_CLONE_CHUNK, __ATOMIC_RELAXED);
+        if(offset >= job->size || __atomic_load_n(&job->error, __ATOMIC_RELAXED))
+            break;
+
+        off_t len = job->size - offset < UNDOFS_CLONE_CHUNK ? job->size - offset : UNDOFS_CLONE_CHUNK;
+        int res;
+        if(job->cache == UNDOFS_CLONE_CACHE_DIRECT)
+            res = copy_range_direct(job->src, job->dst, offset, len);
+        else
+        {
+            res = copy_range(job->method, job->src, job->dst, offset, len);
+            if(res == 0 && job->cache == UNDOFS_CLONE_CACHE_DROP)
+                res = drop_range(job->src, job->dst, offset, len);
+        }
+        if(res != 0)
+        {
+            int expected = 0, error = errno;
+            __atomic_compare_exchange_n(&job->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int undofs_clone(const char *src, const char *dst, int threads)
+{
+    pthread_t workers[UNDOFS_CLONE_MAX_THREADS];
+    clone_job job;
+    struct stat st;
+    int started = 0, i, saved_errno;
+
+    // Don't even open special files, that could block or have side effects.
+    if(sys_lstat(src, &st) != 0)
+        return -1;
+    if(! S_ISREG(st.st_mode))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    job.src = sys_open(src, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if(job.src < 0)
+        return -1;
+    if(sys_fstat(job.src, &st) != 0)
+    {
+        saved_errno = errno;
+        sys_close(job.src);
+        errno = saved_errno;
+        return -1;
+    }
+
+    job.dst = sys_open(dst, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, st.st_mode & 07777);
+    if(job.dst < 0)
+    {
+        saved_errno = errno;
+        sys_close(job.src);
+        errno = saved_errno;
+        return -1;
+    }
+
+    job.method = __atomic_load_n(&clone_method, __ATOMIC_RELAXED);
+    job.size = st.st_size;
+    job.cache = job.size >= UNDOFS_CLONE_UNCACHED_MIN ? __atomic_load_n(&clone_cache, __ATOMIC_RELAXED) : UNDOFS_CLONE_CACHE_KEEP;
+    job.next_chunk = 0;
+    job.error = 0;
+
+    // A reflink shares all extents in one call, the other files are copied.
+    if(job.method != UNDOFS_CLONE_REFLINK || sys_ioctl(job.dst, FICLONE, job.src) != 0)
+    {
+        sys_posix_fadvise(job.src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // Filesystems without O_DIRECT (tmpfs, some fuse ones) refuse the flag.
+        if(job.cache == UNDOFS_CLONE_CACHE_DIRECT && set_direct(&job) != 0)
+            job.cache = UNDOFS_CLONE_CACHE_DROP;
+
+        // Setting the size first lets the workers fill in their chunks in any
+        // order, and lets the filesystem allocate the file in one go.
+        if(sys_ftruncate(job.dst, job.size) != 0)
+            job.error = errno;
+
+        if(threads > UNDOFS_CLONE_MAX_THREADS)
+            threads = UNDOFS_CLONE_MAX_THREADS;
+        if(threads > (job.size + UNDOFS_CLONE_CHUNK - 1) / UNDOFS_CLONE_CHUNK)
+            threads = (job.size + UNDOFS_CLONE_CHUNK - 1) / UNDOFS_CLONE_CHUNK;
+
+        // The calling thread is one of the workers.
+        for(i = 1; i < threads && ! job.error; i++)
+        {
+            if(pthread_create(&workers[started], NULL, clone_worker, &job) != 0)
+                break;
+            started++;
+        }
+        if(! job.error)
+            clone_worker(&job);
+        for(i = 0; i < started; i++)
+            pthread_join(workers[i], NULL);
+
+        // The last block went out whole.
+        if(job.cache == UNDOFS_CLONE_CACHE_DIRECT && ! job.error && sys_ftruncate(job.dst, job.size) != 0)
+            job.error = errno;
+    }
+
+    if(! job.error)
+    {
+        // Like cp -a: ownership only sticks for root.
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if(sys_fchown(job.dst, st.st_uid, st.st_gid) != 0 && errno != EPERM)
+            job.error = errno;
+        else if(sys_futimens(job.dst, times) != 0)
+            job.error = errno;
+    }
+
+    sys_close(job.src);
+    if(sys_close(job.dst) != 0 && ! job.error)
+        job.error = errno;
+
+    if(job.error)
+    {
+        sys_unlink(dst);
+        errno = job.error;
+        return -1;
+    }
+    return 0;
+}
+
+void undofs_clone_set_method(int method)
+{
+    if(method > UNDOFS_CLONE_AUTO && method <= UNDOFS_CLONE_READWRITE)
+        __atomic_store_n(&clone_method, method, __ATOMIC_RELAXED);
+}
+
+int undofs_clone_method_parse(const char *name)
+{
+    size_t i;
+    for(i = 0; i < sizeof(method_names) / sizeof(method_names[0]); i++)
+        if(strcmp(name, method_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *undofs_clone_method_name(int method)
+{
+    if(method < 0 || method > UNDOFS_CLONE_READWRITE)
+        return "unknown";
+    return method_names[method];
+}
+
+void undofs_clone_set_cache(int mode)
+{
+    if(mode >= UNDOFS_CLONE_CACHE_KEEP && mode <= UNDOFS_CLONE_CACHE_DIRECT)
+        __atomic_store_n(&clone_cache, mode, __ATOMIC_RELAXED);
+}
+
+int undofs_clone_cache_parse(const char *name)
+{
+    size_t i;
+    for(i = 0; i < sizeof(cache_names) / sizeof(cache_names[0]); i++)
+        if(strcmp(name, cache_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *undofs_clone_cache_name(int mode)
+{
+    if(mode < 0 || mode > UNDOFS_CLONE_CACHE_DIRECT)
+        return "unknown";
+    return cache_names[mode];
+}
+
+static const struct {
+    long magic;
+    const char *name;
+} fs_types[] = {
+    { 0x9123683e, "btrfs" },
+    { 0x58465342, "xfs" },
+    { 0xca451a4e, "bcachefs" },
+    { 0x2fc12fc1, "zfs" },
+    { 0xef53, "ext4" },
+    { 0x6969, "nfs" },
+    { 0xff534d42, "cifs" },
+    { 0x00c36400, "ceph" },
+    { 0x794c7630, "overlayfs" },
+    { 0x65735546, "fuse" },
+    { 0x01021994, "tmpfs" },
+    { 0x858458f6, "ramfs" },
+};
+
+static const char *fs_name(long magic)
+{
+    size_t i;
+    for(i = 0; i < sizeof(fs_types) / sizeof(fs_types[0]); i++)
+        if(fs_types[i].magic == magic)
+            return fs_types[i].name;
+    return NULL;
+}
+
+int undofs_clone_probe(const char *dir, char *desc, size_t size)
+{
+    char src_path[PATH_MAX], dst_path[PATH_MAX], unknown[32], block[4096];
+    struct statfs sfs;
+    const char *type = NULL;
+    int src = -1, dst = -1, method = UNDOFS_CLONE_READWRITE;
+    const char *why = "no scratch file";
+
+    memset(&sfs, 0, sizeof(sfs));
+    if(statfs(dir, &sfs) == 0)
+        type = fs_name(sfs.f_type);
+    if(type == NULL)
+    {
+        snprintf(unknown, sizeof(unknown), "type %#lx", (long) sfs.f_type);
+        type = unknown;
+    }
+
+    snprintf(src_path, PATH_MAX, "%s/clone.probe", dir);
+    snprintf(dst_path, PATH_MAX, "%s/clone.probe.copy", dir);
+    sys_unlink(src_path);
+    sys_unlink(dst_path);
+    memset(block, 0x5a, sizeof(block));
+    src = sys_open(src_path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    dst = sys_open(dst_path, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(src >= 0 && dst >= 0 && sys_pwrite(src, block, sizeof(block), 0) == sizeof(block) && sys_fsync(src) == 0)
+    {
+        loff_t in = 0, out = 0;
+        if(sys_ioctl(dst, FICLONE, src) == 0)
+        {
+            method = UNDOFS_CLONE_REFLINK;
+            why = "reflinks work";
+        }
+        // Even where it is emulated (tmpfs), copy_file_range saves the
+        // copies through user space.
+        else if(sys_ftruncate(dst, 0) == 0 && sys_copy_file_range(src, &in, dst, &out, sizeof(block), 0) == sizeof(block))
+        {
+            method = UNDOFS_CLONE_COPY_RANGE;
+            why = "no reflinks, copy_file_range works";
+        } else
+            why = "neither reflinks nor copy_file_range work";
+    }
+
+    if(src >= 0)
+        sys_close(src);
+    if(dst >= 0)
+        sys_close(dst);
+    sys_unlink(src_path);
+    sys_unlink(dst_path);
+
+    snprintf(desc, size, "%s, %s", type, why);
+    return method;
+}
@@ -0,0 +1,107 @@
+#ifndef __UNDOFS_CLONE_H_
+#define __UNDOFS_CLONE_H_
+#include "config.h"
+
+#include <stddef.h>
+
+/*
+ * Cloning regular files for new versions.
+ *
+ * Large files are split in chunks that worker threads copy in parallel
+ * with copy_file_range, which stays inside the kernel and lets filesystems
+ * that can share extents do so. Nothing in here depends on fuse, so the
+ * benchmarks can link it.
+ *
+ * What works best depends on the filesystem under the store: sharing
+ * extents with a reflink where it is supported (btrfs, XFS), in-kernel
+ * copies where it isn't (ext4, NFS, tmpfs), and plain reads and writes
+ * where copy_file_range fails. undofs_clone_probe() picks one by trying
+ * them out.
+ *
+ * Copies also fill the page cache with old data that is rarely read again,
+ * pushing out what everything else on the machine works with. The cache
+ * modes below keep large copies out of it: by dropping the pages of both
+ * files as each chunk is done, or by copying with O_DIRECT, where the
+ * filesystem supports it.
+ */
+
+enum undofs_clone_method {
+    UNDOFS_CLONE_AUTO = 0,      // probe the store when mounting
+    UNDOFS_CLONE_REFLINK,       // FICLONE, falling back to copy_file_range
+    UNDOFS_CLONE_COPY_RANGE,    // copy_file_range, in parallel chunks
+    UNDOFS_CLONE_READWRITE,     // pread and pwrite, in parallel chunks
+};
+
+enum undofs_clone_cache {
+    UNDOFS_CLONE_CACHE_KEEP = 0,    // leave both files in the page cache
+    UNDOFS_CLONE_CACHE_DROP,        // write back each chunk and drop its pages
+    UNDOFS_CLONE_CACHE_DIRECT,      // O_DIRECT with aligned buffers, else DROP
+};
+
+#define UNDOFS_CLONE_THREADS 4
+#define UNDOFS_CLONE_MAX_THREADS 64
+#define UNDOFS_CLONE_CHUNK (16 * 1024 * 1024)
+#define UNDOFS_CLONE_UNCACHED_MIN (4 * 1024 * 1024)    // smaller files always use the cache
+
+/**
+ * Copy a regular file to a new file, with its mode, ownership (when
+ * permitted) and timestamps.
+ *
+ * In case of an error, errno will be set appropriately, and dst is removed.
+ *
+ * @param src the file to copy.
+ * @param dst the new file, must not exist yet.
+ * @param threads the number of threads to copy with, at most UNDOFS_CLONE_MAX_THREADS.
+ * @return 0 on success, -1 on failure. errno is EINVAL if src is not a regular file.
+ */
+int undofs_clone(const char *src, const char *dst, int threads);
+
+/**
+ * Choose how undofs_clone() copies from now on.
+ * @param method the method, not UNDOFS_CLONE_AUTO.
+ */
+void undofs_clone_set_method(int method);
+
+/**
+ * Find the best way to clone files in a directory, by looking at the
+ * filesystem type and trying a reflink and copy_file_range on a scratch
+ * file.
+ * @param dir the directory, on the filesystem files will be cloned on.
+ * @param desc receives a description of the filesystem and the outcome, for the log.
+ * @param size the size of desc.
+ * @return the method to use, never UNDOFS_CLONE_AUTO.
+ */
+int undofs_clone_probe(const char *dir, char *desc, size_t size);
+
+/**
+ * @param name a method name, as used in the clone= mount option.
+ * @return the method, or -1 if the name is unknown.
+ */
+int undofs_clone_method_parse(const char *name);
+
+/**
+ * @param method a method.
+ * @return its name.
+ */
+const char *undofs_clone_method_name(int method);
+
+/**
+ * Choose how undofs_clone() treats the page cache from now on. Files smaller
+ * than UNDOFS_CLONE_UNCACHED_MIN and reflinks are not affected.
+ * @param mode the cache mode.
+ */
+void undofs_clone_set_cache(int mode);
+
+/**
+ * @param name a cache mode name, as used in the clone_cache= mount option.
+ * @return the mode, or -1 if the name is unknown.
+ */
+int undofs_clone_cache_parse(const char *name);
+
+/**
+ * @param mode a cache mode.
+ * @return its name.
+ */
+const char *undofs_clone_cache_name(int mode);
+
+#endif
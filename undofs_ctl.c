@@ -0,0 +1,308 @@
+#include "undofs_ctl.h"
+#include "undofs_cache.h"
+#include "undofs_fdcache.h"
+#include "undofs_fops.h"
+#include "undofs_mirror.h"
+#include "undofs_scrub.h"
+#include "undofs_span.h"
+#include "undofs_syscount.h"
+#include "undofs_util.h"
+#include "undofs_wamp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CTL_DIR_LEN (sizeof(UNDOFS_CTL_DIR) - 1)
+#define CTL_CONTENTS_MAX (64 * 1024)
+
+typedef struct {
+    const char *name;
+    mode_t mode;
+    int (*command)(const char *args); // handles one written line
+    size_t (*read)(char *buf, size_t size); // produces the contents
+} ctl_file;
+
+static int cmd_delete_tree(const char *args)
+{
+    if(args[0] != '/' || undofs_ctl_owns(args))
+        return -EINVAL;
+    return undofs_delete_tree(args);
+}
+
+// "<version> <path>", the version first so paths can have spaces.
+static int cmd_restore_version(const char *args)
+{
+    char *end;
+    long version = strtol(args, &end, 10);
+    if(end == args || *end != ' ' || end[1] != '/' || undofs_ctl_owns(end + 1))
+        return -EINVAL;
+    return undofs_restore_version(end + 1, version);
+}
+
+// "<unix time> <path>", the time as undofs-export takes it.
+static int cmd_restore_attrs(const char *args)
+{
+    char *end;
+    double when = strtod(args, &end);
+    if(end == args || when < 0 || *end != ' ' || end[1] != '/' || undofs_ctl_owns(end + 1))
+        return -EINVAL;
+    return undofs_restore_attrs(end + 1, (uint64_t) (when * 1e9));
+}
+
+static int run_command(const char *line)
+{
+    static const struct {
+        const char *name;
+        int (*run)(const char *args);
+    } commands[] = {
+        { "delete-tree", cmd_delete_tree },
+        { "restore-version", cmd_restore_version },
+        { "restore-attrs", cmd_restore_attrs },
+    };
+    size_t i;
+
+    for(i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        size_t len = strlen(commands[i].name);
+        if(strncmp(line, commands[i].name, len) == 0 && line[len] == ' ')
+            return commands[i].run(line + len + 1);
+    }
+    LOG("Unknown control command '%s'", line);
+    return -EINVAL;
+}
+
+static size_t read_stats(char *buf, size_t size)
+{
+    size_t len = undofs_mirror_stats(buf, size);
+    len += undofs_scrub_stats(buf + len, size - len);
+    len += undofs_cache_stats(buf + len, size - len);
+    len += undofs_fdcache_stats(buf + len, size - len);
+    len += undofs_wamp_stats(buf + len, size - len);
+    len += undofs_span_stats(buf + len, size - len);
+    len += undofs_syscount_stats(buf + len, size - len);
+    return len;
+}
+
+static const ctl_file ctl_files[] = {
+    { "ctl", S_IFREG | S_IWUSR, run_command, NULL },
+    { "stats", S_IFREG | S_IRUSR, NULL, read_stats },
+    { "wamp", S_IFREG | S_IRUSR, NULL, undofs_wamp_dirs },
+    { "slow", S_IFREG | S_IRUSR, NULL, undofs_span_slow_ops },
+};
+
+#define CTL_FILES ((int) (sizeof(ctl_files) / sizeof(ctl_files[0])))
+
+// An open control file.
+typedef struct {
+    int file;                   // the index in ctl_files
+    char *contents;             // what reads return, NULL if write-only
+    size_t len;
+} ctl_handle;
+
+int undofs_ctl_owns(const char *path)
+{
+    return path != NULL && strncmp(path, UNDOFS_CTL_DIR, CTL_DIR_LEN) == 0
+        && (path[CTL_DIR_LEN] == 0 || path[CTL_DIR_LEN] == '/');
+}
+
+// The index in ctl_files, -1 for the directory itself, or -2.
+static int find_file(const char *path)
+{
+    int i;
+    if(path[CTL_DIR_LEN] == 0 || strcmp(path + CTL_DIR_LEN, "/") == 0)
+        return -1;
+    for(i = 0; i < CTL_FILES; i++)
+        if(strcmp(path + CTL_DIR_LEN + 1, ctl_files[i].name) == 0)
+            return i;
+    return -2;
+}
+
+static int ctl_getattr(const char *path, struct stat *statbuf)
+{
+    static time_t mounted = 0;
+    int file = find_file(path);
+    if(file == -2)
+        return -ENOENT;
+
+    if(mounted == 0)
+        mounted = time(NULL);
+
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_uid = getuid();
+    statbuf->st_gid = getgid();
+    statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = mounted;
+    // The mount reports inode numbers (use_ino), take some from the top
+    // that no node directory will have.
+    statbuf->st_ino = ~(ino_t) 0 - 1 - file;
+    if(file == -1)
+    {
+        statbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR;
+        statbuf->st_nlink = 2;
+    } else {
+        statbuf->st_mode = ctl_files[file].mode;
+        statbuf->st_nlink = 1;
+    }
+    return 0;
+}
+
+static int ctl_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+    return ctl_getattr(path, statbuf);
+}
+
+static int ctl_access(const char *path, int mask)
+{
+    return find_file(path) == -2 ? -ENOENT : 0;
+}
+
+static int ctl_open(const char *path, struct fuse_file_info *fi)
+{
+    int file = find_file(path);
+    if(file == -2)
+        return -ENOENT;
+    if(file == -1)
+        return -EISDIR;
+    if((fi->flags & O_ACCMODE) != O_WRONLY && ctl_files[file].read == NULL)
+        return -EACCES;
+    if((fi->flags & O_ACCMODE) != O_RDONLY && ctl_files[file].command == NULL)
+        return -EACCES;
+
+    // Commands have to be handled as they're written. Contents are
+    // produced once per open, so a reader sees them in one piece.
+    ctl_handle *handle = calloc(1, sizeof(ctl_handle));
+    if(handle == NULL)
+        return -ENOMEM;
+    handle->file = file;
+    if((fi->flags & O_ACCMODE) != O_WRONLY)
+    {
+        // Per operation system call counts make the stats too large for the stack.
+        char *contents = malloc(CTL_CONTENTS_MAX);
+        if(contents == NULL)
+        {
+            free(handle);
+            return -ENOMEM;
+        }
+        handle->len = ctl_files[file].read(contents, CTL_CONTENTS_MAX);
+        handle->contents = realloc(contents, handle->len + 1);
+        if(handle->contents == NULL)
+            handle->contents = contents;
+    }
+    fi->direct_io = 1;
+    fi->fh = (uintptr_t) handle;
+    return 0;
+}
+
+static int ctl_read(const char *path, char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    ctl_handle *handle = (ctl_handle *) (uintptr_t) fi->fh;
+
+    if(offset >= (off_t) handle->len)
+        size = 0;
+    else if(size > handle->len - offset)
+        size = handle->len - offset;
+    memcpy(buf, handle->contents + offset, size);
+    return size;
+}
+
+static int ctl_write(const char *path, const char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi)
+{
+    char line[PATH_MAX + 64];
+    size_t start = 0, end;
+    int retval;
+
+    // Every write has to hold complete lines.
+    while(start < size)
+    {
+        for(end = start; end < size && buf[end] != '\n'; end++)
+            ;
+        if(end - start >= sizeof(line))
+            return -ENAMETOOLONG;
+        memcpy(line, buf + start, end - start);
+        line[end - start] = 0;
+        start = end + 1;
+
+        if(line[0] == 0)
+            continue;
+        LOG("Control command '%s'", line);
+        retval = ctl_files[((ctl_handle *) (uintptr_t) fi->fh)->file].command(line);
+        if(retval < 0)
+            return retval;
+    }
+    return size;
+}
+
+static int ctl_truncate(const char *path, off_t newsize)
+{
+    return find_file(path) >= 0 ? 0 : -EISDIR;
+}
+
+static int ctl_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+    return 0;
+}
+
+static int ctl_flush(const char *path, struct fuse_file_info *fi)
+{
+    return 0;
+}
+
+static int ctl_release(const char *path, struct fuse_file_info *fi)
+{
+    ctl_handle *handle = (ctl_handle *) (uintptr_t) fi->fh;
+    free(handle->contents);
+    free(handle);
+    return 0;
+}
+
+static int ctl_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    return 0;
+}
+
+static int ctl_opendir(const char *path, struct fuse_file_info *fi)
+{
+    int file = find_file(path);
+    if(file == -2)
+        return -ENOENT;
+    return file == -1 ? 0 : -ENOTDIR;
+}
+
+static int ctl_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    int i;
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for(i = 0; i < CTL_FILES; i++)
+        if(filler(buf, ctl_files[i].name, NULL, 0) != 0)
+            return -ENOMEM;
+    return 0;
+}
+
+static struct fuse_operations ctl_oper = {
+    .getattr = ctl_getattr,
+    .truncate = ctl_truncate,
+    .open = ctl_open,
+    .read = ctl_read,
+    .write = ctl_write,
+    .flush = ctl_flush,
+    .release = ctl_release,
+    .opendir = ctl_opendir,
+    .readdir = ctl_readdir,
+    .releasedir = ctl_releasedir,
+    .access = ctl_access,
+    .ftruncate = ctl_ftruncate,
+    .fgetattr = ctl_fgetattr,
+};
+
+struct fuse_operations *undofs_ctl_operations()
+{
+    return &ctl_oper;
+}
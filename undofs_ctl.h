@@ -0,0 +1,56 @@
+#ifndef __UNDOFS_CTL_H_
+#define __UNDOFS_CTL_H_
+#include "config.h"
+
+#include <fuse.h>
+
+/*
+ * The control directory, /.undofs in every mount.
+ *
+ * It doesn't exist in the store: operations on it are routed here instead
+ * of to the normal file operations. It isn't listed in the root directory,
+ * and hides a real file or directory called .undofs.
+ *
+ *   ctl    write-only, takes one command per line:
+ *            delete-tree <path>   delete a directory and all of its
+ *                                 children in constant time
+ *            restore-version <version> <path>
+ *                                 make an old version of a file the
+ *                                 latest again, also if it was deleted
+ *            restore-attrs <unix time> <path>
+ *                                 give a file or directory back the mode,
+ *                                 owner and times it had at that time
+ *
+ *   stats  read-only, one "name value" pair per line:
+ *            mirror_*             the state of the mirror, see undofs_mirror.h
+ *            scrub_*              the state of the scrubber, see undofs_scrub.h
+ *            cache_*              the state of the node cache, see undofs_cache.h
+ *            fdcache_*            the state of the descriptor cache, see undofs_fdcache.h
+ *            wamp_*               write amplification of the mount, see undofs_wamp.h
+ *            slow_*               the slow operation tracer, see undofs_span.h
+ *            syscall_stats        1 if system calls are counted, see undofs_syscount.h
+ *            sys_<op>_*           system calls made by each operation, by kind
+ *
+ *   wamp   read-only, write amplification of each top-level directory, one
+ *          "<written> <copied> <created> <discarded> <inlined> <name>"
+ *          line each, most bytes copied first, see undofs_wamp.h
+ *
+ *   slow   read-only, the last operations slower than -o slow_ms, newest
+ *          first, each with the steps it took, see undofs_span.h
+ */
+
+#define UNDOFS_CTL_DIR "/.undofs"
+
+/**
+ * Check if a path belongs to the control directory.
+ * @param path relative path provided by FUSE, may be NULL.
+ * @return 1 if it does, 0 otherwise.
+ */
+int undofs_ctl_owns(const char *path);
+
+/**
+ * @return the operations on the control directory. Operations left NULL aren't permitted.
+ */
+struct fuse_operations *undofs_ctl_operations();
+
+#endif
@@ -0,0 +1,383 @@
+#include "config.h"
+#include "undofs_archive.h"
+#include "undofs_meta.h"
+#include "undofs_scan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+// Streams a store, or the changes to it since a given time, as one archive.
+// Version payloads go from the store to the output with sendfile, so they
+// never pass through this process.
+
+typedef struct {
+    const char *root;
+    int fd;
+    char buf[256 * 1024];
+    size_t len;
+    int64_t since_ns, snapshot_ns;
+    unsigned long long entries, files, bytes, deferred;
+} exporter;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: undofs-export [-s <since, unix time>] [-o <archive>] <store root>\n");
+    exit(1);
+}
+
+static void die(const char *what, const char *path)
+{
+    fprintf(stderr, "undofs-export: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+static void flush_out(exporter *ex)
+{
+    size_t done = 0;
+    while(done < ex->len)
+    {
+        ssize_t res = write(ex->fd, ex->buf + done, ex->len - done);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            die("writing", "archive");
+        }
+        done += res;
+    }
+    ex->len = 0;
+}
+
+static void put(exporter *ex, const void *data, size_t size)
+{
+    if(ex->len + size > sizeof(ex->buf))
+        flush_out(ex);
+    if(size > sizeof(ex->buf))
+    {
+        // Only paths, link targets and inline versions come through here, they always fit.
+        errno = ENAMETOOLONG;
+        die("writing", "archive");
+    }
+    memcpy(ex->buf + ex->len, data, size);
+    ex->len += size;
+}
+
+static int64_t ns(struct timespec ts)
+{
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void put_entry(exporter *ex, uint32_t kind, const struct stat *st, uint32_t flags,
+                      uint32_t purge_gen, uint32_t born, const char *path, uint64_t size)
+{
+    undofs_archive_entry e;
+    memset(&e, 0, sizeof(e));
+    e.kind = kind;
+    e.flags = flags;
+    e.purge_gen = purge_gen;
+    e.born = born;
+    e.path_len = strlen(path);
+    e.size = size;
+    if(st != NULL)
+    {
+        e.mode = st->st_mode;
+        e.uid = st->st_uid;
+        e.gid = st->st_gid;
+        e.atime_ns = ns(st->st_atim);
+        e.mtime_ns = ns(st->st_mtim);
+        e.rdev = st->st_rdev;
+    }
+    put(ex, &e, sizeof(e));
+    put(ex, path, e.path_len);
+    ex->entries++;
+}
+
+// Send exactly size bytes of a file, padding with zeroes if it shrank.
+static void send_payload(exporter *ex, int fd, const char *path, uint64_t size)
+{
+    off_t offset = 0;
+    int use_sendfile = 1;
+
+    flush_out(ex);
+    while((uint64_t) offset < size)
+    {
+        ssize_t res = -1;
+        if(use_sendfile)
+        {
+            res = sendfile(ex->fd, fd, &offset, size - offset);
+            if(res < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                use_sendfile = 0;
+                continue;
+            }
+        } else {
+            size_t chunk = size - offset < sizeof(ex->buf) ? size - offset : sizeof(ex->buf);
+            res = pread(fd, ex->buf, chunk, offset);
+            if(res > 0)
+            {
+                ex->len = res;
+                flush_out(ex);
+                offset += res;
+            }
+        }
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            die("reading", path);
+        }
+        if(res == 0)
+        {
+            memset(ex->buf, 0, sizeof(ex->buf));
+            while((uint64_t) offset < size)
+            {
+                size_t chunk = size - offset < sizeof(ex->buf) ? size - offset : sizeof(ex->buf);
+                ex->len = chunk;
+                flush_out(ex);
+                offset += chunk;
+            }
+        }
+    }
+    ex->bytes += size;
+}
+
+static void export_file(exporter *ex, int dirfd, const char *name, const char *path)
+{
+    struct stat st;
+
+    if(fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        if(errno == ENOENT)
+            return;
+        die("stat", path);
+    }
+
+    // Versions still being written after the export started belong to the
+    // next delta, so the archive is a consistent view of the start time.
+    // The change time says so, the mtime can be set to anything.
+    if(ns(st.st_ctim) > ex->snapshot_ns)
+    {
+        ex->deferred++;
+        return;
+    }
+    if(ns(st.st_mtim) <= ex->since_ns && ns(st.st_ctim) <= ex->since_ns)
+        return;
+
+    if(S_ISLNK(st.st_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(dirfd, name, target, sizeof(target));
+        if(len < 0)
+            die("readlink", path);
+        put_entry(ex, UNDOFS_ARCHIVE_FILE, &st, 0, 0, 0, path, len);
+        put(ex, target, len);
+        ex->bytes += len;
+    }
+    else if(S_ISREG(st.st_mode))
+    {
+        int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if(fd < 0)
+            die("open", path);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        put_entry(ex, UNDOFS_ARCHIVE_FILE, &st, 0, 0, 0, path, st.st_size);
+        send_payload(ex, fd, path, st.st_size);
+        close(fd);
+    }
+    else
+        put_entry(ex, UNDOFS_ARCHIVE_FILE, &st, 0, 0, 0, path, 0);
+    ex->files++;
+}
+
+typedef struct {
+    exporter *ex;
+    int dirfd;
+    const char *path;
+} inline_export;
+
+// Versions stored inline in the meta file go in as the version files they
+// were, so an imported store reads like this one did before they moved in.
+static int export_inline(const undofs_meta_inline_record *record, const void *data, void *arg)
+{
+    inline_export *ie = arg;
+    char name[32], child[PATH_MAX];
+    struct stat st;
+
+    // Until its file is removed a version exists twice, and the file went in.
+    snprintf(name, sizeof(name), "%" PRId64, record->version);
+    if(faccessat(ie->dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+        return 0;
+    if((int64_t) record->logged_ns > ie->ex->snapshot_ns)
+    {
+        ie->ex->deferred++;
+        return 0;
+    }
+    if((int64_t) record->logged_ns <= ie->ex->since_ns)
+        return 0;
+    if(snprintf(child, PATH_MAX, "%s%s%s", ie->path, ie->path[0] ? "/" : "", name) >= PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        die("reading", ie->path);
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = record->mode;
+    st.st_uid = record->uid;
+    st.st_gid = record->gid;
+    st.st_mtim.tv_sec = record->mtime_ns / 1000000000;
+    st.st_mtim.tv_nsec = record->mtime_ns % 1000000000;
+    st.st_atim = st.st_mtim;
+    put_entry(ie->ex, UNDOFS_ARCHIVE_FILE, &st, 0, 0, 0, child, record->size);
+    put(ie->ex, data, record->size);
+    ie->ex->bytes += record->size;
+    ie->ex->files++;
+    return 0;
+}
+
+static int is_version(const char *name)
+{
+    return undofs_parse_version(name) >= 0;
+}
+
+static int is_node(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 5 && memcmp(name + len - 5, ".node", 5) == 0;
+}
+
+static void export_node(exporter *ex, int dirfd, const char *path)
+{
+    undofs_dirscan scan;
+    const char *entry;
+    struct stat st;
+    uint32_t flags = 0;
+    char child[PATH_MAX];
+
+    if(fstat(dirfd, &st) != 0)
+        die("stat", path);
+    if(faccessat(dirfd, "dir", F_OK, 0) == 0)
+        flags |= UNDOFS_ARCHIVE_DIR;
+    if(faccessat(dirfd, "deleted", F_OK, 0) == 0)
+        flags |= UNDOFS_ARCHIVE_DELETED;
+
+    // Nodes always go in, even in a delta, so markers that were removed
+    // since then are removed on import too.
+    put_entry(ex, UNDOFS_ARCHIVE_NODE, &st, flags, undofs_read_generation(dirfd, UNDOFS_PURGE_MARKER),
+              undofs_read_generation(dirfd, UNDOFS_BORN_MARKER), path, 0);
+
+    if(undofs_dirscan_start(&scan, dirfd) != 0)
+        die("reading", path);
+    while((entry = undofs_dirscan_next(&scan, NULL)) != NULL)
+    {
+        if(snprintf(child, PATH_MAX, "%s%s%s", path, path[0] ? "/" : "", entry) >= PATH_MAX)
+        {
+            errno = ENAMETOOLONG;
+            die("reading", path);
+        }
+
+        if(is_node(entry))
+        {
+            int fd = openat(dirfd, entry, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+            if(fd < 0)
+            {
+                if(errno == ENOENT)
+                    continue;
+                die("open", child);
+            }
+            export_node(ex, fd, child);
+            close(fd);
+        }
+        else if(is_version(entry) || strcmp(entry, "meta") == 0)
+            export_file(ex, dirfd, entry, child);
+        // Markers are fields of the node, and the rest (the log, the marker
+        // template) belongs to the mount rather than the history.
+    }
+    if(errno != 0)
+        die("reading", path);
+    undofs_dirscan_end(&scan);
+
+    if(! (flags & UNDOFS_ARCHIVE_DIR))
+    {
+        char nodedir[PATH_MAX];
+        inline_export ie = { ex, dirfd, path };
+        snprintf(nodedir, PATH_MAX, "%s/%s", ex->root, path);
+        if(undofs_meta_each_inline(nodedir, export_inline, &ie) != 0)
+            die("reading inline versions of", path);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    exporter *ex = calloc(1, sizeof(exporter));
+    undofs_archive_header header;
+    struct timespec now;
+    const char *output = NULL;
+    double since = 0;
+    int opt, rootfd;
+
+    while((opt = getopt(argc, argv, "s:o:")) != -1)
+    {
+        switch(opt)
+        {
+        case 's':
+            since = atof(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if(optind != argc - 1 || ex == NULL)
+        usage();
+
+    rootfd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(rootfd < 0)
+        die("open", argv[optind]);
+    ex->root = argv[optind];
+
+    ex->fd = output ? open(output, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600) : STDOUT_FILENO;
+    if(ex->fd < 0)
+        die("open", output);
+    if(output == NULL && isatty(STDOUT_FILENO))
+    {
+        fprintf(stderr, "undofs-export: not writing an archive to a terminal, use -o or a redirect.\n");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ex->since_ns = since * 1e9;
+    ex->snapshot_ns = ns(now);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UNDOFS_ARCHIVE_MAGIC, sizeof(header.magic));
+    header.format = UNDOFS_ARCHIVE_FORMAT;
+    header.entry_size = sizeof(undofs_archive_entry);
+    header.since_ns = ex->since_ns;
+    header.snapshot_ns = ex->snapshot_ns;
+    put(ex, &header, sizeof(header));
+
+    export_node(ex, rootfd, "");
+
+    unsigned long long entries = ex->entries;
+    put_entry(ex, UNDOFS_ARCHIVE_END, NULL, 0, 0, 0, "", entries);
+    flush_out(ex);
+    if(output && (fsync(ex->fd) != 0 || close(ex->fd) != 0))
+        die("writing", output);
+
+    fprintf(stderr, "Exported %llu entries, %llu files, %llu bytes.\n", entries, ex->files, ex->bytes);
+    if(ex->deferred)
+        fprintf(stderr, "%llu files changed during the export, they will be in the next delta.\n", ex->deferred);
+    fprintf(stderr, "For the next delta, use -s %lld.%09lld\n",
+            (long long) now.tv_sec, (long long) now.tv_nsec);
+    return 0;
+}
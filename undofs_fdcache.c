@@ -0,0 +1,255 @@
+#include "undofs_fdcache.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BUCKETS 4096
+
+typedef struct fd_entry {
+    struct fd_entry *next_node;     // chain by node, while cached
+    struct fd_entry *next_fd;       // chain by descriptor, while open
+    struct fd_entry *lru_prev, *lru_next;   // idle list, most recently used first
+    uint64_t hash;
+    int fd;
+    int refs;                       // handles using the descriptor
+    int cached;                     // can still be found by node
+    char nodedir[];
+} fd_entry;
+
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static fd_entry *by_node[BUCKETS];
+static fd_entry *by_fd[BUCKETS];
+static fd_entry *lru_head = NULL, *lru_tail = NULL;
+static size_t idle = 0, active = 0;
+static uint64_t changes = 0;
+
+static struct {
+    unsigned long long hits, misses, evictions, invalidations;
+} stats;
+
+static uint64_t hash_node(const char *nodedir)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(; *nodedir; nodedir++)
+        hash = (hash ^ (unsigned char) *nodedir) * 1099511628211ULL;
+    return hash;
+}
+
+// The functions below must be called with fdcache_lock held.
+
+static fd_entry *find_node(const char *nodedir, uint64_t hash)
+{
+    fd_entry *entry;
+    for(entry = by_node[hash % BUCKETS]; entry != NULL; entry = entry->next_node)
+        if(entry->hash == hash && strcmp(entry->nodedir, nodedir) == 0)
+            return entry;
+    return NULL;
+}
+
+static void remove_node(fd_entry *entry)
+{
+    fd_entry **link;
+    for(link = &by_node[entry->hash % BUCKETS]; *link != NULL; link = &(*link)->next_node)
+    {
+        if(*link == entry)
+        {
+            *link = entry->next_node;
+            break;
+        }
+    }
+    entry->cached = 0;
+}
+
+static void lru_remove(fd_entry *entry)
+{
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        lru_head = entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+    idle--;
+}
+
+static void lru_push(fd_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if(lru_head)
+        lru_head->lru_prev = entry;
+    else
+        lru_tail = entry;
+    lru_head = entry;
+    idle++;
+}
+
+// Close the descriptor of an entry nobody uses and that can't be found by node.
+static void destroy(fd_entry *entry)
+{
+    fd_entry **link;
+    for(link = &by_fd[entry->fd % BUCKETS]; *link != NULL; link = &(*link)->next_fd)
+    {
+        if(*link == entry)
+        {
+            *link = entry->next_fd;
+            break;
+        }
+    }
+    close(entry->fd);
+    free(entry);
+}
+
+// Take an entry out of the cache, closing it unless a handle still uses it.
+static void drop(fd_entry *entry)
+{
+    remove_node(entry);
+    if(entry->refs == 0)
+    {
+        lru_remove(entry);
+        destroy(entry);
+    }
+}
+
+int undofs_fdcache_get(const char *nodedir)
+{
+    uint64_t hash = hash_node(nodedir);
+    fd_entry *entry;
+    int fd = -1;
+
+    pthread_mutex_lock(&fdcache_lock);
+    entry = find_node(nodedir, hash);
+    if(entry != NULL)
+    {
+        if(entry->refs++ == 0)
+        {
+            lru_remove(entry);
+            active++;
+        }
+        fd = entry->fd;
+        stats.hits++;
+    } else
+        stats.misses++;
+    pthread_mutex_unlock(&fdcache_lock);
+    return fd;
+}
+
+uint64_t undofs_fdcache_ticket()
+{
+    return __atomic_load_n(&changes, __ATOMIC_ACQUIRE);
+}
+
+int undofs_fdcache_put(const char *nodedir, int fd, uint64_t ticket)
+{
+    uint64_t hash = hash_node(nodedir);
+    size_t len = strlen(nodedir);
+    fd_entry *entry;
+    int retval = -1;
+
+    pthread_mutex_lock(&fdcache_lock);
+    // Another open may have got there first, then this descriptor stays private.
+    if(changes != ticket || find_node(nodedir, hash) != NULL)
+        goto out;
+    entry = calloc(1, sizeof(fd_entry) + len + 1);
+    if(entry == NULL)
+        goto out;
+    memcpy(entry->nodedir, nodedir, len + 1);
+    entry->hash = hash;
+    entry->fd = fd;
+    entry->refs = 1;
+    entry->cached = 1;
+    entry->next_node = by_node[hash % BUCKETS];
+    by_node[hash % BUCKETS] = entry;
+    entry->next_fd = by_fd[fd % BUCKETS];
+    by_fd[fd % BUCKETS] = entry;
+    active++;
+    retval = 0;
+
+out:
+    pthread_mutex_unlock(&fdcache_lock);
+    return retval;
+}
+
+int undofs_fdcache_release(int fd)
+{
+    fd_entry *entry;
+
+    if(fd < 0)
+        return 0;
+    pthread_mutex_lock(&fdcache_lock);
+    for(entry = by_fd[fd % BUCKETS]; entry != NULL; entry = entry->next_fd)
+        if(entry->fd == fd)
+            break;
+    if(entry != NULL && --entry->refs == 0)
+    {
+        active--;
+        if(! entry->cached)
+            destroy(entry);
+        else
+        {
+            lru_push(entry);
+            if(idle > UNDOFS_FDCACHE_IDLE)
+            {
+                drop(lru_tail);
+                stats.evictions++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+    return entry != NULL;
+}
+
+void undofs_fdcache_invalidate(const char *nodedir)
+{
+    uint64_t hash = hash_node(nodedir);
+    fd_entry *entry;
+
+    pthread_mutex_lock(&fdcache_lock);
+    __atomic_add_fetch(&changes, 1, __ATOMIC_RELEASE);
+    entry = find_node(nodedir, hash);
+    if(entry != NULL)
+    {
+        drop(entry);
+        stats.invalidations++;
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+void undofs_fdcache_clear()
+{
+    size_t i;
+
+    pthread_mutex_lock(&fdcache_lock);
+    __atomic_add_fetch(&changes, 1, __ATOMIC_RELEASE);
+    for(i = 0; i < BUCKETS; i++)
+    {
+        while(by_node[i] != NULL)
+        {
+            drop(by_node[i]);
+            stats.invalidations++;
+        }
+    }
+    pthread_mutex_unlock(&fdcache_lock);
+}
+
+size_t undofs_fdcache_stats(char *buf, size_t size)
+{
+    int len;
+
+    pthread_mutex_lock(&fdcache_lock);
+    len = snprintf(buf, size,
+                   "fdcache_idle %zu\n"
+                   "fdcache_active %zu\n"
+                   "fdcache_hits %llu\n"
+                   "fdcache_misses %llu\n"
+                   "fdcache_evictions %llu\n"
+                   "fdcache_invalidations %llu\n",
+                   idle, active, stats.hits, stats.misses, stats.evictions, stats.invalidations);
+    pthread_mutex_unlock(&fdcache_lock);
+    return len < 0 ? 0 : (size_t) len >= size ? size - 1 : (size_t) len;
+}
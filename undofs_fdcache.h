@@ -0,0 +1,73 @@
+#ifndef __UNDOFS_FDCACHE_H_
+#define __UNDOFS_FDCACHE_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cache of read-only file descriptors of the latest version of files.
+ *
+ * Read-only opens of a file share one descriptor, found by node without
+ * resolving the latest version again; all reads use pread, so they don't
+ * get in each other's way. When the last handle is released the descriptor
+ * stays open, in a bounded LRU of idle descriptors. When a node changes,
+ * its descriptor leaves the cache: handles that still use it keep reading
+ * the version they opened, and it is closed with the last of them.
+ *
+ * Nothing in here depends on fuse.
+ */
+
+#define UNDOFS_FDCACHE_IDLE 256     // idle descriptors kept open
+
+/**
+ * Take a cached descriptor of the latest version of a node.
+ * @param nodedir the node path, as returned by undofs_versiondir_path().
+ * @return the descriptor, or -1 if there is none.
+ */
+int undofs_fdcache_get(const char *nodedir);
+
+/**
+ * Take a ticket before resolving the latest version, for undofs_fdcache_put().
+ * @return the ticket.
+ */
+uint64_t undofs_fdcache_ticket();
+
+/**
+ * Add a freshly opened descriptor of the latest version of a node, unless
+ * any node changed since the ticket was taken. The caller holds it either way.
+ * @param nodedir the node path.
+ * @param fd a read-only descriptor of a regular file.
+ * @param ticket from undofs_fdcache_ticket().
+ * @return 0 if the descriptor was added, -1 if it belongs to the caller alone.
+ */
+int undofs_fdcache_put(const char *nodedir, int fd, uint64_t ticket);
+
+/**
+ * Give back a descriptor taken from the cache.
+ * @param fd the descriptor.
+ * @return 1 if it belongs to the cache, 0 if the caller must close it.
+ */
+int undofs_fdcache_release(int fd);
+
+/**
+ * Stop handing out the descriptor of a node, after the node changed.
+ * @param nodedir the node path.
+ */
+void undofs_fdcache_invalidate(const char *nodedir);
+
+/**
+ * Stop handing out any descriptor, after a change that affects a whole
+ * subtree. Idle descriptors are closed.
+ */
+void undofs_fdcache_clear();
+
+/**
+ * Describe the state of the cache, one "name value" pair per line.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_fdcache_stats(char *buf, size_t size);
+
+#endif
@@ -1,10 +1,24 @@
 #include "undofs_fops.h"
+#include "undofs_cache.h"
+#include "undofs_cachepolicy.h"
+#include "undofs_capture.h"
+#include "undofs_clone.h"
+#include "undofs_fdcache.h"
+#include "undofs_meta.h"
+#include "undofs_mirror.h"
+#include "undofs_scrub.h"
+#include "undofs_scan.h"
+#include "undofs_session.h"
+#include "undofs_span.h"
+#include "undofs_syscount.h"
+#include "undofs_trace.h"
 #include "undofs_util.h"
+#include "undofs_wamp.h"
 
 #include <ctype.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -13,6 +27,29 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+// Queue the node of a path for the mirror, after a successful change.
+static void mirror_path(const char *path)
+{
+    char nodedir[PATH_MAX];
+    if(undofs_mirror_enabled() && undofs_versiondir_path(nodedir, path) == 0)
+        undofs_mirror_node(nodedir);
+}
+
+// Report the inode number of the node instead of the one of the version
+// file, which changes with every version. Directory nodes are their own.
+// Version files linked into other nodes aren't hard links of the file, see
+// undofs_scan.h, so their link count isn't either.
+static void stable_ino(const char *path, struct stat *statbuf)
+{
+    uint64_t ino;
+    if(S_ISDIR(statbuf->st_mode))
+        return;
+    statbuf->st_nlink = 1;
+    ino = undofs_node_ino(path);
+    if(ino != 0)
+        statbuf->st_ino = ino;
+}
+
 /** Get file attributes.
  *
  * Similar to stat().  The 'st_dev' and 'st_blksize' fields are
@@ -39,12 +76,13 @@ static int undofs_getattr(const char *path, struct stat *statbuf)
     if(is_deleted(fpath))
         return -ENOENT;
 
-    retstat = lstat(fpath, statbuf);
+    retstat = sys_lstat(fpath, statbuf);
     if (retstat != 0)
     {
         retval = -errno;
         LOG_ERROR("lstat for %s failed (%d)", fpath, retstat);
-    }
+    } else
+        stable_ino(path, statbuf);
 
     return retval;
 }
@@ -66,7 +104,7 @@ static int undofs_readlink(const char *path, char *link, size_t size)
     if(undofs_latest_path(fpath, path))
         return -errno;
 
-    retstat = readlink(fpath, link, size - 1); // System readlink() doesn't have the trailing \0
+    retstat = sys_readlink(fpath, link, size - 1); // System readlink() doesn't have the trailing \0
     if (retstat < 0)
     {
         retval = -errno;
@@ -97,12 +135,12 @@ static int undofs_mknod(const char *path, mode_t mode, dev_t dev)
 
     // On Linux this could just be 'mknod(path, mode, rdev)'
     if (S_ISREG(mode)) {
-        retstat = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
+        retstat = sys_open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
         if (retstat < 0) {
             retval = -errno;
             LOG_ERROR("Failed to create regular file at %s (open returned %d)", fpath, retstat);
         } else {
-            retstat = close(retstat);
+            retstat = sys_close(retstat);
             if (retstat < 0) {
                 retval = -errno;
                 LOG_ERROR("Failed to create regular file at %s (close returned %d)", fpath, retstat);
@@ -110,14 +148,14 @@ static int undofs_mknod(const char *path, mode_t mode, dev_t dev)
         }
     } else
         if(S_ISFIFO(mode)) {
-            retstat = mkfifo(fpath, mode);
+            retstat = sys_mkfifo(fpath, mode);
             if (retstat < 0)
             {
                 retval = -errno;
                 LOG_ERROR("Failed to create FIFO node at %s (mkfifo returned %d)", fpath, retstat);
             }
         } else {
-            retstat = mknod(fpath, mode, dev);
+            retstat = sys_mknod(fpath, mode, dev);
             if (retstat < 0)
             {
                 retval = -errno;
@@ -125,6 +163,11 @@ static int undofs_mknod(const char *path, mode_t mode, dev_t dev)
             }
         }
 
+    if(retval == 0)
+    {
+        undofs_version_created(fpath);
+        mirror_path(path);
+    }
     return retval;
 }
 
@@ -146,9 +189,13 @@ static int undofs_mkdir(const char *path, mode_t mode)
         {
             retval = -errno;
             LOG_ERROR("Failed to undelete directory %s.", fpath);
+        } else {
+            undofs_adjust_parent(fpath, 1);
+            if(undofs_mark_born(fpath) != 0)
+                LOG_ERROR("Failed to mark %s born.", fpath);
         }
     } else {
-        retstat = mkdir(fpath, mode);
+        retstat = sys_mkdir(fpath, mode);
         if (retstat < 0)
         {
             retval = -errno;
@@ -160,11 +207,18 @@ static int undofs_mkdir(const char *path, mode_t mode)
             {
                 retval = -errno;
                 LOG_ERROR("Could not create directory marker at %s.", dmarker);
+            } else {
+                undofs_cache_invalidate(fpath);
+                undofs_adjust_parent(fpath, 1);
+                if(undofs_mark_born(fpath) != 0)
+                    LOG_ERROR("Failed to mark %s born.", fpath);
             }
-            rmdir(fpath);
+            sys_rmdir(fpath);
         }
     }
 
+    if(retval == 0)
+        undofs_mirror_node(fpath);
     return retval;
 }
 
@@ -191,11 +245,13 @@ static int undofs_unlink(const char *path)
         LOG("Already deleted %s, raising ENOENT.", fpath);
         return -ENOENT;
     } else {
-        strncat(fpath, "/deleted", PATH_MAX);
-        if(touch(fpath))
+        if(undofs_mark_deleted(fpath))
         {
             retstat = -EIO;
-            LOG_ERROR("Failed to create deleted marker %s.", fpath);
+            LOG_ERROR("Failed to mark %s deleted.", fpath);
+        } else {
+            undofs_adjust_parent(fpath, -1);
+            undofs_mirror_node(fpath);
         }
     }
 
@@ -214,18 +270,130 @@ static int undofs_rmdir(const char *path)
     if(retstat)
         return retstat;
 
-    // TODO: check if all children are deleted!
+    // The counter is only ever too high (a create that failed halfway), so
+    // zero can be trusted, and anything else is confirmed before refusing.
+    long live;
+    if(undofs_meta_live_children(fpath, &live, 0) != 0
+       || (live != 0 && undofs_meta_live_children(fpath, &live, 1) != 0))
+    {
+        retstat = -errno;
+        LOG_ERROR("Failed to count the children of %s.", fpath);
+        return retstat;
+    }
+    if(live != 0)
+    {
+        LOG("Cannot remove %s, it still has %ld children.", path, live);
+        return -ENOTEMPTY;
+    }
+
+    if(undofs_mark_deleted(fpath))
+    {
+        retstat = -EIO;
+        LOG_ERROR("Failed to mark %s deleted.", fpath);
+    } else {
+        undofs_adjust_parent(fpath, -1);
+        undofs_mirror_node(fpath);
+    }
+
+    return retstat;
+}
+
+int undofs_delete_tree(const char *path)
+{
+    LOG("delete_tree(%s)", path);
+
+    int retstat = 0;
+    char fpath[PATH_MAX];
+
+    if(strcmp(path, "/") == 0)
+        return -EBUSY;
+
+    retstat = undofs_versiondir_path(fpath, path);
+    if(retstat)
+        return -errno;
+
+    if(! is_directory(fpath))
+        return sys_access(fpath, F_OK) == 0 ? -ENOTDIR : -ENOENT;
+    if(is_deleted(fpath))
+        return -ENOENT;
+
+    // Only the directory itself is touched: its children find out they
+    // are deleted when they are looked up again.
+    if(undofs_mark_purged(fpath) != 0)
+    {
+        retstat = -errno;
+        LOG_ERROR("Failed to mark the subtree of %s deleted.", fpath);
+        return retstat;
+    }
+    undofs_meta_reset_children(fpath);
+    // Files in the subtree are looked up through their descriptors no more.
+    undofs_fdcache_clear();
 
-    strncat(fpath, "/deleted", PATH_MAX);
-    if(touch(fpath))
+    if(undofs_mark_deleted(fpath))
     {
         retstat = -EIO;
-        LOG_ERROR("Failed to create deleted marker %s.", fpath);
+        LOG_ERROR("Failed to mark %s deleted.", fpath);
+    } else {
+        undofs_adjust_parent(fpath, -1);
+        undofs_mirror_node(fpath);
     }
 
     return retstat;
 }
 
+int undofs_restore_version(const char *path, long version)
+{
+    LOG("restore_version(%s, %ld)", path, version);
+
+    int retval = 0, deleted, inlined = 0;
+    char nodedir[PATH_MAX], src[PATH_MAX], fpath[PATH_MAX];
+    char data[UNDOFS_META_INLINE_LIMIT];
+    undofs_meta_inline_record record;
+    struct stat st;
+
+    if(version < 0)
+        return -EINVAL;
+    if(undofs_versiondir_path(nodedir, path))
+        return -errno;
+    if(is_directory(nodedir))
+        return -EISDIR;
+
+    // Tiny superseded versions live in the meta file instead of a file.
+    snprintf(src, PATH_MAX, "%s/%ld", nodedir, version);
+    if(sys_lstat(src, &st) != 0)
+    {
+        if(errno != ENOENT)
+            return -errno;
+        inlined = undofs_meta_read_inline(nodedir, version, &record, data, sizeof(data));
+        if(inlined < 0)
+            return -errno;
+        if(inlined == 0)
+            return -ENOENT;
+    }
+
+    deleted = is_deleted(nodedir);
+    if(undofs_new_empty_path(fpath, path))
+        return -errno;
+    // The empty new version makes way for the restored one.
+    sys_unlink(fpath);
+
+    if(inlined ? undofs_meta_write_inline(AT_FDCWD, fpath, &record, data) != 0 : clone_file(src, fpath) != 0)
+    {
+        retval = -errno;
+        LOG_ERROR("Failed to restore version %ld of %s", version, path);
+        // Making the new version undeleted the file.
+        if(deleted && undofs_mark_deleted(nodedir) == 0)
+            undofs_adjust_parent(nodedir, -1);
+        return retval;
+    }
+
+    undofs_version_created(fpath);
+    undofs_wamp_add(path, UNDOFS_WAMP_VERSIONS_CREATED, 1);
+    undofs_count_copy(path, fpath);
+    mirror_path(path);
+    return 0;
+}
+
 /** Create a symbolic link */
 // The parameters here are a little bit confusing, but do correspond
 // to the symlink() system call.  The 'path' is where the link points,
@@ -240,11 +408,14 @@ static int undofs_symlink(const char *path, const char *link)
     if(undofs_new_path(flink, link) != 0)
         return -errno;
 
-    retstat = symlink(path, flink);
+    retstat = sys_symlink(path, flink);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Failed to create symlink for %s (symlink returned %d)", flink, retstat);
+    } else {
+        undofs_version_created(flink);
+        mirror_path(link);
     }
 
     return retval;
@@ -272,30 +443,63 @@ static int undofs_rename(const char *path, const char *newpath)
 
     if(is_directory(fpath)) // Directory:
     {
-        if(access(fnewpath, F_OK))
+        if(sys_access(fnewpath, F_OK))
             LOG("Warning: moving directory to %s, but destination already exists and will be overwritten, deleting all history.", fnewpath);
 
-        retstat = rename(fpath, fnewpath);
+        int existed = (sys_access(fnewpath, F_OK) == 0);
+        undofs_meta_flush();
+        retstat = sys_rename(fpath, fnewpath);
         if (retstat < 0)
         {
             retval = -errno;
             LOG_ERROR("rename of %s to %s failed (returned %d).", fpath, fnewpath, retstat);
+        } else {
+            undofs_adjust_parent(fpath, -1);
+            if(!existed)
+                undofs_adjust_parent(fnewpath, 1);
+            // Every node under both paths moved.
+            undofs_cache_clear();
+            // The subtree deletes of its old directory don't count here.
+            if(undofs_mark_born(fnewpath) != 0)
+                LOG_ERROR("Failed to mark %s born.", fnewpath);
+            undofs_mirror_rename(fpath, fnewpath);
         }
     } else {
         // Normal file: unlink (mark as deleted) the source, then copy the latest version to the new
+        char node[PATH_MAX], newnode[PATH_MAX];
+        int target_live;
         if(undofs_latest_path(fpath, path))
             return -errno;
-        if(undofs_new_path(fnewpath, newpath))
+        undofs_versiondir_path(node, path);
+        undofs_versiondir_path(newnode, newpath);
+        target_live = undofs_latest_version(newpath) >= 0 && ! is_deleted(newnode);
+        if(undofs_new_empty_path(fnewpath, newpath))
             return -errno;
+        // Replacing an existing file gave it an empty new version, which the copy takes the place of.
+        sys_unlink(fnewpath);
+        undofs_wamp_add(newpath, UNDOFS_WAMP_VERSIONS_DISCARDED, 1);
 
         retval = undofs_unlink(path);
-        if(retval == 0)
+        if(retval == 0 && clone_file(fpath, fnewpath))
         {
-            if(clone_file(fpath, fnewpath))
-            {
-                retval = -errno;
-                undelete(fpath);
-            }
+            retval = -errno;
+            if(undelete(node) == 0)
+                undofs_adjust_parent(node, 1);
+        }
+        if(retval != 0)
+        {
+            // Making the new version created or undeleted the target, undo that.
+            if(! target_live && undofs_mark_deleted(newnode) == 0)
+                undofs_adjust_parent(newnode, -1);
+            undofs_cache_invalidate(newnode);
+        } else {
+            undofs_version_created(fnewpath);
+            undofs_wamp_add(newpath, UNDOFS_WAMP_VERSIONS_CREATED, 1);
+            undofs_count_copy(newpath, fnewpath);
+            // The file keeps its inode number at the new path.
+            if(undofs_swap_inodes(node, newnode) != 0)
+                LOG_ERROR("Failed to move the inode number of %s to %s", path, newpath);
+            mirror_path(newpath);
         }
     }
 
@@ -325,38 +529,53 @@ static int undofs_link(const char *path, const char *newpath)
     if(undofs_new_path(fnewpath, newpath))
         return -errno;
 
-    retstat = link(fpath, fnewpath);
+    retstat = sys_link(fpath, fnewpath);
     if (retstat < 0)
     {
         retval = -errno;
         LOG("Failed to link %s to %s (link returned %d)", path, newpath, retstat);
+    } else {
+        undofs_version_created(fnewpath);
+        mirror_path(newpath);
     }
 
     return retval;
 }
 
+// Record an attribute change as a metadata version of the node, so the old
+// attributes stay restorable without copying any data.
+static void log_attr_change(const char *path, const char *fpath, long version, const struct stat *before)
+{
+    char nodedir[PATH_MAX];
+    struct stat after;
+
+    if(sys_lstat(fpath, &after) != 0 || undofs_versiondir_path(nodedir, path) != 0
+       || undofs_meta_log_attrs(nodedir, version, before, &after) != 0)
+        LOG_ERROR("Failed to record the attribute change of %s, its old attributes are lost", path);
+}
+
 /** Change the permission bits of a file */
 static int undofs_chmod(const char *path, mode_t mode)
 {
     LOG("chmod(%s, %x)", path, mode);
     int retstat = 0, retval = 0;
     char fpath[PATH_MAX];
+    struct stat before;
+    long version;
 
-    retstat = undofs_versiondir_path(fpath, path);
-    if(retstat)
-        return retstat;
-    
-    if(! is_directory(fpath))
-    {
-        if(undofs_latest_path(fpath, path))
-            return -errno;
-    }
+    if(undofs_latest_version_path(fpath, &version, path))
+        return -errno;
+    if(sys_lstat(fpath, &before) != 0)
+        return -errno;
 
-    retstat = chmod(fpath, mode);
+    retstat = sys_chmod(fpath, mode);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Failed to change permissions for %s to %x (chmod returned %d)", fpath, mode, retstat);
+    } else {
+        log_attr_change(path, fpath, version, &before);
+        mirror_path(path);
     }
 
     return retval;
@@ -368,22 +587,22 @@ static int undofs_chown(const char *path, uid_t uid, gid_t gid)
     LOG("chown(%s, %x, %x)", path, uid, gid);
     int retstat = 0, retval = 0;
     char fpath[PATH_MAX];
+    struct stat before;
+    long version;
 
-    retstat = undofs_versiondir_path(fpath, path);
-    if(retstat)
-        return retstat;
-    
-    if(! is_directory(fpath))
-    {
-        if(undofs_latest_path(fpath, path))
-            return -errno;
-    }
+    if(undofs_latest_version_path(fpath, &version, path))
+        return -errno;
+    if(sys_lstat(fpath, &before) != 0)
+        return -errno;
 
-    retstat = chown(fpath, uid, gid);
+    retstat = sys_chown(fpath, uid, gid);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Failed to chown %s (return value %d)", fpath, retstat);
+    } else {
+        log_attr_change(path, fpath, version, &before);
+        mirror_path(path);
     }
 
     return retval;
@@ -399,12 +618,13 @@ static int undofs_truncate(const char *path, off_t newsize)
     if(undofs_latest_path(fpath, path))
         return -errno;
 
-    retstat = truncate(fpath, newsize);
+    retstat = sys_truncate(fpath, newsize);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("truncate of %s failed (return value %d)", fpath, retstat);
-    }
+    } else
+        mirror_path(path);
 
     return retval;
 }
@@ -416,27 +636,133 @@ static int undofs_utime(const char *path, struct utimbuf *ubuf)
     LOG("utime(%s, %p)", path, ubuf);
     int retstat = 0, retval = 0;
     char fpath[PATH_MAX];
+    struct stat before;
+    long version;
 
-    if(undofs_latest_path(fpath, path))
+    if(undofs_latest_version_path(fpath, &version, path))
+        return -errno;
+    if(sys_lstat(fpath, &before) != 0)
         return -errno;
 
-    retstat = utime(fpath, ubuf);
+    retstat = sys_utime(fpath, ubuf);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Failed to change timestamps of %s (utime returned %d)", fpath, retstat);
+    } else {
+        log_attr_change(path, fpath, version, &before);
+        mirror_path(path);
+    }
+
+    return retval;
+}
+
+int undofs_restore_attrs(const char *path, uint64_t when_ns)
+{
+    LOG("restore_attrs(%s, %" PRIu64 ")", path, when_ns);
+    int retval = 0;
+    char fpath[PATH_MAX], nodedir[PATH_MAX];
+    undofs_meta_record record;
+    struct stat before;
+    long version;
+
+    if(undofs_latest_version_path(fpath, &version, path) || undofs_versiondir_path(nodedir, path))
+        return -errno;
+    if(sys_lstat(fpath, &before) != 0)
+        return -errno;
+
+    switch(undofs_meta_attrs_at(nodedir, version, when_ns, &record))
+    {
+    case 0:
+        // Never changed, so they are what they were.
+        return 0;
+    case -1:
+        return -errno;
+    }
+
+    struct timespec times[2] = {
+        { record.atime_ns / 1000000000, record.atime_ns % 1000000000 },
+        { record.mtime_ns / 1000000000, record.mtime_ns % 1000000000 },
+    };
+    if((! S_ISLNK(before.st_mode) && sys_chmod(fpath, record.mode & 07777) != 0)
+       || sys_lchown(fpath, record.uid, record.gid) != 0
+       || sys_utimensat(AT_FDCWD, fpath, times, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        retval = -errno;
+        LOG_ERROR("Failed to restore the attributes of %s", fpath);
     }
 
+    // Even halfway, so the restore can be undone as well.
+    log_attr_change(path, fpath, version, &before);
+    mirror_path(path);
     return retval;
 }
 
+// Read-only opens share descriptors, but their handles have to stay apart
+// (the capture tells them by fh), so a shared handle has a serial number
+// above the descriptor.
+#define HANDLE_FD(fi) ((int) ((fi)->fh & 0xffffffffu))
+static uint32_t shared_handles = 0;
+
+// Open the latest version of a file for reading, through the descriptor
+// cache: repeated opens of a file don't resolve its version again. cached
+// tells whether the descriptor was cached, which means the version is the
+// one the previous open saw: the cache forgets nodes when they change.
+static int open_shared(const char *path, int *cached)
+{
+    char nodedir[PATH_MAX], fpath[PATH_MAX];
+    struct stat st;
+    uint64_t ticket;
+    int fd;
+
+    if(undofs_versiondir_path(nodedir, path))
+        return -1;
+    fd = undofs_fdcache_get(nodedir);
+    *cached = fd >= 0;
+    if(fd >= 0)
+    {
+        LOG("Reusing cached file handle %d for %s", fd, path);
+        return fd;
+    }
+
+    ticket = undofs_fdcache_ticket();
+    if(undofs_latest_path(fpath, path))
+        return -1;
+
+    LOG("Opening %s", fpath);
+    int span = undofs_span_begin(UNDOFS_SPAN_OPEN);
+    fd = sys_open(fpath, O_RDONLY | O_CLOEXEC);
+    undofs_span_end(span);
+    // Only regular files: opening a FIFO again has side effects.
+    if(fd >= 0 && sys_fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        undofs_fdcache_put(nodedir, fd, ticket);
+    return fd;
+}
+
+// Tell the kernel whether to cache the file for the mount, see undofs_cachepolicy.h.
+// same_version is non-zero when the open found the version the previous
+// open of the file saw.
+static void set_cache_policy(const char *path, struct fuse_file_info *fi, int same_version)
+{
+    int policy = undofs_cachepolicy_for(path);
+    if(policy == UNDOFS_CACHEPOLICY_DIRECT_IO)
+        fi->direct_io = 1;
+    // Pages of the store are gone after each read, so the mount cache is
+    // all there is. It may only be kept while the version stays the same:
+    // restores, subtree deletes and the scrubber change files without
+    // going through it, and the inode number doesn't change with them.
+    else if(policy == UNDOFS_CACHEPOLICY_DROP_BACKING && same_version && ! (fi->flags & (O_WRONLY | O_RDWR)))
+        fi->keep_cache = 1;
+}
+
 /** File open operation
  *
- * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
- * will be passed to open().  Open should check if the operation
- * is permitted for the given flags.  Optionally open may also
- * return an arbitrary filehandle in the fuse_file_info structure,
- * which will be passed to all file operations.
+ * No creation (O_CREAT, O_EXCL) flags will be passed to open().
+ * O_TRUNC is passed along, because undofs asks for atomic_o_trunc.
+ * Open should check if the operation is permitted for the given
+ * flags.  Optionally open may also return an arbitrary filehandle
+ * in the fuse_file_info structure, which will be passed to all
+ * file operations.
  *
  * Changed in version 2.2
  */
@@ -445,28 +771,37 @@ static int undofs_open(const char *path, struct fuse_file_info *fi)
     LOG("open(%s, %x)", path, fi->flags);
     int retval = 0;
     int fd;
+    int cached = 0;
+    uint64_t serial = 0;
     char fpath[PATH_MAX];
 
     if(fi->flags & O_RDWR || fi->flags & O_WRONLY)
     {
-        undofs_new_path(fpath, path);
-    } else {
+        fd = undofs_session_open(path, fi->flags, 0);
+    } else if(fi->flags & ~(O_ACCMODE | O_LARGEFILE | O_NOCTTY | O_CLOEXEC)) {
+        // Flags that change how the file is read get a descriptor of their own.
         if(undofs_latest_path(fpath, path))
             return -errno;
-    }
 
-    LOG("Opening %s", fpath);
+        LOG("Opening %s", fpath);
+        int span = undofs_span_begin(UNDOFS_SPAN_OPEN);
+        fd = sys_open(fpath, fi->flags);
+        undofs_span_end(span);
+    } else {
+        fd = open_shared(path, &cached);
+        serial = __atomic_add_fetch(&shared_handles, 1, __ATOMIC_RELAXED);
+    }
 
-    fd = open(fpath, fi->flags);
     if (fd < 0)
     {
         retval = -errno;
-        LOG_ERROR("open of %s failed (returned %d)", fpath, fd);
+        LOG_ERROR("open of %s failed (returned %d)", path, fd);
     } else {
         LOG("Opened %s, file handle is %d", path, fd);
+        set_cache_policy(path, fi, cached);
     }
 
-    fi->fh = fd;
+    fi->fh = fd < 0 ? (uint64_t) fd : serial << 32 | fd;
 
     return retval;
 }
@@ -492,12 +827,13 @@ static int undofs_read(const char *path, char *buf, size_t size, off_t offset, s
     //LOG("read(%s, %p, %zd, %ld), file handle is %ld", path, buf, size, offset, fi->fh);
     int retstat = 0, retval = 0;
 
-    retstat = pread(fi->fh, buf, size, offset);
+    retstat = sys_pread(HANDLE_FD(fi), buf, size, offset);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Failed to read(%s, %lu, %ld), fh = %lu, pread returned %d", path, size, offset, fi->fh, retstat);
-    }
+    } else if(retstat > 0 && undofs_cachepolicy_for(path) == UNDOFS_CACHEPOLICY_DROP_BACKING)
+        sys_posix_fadvise(HANDLE_FD(fi), offset, retstat, POSIX_FADV_DONTNEED);
     retval = retstat;
 
     return retval;
@@ -519,17 +855,98 @@ static int undofs_write(const char *path, const char *buf, size_t size, off_t of
     //LOG("write(%s, %p, %zd, %ld), file handle is %ld", path, buf, size, offset, fi->fh);
     int retstat = 0, retval = 0;
 
-    retstat = pwrite(fi->fh, buf, size, offset);
+    retstat = sys_pwrite(HANDLE_FD(fi), buf, size, offset);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Failed to write(%s, %lu, %ld), fh = %lu, pwrite returned %d", path, size, offset, fi->fh, retstat);
+    } else {
+        retval = retstat;
+        undofs_wamp_add(path, UNDOFS_WAMP_BYTES_WRITTEN, retstat);
     }
-    retval = retstat;
 
     return retval;
 }
 
+#ifdef FUSE_CAP_SPLICE_READ
+/** Read data from an open file, without copying it through undofs
+ *
+ * The buffer handed back refers to the version file itself, and libfuse
+ * splices it from there to the kernel. Files whose store pages are dropped
+ * after reads are read into memory instead, so the pages can be dropped.
+ *
+ * Introduced in version 2.9
+ */
+static int undofs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                           struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec));
+    if(src == NULL)
+        return -ENOMEM;
+    *src = FUSE_BUFVEC_INIT(size);
+
+    if(undofs_cachepolicy_for(path) == UNDOFS_CACHEPOLICY_DROP_BACKING)
+    {
+        int res;
+        src->buf[0].mem = malloc(size);
+        if(src->buf[0].mem == NULL)
+        {
+            free(src);
+            return -ENOMEM;
+        }
+        res = undofs_read(path, src->buf[0].mem, size, offset, fi);
+        if(res < 0)
+        {
+            free(src->buf[0].mem);
+            free(src);
+            return res;
+        }
+        src->buf[0].size = res;
+    } else {
+        src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        src->buf[0].fd = HANDLE_FD(fi);
+        src->buf[0].pos = offset;
+        // libfuse reads the version file after we return, count the call
+        // here. Its time is spent outside of the operation.
+        undofs_syscount_done(UNDOFS_SYS_READ, undofs_syscount_start());
+    }
+
+    *bufp = src;
+    return 0;
+}
+
+/** Write data to an open file, without copying it through undofs
+ *
+ * libfuse splices the data from the kernel to the version file, when the
+ * kernel lets it.
+ *
+ * Introduced in version 2.9
+ */
+static int undofs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                            struct fuse_file_info *fi)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+    ssize_t res;
+
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd = HANDLE_FD(fi);
+    dst.buf[0].pos = offset;
+
+    // libfuse writes or splices into the version file.
+    uint64_t start = undofs_syscount_start();
+    res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    undofs_syscount_done(UNDOFS_SYS_WRITE, start);
+    if(res < 0)
+    {
+        LOG_ERROR("Failed to write(%s, %zu, %ld), fh = %lu, returned %zd", path, fuse_buf_size(buf), offset, fi->fh, res);
+    } else {
+        undofs_wamp_add(path, UNDOFS_WAMP_BYTES_WRITTEN, res);
+    }
+
+    return res;
+}
+#endif
+
 /** Get file system statistics
  *
  * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
@@ -554,7 +971,7 @@ static int undofs_statfs(const char *path, struct statvfs *statv)
     }
 
     // get stats for underlying filesystem
-    retstat = statvfs(fpath, statv);
+    retstat = sys_statvfs(fpath, statv);
     if (retstat < 0)
     {
         retval = -errno;
@@ -585,6 +1002,9 @@ static int undofs_statfs(const char *path, struct statvfs *statv)
  * Filesystems shouldn't assume that flush will always be called
  * after some writes, or that if will be called at all.
  *
+ * A flush never ends a writer session, so repeated flushes don't
+ * create extra versions.
+ *
  * Changed in version 2.2
  */
 static int undofs_flush(const char *path, struct fuse_file_info *fi)
@@ -612,14 +1032,23 @@ static int undofs_release(const char *path, struct fuse_file_info *fi)
     LOG("close(%s), file handle is %lu", path, fi->fh);
     int retstat = 0, retval = 0;
 
-    // We need to close the file.  Had we allocated any resources
-    // (buffers etc) we'd need to free them here as well.
-    retstat = close(fi->fh);
+    // Shared read-only descriptors stay open in the cache.
+    if(undofs_fdcache_release(HANDLE_FD(fi)))
+        return 0;
+
+    // Closing the last writable handle of a file seals its version, the
+    // others never joined a session.
+    if(fi->flags & (O_WRONLY | O_RDWR))
+        retstat = undofs_session_close(HANDLE_FD(fi));
+    else
+        retstat = sys_close(HANDLE_FD(fi));
     if(retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Release failed (close returned %d)", retstat);
     }
+    if(fi->flags & (O_WRONLY | O_RDWR))
+        mirror_path(path);
 
     return retval;
 }
@@ -639,15 +1068,19 @@ static int undofs_fsync(const char *path, int datasync, struct fuse_file_info *f
     // some unix-like systems (notably freebsd) don't have a datasync call
 #ifdef HAVE_FDATASYNC
     if (datasync)
-        retstat = fdatasync(fi->fh);
+        retstat = sys_fdatasync(HANDLE_FD(fi));
     else
 #endif
-        retstat = fsync(fi->fh);
+        retstat = sys_fsync(HANDLE_FD(fi));
 
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("Failed to fsync(%lu), return value is %d", fi->fh, retstat);
+    } else {
+        // What the writer made durable should reach the mirror too, not
+        // only once the file is released.
+        mirror_path(path);
     }
 
     return retval;
@@ -663,7 +1096,7 @@ static int undofs_fsync(const char *path, int datasync, struct fuse_file_info *f
 static int undofs_opendir(const char *path, struct fuse_file_info *fi)
 {
     LOG("opendir(%s)", path);
-    DIR *dp;
+    int fd;
     int retstat = 0;
     char fpath[PATH_MAX];
 
@@ -677,14 +1110,16 @@ static int undofs_opendir(const char *path, struct fuse_file_info *fi)
         return -ENOTDIR;
     }
 
-    dp = opendir(fpath);
-    if (dp == NULL)
+    // Keep a plain descriptor instead of a DIR*, readdir scans it in bulk
+    // and looks up the children relative to it.
+    fd = sys_open(fpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
     {
         retstat = -errno;
         LOG_ERROR("Failed to open the directory %s", fpath);
     }
 
-    fi->fh = (intptr_t) dp;
+    fi->fh = fd;
 
     return retstat;
 }
@@ -714,23 +1149,15 @@ static int undofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, o
                    struct fuse_file_info *fi)
 {
     LOG("readdir(%s), offset %ld", path, offset);
-    DIR *dp;
-    struct dirent *de;
-    char dirpath[PATH_MAX];
-    if(undofs_versiondir_path(dirpath, path))
-        return -errno;
-
-    // once again, no need for fullpath -- but note that I need to cast fi->fh
-    dp = (DIR *) (uintptr_t) fi->fh;
+    int dirfd = fi->fh;
+    undofs_dirscan scan;
+    const char *entry;
+    int retval = 0;
 
-    // Every directory contains at least two entries: . and ..  If my
-    // first call to the system readdir() returns NULL I've got an
-    // error; near as I can tell, that's the only condition under
-    // which I can get an error from readdir()
-    de = readdir(dp);
-    if (de == 0) {
-        int retval = -errno;
-        LOG_ERROR("readdir call returned NULL");
+    // Every call lists the whole directory, start from the top.
+    if (sys_lseek(dirfd, 0, SEEK_SET) < 0 || undofs_dirscan_start(&scan, dirfd) != 0) {
+        retval = -errno;
+        LOG_ERROR("Failed to start scanning %s", path);
         return retval;
     }
 
@@ -738,46 +1165,68 @@ static int undofs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, o
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
 
+    uint32_t purge_gen = undofs_read_generation(dirfd, UNDOFS_PURGE_MARKER);
+
     // This will copy the entire directory into the buffer.  The loop exits
-    // when either the system readdir() returns NULL, or filler()
-    // returns something non-zero.  The first case just means I've
-    // read the whole directory; the second means the buffer is full.
-    do {
-        char rpath[PATH_MAX], fpath[PATH_MAX];
-        int file_ok = 0, name_wrong = 0;
-        snprintf(fpath, PATH_MAX, "%s/%s", dirpath, de->d_name);
-        name_wrong |= undofs_clean_name(rpath, fpath);
-        if(name_wrong)
+    // when either the scan runs out of entries, or filler() returns
+    // something non-zero.  The first case just means I've read the whole
+    // directory; the second means the buffer is full.
+    while ((entry = undofs_dirscan_next(&scan, NULL)) != NULL) {
+        char rpath[PATH_MAX];
+        undofs_node_info info;
+        struct stat st;
+        size_t len = strlen(entry);
+
+        // Skips the markers and log.txt without touching them.
+        if(len <= 5 || memcmp(entry + len - 5, ".node", 5) != 0)
             continue;
-    
-        if(is_directory(fpath))
+
+        if(undofs_scan_node(dirfd, entry, &info) != 0)
         {
-            if(!is_deleted(fpath))
-                file_ok = 1;
-        } else {
-            undofs_latest_path(fpath, rpath);
-            if(access(fpath, F_OK) == 0)
-                file_ok = 1;
+            LOG("While reading %s, failed to scan %s, skipping.", path, entry);
+            continue;
         }
+        if(undofs_scan_purged(purge_gen, &info))
+            continue;
 
-        if(! file_ok)
+        if(info.is_dir)
         {
-            LOG("While reading %s, %s seems to be neither an undofs directory nor file, skipping.", path, de->d_name);
-            continue;
+            if(info.deleted || undofs_stat_type(dirfd, entry, &st) != 0)
+                continue;
+        } else {
+            char version_path[PATH_MAX];
+            if(info.deleted || info.latest < 0)
+                continue;
+            snprintf(version_path, PATH_MAX, "%s/%ld", entry, info.latest);
+            if(undofs_stat_type(dirfd, version_path, &st) != 0)
+            {
+                LOG("While reading %s, %s seems to be neither an undofs directory nor file, skipping.", path, entry);
+                continue;
+            }
+            // The number getattr reports, see stable_ino(). The scan falls
+            // back to the one of the node directory.
+            if(info.ino != 0)
+                st.st_ino = info.ino;
         }
 
-        name_wrong |= undofs_clean_name(rpath, de->d_name);
-        if(name_wrong)
+        if(undofs_clean_name(rpath, entry))
             continue;
 
-        if (filler(buf, rpath, NULL, 0) != 0) {
+        if (filler(buf, rpath, &st, 0) != 0) {
             errno = ENOMEM;
             LOG_ERROR("readdir filler callback failed, is the buffer full?");
-            return -ENOMEM;
+            retval = -ENOMEM;
+            break;
         }
-    } while ((de = readdir(dp)) != NULL);
+    }
 
-    return 0;
+    if (entry == NULL && errno != 0) {
+        retval = -errno;
+        LOG_ERROR("Failed to read directory %s", path);
+    }
+
+    undofs_dirscan_end(&scan);
+    return retval;
 }
 
 /** Release directory
@@ -788,7 +1237,7 @@ static int undofs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     LOG("releasedir(%s)", path);
 
-    closedir((DIR *) (uintptr_t) fi->fh);
+    sys_close(fi->fh);
 
     return 0;
 }
@@ -835,7 +1284,7 @@ static int undofs_access(const char *path, int mask)
             return -errno;
     }
 
-    retstat = access(fpath, mask);
+    retstat = sys_access(fpath, mask);
 
     if (retstat < 0)
     {
@@ -862,18 +1311,20 @@ static int undofs_create(const char *path, mode_t mode, struct fuse_file_info *f
 {
     LOG("create(%s, %x)", path, mode);
     int retstat = 0;
-    char fpath[PATH_MAX];
     int fd;
 
-    if(undofs_new_path(fpath, path))
-        return -errno;
+    // Release ends the session of writable handles only, and a created
+    // file always gets one.
+    if((fi->flags & O_ACCMODE) == O_RDONLY)
+        fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
 
-    fd = creat(fpath, mode);
+    fd = undofs_session_open(path, fi->flags | O_CREAT | O_TRUNC, mode);
     if (fd < 0)
     {
         retstat = -errno;
-        LOG_ERROR("Failed to create file %s, returned handle was %d", fpath, fd);
-    }
+        LOG_ERROR("Failed to create file %s, returned handle was %d", path, fd);
+    } else
+        set_cache_policy(path, fi, 0);
 
     fi->fh = fd;
 
@@ -897,7 +1348,7 @@ static int undofs_ftruncate(const char *path, off_t offset, struct fuse_file_inf
     LOG("ftruncate(%s, %ld), file handle is %lu.", path, offset, fi->fh);
     int retstat = 0;
 
-    retstat = ftruncate(fi->fh, offset);
+    retstat = sys_ftruncate(HANDLE_FD(fi), offset);
     if (retstat < 0)
     {
         int retval = -errno;
@@ -932,12 +1383,13 @@ static int undofs_fgetattr(const char *path, struct stat *statbuf, struct fuse_f
     if (!strcmp(path, "/"))
         return undofs_getattr(path, statbuf);
 
-    retstat = fstat(fi->fh, statbuf);
+    retstat = sys_fstat(HANDLE_FD(fi), statbuf);
     if (retstat < 0)
     {
         retval = -errno;
         LOG_ERROR("fstat failed for %s (%lu), return value was %d", path, fi->fh, retstat);
-    }
+    } else
+        stable_ino(path, statbuf);
 
     return retval;
 }
@@ -963,6 +1415,56 @@ static void *undofs_init(struct fuse_conn_info *conn)
 {
     LOG("Init undofs.");
 
+    // Let O_TRUNC reach open(), so truncating opens create an empty
+    // version instead of truncating the latest one in place.
+    if(conn->capable & FUSE_CAP_ATOMIC_O_TRUNC)
+        conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+    if(conn->capable & FUSE_CAP_BIG_WRITES)
+        conn->want |= FUSE_CAP_BIG_WRITES;
+#ifdef FUSE_CAP_SPLICE_READ
+    // Data moves between the kernel and version files through pipes, where
+    // the kernel supports it; libfuse copies it where it doesn't.
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    LOG("Splicing file data: reads %s, writes %s.",
+        conn->want & FUSE_CAP_SPLICE_WRITE ? "yes" : "no", conn->want & FUSE_CAP_SPLICE_READ ? "yes" : "no");
+#endif
+
+    // Versions are cloned inside the store, so its filesystem decides how.
+    char probed[128] = "chosen with -o clone";
+    int method = PRIVATE_DATA->clone_method ? undofs_clone_method_parse(PRIVATE_DATA->clone_method) : UNDOFS_CLONE_AUTO;
+    if(method <= UNDOFS_CLONE_AUTO)
+        method = undofs_clone_probe(PRIVATE_DATA->rootdir, probed, sizeof(probed));
+    undofs_clone_set_method(method);
+    LOG("Cloning versions with %s (%s).", undofs_clone_method_name(method), probed);
+    if(PRIVATE_DATA->clone_cache)
+    {
+        int mode = undofs_clone_cache_parse(PRIVATE_DATA->clone_cache);
+        undofs_clone_set_cache(mode);
+        LOG("Cloning large versions with page cache mode %s.", undofs_clone_cache_name(mode));
+    }
+
+    if(undofs_cache_open(PRIVATE_DATA->rootdir) != 0)
+        LOG_ERROR("Failed to advance the store generation, starting with a cold cache.");
+    if(PRIVATE_DATA->trace_path)
+        undofs_trace_open(PRIVATE_DATA->trace_path, PRIVATE_DATA->trace_size_mb);
+    if(PRIVATE_DATA->capture_path)
+        undofs_capture_open(PRIVATE_DATA->capture_path);
+    if(PRIVATE_DATA->syscall_stats)
+    {
+        undofs_syscount_enable(1);
+        LOG("Counting system calls per operation.");
+    }
+    if(PRIVATE_DATA->slow_ms)
+    {
+        undofs_span_set_threshold(PRIVATE_DATA->slow_ms * 1000000ULL);
+        LOG("Keeping operations slower than %lu ms.", PRIVATE_DATA->slow_ms);
+    }
+    // Threads don't survive fuse daemonizing, so it can't start any sooner.
+    if(PRIVATE_DATA->mirror_path)
+        undofs_mirror_start(PRIVATE_DATA->rootdir, PRIVATE_DATA->mirror_path);
+    if(PRIVATE_DATA->scrub_rate_mb)
+        undofs_scrub_start(PRIVATE_DATA->rootdir, PRIVATE_DATA->scrub_rate_mb, PRIVATE_DATA->scrub_quarantine);
+
     return fuse_get_context()->private_data;
 }
 
@@ -976,6 +1478,14 @@ static void *undofs_init(struct fuse_conn_info *conn)
 static void undofs_destroy(void *userdata)
 {
     LOG("Destroying undofs");
+    undofs_scrub_stop();
+    undofs_meta_flush();
+    if(undofs_cache_close() != 0)
+        LOG_ERROR("Failed to write the cache snapshot, the next mount starts cold.");
+    undofs_fdcache_clear();
+    undofs_mirror_stop();
+    undofs_trace_close();
+    undofs_capture_close();
 }
 
 struct fuse_operations undofs_oper = {
@@ -997,6 +1507,10 @@ struct fuse_operations undofs_oper = {
     .open = undofs_open,
     .read = undofs_read,
     .write = undofs_write,
+#ifdef FUSE_CAP_SPLICE_READ
+    .read_buf = undofs_read_buf,
+    .write_buf = undofs_write_buf,
+#endif
     .statfs = undofs_statfs,
     .flush = undofs_flush,
     .release = undofs_release,
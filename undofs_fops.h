@@ -3,10 +3,40 @@
 #include "config.h"
 
 #include <fuse.h>
+#include <stdint.h>
 
 /**
  * @return pointer to a fuse_operations structure with all the undofs operations filled in.
  */
 struct fuse_operations *undofs_operations();
 
+/**
+ * Delete a directory and everything below it, in constant time.
+ * The children aren't visited: they are marked deleted lazily, when they
+ * are looked up after the directory was recreated. Their history is kept.
+ * @param path the relative path of the directory.
+ * @return 0 on success, or a negative errno value.
+ */
+int undofs_delete_tree(const char *path);
+
+/**
+ * Make an old version of a file its latest version again, by copying it
+ * to a new version. Works on deleted files too, which are undeleted.
+ * Versions stored inline in the meta file are written out from there.
+ * @param path the relative path of the file.
+ * @param version the version to restore.
+ * @return 0 on success, or a negative errno value.
+ */
+int undofs_restore_version(const char *path, long version);
+
+/**
+ * Give the latest version of a file or a directory back the attributes it
+ * had at a given time, from the attribute changes logged in its meta file.
+ * The restore is logged as a change itself.
+ * @param path the relative path.
+ * @param when_ns the time, in wall clock nanoseconds.
+ * @return 0 on success, or a negative errno value.
+ */
+int undofs_restore_attrs(const char *path, uint64_t when_ns);
+
 #endif
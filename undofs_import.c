@@ -0,0 +1,637 @@
+#include "config.h"
+#include "undofs_archive.h"
+#include "undofs_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+// Restores an archive from undofs-export into a store root, either a new
+// one or the store a previous archive was restored into. Small versions are
+// written by a pool of workers, large ones are moved straight from the
+// input to the store with splice or copy_file_range.
+
+#define IMPORT_THREADS 4
+#define IMPORT_MAX_THREADS 64
+#define IMPORT_QUEUE 256
+#define IMPORT_SMALL (1024 * 1024)
+
+typedef struct {
+    undofs_archive_entry e;
+    char *path;
+    int dirfd;              // the directory the file goes in, and its name there
+    const char *name;
+    char *data;             // NULL for large files, which are written inline
+} import_file;
+
+typedef struct {
+    int rootfd;
+    int in;
+    char buf[256 * 1024];
+    size_t pos, len;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+    import_file *queue[IMPORT_QUEUE];
+    int head, count, done;
+    int error;              // first errno seen by any worker
+
+    undofs_archive_entry *dirs;
+    char **dir_paths;           // every node imported so far
+    size_t ndirs, dirs_size;
+    size_t *node_index;         // open addressing over dir_paths, index + 1
+    size_t node_index_size;
+    char parent[PATH_MAX];      // the directory parent_fd() opened last
+    size_t parent_len;
+    int parent_fd;
+    unsigned long long entries, files, bytes;
+} importer;
+
+static void usage()
+{
+    fprintf(stderr, "Usage: undofs-import [-j <threads>] [-i <archive>] <store root>\n");
+    exit(1);
+}
+
+static void die(const char *what, const char *path)
+{
+    fprintf(stderr, "undofs-import: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+static void truncated()
+{
+    fprintf(stderr, "undofs-import: archive is truncated or corrupt.\n");
+    exit(1);
+}
+
+static struct timespec ts(int64_t ns)
+{
+    struct timespec t = { ns / 1000000000LL, ns % 1000000000LL };
+    return t;
+}
+
+static size_t fill(importer *im)
+{
+    if(im->pos == im->len)
+    {
+        ssize_t res;
+        do
+            res = read(im->in, im->buf, sizeof(im->buf));
+        while(res < 0 && errno == EINTR);
+        if(res < 0)
+            die("reading", "archive");
+        im->pos = 0;
+        im->len = res;
+    }
+    return im->len - im->pos;
+}
+
+static void get(importer *im, void *data, size_t size)
+{
+    while(size > 0)
+    {
+        size_t avail = fill(im);
+        if(avail == 0)
+            truncated();
+        if(avail > size)
+            avail = size;
+        memcpy(data, im->buf + im->pos, avail);
+        im->pos += avail;
+        data = (char *) data + avail;
+        size -= avail;
+    }
+}
+
+static void write_all(int fd, const char *data, size_t size, const char *path)
+{
+    while(size > 0)
+    {
+        ssize_t res = write(fd, data, size);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            die("writing", path);
+        }
+        data += res;
+        size -= res;
+    }
+}
+
+// Move size bytes of payload from the input to fd. Whatever is already in
+// the read buffer goes first, the rest is moved by the kernel if it can.
+static void copy_payload(importer *im, int fd, uint64_t size, const char *path)
+{
+    int use_splice = 1, use_copy_range = 1;
+    size_t avail = im->len - im->pos;
+
+    if(avail > size)
+        avail = size;
+    write_all(fd, im->buf + im->pos, avail, path);
+    im->pos += avail;
+    size -= avail;
+
+    while(size > 0)
+    {
+        ssize_t res = -1;
+        if(use_splice)
+        {
+            res = splice(im->in, NULL, fd, NULL, size, SPLICE_F_MOVE);
+            if(res < 0 && errno == EINVAL)
+            {
+                use_splice = 0;
+                continue;
+            }
+        }
+        else if(use_copy_range)
+        {
+            res = copy_file_range(im->in, NULL, fd, NULL, size, 0);
+            if(res < 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                use_copy_range = 0;
+                continue;
+            }
+        } else {
+            avail = fill(im);
+            if(avail > size)
+                avail = size;
+            write_all(fd, im->buf + im->pos, avail, path);
+            im->pos += avail;
+            res = avail;
+        }
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            die("writing", path);
+        }
+        if(res == 0)
+            truncated();
+        size -= res;
+    }
+}
+
+static void finish_file(int fd, const undofs_archive_entry *e)
+{
+    struct timespec times[2] = { ts(e->atime_ns), ts(e->mtime_ns) };
+    // Ownership only sticks for root, like cp -a.
+    if(fchown(fd, e->uid, e->gid) != 0 && errno != EPERM)
+        return;
+    fchmod(fd, e->mode & 07777);
+    futimens(fd, times);
+}
+
+// Versions never change once written, but the meta file of a node does, so
+// files are replaced rather than written over.
+static int open_file(int dirfd, const char *name, mode_t mode)
+{
+    if(unlinkat(dirfd, name, 0) != 0 && errno != ENOENT)
+        return -1;
+    return openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, mode & 07777);
+}
+
+static int write_small(importer *im, import_file *f)
+{
+    int fd = open_file(f->dirfd, f->name, f->e.mode);
+    size_t done = 0;
+
+    if(fd < 0)
+        return -1;
+    while(done < f->e.size)
+    {
+        ssize_t res = write(fd, f->data + done, f->e.size - done);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        done += res;
+    }
+    finish_file(fd, &f->e);
+    return close(fd);
+}
+
+static void *import_worker(void *arg)
+{
+    importer *im = arg;
+
+    for(;;)
+    {
+        import_file *f;
+
+        pthread_mutex_lock(&im->lock);
+        while(im->count == 0 && ! im->done)
+            pthread_cond_wait(&im->not_empty, &im->lock);
+        if(im->count == 0)
+        {
+            pthread_mutex_unlock(&im->lock);
+            return NULL;
+        }
+        f = im->queue[im->head];
+        im->head = (im->head + 1) % IMPORT_QUEUE;
+        im->count--;
+        pthread_cond_signal(&im->not_full);
+        pthread_mutex_unlock(&im->lock);
+
+        if(write_small(im, f) != 0)
+        {
+            int error = errno;
+            fprintf(stderr, "undofs-import: writing %s: %s\n", f->path, strerror(error));
+            pthread_mutex_lock(&im->lock);
+            if(! im->error)
+                im->error = error;
+            pthread_mutex_unlock(&im->lock);
+        }
+        close(f->dirfd);
+        free(f->path);
+        free(f->data);
+        free(f);
+    }
+}
+
+static void enqueue(importer *im, import_file *f)
+{
+    pthread_mutex_lock(&im->lock);
+    while(im->count == IMPORT_QUEUE)
+        pthread_cond_wait(&im->not_full, &im->lock);
+    im->queue[(im->head + im->count) % IMPORT_QUEUE] = f;
+    im->count++;
+    pthread_cond_signal(&im->not_empty);
+    pthread_mutex_unlock(&im->lock);
+}
+
+static uint64_t hash_path(const char *path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for(i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static size_t *node_slot(importer *im, const char *path, size_t len)
+{
+    size_t mask = im->node_index_size - 1, i = hash_path(path, len) & mask;
+    for(; im->node_index[i] != 0; i = (i + 1) & mask)
+    {
+        const char *node = im->dir_paths[im->node_index[i] - 1];
+        if(strncmp(node, path, len) == 0 && node[len] == '\0')
+            break;
+    }
+    return &im->node_index[i];
+}
+
+// Whether the first len bytes of path name a node the archive created.
+static int known_node(importer *im, const char *path, size_t len)
+{
+    return im->node_index_size != 0 && *node_slot(im, path, len) != 0;
+}
+
+static void add_node(importer *im, size_t d)
+{
+    size_t i;
+    if(2 * (d + 1) > im->node_index_size)
+    {
+        size_t *old = im->node_index, old_size = im->node_index_size;
+        im->node_index_size = old_size ? old_size * 2 : 4096;
+        im->node_index = calloc(im->node_index_size, sizeof(size_t));
+        if(im->node_index == NULL)
+            die("importing", im->dir_paths[d]);
+        for(i = 0; i < old_size; i++)
+            if(old[i] != 0)
+                *node_slot(im, im->dir_paths[old[i] - 1], strlen(im->dir_paths[old[i] - 1])) = old[i];
+        free(old);
+    }
+    *node_slot(im, im->dir_paths[d], strlen(im->dir_paths[d])) = d + 1;
+}
+
+// The directory an archive path goes in, opened one component at a time
+// without following symbolic links, so entries can't be written through a
+// link an earlier entry created. name receives the last component. The
+// descriptor belongs to the importer.
+static int parent_fd(importer *im, const char *path, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t) (slash - path) : 0;
+    char dir[PATH_MAX], *component, *next;
+    int fd = im->rootfd;
+
+    *name = slash ? slash + 1 : path;
+    if(len == 0)
+        return im->rootfd;
+    if(im->parent_fd >= 0 && im->parent_len == len && memcmp(im->parent, path, len) == 0)
+        return im->parent_fd;
+
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    for(component = dir; component != NULL; component = next)
+    {
+        next = strchr(component, '/');
+        if(next != NULL)
+            *next++ = '\0';
+        int child = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(fd != im->rootfd)
+            close(fd);
+        if(child < 0)
+            die("opening the directory of", path);
+        fd = child;
+    }
+    if(im->parent_fd >= 0)
+        close(im->parent_fd);
+    memcpy(im->parent, path, len);
+    im->parent_len = len;
+    im->parent_fd = fd;
+    return fd;
+}
+
+static void set_marker(importer *im, int nodefd, const char *path, const char *marker, int present)
+{
+    if(! present)
+    {
+        if(unlinkat(nodefd, marker, 0) != 0 && errno != ENOENT)
+            die("removing a marker of", path);
+        return;
+    }
+
+    // Deleted markers share one inode, like the ones undofs makes.
+    if(strcmp(marker, "deleted") == 0 && linkat(im->rootfd, "marker.template", nodefd, marker, 0) == 0)
+        return;
+    int fd = openat(nodefd, marker, O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC, S_IRUSR);
+    if(fd < 0)
+        die("creating a marker of", path);
+    close(fd);
+}
+
+// Generation markers are symbolic links to the number, see UNDOFS_PURGE_MARKER.
+static void set_generation(int nodefd, const char *path, const char *marker, uint32_t gen)
+{
+    char target[16];
+
+    if(unlinkat(nodefd, marker, 0) != 0 && errno != ENOENT)
+        die("removing a marker of", path);
+    if(gen == 0)
+        return;
+    snprintf(target, sizeof(target), "%" PRIu32, gen);
+    if(symlinkat(target, nodefd, marker) != 0)
+        die("creating a marker of", path);
+}
+
+static void import_node(importer *im, const undofs_archive_entry *e, char *path)
+{
+    const char *name;
+    int nodefd;
+
+    if(path[0])
+    {
+        int dirfd = parent_fd(im, path, &name);
+        if(mkdirat(dirfd, name, e->mode & 07777) != 0 && errno != EEXIST)
+            die("creating", path);
+        nodefd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(nodefd < 0)
+            die("opening", path);
+        fchmod(nodefd, e->mode & 07777);
+    }
+    else if((nodefd = dup(im->rootfd)) < 0)
+        die("opening", "the store root");
+
+    set_marker(im, nodefd, path, "dir", e->flags & UNDOFS_ARCHIVE_DIR);
+    set_marker(im, nodefd, path, "deleted", e->flags & UNDOFS_ARCHIVE_DELETED);
+    set_generation(nodefd, path, UNDOFS_PURGE_MARKER, e->purge_gen);
+    set_generation(nodefd, path, UNDOFS_BORN_MARKER, e->born);
+    close(nodefd);
+
+    // Directories report the times of their node, so directory times are
+    // restored once everything inside them has been written.
+    if(im->ndirs == im->dirs_size)
+    {
+        im->dirs_size = im->dirs_size ? im->dirs_size * 2 : 1024;
+        im->dirs = realloc(im->dirs, im->dirs_size * sizeof(*im->dirs));
+        im->dir_paths = realloc(im->dir_paths, im->dirs_size * sizeof(*im->dir_paths));
+        if(im->dirs == NULL || im->dir_paths == NULL)
+            die("importing", path);
+    }
+    im->dirs[im->ndirs] = *e;
+    im->dir_paths[im->ndirs] = path;
+    add_node(im, im->ndirs++);
+}
+
+static void import_file_entry(importer *im, const undofs_archive_entry *e, char *path)
+{
+    const char *name;
+    int dirfd = parent_fd(im, path, &name);
+
+    if(S_ISREG(e->mode) && e->size <= IMPORT_SMALL)
+    {
+        import_file *f = malloc(sizeof(import_file));
+        if(f == NULL || (f->data = malloc(e->size ? e->size : 1)) == NULL)
+            die("importing", path);
+        f->e = *e;
+        f->path = path;
+        f->name = name;
+        // parent_fd() moves on before the worker gets to it.
+        if((f->dirfd = dup(dirfd)) < 0)
+            die("importing", path);
+        get(im, f->data, e->size);
+        enqueue(im, f);
+    }
+    else if(S_ISREG(e->mode))
+    {
+        int fd = open_file(dirfd, name, e->mode);
+        if(fd < 0)
+            die("creating", path);
+        copy_payload(im, fd, e->size, path);
+        finish_file(fd, e);
+        if(close(fd) != 0)
+            die("writing", path);
+        free(path);
+    }
+    else if(S_ISLNK(e->mode))
+    {
+        char target[PATH_MAX];
+        if(e->size >= PATH_MAX)
+            truncated();
+        get(im, target, e->size);
+        target[e->size] = '\0';
+        if(unlinkat(dirfd, name, 0) != 0 && errno != ENOENT)
+            die("replacing", path);
+        if(symlinkat(target, dirfd, name) != 0)
+            die("creating", path);
+        struct timespec times[2] = { ts(e->atime_ns), ts(e->mtime_ns) };
+        fchownat(dirfd, name, e->uid, e->gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+        free(path);
+    } else {
+        if(unlinkat(dirfd, name, 0) != 0 && errno != ENOENT)
+            die("replacing", path);
+        if(mknodat(dirfd, name, e->mode, e->rdev) != 0)
+            die("creating", path);
+        struct timespec times[2] = { ts(e->atime_ns), ts(e->mtime_ns) };
+        fchownat(dirfd, name, e->uid, e->gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+        free(path);
+    }
+    im->files++;
+    im->bytes += e->size;
+}
+
+// Archive paths are relative to the store root, one name per component;
+// refuse anything that could point outside of it. Symbolic links are taken
+// care of by parent_fd().
+static int safe_path(const char *path)
+{
+    const char *p = path;
+    if(path[0] == '\0')
+        return 1;
+    for(;;)
+    {
+        size_t len = strcspn(p, "/");
+        if(len == 0 || (p[0] == '.' && (len == 1 || (len == 2 && p[1] == '.'))))
+            return 0;
+        if(p[len] == '\0')
+            return 1;
+        p += len + 1;
+    }
+}
+
+// Everything but the store root goes in a node the archive made before.
+static int in_node(importer *im, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    if(path[0] == '\0')
+        return 1;
+    return known_node(im, path, slash ? (size_t) (slash - path) : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    importer *im = calloc(1, sizeof(importer));
+    pthread_t workers[IMPORT_MAX_THREADS];
+    undofs_archive_header header;
+    undofs_archive_entry e;
+    const char *input = NULL;
+    int threads = IMPORT_THREADS, started = 0, opt, i;
+    size_t d;
+
+    while((opt = getopt(argc, argv, "j:i:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'j':
+            threads = atoi(optarg);
+            if(threads < 1 || threads > IMPORT_MAX_THREADS)
+                usage();
+            break;
+        case 'i':
+            input = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if(optind != argc - 1 || im == NULL)
+        usage();
+
+    if(mkdir(argv[optind], 0755) != 0 && errno != EEXIST)
+        die("creating", argv[optind]);
+    im->rootfd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    im->parent_fd = -1;
+    if(im->rootfd < 0)
+        die("open", argv[optind]);
+    // The next mount must not trust what it cached before the import.
+    if(unlinkat(im->rootfd, UNDOFS_CACHE_SNAPSHOT, 0) != 0 && errno != ENOENT)
+        die("removing the cache snapshot of", argv[optind]);
+    im->in = input ? open(input, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if(im->in < 0)
+        die("open", input);
+    posix_fadvise(im->in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    get(im, &header, sizeof(header));
+    if(memcmp(header.magic, UNDOFS_ARCHIVE_MAGIC, sizeof(header.magic)) != 0
+       || header.format != UNDOFS_ARCHIVE_FORMAT || header.entry_size != sizeof(undofs_archive_entry))
+    {
+        fprintf(stderr, "undofs-import: not an undofs archive, or from an incompatible version.\n");
+        return 1;
+    }
+
+    // Deleted markers are hardlinks to this, see undofs_mark_deleted.
+    int template = openat(im->rootfd, "marker.template", O_CREAT | O_WRONLY | O_CLOEXEC, S_IRUSR);
+    if(template >= 0)
+        close(template);
+
+    pthread_mutex_init(&im->lock, NULL);
+    pthread_cond_init(&im->not_empty, NULL);
+    pthread_cond_init(&im->not_full, NULL);
+    for(i = 0; i < threads; i++)
+    {
+        if(pthread_create(&workers[started], NULL, import_worker, im) != 0)
+            break;
+        started++;
+    }
+    if(started == 0)
+        die("starting", "workers");
+
+    for(;;)
+    {
+        char *path;
+
+        get(im, &e, sizeof(e));
+        if(e.kind == UNDOFS_ARCHIVE_END)
+            break;
+        if(e.path_len >= PATH_MAX || (path = malloc(e.path_len + 1)) == NULL)
+            truncated();
+        get(im, path, e.path_len);
+        path[e.path_len] = '\0';
+        if(! safe_path(path) || ! in_node(im, path))
+        {
+            fprintf(stderr, "undofs-import: refusing path %s\n", path);
+            return 1;
+        }
+
+        if(e.kind == UNDOFS_ARCHIVE_NODE)
+            import_node(im, &e, path);
+        else if(e.kind == UNDOFS_ARCHIVE_FILE && path[0])
+            import_file_entry(im, &e, path);
+        else
+            truncated();
+        im->entries++;
+    }
+    if(e.size != im->entries)
+        truncated();
+
+    pthread_mutex_lock(&im->lock);
+    im->done = 1;
+    pthread_cond_broadcast(&im->not_empty);
+    pthread_mutex_unlock(&im->lock);
+    for(i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    if(im->error)
+        return 1;
+
+    // Children come after their parents, so going backwards sets every
+    // directory time after the last change inside it.
+    for(d = im->ndirs; d-- > 0;)
+    {
+        struct timespec times[2] = { ts(im->dirs[d].atime_ns), ts(im->dirs[d].mtime_ns) };
+        const char *path = im->dir_paths[d], *name = ".";
+        int dirfd = path[0] ? parent_fd(im, path, &name) : im->rootfd;
+        if(utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW) != 0)
+            die("setting times on", path);
+        free(im->dir_paths[d]);
+    }
+
+    if(fsync(im->rootfd) != 0)
+        die("syncing", argv[optind]);
+    fprintf(stderr, "Imported %llu entries, %llu files, %llu bytes.\n", im->entries, im->files, im->bytes);
+    return 0;
+}
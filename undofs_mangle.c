@@ -0,0 +1,428 @@
+#include "undofs_mangle.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/*
+ * Separator iterators return the positions of every '/' and the final '\0'
+ * of a string, in order.  The SIMD versions classify a whole block of bytes
+ * at once and then walk the bits of the resulting mask, so a path made of
+ * many short components costs one load per block, not one per component.
+ */
+typedef struct {
+    const char *block;
+    unsigned mask;
+} separator_iter;
+
+static inline void separators_portable_init(separator_iter *it, const char *p)
+{
+    it->block = p;
+}
+
+static inline const char *separators_portable_next(separator_iter *it)
+{
+    const char *p = it->block;
+    while(*p && *p != '/')
+        p++;
+    it->block = p + 1;
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+// Aligned loads never cross a page boundary, so reading a whole block
+// around the end of the string is safe.
+__attribute__((target("sse2")))
+static inline unsigned separator_mask_sse2(const char *block)
+{
+    __m128i v = _mm_load_si128((const __m128i *) block);
+    return _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')),
+                                          _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+__attribute__((target("sse2")))
+static inline void separators_sse2_init(separator_iter *it, const char *p)
+{
+    uintptr_t misalign = (uintptr_t) p & 15;
+    it->block = p - misalign;
+    it->mask = separator_mask_sse2(it->block) & (~0u << misalign);
+}
+
+__attribute__((target("sse2")))
+static inline const char *separators_sse2_next(separator_iter *it)
+{
+    while(it->mask == 0)
+    {
+        it->block += 16;
+        it->mask = separator_mask_sse2(it->block);
+    }
+    const char *separator = it->block + __builtin_ctz(it->mask);
+    it->mask &= it->mask - 1;
+    return separator;
+}
+
+__attribute__((target("avx2")))
+static inline unsigned separator_mask_avx2(const char *block)
+{
+    __m256i v = _mm256_load_si256((const __m256i *) block);
+    return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')),
+                                                _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static inline void separators_avx2_init(separator_iter *it, const char *p)
+{
+    uintptr_t misalign = (uintptr_t) p & 31;
+    it->block = p - misalign;
+    it->mask = separator_mask_avx2(it->block) & (~0u << misalign);
+}
+
+__attribute__((target("avx2")))
+static inline const char *separators_avx2_next(separator_iter *it)
+{
+    while(it->mask == 0)
+    {
+        it->block += 32;
+        it->mask = separator_mask_avx2(it->block);
+    }
+    const char *separator = it->block + __builtin_ctz(it->mask);
+    it->mask &= it->mask - 1;
+    return separator;
+}
+#endif
+
+static int mangle_scalar(char *fpath, const char *rootdir, const char *path)
+{
+    if(strcmp(path, "/") == 0)
+    {
+        snprintf(fpath, PATH_MAX, "%s", rootdir);
+        return 0;
+    }
+    else
+    {
+        int i = 0;
+        const char* path_pos = path;
+        char * fpath_pos = fpath;
+        i = snprintf(fpath, PATH_MAX, "%s", rootdir);
+        fpath_pos += i;
+
+        // Ignore leading '/' for mangling.
+        while(*path_pos == '/')
+        {
+            *fpath_pos++ = *path_pos++;
+            i++;
+        }
+
+        // 12 is reserved for inserting a .node/ + final .node\0
+        while(fpath_pos + 12 < fpath + PATH_MAX
+              && *path_pos)
+        {
+            if(*path_pos == '/')
+            {
+                *fpath_pos++ = '.';
+                *fpath_pos++ = 'n';
+                *fpath_pos++ = 'o';
+                *fpath_pos++ = 'd';
+                *fpath_pos++ = 'e';
+                // Skip double slashes in filenames.
+                while(path_pos[1] == '/') path_pos++;
+            }
+            *fpath_pos++ = *path_pos++;
+        }
+
+        if (*path_pos)
+        {
+            *fpath_pos = 0;
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        // Trailing .node need not be added for root directory.
+        if(fpath_pos - fpath > i)
+        {
+            *fpath_pos++ = '.';
+            *fpath_pos++ = 'n';
+            *fpath_pos++ = 'o';
+            *fpath_pos++ = 'd';
+            *fpath_pos++ = 'e';
+        }
+        *fpath_pos++ = '\0';
+
+        return 0;
+    }
+}
+
+// Most path components are only a few bytes long, too short for a call
+// to memcpy to pay off.
+static inline __attribute__((always_inline)) void copy_short(char *dst, const char *src, size_t len)
+{
+    if(len > 16)
+        memcpy(dst, src, len);
+    else
+        while(len--)
+            *dst++ = *src++;
+}
+
+// Same output as mangle_scalar, but copies whole components at once.
+// Always inlined, so each implementation below gets its own copy with the
+// separator search inlined as well.
+#define SEPARATOR_ITER_ARGS \
+    void (*separators_init)(separator_iter *, const char *), \
+    const char *(*separators_next)(separator_iter *)
+
+static inline __attribute__((always_inline)) int mangle_segments(char *fpath, const char *rootdir, const char *path,
+                                                                 SEPARATOR_ITER_ARGS)
+{
+    separator_iter it;
+    size_t root_len = strlen(rootdir);
+    // 12 is reserved for inserting a .node/ + final .node\0
+    char *limit = fpath + PATH_MAX - 12;
+    char *out, *content;
+
+    if(root_len >= PATH_MAX - 12)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(fpath, rootdir, root_len + 1);
+    if(path[0] == '/' && path[1] == 0)
+        return 0;
+
+    out = fpath + root_len;
+    // Leading slashes are kept as they are.
+    while(*path == '/' && out < limit)
+        *out++ = *path++;
+    content = out;
+
+    separators_init(&it, path);
+    while(*path)
+    {
+        const char *separator = separators_next(&it);
+        size_t len = separator - path;
+
+        if(len > (size_t) (limit - out))
+        {
+            memcpy(out, path, limit - out);
+            fpath[PATH_MAX - 12] = 0;
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        copy_short(out, path, len);
+        out += len;
+        path = separator;
+
+        if(*path == '/')
+        {
+            if(out >= limit)
+            {
+                *out = 0;
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            memcpy(out, ".node/", 6);
+            out += 6;
+            // Skip double slashes in filenames.
+            while(*++path == '/')
+                separators_next(&it);
+        }
+    }
+
+    // Trailing .node need not be added for root directory.
+    if(out > content)
+    {
+        memcpy(out, ".node", 5);
+        out += 5;
+    }
+    *out = 0;
+    return 0;
+}
+
+static int demangle_scalar(char *name, const char *rootdir, const char *mangled)
+{
+    char *name_pos = name;
+    const char *mangled_pos = mangled;
+    int demangled_last_char = 1, retval = 0;
+
+    // Ignore leading rootdir
+    size_t rootdir_len = strlen(rootdir);
+    if(strncmp(rootdir, mangled, rootdir_len) == 0)
+        mangled_pos += rootdir_len;
+
+    // Ignore leading '/' for demangling.
+    if(*mangled_pos == '/')
+        *name_pos++ = *mangled_pos++;
+
+    while(*mangled_pos)
+    {
+        // Skip .node at end of string or before path separator.
+        if(strncmp(mangled_pos, ".node", 5) == 0 &&
+           (mangled_pos[5] == '/' || mangled_pos[5] == '\0'))
+        {
+            demangled_last_char = 1;
+            mangled_pos += 5;
+        } else {
+            if(*mangled_pos == '/' && demangled_last_char == 0)
+                retval = -1;
+            *name_pos++ = *mangled_pos++;
+            demangled_last_char = 0;
+        }
+    }
+    *name_pos = 0;
+
+    if (demangled_last_char == 0)
+        retval = -1;
+
+    return retval;
+}
+
+// Same output as demangle_scalar, but looks at whole components at once:
+// ".node" can only be stripped from the end of a component.
+static inline __attribute__((always_inline)) int demangle_segments(char *name, const char *rootdir, const char *mangled,
+                                                                   SEPARATOR_ITER_ARGS)
+{
+    separator_iter it;
+    size_t root_len = strlen(rootdir);
+    const char *in = mangled;
+    char *out = name;
+    int demangled_last = 1, retval = 0;
+
+    if(strncmp(rootdir, mangled, root_len) == 0)
+        in += root_len;
+
+    if(*in == '/')
+        *out++ = *in++;
+
+    separators_init(&it, in);
+    for(;;)
+    {
+        const char *separator = separators_next(&it);
+        size_t len = separator - in;
+
+        if(len >= 5 && memcmp(separator - 5, ".node", 5) == 0)
+        {
+            copy_short(out, in, len - 5);
+            out += len - 5;
+            demangled_last = 1;
+        } else if(len > 0) {
+            copy_short(out, in, len);
+            out += len;
+            demangled_last = 0;
+        }
+
+        if(*separator == 0)
+            break;
+
+        if(!demangled_last)
+            retval = -1;
+        *out++ = '/';
+        demangled_last = 0;
+        in = separator + 1;
+    }
+    *out = 0;
+
+    if(!demangled_last)
+        retval = -1;
+    return retval;
+}
+
+typedef int (*mangle_fn)(char *out, const char *rootdir, const char *in);
+
+static int mangle_portable(char *fpath, const char *rootdir, const char *path)
+{
+    return mangle_segments(fpath, rootdir, path, separators_portable_init, separators_portable_next);
+}
+
+static int demangle_portable(char *name, const char *rootdir, const char *mangled)
+{
+    return demangle_segments(name, rootdir, mangled, separators_portable_init, separators_portable_next);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static int mangle_sse2(char *fpath, const char *rootdir, const char *path)
+{
+    return mangle_segments(fpath, rootdir, path, separators_sse2_init, separators_sse2_next);
+}
+
+__attribute__((target("sse2")))
+static int demangle_sse2(char *name, const char *rootdir, const char *mangled)
+{
+    return demangle_segments(name, rootdir, mangled, separators_sse2_init, separators_sse2_next);
+}
+
+__attribute__((target("avx2")))
+static int mangle_avx2(char *fpath, const char *rootdir, const char *path)
+{
+    return mangle_segments(fpath, rootdir, path, separators_avx2_init, separators_avx2_next);
+}
+
+__attribute__((target("avx2")))
+static int demangle_avx2(char *name, const char *rootdir, const char *mangled)
+{
+    return demangle_segments(name, rootdir, mangled, separators_avx2_init, separators_avx2_next);
+}
+#endif
+
+static mangle_fn selected_mangle = NULL;
+static mangle_fn selected_demangle = NULL;
+
+int undofs_mangle_select(int impl)
+{
+    switch(impl)
+    {
+    case UNDOFS_MANGLE_AUTO:
+#ifdef HAVE_X86_SIMD
+        if(__builtin_cpu_supports("avx2"))
+            return undofs_mangle_select(UNDOFS_MANGLE_AVX2);
+        if(__builtin_cpu_supports("sse2"))
+            return undofs_mangle_select(UNDOFS_MANGLE_SSE2);
+#endif
+        return undofs_mangle_select(UNDOFS_MANGLE_PORTABLE);
+    case UNDOFS_MANGLE_SCALAR:
+        selected_demangle = demangle_scalar;
+        selected_mangle = mangle_scalar;
+        break;
+    case UNDOFS_MANGLE_PORTABLE:
+        selected_demangle = demangle_portable;
+        selected_mangle = mangle_portable;
+        break;
+#ifdef HAVE_X86_SIMD
+    case UNDOFS_MANGLE_SSE2:
+        if(!__builtin_cpu_supports("sse2"))
+            return -1;
+        selected_demangle = demangle_sse2;
+        selected_mangle = mangle_sse2;
+        break;
+    case UNDOFS_MANGLE_AVX2:
+        if(!__builtin_cpu_supports("avx2"))
+            return -1;
+        selected_demangle = demangle_avx2;
+        selected_mangle = mangle_avx2;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+int undofs_mangle(char *fpath, const char *rootdir, const char *path)
+{
+    if(selected_mangle == NULL)
+        undofs_mangle_select(UNDOFS_MANGLE_AUTO);
+    return selected_mangle(fpath, rootdir, path);
+}
+
+int undofs_demangle(char *name, const char *rootdir, const char *mangled)
+{
+    if(selected_mangle == NULL)
+        undofs_mangle_select(UNDOFS_MANGLE_AUTO);
+    return selected_demangle(name, rootdir, mangled);
+}
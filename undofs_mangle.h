@@ -0,0 +1,52 @@
+#ifndef __UNDOFS_MANGLE_H_
+#define __UNDOFS_MANGLE_H_
+#include "config.h"
+
+/*
+ * Path mangling: every component of a relative path gets a ".node" suffix,
+ * and the result is prefixed with the store root, so "/a/b" becomes
+ * "<root>/a.node/b.node".  Demangling reverses this.
+ *
+ * These functions don't depend on fuse, so the benchmarks can link them.
+ * The implementation is picked at first use: AVX2 or SSE2 when the CPU has
+ * them, plain C otherwise.
+ */
+
+enum undofs_mangle_impl {
+    UNDOFS_MANGLE_AUTO,
+    UNDOFS_MANGLE_SCALAR,   // the original byte-at-a-time loops
+    UNDOFS_MANGLE_PORTABLE, // segment-at-a-time, plain C separator search
+    UNDOFS_MANGLE_SSE2,
+    UNDOFS_MANGLE_AVX2
+};
+
+/**
+ * Choose the implementation used by undofs_mangle() and undofs_demangle().
+ * @param impl one of enum undofs_mangle_impl.
+ * @return 0 on success, -1 if the CPU or compiler doesn't support it.
+ */
+int undofs_mangle_select(int impl);
+
+/**
+ * Mangle a relative path into an absolute path in the store.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param fpath Output parameter, PATH_MAX bytes.
+ * @param rootdir The store root.
+ * @param path Relative path provided by FUSE.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_mangle(char *fpath, const char *rootdir, const char *path);
+
+/**
+ * Demangle a path in the store, or a single mangled name, to a clean name.
+ * A leading store root is stripped.
+ * @param name Output parameter, at least as long as mangled.
+ * @param rootdir The store root.
+ * @param mangled The mangled path or name.
+ * @return 0 if the name was properly mangled, -1 otherwise.
+ */
+int undofs_demangle(char *name, const char *rootdir, const char *mangled);
+
+#endif
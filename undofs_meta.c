@@ -0,0 +1,722 @@
+#include "undofs_meta.h"
+#include "undofs_scan.h"
+#include "undofs_syscount.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Meta files are small and updated rarely, one lock for all of them will do.
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int open_meta(const char *nodedir, int flags)
+{
+    char meta_path[PATH_MAX];
+    if(snprintf(meta_path, PATH_MAX, "%s/" UNDOFS_META_NAME, nodedir) >= PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return sys_open(meta_path, flags | O_CLOEXEC, S_IRUSR | S_IWUSR);
+}
+
+// Read the header, or set up a new one if the file is empty.
+static int read_header(int fd, undofs_meta_header *header)
+{
+    ssize_t got = sys_pread(fd, header, sizeof(*header), 0);
+    if(got < 0)
+        return -1;
+
+    if(got == 0)
+    {
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, UNDOFS_META_MAGIC, sizeof(header->magic));
+        header->format = UNDOFS_META_FORMAT;
+        header->record_size = sizeof(undofs_meta_record);
+        header->last_version = -1;
+        return 0;
+    }
+
+    if(got != sizeof(*header)
+       || memcmp(header->magic, UNDOFS_META_MAGIC, sizeof(header->magic)) != 0
+       || header->format != UNDOFS_META_FORMAT
+       || header->record_size != sizeof(undofs_meta_record))
+    {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int write_header(int fd, const undofs_meta_header *header)
+{
+    ssize_t written = sys_pwrite(fd, header, sizeof(*header), 0);
+    if(written != sizeof(*header))
+    {
+        if(written >= 0)
+            errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static void fill_attrs(undofs_meta_record *record, long version, uint32_t kind,
+                       uint64_t now_ns, const struct stat *st)
+{
+    memset(record, 0, sizeof(*record));
+    record->version = version;
+    record->logged_ns = now_ns;
+    record->kind = kind;
+    record->mode = st->st_mode;
+    record->uid = st->st_uid;
+    record->gid = st->st_gid;
+    record->atime_ns = (int64_t) st->st_atim.tv_sec * 1000000000 + st->st_atim.tv_nsec;
+    record->mtime_ns = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+int undofs_meta_log_attrs(const char *nodedir, long version, const struct stat *before, const struct stat *after)
+{
+    undofs_meta_header header;
+    undofs_meta_record records[2];
+    struct timespec now;
+    uint64_t now_ns;
+    int count = 0, retval = -1, saved_errno;
+    size_t size;
+    ssize_t written;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    now_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    int fd = open_meta(nodedir, O_RDWR | O_CREAT);
+    if(fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&meta_lock);
+
+    if(read_header(fd, &header) != 0)
+        goto out;
+
+    if(header.records == 0 || header.last_version != version)
+        fill_attrs(&records[count++], version, UNDOFS_META_ATTR_BASE, now_ns, before);
+    fill_attrs(&records[count++], version, UNDOFS_META_ATTR, now_ns, after);
+
+    // Records go in before the header counts them, so a crash in between
+    // only loses the change that was being logged.
+    size = count * sizeof(undofs_meta_record);
+    written = sys_pwrite(fd, records, size, sizeof(header) + header.records * sizeof(undofs_meta_record));
+    if(written != (ssize_t) size)
+    {
+        if(written >= 0)
+            errno = EIO;
+        goto out;
+    }
+
+    header.records += count;
+    header.last_version = version;
+    retval = write_header(fd, &header);
+
+out:
+    saved_errno = errno;
+    pthread_mutex_unlock(&meta_lock);
+    sys_close(fd);
+    errno = saved_errno;
+    return retval;
+}
+
+int undofs_meta_attrs_at(const char *nodedir, long version, uint64_t when_ns, undofs_meta_record *record)
+{
+    undofs_meta_header header;
+    undofs_meta_record batch[256];
+    uint64_t end;
+    int retval = -1, saved_errno;
+
+    int fd = open_meta(nodedir, O_RDONLY);
+    if(fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if(read_header(fd, &header) != 0)
+        goto out;
+
+    // Newest first: the first change made by then wins. Failing that, the
+    // base record, which comes before all changes of the version.
+    retval = 0;
+    for(end = header.records; end > 0;)
+    {
+        uint64_t start = end > 256 ? end - 256 : 0, i;
+        size_t size = (end - start) * sizeof(undofs_meta_record);
+        if(sys_pread(fd, batch, size, sizeof(header) + start * sizeof(undofs_meta_record)) != (ssize_t) size)
+        {
+            errno = EIO;
+            retval = -1;
+            goto out;
+        }
+        for(i = end - start; i-- > 0;)
+        {
+            if(batch[i].version != version)
+                continue;
+            if(batch[i].kind == UNDOFS_META_ATTR && batch[i].logged_ns <= when_ns)
+            {
+                *record = batch[i];
+                retval = 1;
+                goto out;
+            }
+            if(batch[i].kind == UNDOFS_META_ATTR_BASE)
+            {
+                *record = batch[i];
+                retval = 1;
+            }
+        }
+        end = start;
+    }
+
+out:
+    saved_errno = errno;
+    sys_close(fd);
+    errno = saved_errno;
+    return retval;
+}
+
+int undofs_meta_log_hash(const char *nodedir, const undofs_meta_hash_record *record)
+{
+    undofs_meta_header header;
+    undofs_meta_hash_record entry = *record;
+    struct timespec now;
+    int retval = -1, saved_errno;
+    ssize_t written;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    entry.logged_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    entry.kind = UNDOFS_META_HASH;
+    entry.reserved = 0;
+
+    int fd = open_meta(nodedir, O_RDWR | O_CREAT);
+    if(fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&meta_lock);
+
+    if(read_header(fd, &header) != 0)
+        goto out;
+
+    // last_version is left alone: it decides when attribute changes need
+    // a base record, and hashing doesn't change any attributes.
+    written = sys_pwrite(fd, &entry, sizeof(entry), sizeof(header) + header.records * sizeof(undofs_meta_record));
+    if(written != sizeof(entry))
+    {
+        if(written >= 0)
+            errno = EIO;
+        goto out;
+    }
+    header.records++;
+    retval = write_header(fd, &header);
+
+out:
+    saved_errno = errno;
+    pthread_mutex_unlock(&meta_lock);
+    sys_close(fd);
+    errno = saved_errno;
+    return retval;
+}
+
+// Find the newest record of a kind for a data version. All records share
+// the layout of their first fields, so kind and version can be checked on
+// any of them.
+static int find_record(int fd, uint64_t records, uint32_t kind, long version,
+                       undofs_meta_record *record, uint64_t *index)
+{
+    undofs_meta_record batch[256];
+    uint64_t end;
+
+    // Newest first, in batches.
+    for(end = records; end > 0;)
+    {
+        uint64_t start = end > 256 ? end - 256 : 0, i;
+        size_t size = (end - start) * sizeof(undofs_meta_record);
+        if(sys_pread(fd, batch, size, sizeof(undofs_meta_header) + start * sizeof(undofs_meta_record)) != (ssize_t) size)
+        {
+            errno = EIO;
+            return -1;
+        }
+        for(i = end - start; i-- > 0;)
+        {
+            if(batch[i].kind == kind && batch[i].version == version)
+            {
+                *record = batch[i];
+                *index = start + i;
+                return 1;
+            }
+        }
+        end = start;
+    }
+    return 0;
+}
+
+typedef struct {
+    undofs_meta_hash_record record;
+    uint64_t index;         // in the log, which tells the latest apart
+} indexed_hash;
+
+static int by_version(const void *a, const void *b)
+{
+    const indexed_hash *x = a, *y = b;
+    if(x->record.version != y->record.version)
+        return x->record.version < y->record.version ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+int undofs_meta_read_hashes(const char *nodedir, undofs_meta_hash_record **records, size_t *count)
+{
+    undofs_meta_header header;
+    undofs_meta_record batch[256];
+    indexed_hash *found = NULL, *grown;
+    undofs_meta_hash_record *latest;
+    size_t found_count = 0, found_size = 0, i, kept;
+    uint64_t start, j;
+    int retval = -1, saved_errno;
+
+    *records = NULL;
+    *count = 0;
+    int fd = open_meta(nodedir, O_RDONLY);
+    if(fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    if(read_header(fd, &header) != 0)
+        goto out;
+    for(start = 0; start < header.records; start += 256)
+    {
+        uint64_t n = header.records - start < 256 ? header.records - start : 256;
+        size_t size = n * sizeof(undofs_meta_record);
+        if(sys_pread(fd, batch, size, sizeof(header) + start * sizeof(undofs_meta_record)) != (ssize_t) size)
+        {
+            errno = EIO;
+            goto out;
+        }
+        for(j = 0; j < n; j++)
+        {
+            if(batch[j].kind != UNDOFS_META_HASH)
+                continue;
+            if(found_count == found_size)
+            {
+                found_size = found_size ? found_size * 2 : 64;
+                grown = realloc(found, found_size * sizeof(*found));
+                if(grown == NULL)
+                    goto out;
+                found = grown;
+            }
+            memcpy(&found[found_count].record, &batch[j], sizeof(found->record));
+            found[found_count++].index = start + j;
+        }
+    }
+    retval = 0;
+    if(found_count == 0)
+        goto out;
+
+    // Keep the latest hash of each version.
+    qsort(found, found_count, sizeof(*found), by_version);
+    latest = malloc(found_count * sizeof(*latest));
+    if(latest == NULL)
+    {
+        retval = -1;
+        goto out;
+    }
+    for(i = 0, kept = 0; i < found_count; i++)
+    {
+        if(kept > 0 && latest[kept - 1].version == found[i].record.version)
+            kept--;
+        latest[kept++] = found[i].record;
+    }
+    *records = latest;
+    *count = kept;
+
+out:
+    saved_errno = errno;
+    free(found);
+    sys_close(fd);
+    errno = saved_errno;
+    return retval;
+}
+
+int undofs_meta_log_inline(const char *nodedir, long version, const struct stat *st, const void *data, size_t size)
+{
+    undofs_meta_header header;
+    undofs_meta_record records[1 + (UNDOFS_META_INLINE_LIMIT + UNDOFS_META_INLINE_CHUNK - 1) / UNDOFS_META_INLINE_CHUNK];
+    undofs_meta_inline_record *entry = (undofs_meta_inline_record *) &records[0];
+    struct timespec now;
+    size_t count = 1, offset;
+    int retval = -1, saved_errno;
+    ssize_t written;
+
+    if(size > UNDOFS_META_INLINE_LIMIT)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(records, 0, sizeof(records));
+    entry->version = version;
+    entry->logged_ns = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    entry->kind = UNDOFS_META_INLINE;
+    entry->mode = st->st_mode;
+    entry->uid = st->st_uid;
+    entry->gid = st->st_gid;
+    entry->mtime_ns = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    entry->size = size;
+    for(offset = 0; offset < size; offset += UNDOFS_META_INLINE_CHUNK)
+    {
+        undofs_meta_inline_data *chunk = (undofs_meta_inline_data *) &records[count++];
+        chunk->version = version;
+        chunk->offset = offset;
+        chunk->kind = UNDOFS_META_INLINE_DATA;
+        chunk->length = size - offset < UNDOFS_META_INLINE_CHUNK ? size - offset : UNDOFS_META_INLINE_CHUNK;
+        memcpy(chunk->data, (const char *) data + offset, chunk->length);
+    }
+
+    int fd = open_meta(nodedir, O_RDWR | O_CREAT);
+    if(fd < 0)
+        return -1;
+
+    pthread_mutex_lock(&meta_lock);
+
+    if(read_header(fd, &header) != 0)
+        goto out;
+
+    // Like hashes, inline versions leave last_version alone.
+    written = sys_pwrite(fd, records, count * sizeof(undofs_meta_record),
+                     sizeof(header) + header.records * sizeof(undofs_meta_record));
+    if(written != (ssize_t) (count * sizeof(undofs_meta_record)))
+    {
+        if(written >= 0)
+            errno = EIO;
+        goto out;
+    }
+    header.records += count;
+    retval = write_header(fd, &header);
+
+out:
+    saved_errno = errno;
+    pthread_mutex_unlock(&meta_lock);
+    sys_close(fd);
+    errno = saved_errno;
+    return retval;
+}
+
+int undofs_meta_read_inline(const char *nodedir, long version, undofs_meta_inline_record *record, void *buf, size_t size)
+{
+    undofs_meta_header header;
+    undofs_meta_record found;
+    undofs_meta_inline_data chunk;
+    uint64_t index, i, chunks;
+    int retval = -1, saved_errno;
+
+    int fd = open_meta(nodedir, O_RDONLY);
+    if(fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    if(read_header(fd, &header) != 0)
+        goto out;
+    retval = find_record(fd, header.records, UNDOFS_META_INLINE, version, &found, &index);
+    if(retval != 1)
+        goto out;
+    memcpy(record, &found, sizeof(*record));
+
+    // The contents follow the record, in order.
+    chunks = (record->size + UNDOFS_META_INLINE_CHUNK - 1) / UNDOFS_META_INLINE_CHUNK;
+    for(i = 0; i < chunks; i++)
+    {
+        off_t at = sizeof(header) + (index + 1 + i) * sizeof(undofs_meta_record);
+        if(index + 1 + i >= header.records
+           || sys_pread(fd, &chunk, sizeof(chunk), at) != sizeof(chunk)
+           || chunk.kind != UNDOFS_META_INLINE_DATA || chunk.version != version
+           || chunk.offset != i * UNDOFS_META_INLINE_CHUNK || chunk.length > UNDOFS_META_INLINE_CHUNK)
+        {
+            errno = EIO;
+            retval = -1;
+            goto out;
+        }
+        if(chunk.offset < size)
+            memcpy((char *) buf + chunk.offset, chunk.data,
+                   size - chunk.offset < chunk.length ? size - chunk.offset : chunk.length);
+    }
+
+out:
+    saved_errno = errno;
+    sys_close(fd);
+    errno = saved_errno;
+    return retval;
+}
+
+int undofs_meta_each_inline(const char *nodedir, undofs_meta_inline_fn fn, void *arg)
+{
+    undofs_meta_header header;
+    undofs_meta_record batch[256];
+    undofs_meta_inline_record current;
+    char data[UNDOFS_META_INLINE_LIMIT];
+    uint64_t start, i, got = 0;
+    int pending = 0, retval = -1, saved_errno;
+
+    int fd = open_meta(nodedir, O_RDONLY);
+    if(fd < 0)
+        return errno == ENOENT ? 0 : -1;
+
+    if(read_header(fd, &header) != 0)
+        goto out;
+
+    // The contents follow each version record in order, so one pass
+    // collects them. A version whose contents don't add up is skipped.
+    for(start = 0; start < header.records; start += 256)
+    {
+        uint64_t count = header.records - start < 256 ? header.records - start : 256;
+        size_t size = count * sizeof(undofs_meta_record);
+        if(sys_pread(fd, batch, size, sizeof(header) + start * sizeof(undofs_meta_record)) != (ssize_t) size)
+        {
+            errno = EIO;
+            goto out;
+        }
+        for(i = 0; i < count; i++)
+        {
+            if(batch[i].kind == UNDOFS_META_INLINE)
+            {
+                memcpy(&current, &batch[i], sizeof(current));
+                pending = current.size <= UNDOFS_META_INLINE_LIMIT;
+                got = 0;
+            }
+            else if(pending && batch[i].kind == UNDOFS_META_INLINE_DATA)
+            {
+                const undofs_meta_inline_data *chunk = (const undofs_meta_inline_data *) &batch[i];
+                if(chunk->version != current.version || chunk->offset != got
+                   || chunk->length > UNDOFS_META_INLINE_CHUNK || got + chunk->length > current.size)
+                {
+                    pending = 0;
+                    continue;
+                }
+                memcpy(data + got, chunk->data, chunk->length);
+                got += chunk->length;
+            }
+            else
+            {
+                pending = 0;
+                continue;
+            }
+
+            if(pending && got == current.size)
+            {
+                pending = 0;
+                if(fn(&current, data, arg) != 0)
+                {
+                    retval = 0;
+                    goto out;
+                }
+            }
+        }
+    }
+    retval = 0;
+
+out:
+    saved_errno = errno;
+    sys_close(fd);
+    errno = saved_errno;
+    return retval;
+}
+
+int undofs_meta_write_inline(int dirfd, const char *name, const undofs_meta_inline_record *record, const void *data)
+{
+    struct timespec times[2];
+    ssize_t written;
+    int saved_errno;
+
+    int fd = sys_openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, record->mode & 07777);
+    if(fd < 0)
+        return -1;
+
+    times[0].tv_sec = times[1].tv_sec = record->mtime_ns / 1000000000;
+    times[0].tv_nsec = times[1].tv_nsec = record->mtime_ns % 1000000000;
+    written = sys_write(fd, data, record->size);
+    if(written != (ssize_t) record->size)
+    {
+        if(written >= 0)
+            errno = EIO;
+        goto fail;
+    }
+    // Best effort on the owner, like cp -a: only root can give files away.
+    if((sys_fchown(fd, record->uid, record->gid) != 0 && errno != EPERM) || sys_futimens(fd, times) != 0)
+        goto fail;
+    if(sys_close(fd) != 0)
+    {
+        fd = -1;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    saved_errno = errno;
+    if(fd >= 0)
+        sys_close(fd);
+    sys_unlinkat(dirfd, name, 0);
+    errno = saved_errno;
+    return -1;
+}
+
+// Count the children of a directory node the way readdir shows them.
+static int count_children(const char *nodedir, long *live)
+{
+    undofs_dirscan scan;
+    const char *entry;
+    int saved_errno;
+    int dirfd = sys_open(nodedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd < 0)
+        return -1;
+    if(undofs_dirscan_start(&scan, dirfd) != 0)
+    {
+        sys_close(dirfd);
+        return -1;
+    }
+
+    uint32_t purge_gen = undofs_read_generation(dirfd, UNDOFS_PURGE_MARKER);
+
+    *live = 0;
+    while((entry = undofs_dirscan_next(&scan, NULL)) != NULL)
+    {
+        undofs_node_info info;
+        size_t len = strlen(entry);
+        if(len <= 5 || memcmp(entry + len - 5, ".node", 5) != 0)
+            continue;
+        if(undofs_scan_node(dirfd, entry, &info) != 0)
+            continue;
+        if(undofs_scan_purged(purge_gen, &info))
+            continue;
+        if(!info.deleted && (info.is_dir || info.latest >= 0))
+            (*live)++;
+    }
+    saved_errno = errno;
+
+    undofs_dirscan_end(&scan);
+    sys_close(dirfd);
+    errno = saved_errno;
+    return saved_errno ? -1 : 0;
+}
+
+enum children_update { CHILDREN_ADJUST, CHILDREN_RECOUNT, CHILDREN_RESET };
+
+// Decrements of one directory are collected here, so removing all files
+// of a directory one by one writes its header once instead of per file.
+// Only decrements wait: if they are lost the counter is too high, which
+// rmdir notices and repairs, while a lost increment would let it remove
+// a directory that isn't empty.
+static char pending_dir[PATH_MAX];
+static int pending_delta = 0;
+
+// Must be called with meta_lock held.
+static int update_children(const char *nodedir, int delta, int how, long *live)
+{
+    undofs_meta_header header;
+    int retval = -1, saved_errno;
+
+    int fd = open_meta(nodedir, O_RDWR | O_CREAT);
+    if(fd < 0)
+        return -1;
+
+    if(read_header(fd, &header) != 0)
+        goto out;
+
+    if(how == CHILDREN_RESET)
+    {
+        header.live_children = 0;
+        header.flags |= UNDOFS_META_CHILDREN_COUNTED;
+    }
+    else if(how == CHILDREN_ADJUST && (header.flags & UNDOFS_META_CHILDREN_COUNTED))
+    {
+        if(delta == 0)
+        {
+            retval = 0;
+            goto out;
+        }
+        header.live_children += delta;
+        if(header.live_children < 0)
+            header.live_children = 0;
+    } else {
+        // The change has already been made on disk, so counting includes it.
+        long counted;
+        if(count_children(nodedir, &counted) != 0)
+            goto out;
+        header.live_children = counted;
+        header.flags |= UNDOFS_META_CHILDREN_COUNTED;
+    }
+    retval = write_header(fd, &header);
+
+out:
+    saved_errno = errno;
+    sys_close(fd);
+    if(live && retval == 0)
+        *live = header.live_children;
+    errno = saved_errno;
+    return retval;
+}
+
+// Take the pending decrements of nodedir, or write out those of another
+// directory. Must be called with meta_lock held.
+static int take_pending(const char *nodedir)
+{
+    int delta = 0;
+    if(pending_delta == 0)
+        return 0;
+
+    if(nodedir != NULL && strcmp(pending_dir, nodedir) == 0)
+        delta = pending_delta;
+    else
+        update_children(pending_dir, pending_delta, CHILDREN_ADJUST, NULL);
+    pending_delta = 0;
+    return delta;
+}
+
+static int children(const char *nodedir, int delta, int how, long *live)
+{
+    int retval;
+    pthread_mutex_lock(&meta_lock);
+    delta += take_pending(nodedir);
+    retval = update_children(nodedir, delta, how, live);
+    pthread_mutex_unlock(&meta_lock);
+    return retval;
+}
+
+int undofs_meta_live_children(const char *nodedir, long *live, int recount)
+{
+    return children(nodedir, 0, recount ? CHILDREN_RECOUNT : CHILDREN_ADJUST, live);
+}
+
+int undofs_meta_reset_children(const char *nodedir)
+{
+    return children(nodedir, 0, CHILDREN_RESET, NULL);
+}
+
+int undofs_meta_adjust_children(const char *nodedir, int delta)
+{
+    if(delta >= 0)
+        return children(nodedir, delta, CHILDREN_ADJUST, NULL);
+
+    pthread_mutex_lock(&meta_lock);
+    if(pending_delta == 0 || strcmp(pending_dir, nodedir) != 0)
+    {
+        take_pending(NULL);
+        if(snprintf(pending_dir, PATH_MAX, "%s", nodedir) >= PATH_MAX)
+        {
+            pthread_mutex_unlock(&meta_lock);
+            return children(nodedir, delta, CHILDREN_ADJUST, NULL);
+        }
+    }
+    pending_delta += delta;
+    pthread_mutex_unlock(&meta_lock);
+    return 0;
+}
+
+void undofs_meta_flush()
+{
+    pthread_mutex_lock(&meta_lock);
+    take_pending(NULL);
+    pthread_mutex_unlock(&meta_lock);
+}
@@ -0,0 +1,274 @@
+#ifndef __UNDOFS_META_H_
+#define __UNDOFS_META_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Node metadata.
+ *
+ * Every node directory can hold a "meta" file: a fixed header followed by
+ * an append-only log of records.  Attribute changes (chmod, chown, utime)
+ * are applied to the latest version in place, and logged here as
+ * metadata versions that refer to the data version they were made on.
+ * That keeps old modes, owners and times restorable without copying data.
+ * Directory nodes also keep their number of live children in the header,
+ * so emptiness can be checked without listing them.  The scrubber logs
+ * content hashes of data versions here as well, and tiny data versions
+ * can be moved in here once they are superseded, so they don't keep an
+ * inode each.
+ *
+ * Nothing in here depends on fuse.
+ */
+
+#define UNDOFS_META_NAME "meta"
+#define UNDOFS_META_MAGIC "UNDOMETA"
+#define UNDOFS_META_FORMAT 1
+
+enum undofs_meta_kind {
+    UNDOFS_META_ATTR_BASE = 1, // attributes of a data version before its first change
+    UNDOFS_META_ATTR = 2,      // attributes after a change
+    UNDOFS_META_HASH = 3,      // content hash of a data version, see undofs_meta_hash_record
+    UNDOFS_META_INLINE = 4,    // a data version stored inline, see undofs_meta_inline_record
+    UNDOFS_META_INLINE_DATA = 5, // its contents, see undofs_meta_inline_data
+};
+
+#define UNDOFS_META_INLINE_CHUNK 24
+#define UNDOFS_META_INLINE_LIMIT 4096   // largest data version that can be stored inline
+
+enum undofs_meta_flags {
+    UNDOFS_META_CHILDREN_COUNTED = 1, // live_children is valid
+};
+
+/**
+ * Meta file header, 64 bytes.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t record_size;
+    uint64_t records;       // number of records following the header
+    int64_t last_version;   // data version of the last attribute record
+    int64_t live_children;  // directories: children that aren't deleted
+    uint64_t flags;         // enum undofs_meta_flags
+    uint64_t reserved[2];
+} undofs_meta_header;
+
+/**
+ * A metadata version, 48 bytes.
+ */
+typedef struct {
+    int64_t version;        // data version these attributes apply to, -1 for directories
+    uint64_t logged_ns;     // wall clock time of the change
+    uint32_t kind;          // enum undofs_meta_kind
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime_ns;
+    int64_t mtime_ns;
+} undofs_meta_record;
+
+/**
+ * A content hash, 48 bytes like the other records. It only holds while
+ * the version still has the size and mtime it had when it was hashed.
+ */
+typedef struct {
+    int64_t version;        // data version that was hashed
+    uint64_t logged_ns;     // wall clock time of the hash
+    uint32_t kind;          // UNDOFS_META_HASH
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t hash;
+} undofs_meta_hash_record;
+
+/**
+ * A data version stored inline, 48 bytes. Its contents follow in
+ * UNDOFS_META_INLINE_DATA records.
+ */
+typedef struct {
+    int64_t version;        // data version stored here
+    uint64_t logged_ns;     // wall clock time it was moved in
+    uint32_t kind;          // UNDOFS_META_INLINE
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t mtime_ns;
+    uint32_t size;          // of the contents
+    uint32_t reserved;
+} undofs_meta_inline_record;
+
+/**
+ * A piece of the contents of an inline data version, 48 bytes.
+ */
+typedef struct {
+    int64_t version;
+    uint64_t offset;        // in the contents
+    uint32_t kind;          // UNDOFS_META_INLINE_DATA
+    uint32_t length;
+    char data[UNDOFS_META_INLINE_CHUNK];
+} undofs_meta_inline_data;
+
+/**
+ * Log an attribute change of a node.
+ * The first change made to a data version also logs the attributes it had
+ * before, so the log holds every state the version has been in.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node directory, as returned by undofs_versiondir_path().
+ * @param version the data version that was changed, -1 for directories.
+ * @param before the attributes before the change.
+ * @param after the attributes after the change.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_log_attrs(const char *nodedir, long version, const struct stat *before, const struct stat *after);
+
+/**
+ * Find the attributes a data version had at a given time, from the log.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node directory, as returned by undofs_versiondir_path().
+ * @param version the data version, -1 for directories.
+ * @param when_ns the time, in wall clock nanoseconds.
+ * @param record receives the attributes: those after the last change made
+ *               by then, or those before the first change if none was.
+ * @return 1 if found, 0 if the attributes of the version were never changed, -1 on failure.
+ */
+int undofs_meta_attrs_at(const char *nodedir, long version, uint64_t when_ns, undofs_meta_record *record);
+
+/**
+ * Log the content hash of a data version.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node directory, as returned by undofs_versiondir_path().
+ * @param record the hash, with version, size, mtime_ns and hash filled in.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_log_hash(const char *nodedir, const undofs_meta_hash_record *record);
+
+/**
+ * Read the latest content hash logged for each data version of a node, in
+ * one pass over the meta file.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node directory, as returned by undofs_versiondir_path().
+ * @param records receives the hashes sorted by version, to be freed by the caller. NULL if there are none.
+ * @param count receives the number of hashes.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_read_hashes(const char *nodedir, undofs_meta_hash_record **records, size_t *count);
+
+/**
+ * Store a data version inline. The version file can be removed afterwards.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node directory, as returned by undofs_versiondir_path().
+ * @param version the data version.
+ * @param st the attributes of the version file.
+ * @param data the contents.
+ * @param size the size of the contents, at most UNDOFS_META_INLINE_LIMIT.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_log_inline(const char *nodedir, long version, const struct stat *st, const void *data, size_t size);
+
+/**
+ * Read a data version stored inline.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node directory, as returned by undofs_versiondir_path().
+ * @param version the data version.
+ * @param record receives its attributes.
+ * @param buf receives the contents, up to size bytes.
+ * @param size the size of buf.
+ * @return 1 if the version is stored inline, 0 if not, -1 on failure.
+ */
+int undofs_meta_read_inline(const char *nodedir, long version, undofs_meta_inline_record *record, void *buf, size_t size);
+
+/**
+ * Called for each data version stored inline, see undofs_meta_each_inline().
+ * @param record the attributes of the version.
+ * @param data its contents, record->size bytes.
+ * @param arg as passed to undofs_meta_each_inline().
+ * @return 0 to go on, non-zero to stop.
+ */
+typedef int (*undofs_meta_inline_fn)(const undofs_meta_inline_record *record, const void *data, void *arg);
+
+/**
+ * Go through the data versions stored inline in a node, oldest first.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node directory.
+ * @param fn called for each version.
+ * @param arg passed on to fn.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_each_inline(const char *nodedir, undofs_meta_inline_fn fn, void *arg);
+
+/**
+ * Write a data version stored inline out to a file of its own, with the
+ * mode, owner and mtime it had. The file must not exist yet.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param dirfd directory to resolve name against, or AT_FDCWD.
+ * @param name the file to create.
+ * @param record the attributes of the version.
+ * @param data its contents.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_write_inline(int dirfd, const char *name, const undofs_meta_inline_record *record, const void *data);
+
+/**
+ * Get the number of live children of a directory node.
+ * Stores that predate the counters are counted once, and the result is kept.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the directory node.
+ * @param live receives the number of children that aren't deleted.
+ * @param recount non-zero to ignore the stored counter and count again.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_live_children(const char *nodedir, long *live, int recount);
+
+/**
+ * Adjust the live children counter of a directory node, after a child was
+ * created, deleted or undeleted on disk.
+ * Decrements of the same directory are batched in memory until another
+ * directory is updated or undofs_meta_flush() is called.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the directory node.
+ * @param delta the change in live children.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_adjust_children(const char *nodedir, int delta);
+
+/**
+ * Mark a directory node as having no live children, because all of them
+ * were deleted at once.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the directory node.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_meta_reset_children(const char *nodedir);
+
+/**
+ * Write out counter updates that are still held in memory.
+ * Call before renaming a directory node, and when unmounting.
+ */
+void undofs_meta_flush();
+
+#endif
@@ -0,0 +1,690 @@
+#include "undofs_mirror.h"
+#include "undofs_clone.h"
+#include "undofs_meta.h"
+#include "undofs_scan.h"
+#include "undofs_util.h"
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+// The thread has no fuse context, so nothing in here may use PRIVATE_DATA.
+// Logging is fine, the log file is open long before the thread starts.
+
+#define CLEAN_MARKER "mirror.clean"
+
+enum mirror_kind {
+    MIRROR_NODE,            // the node directory and everything in it
+    MIRROR_COUNTS,          // just the meta file and times of a directory node
+    MIRROR_RENAME,
+};
+
+typedef struct mirror_event {
+    struct mirror_event *next;
+    uint64_t queued_ns;
+    int kind;               // enum mirror_kind
+    char *path;             // relative to both roots, "" for the root
+    char *newpath;          // for renames, NULL otherwise
+} mirror_event;
+
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mirror_wakeup = PTHREAD_COND_INITIALIZER;
+static mirror_event *queue_head = NULL, *queue_tail = NULL;
+static size_t queued = 0;
+static int running = 0, stopping = 0, resync = 0;
+static uint64_t busy_since_ns = 0;  // queue time of the work in progress, 0 when idle
+static pthread_t mirror_thread;
+
+static char *source_root = NULL, *mirror_root = NULL;
+static size_t source_len;
+static int srcfd = -1, dstfd = -1;
+
+static struct {
+    unsigned long long applied, copied, reflinked, bytes, errors, resyncs;
+} stats;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Paths relative to a root fd, where the root itself is "".
+static const char *at(const char *rel)
+{
+    return rel[0] ? rel : ".";
+}
+
+static void parent_of(char *parent, const char *rel)
+{
+    const char *slash = strrchr(rel, '/');
+    size_t len = slash ? (size_t) (slash - rel) : 0;
+    memcpy(parent, rel, len);
+    parent[len] = 0;
+}
+
+static int is_node_name(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 5 && strcmp(name + len - 5, ".node") == 0;
+}
+
+// Versions, the meta file and the markers; not the log or the template.
+static int is_mirrored_file(const char *name)
+{
+    return undofs_parse_version(name) >= 0 || strcmp(name, "meta") == 0 || strcmp(name, "dir") == 0
+        || strcmp(name, "deleted") == 0 || strcmp(name, UNDOFS_PURGE_MARKER) == 0
+        || strcmp(name, UNDOFS_BORN_MARKER) == 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+static int remove_tree(const char *rel)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", mirror_root, rel);
+    return nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int same_times(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Share the extents when the mirror is on the same filesystem, copy
+// otherwise. The copy goes to a temporary name first, so a crash never
+// leaves a torn version in the mirror.
+static int copy_regular(int sfd, int dfd, const char *rel, const char *name, const char *tmp,
+                        const struct stat *st)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    int in, out;
+
+    in = openat(sfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if(in < 0)
+        return errno == ENOENT ? 0 : -1;
+    out = openat(dfd, tmp, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, st->st_mode & 07777);
+    if(out < 0)
+    {
+        close(in);
+        return -1;
+    }
+    if(ioctl(out, FICLONE, in) == 0)
+    {
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        int retval = 0;
+        if(fchown(out, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+            retval = -1;
+        else if(fchmod(out, st->st_mode & 07777) != 0 || futimens(out, times) != 0)
+            retval = -1;
+        close(in);
+        if(close(out) != 0)
+            retval = -1;
+        if(retval == 0)
+            __atomic_add_fetch(&stats.reflinked, 1, __ATOMIC_RELAXED);
+        return retval;
+    }
+    close(in);
+    close(out);
+    unlinkat(dfd, tmp, 0);
+
+    snprintf(src, PATH_MAX, "%s/%s%s%s", source_root, rel, rel[0] ? "/" : "", name);
+    snprintf(dst, PATH_MAX, "%s/%s%s%s", mirror_root, rel, rel[0] ? "/" : "", tmp);
+    if(undofs_clone(src, dst, 1) != 0)
+        return errno == ENOENT ? 0 : -1;
+    __atomic_add_fetch(&stats.bytes, st->st_size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int sync_file(int sfd, int dfd, const char *rel, const char *name)
+{
+    struct stat st, mst;
+    char tmp[NAME_MAX + 1];
+    int retval = 0;
+
+    if(fstatat(sfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return errno == ENOENT ? 0 : -1;
+
+    // These markers mean something by existing, there is nothing to update.
+    if((strcmp(name, "deleted") == 0 || strcmp(name, "dir") == 0)
+       && faccessat(dfd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+        return 0;
+
+    if(fstatat(dfd, name, &mst, AT_SYMLINK_NOFOLLOW) == 0
+       && (st.st_mode & S_IFMT) == (mst.st_mode & S_IFMT)
+       && st.st_size == mst.st_size && same_times(&st.st_mtim, &mst.st_mtim))
+    {
+        // Only the attributes can have changed.
+        if(! S_ISLNK(st.st_mode) && st.st_mode != mst.st_mode
+           && fchmodat(dfd, name, st.st_mode & 07777, 0) != 0)
+            return -1;
+        if((st.st_uid != mst.st_uid || st.st_gid != mst.st_gid)
+           && fchownat(dfd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0 && errno != EPERM)
+            return -1;
+        return 0;
+    }
+
+    // Deleted markers share an inode in the mirror too.
+    if(strcmp(name, "deleted") == 0 && st.st_nlink > 1)
+    {
+        unlinkat(dfd, name, 0);
+        if(linkat(dstfd, "marker.template", dfd, name, 0) == 0)
+            return 0;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    unlinkat(dfd, tmp, 0);
+    if(S_ISREG(st.st_mode))
+        retval = copy_regular(sfd, dfd, rel, name, tmp, &st);
+    else if(S_ISLNK(st.st_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t len = readlinkat(sfd, name, target, sizeof(target) - 1);
+        if(len < 0)
+            return errno == ENOENT ? 0 : -1;
+        target[len] = 0;
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if(symlinkat(target, dfd, tmp) != 0)
+            return -1;
+        fchownat(dfd, tmp, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dfd, tmp, times, AT_SYMLINK_NOFOLLOW);
+    } else {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if(mknodat(dfd, tmp, st.st_mode, st.st_rdev) != 0)
+            return -1;
+        fchownat(dfd, tmp, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+        utimensat(dfd, tmp, times, AT_SYMLINK_NOFOLLOW);
+    }
+    if(retval != 0 || faccessat(dfd, tmp, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+        return retval;
+    if(renameat(dfd, tmp, dfd, name) != 0)
+        return -1;
+    __atomic_add_fetch(&stats.copied, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Versions that moved into the meta file of their source node stay in the
+// mirror as version files, so it reads like the store did before.
+typedef struct {
+    int dfd;
+    long *versions;         // all of them, files or not
+    size_t count, size;
+    int failed;             // on allocation failure the list is incomplete
+} inline_sync;
+
+static int sync_inline(const undofs_meta_inline_record *record, const void *data, void *arg)
+{
+    inline_sync *in = arg;
+    char name[32], tmp[40];
+
+    if(in->count == in->size)
+    {
+        size_t size = in->size ? in->size * 2 : 64;
+        long *grown = realloc(in->versions, size * sizeof(long));
+        if(grown == NULL)
+        {
+            in->failed = 1;
+            return 1;
+        }
+        in->versions = grown;
+        in->size = size;
+    }
+    in->versions[in->count++] = record->version;
+
+    snprintf(name, sizeof(name), "%" PRId64, record->version);
+    if(faccessat(in->dfd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+        return 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    unlinkat(in->dfd, tmp, 0);
+    if(undofs_meta_write_inline(in->dfd, tmp, record, data) != 0 || renameat(in->dfd, tmp, in->dfd, name) != 0)
+    {
+        LOG_ERROR("Failed to mirror inline version %s", name);
+        unlinkat(in->dfd, tmp, 0);
+        return 0;
+    }
+    __atomic_add_fetch(&stats.copied, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.bytes, record->size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static int is_inline(const inline_sync *in, long version)
+{
+    size_t i;
+    if(in->failed)
+        return 1;
+    for(i = 0; i < in->count; i++)
+        if(in->versions[i] == version)
+            return 1;
+    return 0;
+}
+
+// Creating entries in a mirror directory bumps its mtime, and directories
+// report the times of their node.
+static void copy_dir_times(const char *rel)
+{
+    struct stat st;
+    if(fstatat(srcfd, at(rel), &st, 0) == 0)
+    {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        utimensat(dstfd, at(rel), times, 0);
+    }
+}
+
+// Bring one node directory of the mirror up to date. With deep, its child
+// nodes too, and child nodes that no longer exist are removed.
+static int sync_node(const char *rel, int deep)
+{
+    undofs_dirscan scan;
+    const char *name;
+    char parent[PATH_MAX], child[PATH_MAX], nodedir[PATH_MAX];
+    inline_sync inlined = { -1, NULL, 0, 0, 0 };
+    struct stat st;
+    int sfd, dfd, retval = 0;
+
+    if(fstatat(srcfd, at(rel), &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return errno == ENOENT ? 0 : -1;   // renamed away, the rename follows
+    if(! S_ISDIR(st.st_mode))
+        return 0;
+
+    if(rel[0])
+    {
+        parent_of(parent, rel);
+        if(faccessat(dstfd, at(parent), F_OK, AT_SYMLINK_NOFOLLOW) != 0 && sync_node(parent, 0) != 0)
+            return -1;
+        if(mkdirat(dstfd, rel, st.st_mode & 07777) != 0 && errno != EEXIST)
+            return -1;
+    }
+
+    sfd = openat(srcfd, at(rel), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if(sfd < 0)
+        return errno == ENOENT ? 0 : -1;
+    dfd = openat(dstfd, at(rel), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if(dfd < 0)
+    {
+        close(sfd);
+        return -1;
+    }
+
+    if(undofs_dirscan_start(&scan, sfd) != 0)
+        retval = -1;
+    else {
+        while((name = undofs_dirscan_next(&scan, NULL)) != NULL)
+        {
+            if(is_mirrored_file(name))
+            {
+                if(sync_file(sfd, dfd, rel, name) != 0)
+                {
+                    LOG_ERROR("Failed to mirror %s/%s", rel, name);
+                    retval = -1;
+                }
+            }
+            else if(deep && is_node_name(name))
+            {
+                snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name);
+                if(sync_node(child, 1) != 0)
+                    retval = -1;
+            }
+        }
+        if(errno != 0)
+            retval = -1;
+        undofs_dirscan_end(&scan);
+    }
+
+    inlined.dfd = dfd;
+    snprintf(nodedir, PATH_MAX, "%s%s%s", source_root, rel[0] ? "/" : "", rel);
+    if(undofs_meta_each_inline(nodedir, sync_inline, &inlined) != 0)
+    {
+        LOG_ERROR("Failed to read the inline versions of %s", nodedir);
+        inlined.failed = 1;
+        retval = -1;
+    }
+
+    // Markers can go away, e.g. when a file is undeleted, and versions
+    // when they are stored inline.
+    if(undofs_dirscan_start(&scan, dfd) == 0)
+    {
+        while((name = undofs_dirscan_next(&scan, NULL)) != NULL)
+        {
+            int mirrored = is_mirrored_file(name), node = deep && is_node_name(name);
+            size_t len = strlen(name);
+            int tmp = len > 4 && strcmp(name + len - 4, ".tmp") == 0;
+            if((! mirrored && ! node && ! tmp) || (rel[0] == 0 && strcmp(name, CLEAN_MARKER) == 0))
+                continue;
+            if(! tmp && faccessat(sfd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+                continue;
+            if(undofs_parse_version(name) >= 0 && is_inline(&inlined, undofs_parse_version(name)))
+                continue;
+            snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name);
+            if(node ? remove_tree(child) : unlinkat(dfd, name, 0))
+            {
+                LOG_ERROR("Failed to remove %s from the mirror", child);
+                retval = -1;
+            }
+        }
+        undofs_dirscan_end(&scan);
+    }
+
+    free(inlined.versions);
+    close(sfd);
+    close(dfd);
+    copy_dir_times(rel);
+    if(rel[0])
+        copy_dir_times(parent);
+    return retval;
+}
+
+// After a child was created or deleted, only the live children counter in
+// the meta file and the times changed. Listing a large directory for that
+// would be a waste.
+static int sync_counts(const char *rel)
+{
+    int sfd, dfd, retval;
+
+    if(faccessat(dstfd, at(rel), F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+        return sync_node(rel, 0);
+
+    sfd = openat(srcfd, at(rel), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if(sfd < 0)
+        return errno == ENOENT ? 0 : -1;
+    dfd = openat(dstfd, at(rel), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if(dfd < 0)
+    {
+        close(sfd);
+        return -1;
+    }
+    retval = sync_file(sfd, dfd, rel, "meta");
+    close(sfd);
+    close(dfd);
+    copy_dir_times(rel);
+    return retval;
+}
+
+static int apply_rename(const char *rel, const char *newrel)
+{
+    char parent[PATH_MAX], newparent[PATH_MAX];
+
+    parent_of(parent, rel);
+    parent_of(newparent, newrel);
+
+    // Nothing to move if the mirror never saw the old directory.
+    if(faccessat(dstfd, rel, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+        return sync_node(newrel, 1);
+
+    if(faccessat(dstfd, at(newparent), F_OK, AT_SYMLINK_NOFOLLOW) != 0 && sync_node(newparent, 0) != 0)
+        return -1;
+    if(renameat(dstfd, rel, dstfd, newrel) != 0)
+    {
+        // Replacing a directory replaces its history, like in the store.
+        if((errno != ENOTEMPTY && errno != EEXIST) || remove_tree(newrel) != 0
+           || renameat(dstfd, rel, dstfd, newrel) != 0)
+            return -1;
+    }
+    return sync_node(newrel, 0) | sync_counts(parent) | sync_counts(newparent);
+}
+
+static void free_event(mirror_event *event)
+{
+    free(event->path);
+    free(event->newpath);
+    free(event);
+}
+
+// Call with mirror_lock held.
+static void drop_queue()
+{
+    while(queue_head != NULL)
+    {
+        mirror_event *next = queue_head->next;
+        free_event(queue_head);
+        queue_head = next;
+    }
+    queue_tail = NULL;
+    queued = 0;
+}
+
+static void *mirror_main(void *arg)
+{
+    pthread_mutex_lock(&mirror_lock);
+    for(;;)
+    {
+        mirror_event *event;
+        int retval;
+
+        while(queue_head == NULL && ! resync && ! stopping)
+            pthread_cond_wait(&mirror_wakeup, &mirror_lock);
+
+        if(resync)
+        {
+            // The walk covers everything queued before it.
+            resync = 0;
+            drop_queue();
+            busy_since_ns = monotonic_ns();
+            pthread_mutex_unlock(&mirror_lock);
+
+            LOG("Mirroring the whole store to %s.", mirror_root);
+            retval = sync_node("", 1);
+            __atomic_add_fetch(&stats.resyncs, 1, __ATOMIC_RELAXED);
+            if(retval != 0)
+                __atomic_add_fetch(&stats.errors, 1, __ATOMIC_RELAXED);
+
+            pthread_mutex_lock(&mirror_lock);
+            busy_since_ns = 0;
+            continue;
+        }
+
+        event = queue_head;
+        if(event == NULL)
+            break;  // stopping, and nothing left to do
+        queue_head = event->next;
+        if(queue_head == NULL)
+            queue_tail = NULL;
+        queued--;
+        busy_since_ns = event->queued_ns;
+        pthread_mutex_unlock(&mirror_lock);
+
+        if(event->kind == MIRROR_RENAME)
+            retval = apply_rename(event->path, event->newpath);
+        else if(event->kind == MIRROR_COUNTS)
+            retval = sync_counts(event->path);
+        else
+            retval = sync_node(event->path, 0);
+        if(retval != 0)
+        {
+            LOG_ERROR("Failed to mirror %s", event->path);
+            __atomic_add_fetch(&stats.errors, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&stats.applied, 1, __ATOMIC_RELAXED);
+        free_event(event);
+
+        pthread_mutex_lock(&mirror_lock);
+        busy_since_ns = 0;
+    }
+    pthread_mutex_unlock(&mirror_lock);
+    return NULL;
+}
+
+int undofs_mirror_start(const char *rootdir, const char *mirrordir)
+{
+    int fd;
+
+    if(mkdir(mirrordir, 0755) != 0 && errno != EEXIST)
+    {
+        LOG_ERROR("Failed to create the mirror %s", mirrordir);
+        return -1;
+    }
+    srcfd = open(rootdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dstfd = open(mirrordir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(srcfd < 0 || dstfd < 0)
+    {
+        LOG_ERROR("Failed to open the store or the mirror %s", mirrordir);
+        return -1;
+    }
+    source_root = strdup(rootdir);
+    mirror_root = strdup(mirrordir);
+    source_len = strlen(rootdir);
+
+    fd = openat(dstfd, "marker.template", O_CREAT | O_WRONLY | O_CLOEXEC, S_IRUSR);
+    if(fd >= 0)
+        close(fd);
+
+    // Without a clean stop, changes may have been lost on the way.
+    if(unlinkat(dstfd, CLEAN_MARKER, 0) != 0)
+        resync = 1;
+
+    stopping = 0;
+    if(pthread_create(&mirror_thread, NULL, mirror_main, NULL) != 0)
+    {
+        LOG_ERROR("Failed to start the mirror thread");
+        return -1;
+    }
+    running = 1;
+    LOG("Mirroring the store to %s.", mirrordir);
+    return 0;
+}
+
+void undofs_mirror_stop()
+{
+    int fd;
+
+    if(! running)
+        return;
+
+    pthread_mutex_lock(&mirror_lock);
+    stopping = 1;
+    pthread_cond_signal(&mirror_wakeup);
+    pthread_mutex_unlock(&mirror_lock);
+    pthread_join(mirror_thread, NULL);
+    running = 0;
+
+    if(stats.errors == 0)
+    {
+        fd = openat(dstfd, CLEAN_MARKER, O_CREAT | O_WRONLY | O_CLOEXEC, S_IRUSR);
+        if(fd >= 0)
+            close(fd);
+    }
+    syncfs(dstfd);
+    close(srcfd);
+    close(dstfd);
+}
+
+int undofs_mirror_enabled()
+{
+    return running;
+}
+
+static void enqueue(int kind, const char *nodedir, const char *newnodedir)
+{
+    mirror_event *event;
+    const char *rel = nodedir + source_len, *newrel = newnodedir ? newnodedir + source_len : NULL;
+
+    if(! running || strncmp(nodedir, source_root, source_len) != 0
+       || (newnodedir && strncmp(newnodedir, source_root, source_len) != 0))
+        return;
+    while(*rel == '/')
+        rel++;
+    while(newrel && *newrel == '/')
+        newrel++;
+
+    pthread_mutex_lock(&mirror_lock);
+    // Consecutive changes to one node are applied in one go.
+    if(kind != MIRROR_RENAME && queue_tail != NULL && queue_tail->kind == kind
+       && strcmp(queue_tail->path, rel) == 0)
+    {
+        pthread_mutex_unlock(&mirror_lock);
+        return;
+    }
+    if(queued >= UNDOFS_MIRROR_QUEUE)
+    {
+        // Walking the store is cheaper than an unbounded backlog.
+        if(! resync)
+            LOG("Mirror queue overflowed, the whole store will be mirrored again.");
+        drop_queue();
+        resync = 1;
+        pthread_cond_signal(&mirror_wakeup);
+        pthread_mutex_unlock(&mirror_lock);
+        return;
+    }
+
+    event = malloc(sizeof(mirror_event));
+    if(event == NULL || (event->path = strdup(rel)) == NULL)
+    {
+        free(event);
+        resync = 1;
+        pthread_mutex_unlock(&mirror_lock);
+        return;
+    }
+    event->kind = kind;
+    event->newpath = newrel ? strdup(newrel) : NULL;
+    event->next = NULL;
+    event->queued_ns = monotonic_ns();
+    if(queue_tail)
+        queue_tail->next = event;
+    else
+        queue_head = event;
+    queue_tail = event;
+    queued++;
+    pthread_cond_signal(&mirror_wakeup);
+    pthread_mutex_unlock(&mirror_lock);
+}
+
+void undofs_mirror_node(const char *nodedir)
+{
+    enqueue(MIRROR_NODE, nodedir, NULL);
+}
+
+void undofs_mirror_parent(const char *nodedir)
+{
+    char parent[PATH_MAX];
+    if(! running)
+        return;
+    parent_of(parent, nodedir);
+    enqueue(MIRROR_COUNTS, parent, NULL);
+}
+
+void undofs_mirror_rename(const char *nodedir, const char *newnodedir)
+{
+    enqueue(MIRROR_RENAME, nodedir, newnodedir);
+}
+
+size_t undofs_mirror_stats(char *buf, size_t size)
+{
+    uint64_t oldest, lag_ns = 0;
+    size_t pending;
+    int len;
+
+    pthread_mutex_lock(&mirror_lock);
+    oldest = busy_since_ns;
+    if(oldest == 0 && queue_head != NULL)
+        oldest = queue_head->queued_ns;
+    if(oldest != 0)
+        lag_ns = monotonic_ns() - oldest;
+    pending = queued;
+    pthread_mutex_unlock(&mirror_lock);
+
+    len = snprintf(buf, size,
+                   "mirror_enabled %d\n"
+                   "mirror_lag_ms %llu\n"
+                   "mirror_queued %zu\n"
+                   "mirror_applied %llu\n"
+                   "mirror_copied %llu\n"
+                   "mirror_copied_bytes %llu\n"
+                   "mirror_reflinked %llu\n"
+                   "mirror_resyncs %llu\n"
+                   "mirror_errors %llu\n",
+                   running, (unsigned long long) (lag_ns / 1000000), pending,
+                   stats.applied, stats.copied, stats.bytes, stats.reflinked,
+                   stats.resyncs, stats.errors);
+    return len < 0 ? 0 : (size_t) len >= size ? size - 1 : (size_t) len;
+}
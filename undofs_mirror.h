@@ -0,0 +1,78 @@
+#ifndef __UNDOFS_MIRROR_H_
+#define __UNDOFS_MIRROR_H_
+#include "config.h"
+
+#include <stddef.h>
+
+/*
+ * Asynchronous mirroring of the store to a second directory, usually on
+ * another disk, as a warm standby.
+ *
+ * Operations queue the node directories they changed, and a background
+ * thread brings the same nodes up to date in the mirror: versions and meta
+ * files are reflinked or copied when their size or mtime differ, markers
+ * follow the store, and node directory times are copied as well since the
+ * subtree delete depends on them. Directory renames are replayed as
+ * renames.
+ *
+ * Files are queued when they are released or fsynced, so data written
+ * to an open file reaches the mirror at the next fsync or the last close,
+ * not with every write.
+ *
+ * The queue is bounded. When it overflows, or when the mirror wasn't
+ * stopped cleanly, the thread walks the whole store instead.
+ *
+ * Child counter decrements that undofs_meta still batches in memory reach
+ * the mirror with the next change to the same directory. Until then the
+ * mirror's counter is too high, which rmdir double-checks anyway.
+ */
+
+#define UNDOFS_MIRROR_QUEUE 65536
+
+/**
+ * Start the mirror thread.
+ * @param rootdir the store root.
+ * @param mirrordir the mirror root, created if needed.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_mirror_start(const char *rootdir, const char *mirrordir);
+
+/**
+ * Apply everything still queued, and stop the mirror thread.
+ */
+void undofs_mirror_stop();
+
+/**
+ * @return non-zero when the store is being mirrored.
+ */
+int undofs_mirror_enabled();
+
+/**
+ * Queue a node directory for mirroring. Does nothing when mirroring is off.
+ * @param nodedir the node path, as returned by undofs_versiondir_path().
+ */
+void undofs_mirror_node(const char *nodedir);
+
+/**
+ * Queue the live children counter of the directory containing a node,
+ * after the node was created, deleted or undeleted.
+ * @param nodedir the node path, as returned by undofs_versiondir_path().
+ */
+void undofs_mirror_parent(const char *nodedir);
+
+/**
+ * Queue the rename of a directory node.
+ * @param nodedir the old node path.
+ * @param newnodedir the new node path.
+ */
+void undofs_mirror_rename(const char *nodedir, const char *newnodedir);
+
+/**
+ * Describe the state of the mirror, one "name value" pair per line.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_mirror_stats(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,433 @@
+#include "undofs_opwrap.h"
+#include "undofs_capture.h"
+#include "undofs_ctl.h"
+#include "undofs_span.h"
+#include "undofs_syscount.h"
+#include "undofs_trace.h"
+#include "undofs_util.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct fuse_operations *inner;
+static struct fuse_operations *ctl;
+static struct fuse_operations wrapped;
+
+static __thread undofs_op_ctx *current_op = NULL;
+static __thread uint16_t thread_no = 0;
+static uint16_t thread_count = 0;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// FNV-1a, good enough to tell nodes apart in a trace.
+static uint64_t path_hash(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    if(path == NULL)
+        return 0;
+    while(*path)
+    {
+        hash ^= (unsigned char) *path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void op_begin(undofs_op_ctx *ctx, int op, const char *path)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->op = op;
+    ctx->path = path;
+    ctx->version = -1;
+    if(undofs_trace_enabled() || undofs_capture_enabled())
+        ctx->start_ns = monotonic_ns();
+    current_op = ctx;
+    undofs_syscount_op(op);
+    undofs_span_op_begin(op);
+}
+
+static int op_end(undofs_op_ctx *ctx, int result, long bytes)
+{
+    current_op = NULL;
+    undofs_syscount_op(-1);
+    undofs_span_op_end(ctx->path, result);
+    if(ctx->start_ns == 0)
+        return result;
+
+    undofs_trace_record record;
+    uint64_t duration = monotonic_ns() - ctx->start_ns;
+
+    undofs_capture_op(ctx, result, duration);
+    if(! undofs_trace_enabled())
+        return result;
+
+    if(thread_no == 0)
+        thread_no = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+
+    record.start_ns = ctx->start_ns;
+    record.node = path_hash(ctx->path);
+    record.version = ctx->version;
+    record.bytes = bytes;
+    record.duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration;
+    record.result = result;
+    record.op = ctx->op;
+    record.thread = thread_no;
+    undofs_trace_append(&record);
+
+    return result;
+}
+
+static int op_end_bytes(undofs_op_ctx *ctx, int result)
+{
+    return op_end(ctx, result, result > 0 ? result : 0);
+}
+
+void undofs_op_version(long version)
+{
+    if(current_op != NULL)
+        current_op->version = version;
+}
+
+// Operations on the control directory go to its own handlers, and are
+// refused where it has none.
+static struct fuse_operations *ops_for(const char *path)
+{
+    return undofs_ctl_owns(path) ? ctl : inner;
+}
+
+#define CALL(path, name, ...) (ops_for(path)->name ? ops_for(path)->name(__VA_ARGS__) : -EPERM)
+#define CALL2(path, path2, name, ...) \
+    (undofs_ctl_owns(path2) ? -EPERM : CALL(path, name, __VA_ARGS__))
+
+#define BEGIN(op, path) undofs_op_ctx ctx; op_begin(&ctx, UNDOFS_OP_##op, path)
+#define END(res) op_end(&ctx, res, 0)
+#define END_BYTES(res) op_end_bytes(&ctx, res)
+
+static int wrap_getattr(const char *path, struct stat *statbuf)
+{
+    BEGIN(GETATTR, path);
+    return END(CALL(path, getattr, path, statbuf));
+}
+
+static int wrap_readlink(const char *path, char *link, size_t size)
+{
+    BEGIN(READLINK, path);
+    ctx.size = size;
+    return END(CALL(path, readlink, path, link, size));
+}
+
+static int wrap_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    BEGIN(MKNOD, path);
+    ctx.mode = mode;
+    return END(CALL(path, mknod, path, mode, dev));
+}
+
+static int wrap_mkdir(const char *path, mode_t mode)
+{
+    BEGIN(MKDIR, path);
+    ctx.mode = mode;
+    return END(CALL(path, mkdir, path, mode));
+}
+
+static int wrap_unlink(const char *path)
+{
+    BEGIN(UNLINK, path);
+    return END(CALL(path, unlink, path));
+}
+
+static int wrap_rmdir(const char *path)
+{
+    BEGIN(RMDIR, path);
+    return END(CALL(path, rmdir, path));
+}
+
+static int wrap_symlink(const char *path, const char *link)
+{
+    BEGIN(SYMLINK, link);
+    ctx.size = strlen(path);
+    return END(CALL(link, symlink, path, link));
+}
+
+static int wrap_rename(const char *path, const char *newpath)
+{
+    BEGIN(RENAME, path);
+    ctx.path2 = newpath;
+    return END(CALL2(path, newpath, rename, path, newpath));
+}
+
+static int wrap_link(const char *path, const char *newpath)
+{
+    BEGIN(LINK, path);
+    ctx.path2 = newpath;
+    return END(CALL2(path, newpath, link, path, newpath));
+}
+
+static int wrap_chmod(const char *path, mode_t mode)
+{
+    BEGIN(CHMOD, path);
+    ctx.mode = mode;
+    return END(CALL(path, chmod, path, mode));
+}
+
+static int wrap_chown(const char *path, uid_t uid, gid_t gid)
+{
+    BEGIN(CHOWN, path);
+    ctx.flags = uid;
+    ctx.mode = gid;
+    return END(CALL(path, chown, path, uid, gid));
+}
+
+static int wrap_truncate(const char *path, off_t newsize)
+{
+    BEGIN(TRUNCATE, path);
+    ctx.size = newsize;
+    return END(CALL(path, truncate, path, newsize));
+}
+
+static int wrap_utime(const char *path, struct utimbuf *ubuf)
+{
+    BEGIN(UTIME, path);
+    return END(CALL(path, utime, path, ubuf));
+}
+
+static int wrap_open(const char *path, struct fuse_file_info *fi)
+{
+    BEGIN(OPEN, path);
+    ctx.flags = fi->flags;
+    int res = CALL(path, open, path, fi);
+    ctx.fh = fi->fh;
+    return END(res);
+}
+
+static int wrap_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    BEGIN(READ, path);
+    ctx.fh = fi->fh;
+    ctx.size = size;
+    ctx.offset = offset;
+    return END_BYTES(CALL(path, read, path, buf, size, offset, fi));
+}
+
+static int wrap_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    BEGIN(WRITE, path);
+    ctx.fh = fi->fh;
+    ctx.size = size;
+    ctx.offset = offset;
+    return END_BYTES(CALL(path, write, path, buf, size, offset, fi));
+}
+
+#ifdef FUSE_CAP_SPLICE_READ
+// The control files only have read and write, so buffers are copied for
+// them the way libfuse does when read_buf and write_buf are missing.
+static int read_into_buf(struct fuse_operations *ops, const char *path, struct fuse_bufvec **bufp,
+                         size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *buf;
+    int res;
+
+    if(ops->read == NULL)
+        return -EPERM;
+    buf = malloc(sizeof(struct fuse_bufvec));
+    if(buf == NULL)
+        return -ENOMEM;
+    *buf = FUSE_BUFVEC_INIT(size);
+    buf->buf[0].mem = malloc(size);
+    if(buf->buf[0].mem == NULL)
+    {
+        free(buf);
+        return -ENOMEM;
+    }
+    res = ops->read(path, buf->buf[0].mem, size, offset, fi);
+    if(res < 0)
+    {
+        free(buf->buf[0].mem);
+        free(buf);
+        return res;
+    }
+    buf->buf[0].size = res;
+    *bufp = buf;
+    return 0;
+}
+
+static int write_from_buf(struct fuse_operations *ops, const char *path, struct fuse_bufvec *buf,
+                          off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+    ssize_t res;
+
+    if(ops->write == NULL)
+        return -EPERM;
+    mem.buf[0].mem = malloc(mem.buf[0].size);
+    if(mem.buf[0].mem == NULL)
+        return -ENOMEM;
+    res = fuse_buf_copy(&mem, buf, 0);
+    if(res >= 0)
+        res = ops->write(path, mem.buf[0].mem, res, offset, fi);
+    free(mem.buf[0].mem);
+    return res;
+}
+
+static int wrap_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                         struct fuse_file_info *fi)
+{
+    struct fuse_operations *ops = ops_for(path);
+    BEGIN(READ, path);
+    ctx.fh = fi->fh;
+    ctx.size = size;
+    ctx.offset = offset;
+    int res = ops->read_buf ? ops->read_buf(path, bufp, size, offset, fi)
+                            : read_into_buf(ops, path, bufp, size, offset, fi);
+    // Data left in the file counts as the size asked for, even past its end.
+    return op_end(&ctx, res, res == 0 ? (long) fuse_buf_size(*bufp) : 0);
+}
+
+static int wrap_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_operations *ops = ops_for(path);
+    BEGIN(WRITE, path);
+    ctx.fh = fi->fh;
+    ctx.size = fuse_buf_size(buf);
+    ctx.offset = offset;
+    return END_BYTES(ops->write_buf ? ops->write_buf(path, buf, offset, fi)
+                                    : write_from_buf(ops, path, buf, offset, fi));
+}
+#endif
+
+static int wrap_statfs(const char *path, struct statvfs *statv)
+{
+    BEGIN(STATFS, path);
+    return END(inner->statfs(path, statv));
+}
+
+static int wrap_flush(const char *path, struct fuse_file_info *fi)
+{
+    BEGIN(FLUSH, path);
+    ctx.fh = fi->fh;
+    return END(CALL(path, flush, path, fi));
+}
+
+static int wrap_release(const char *path, struct fuse_file_info *fi)
+{
+    BEGIN(RELEASE, path);
+    ctx.fh = fi->fh;
+    return END(CALL(path, release, path, fi));
+}
+
+static int wrap_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    BEGIN(FSYNC, path);
+    ctx.fh = fi->fh;
+    ctx.flags = datasync;
+    return END(CALL(path, fsync, path, datasync, fi));
+}
+
+static int wrap_opendir(const char *path, struct fuse_file_info *fi)
+{
+    BEGIN(OPENDIR, path);
+    return END(CALL(path, opendir, path, fi));
+}
+
+static int wrap_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    BEGIN(READDIR, path);
+    return END(CALL(path, readdir, path, buf, filler, offset, fi));
+}
+
+static int wrap_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    BEGIN(RELEASEDIR, path);
+    return END(CALL(path, releasedir, path, fi));
+}
+
+static int wrap_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    BEGIN(FSYNCDIR, path);
+    return END(CALL(path, fsyncdir, path, datasync, fi));
+}
+
+static int wrap_access(const char *path, int mask)
+{
+    BEGIN(ACCESS, path);
+    ctx.flags = mask;
+    return END(CALL(path, access, path, mask));
+}
+
+static int wrap_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    BEGIN(CREATE, path);
+    ctx.flags = fi->flags;
+    ctx.mode = mode;
+    int res = CALL(path, create, path, mode, fi);
+    ctx.fh = fi->fh;
+    return END(res);
+}
+
+static int wrap_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    BEGIN(FTRUNCATE, path);
+    ctx.fh = fi->fh;
+    ctx.size = offset;
+    return END(CALL(path, ftruncate, path, offset, fi));
+}
+
+static int wrap_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+    BEGIN(FGETATTR, path);
+    ctx.fh = fi->fh;
+    return END(CALL(path, fgetattr, path, statbuf, fi));
+}
+
+struct fuse_operations *undofs_opwrap(struct fuse_operations *ops)
+{
+    inner = ops;
+    ctl = undofs_ctl_operations();
+    wrapped = *ops;
+
+#define WRAP(name) if(ops->name) wrapped.name = wrap_##name
+    WRAP(getattr);
+    WRAP(readlink);
+    WRAP(mknod);
+    WRAP(mkdir);
+    WRAP(unlink);
+    WRAP(rmdir);
+    WRAP(symlink);
+    WRAP(rename);
+    WRAP(link);
+    WRAP(chmod);
+    WRAP(chown);
+    WRAP(truncate);
+    WRAP(utime);
+    WRAP(open);
+    WRAP(read);
+    WRAP(write);
+#ifdef FUSE_CAP_SPLICE_READ
+    WRAP(read_buf);
+    WRAP(write_buf);
+#endif
+    WRAP(statfs);
+    WRAP(flush);
+    WRAP(release);
+    WRAP(fsync);
+    WRAP(opendir);
+    WRAP(readdir);
+    WRAP(releasedir);
+    WRAP(fsyncdir);
+    WRAP(access);
+    WRAP(create);
+    WRAP(ftruncate);
+    WRAP(fgetattr);
+#undef WRAP
+
+    return &wrapped;
+}
@@ -0,0 +1,40 @@
+#ifndef __UNDOFS_OPWRAP_H_
+#define __UNDOFS_OPWRAP_H_
+#include "config.h"
+
+#include <fuse.h>
+#include <stdint.h>
+
+/**
+ * Context of the fuse operation being handled by the current thread.
+ */
+typedef struct {
+    int op;                 // enum undofs_trace_op
+    uint64_t start_ns;      // CLOCK_MONOTONIC, 0 when nothing is recording
+    const char *path;
+    const char *path2;      // second path of rename, link and symlink
+    long version;
+    uint64_t fh;            // file handle, for operations on open files
+    uint64_t size;          // requested size of read, write and truncate
+    int64_t offset;
+    unsigned int flags;     // open flags, access mask or uid
+    unsigned int mode;      // file mode or gid
+} undofs_op_ctx;
+
+/**
+ * Wrap a set of fuse operations, so every operation is timed and reported
+ * to the binary trace when tracing is enabled. Operations on the control
+ * directory are sent to undofs_ctl_operations() instead.
+ * @param ops the operations to wrap. Must stay valid while mounted.
+ * @return pointer to the wrapping fuse_operations structure.
+ */
+struct fuse_operations *undofs_opwrap(struct fuse_operations *ops);
+
+/**
+ * Record which version of a file the current operation works on.
+ * Does nothing outside of a wrapped operation.
+ * @param version the version number.
+ */
+void undofs_op_version(long version);
+
+#endif
@@ -0,0 +1,600 @@
+#include "config.h"
+#include "undofs_capture.h"
+#include "undofs_trace.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    int op;
+    int result;
+    uint64_t fh;
+    uint64_t size;
+    int64_t offset;
+    unsigned int flags;
+    unsigned int mode;
+    char *path;
+    char *path2;
+} capture_entry;
+
+typedef struct {
+    capture_entry *entries;
+    size_t count;
+} capture;
+
+// Latencies of one operation type, in nanoseconds.
+typedef struct {
+    uint64_t *samples;
+    size_t count, size;
+} latencies;
+
+static void usage()
+{
+    fprintf(stderr,
+            "Usage: undofs-replay [-s speed] [-n] <capture> <target directory>\n"
+            "       undofs-replay -d <capture> <other capture>\n"
+            "  -s speed  replay speed: 1 keeps the original timing, 10 is ten times\n"
+            "            faster, 0 issues operations back to back (default 1)\n"
+            "  -n        don't create the files the capture expects to exist\n"
+            "  -d        compare the recorded latencies of two captures\n");
+    exit(1);
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int op_from_name(const char *name)
+{
+    int op;
+    for(op = 0; op < UNDOFS_OP_COUNT; op++)
+        if(strcmp(undofs_trace_op_names[op], name) == 0)
+            return op;
+    return -1;
+}
+
+static int compare_start(const void *a, const void *b)
+{
+    const capture_entry *x = a, *y = b;
+    return (x->start_ns > y->start_ns) - (x->start_ns < y->start_ns);
+}
+
+static void load_capture(capture *c, const char *file)
+{
+    char line[2 * PATH_MAX + 256], opname[32];
+    char *path = malloc(PATH_MAX), *path2 = malloc(PATH_MAX);
+    size_t size = 0;
+    FILE *f = fopen(file, "r");
+
+    if(f == NULL)
+    {
+        perror(file);
+        exit(1);
+    }
+    if(fgets(line, sizeof(line), f) == NULL || strncmp(line, UNDOFS_CAPTURE_HEADER, strlen(UNDOFS_CAPTURE_HEADER)) != 0)
+    {
+        fprintf(stderr, "%s: not an undofs capture file\n", file);
+        exit(1);
+    }
+
+    c->entries = NULL;
+    c->count = 0;
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        capture_entry e;
+        unsigned long long start, duration, fh, esize;
+        long long offset;
+
+        if(sscanf(line, "%llu\t%llu\t%31s\t%d\t%llu\t%llu\t%lld\t%u\t%u\t%4095s\t%4095s",
+                  &start, &duration, opname, &e.result, &fh, &esize, &offset,
+                  &e.flags, &e.mode, path, path2) != 11
+           || (e.op = op_from_name(opname)) < 0)
+        {
+            fprintf(stderr, "%s: skipping malformed line: %s", file, line);
+            continue;
+        }
+        e.start_ns = start;
+        e.duration_ns = duration;
+        e.fh = fh;
+        e.size = esize;
+        e.offset = offset;
+        e.path = strdup(path);
+        e.path2 = strcmp(path2, "-") ? strdup(path2) : NULL;
+
+        if(c->count == size)
+        {
+            size = size ? size * 2 : 4096;
+            c->entries = realloc(c->entries, size * sizeof(capture_entry));
+            if(c->entries == NULL)
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        c->entries[c->count++] = e;
+    }
+    fclose(f);
+    free(path);
+    free(path2);
+
+    qsort(c->entries, c->count, sizeof(capture_entry), compare_start);
+}
+
+static void add_latency(latencies *l, uint64_t ns)
+{
+    if(l->count == l->size)
+    {
+        l->size = l->size ? l->size * 2 : 256;
+        l->samples = realloc(l->samples, l->size * sizeof(uint64_t));
+        if(l->samples == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    l->samples[l->count++] = ns;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void summarize(latencies *l, double *mean, double *p50, double *p99)
+{
+    size_t i;
+    double sum = 0;
+
+    *mean = *p50 = *p99 = 0;
+    if(l->count == 0)
+        return;
+
+    qsort(l->samples, l->count, sizeof(uint64_t), compare_u64);
+    for(i = 0; i < l->count; i++)
+        sum += l->samples[i];
+    *mean = sum / l->count / 1000.0;
+    *p50 = l->samples[l->count / 2] / 1000.0;
+    *p99 = l->samples[(l->count * 99) / 100] / 1000.0;
+}
+
+static void report(const char *a_name, latencies *a, const char *b_name, latencies *b)
+{
+    int op;
+
+    printf("%-11s %8s  %10s %10s %10s  %10s %10s %10s  %9s\n",
+           "op", "count", "mean", "p50", "p99", "mean", "p50", "p99", "delta");
+    printf("%-11s %8s  %-32s  %-32s  %9s\n", "", "", a_name, b_name, "(mean)");
+    for(op = 0; op < UNDOFS_OP_COUNT; op++)
+    {
+        double am, a50, a99, bm, b50, b99;
+        if(a[op].count == 0 && b[op].count == 0)
+            continue;
+        summarize(&a[op], &am, &a50, &a99);
+        summarize(&b[op], &bm, &b50, &b99);
+        printf("%-11s %8zu  %10.1f %10.1f %10.1f  %10.1f %10.1f %10.1f  ",
+               undofs_trace_op_names[op], b[op].count ? b[op].count : a[op].count,
+               am, a50, a99, bm, b50, b99);
+        if(am > 0 && b[op].count)
+            printf("%+8.1f%%\n", (bm - am) * 100.0 / am);
+        else
+            printf("%9s\n", "-");
+    }
+    printf("(latencies in microseconds)\n");
+}
+
+/* Preparation: create everything the capture used but didn't create. */
+
+typedef struct known_path {
+    struct known_path *next;
+    char *path;
+    int seen, is_dir;
+    uint64_t size;
+} known_path;
+
+#define KNOWN_BUCKETS 65536
+static known_path *known[KNOWN_BUCKETS];
+
+static known_path *lookup_path(const char *path)
+{
+    unsigned long hash = 5381;
+    const char *p;
+    known_path *k;
+
+    for(p = path; *p; p++)
+        hash = hash * 33 + (unsigned char) *p;
+    for(k = known[hash % KNOWN_BUCKETS]; k != NULL; k = k->next)
+        if(strcmp(k->path, path) == 0)
+            return k;
+
+    k = calloc(1, sizeof(known_path));
+    k->path = strdup(path);
+    k->next = known[hash % KNOWN_BUCKETS];
+    known[hash % KNOWN_BUCKETS] = k;
+    return k;
+}
+
+static void mark_parents(const char *path)
+{
+    char parent[PATH_MAX], *slash;
+    snprintf(parent, PATH_MAX, "%s", path);
+    while((slash = strrchr(parent, '/')) != NULL && slash != parent)
+    {
+        *slash = 0;
+        lookup_path(parent)->is_dir = 1;
+    }
+}
+
+static void mkdirs(const char *target, const char *path)
+{
+    char full[PATH_MAX], *slash;
+    snprintf(full, PATH_MAX, "%s%s", target, path);
+    for(slash = full + strlen(target) + 1; (slash = strchr(slash, '/')) != NULL; slash++)
+    {
+        *slash = 0;
+        mkdir(full, 0755);
+        *slash = '/';
+    }
+}
+
+static void prepare(const capture *c, const char *target)
+{
+    size_t i, created = 0;
+    int b;
+
+    for(i = 0; i < c->count; i++)
+    {
+        const capture_entry *e = &c->entries[i];
+        known_path *k = lookup_path(e->path);
+        int creates = (e->op == UNDOFS_OP_MKNOD || e->op == UNDOFS_OP_MKDIR
+                       || e->op == UNDOFS_OP_CREATE || e->op == UNDOFS_OP_SYMLINK);
+
+        if(e->op == UNDOFS_OP_OPENDIR || e->op == UNDOFS_OP_RMDIR)
+            k->is_dir = 1;
+        mark_parents(e->path);
+        if(e->path2)
+            mark_parents(e->path2);
+        if(e->op == UNDOFS_OP_READ && e->offset + e->size > k->size)
+            k->size = e->offset + e->size;
+        // A path the original workload found without creating it first.
+        if(!k->seen && !creates && e->result >= 0 && strcmp(e->path, "/") != 0)
+            k->seen = 1;
+        else if(!k->seen)
+            k->seen = 2;
+    }
+
+    for(b = 0; b < KNOWN_BUCKETS; b++)
+    {
+        known_path *k;
+        for(k = known[b]; k != NULL; k = k->next)
+        {
+            char full[PATH_MAX];
+            if(k->seen != 1)
+                continue;
+
+            mkdirs(target, k->path);
+            snprintf(full, PATH_MAX, "%s%s", target, k->path);
+            if(k->is_dir)
+                mkdir(full, 0755);
+            else
+            {
+                int fd = open(full, O_WRONLY | O_CREAT, 0644);
+                if(fd >= 0)
+                {
+                    if(ftruncate(fd, k->size) != 0)
+                        perror(full);
+                    close(fd);
+                }
+            }
+            created++;
+        }
+    }
+    fprintf(stderr, "Created %zu files and directories the capture expects.\n", created);
+}
+
+/* Replay */
+
+typedef struct {
+    uint64_t fh;
+    int fd;
+    DIR *dir;
+    int opens;                  // captures from before handles got serial numbers reuse fh
+    int used, tombstone;
+} handle;
+
+static handle *handles;
+static size_t handles_size = 1 << 16;
+
+static handle *find_handle(uint64_t fh, int create)
+{
+    size_t i = (fh * 0x9E3779B97F4A7C15ULL) % handles_size, n;
+    handle *free_slot = NULL;
+
+    for(n = 0; n < handles_size; n++, i = (i + 1) % handles_size)
+    {
+        if(handles[i].used && handles[i].fh == fh)
+            return &handles[i];
+        if(!handles[i].used)
+        {
+            if(free_slot == NULL)
+                free_slot = &handles[i];
+            // Tombstones keep probe chains intact, an empty slot ends them.
+            if(!handles[i].tombstone)
+                break;
+        }
+    }
+    if(!create || free_slot == NULL)
+        return NULL;
+    free_slot->used = 1;
+    free_slot->tombstone = 0;
+    free_slot->fh = fh;
+    free_slot->fd = -1;
+    free_slot->dir = NULL;
+    free_slot->opens = 0;
+    return free_slot;
+}
+
+static void forget_handle(handle *h)
+{
+    h->used = 0;
+    h->tombstone = 1;
+}
+
+static char *write_buffer(size_t size)
+{
+    static char *buffer = NULL;
+    static size_t buffer_size = 0;
+    if(size > buffer_size)
+    {
+        free(buffer);
+        buffer = calloc(1, size);
+        buffer_size = size;
+    }
+    return buffer;
+}
+
+// Issue one operation against the target. Returns 0 or -errno like fuse
+// would, or 1 when the operation can't be replayed.
+static int replay_one(const capture_entry *e, const char *target)
+{
+    char path[PATH_MAX], path2[PATH_MAX];
+    struct stat st;
+    handle *h = NULL;
+    int res = 0;
+
+    snprintf(path, PATH_MAX, "%s%s", target, strcmp(e->path, "/") ? e->path : "");
+    if(e->path2)
+        snprintf(path2, PATH_MAX, "%s%s", target, e->path2);
+
+    switch(e->op)
+    {
+    case UNDOFS_OP_OPEN:
+    case UNDOFS_OP_CREATE:
+    case UNDOFS_OP_OPENDIR:
+        if(e->result < 0)
+            break;
+        h = find_handle(e->fh, 1);
+        if(h == NULL)
+            return 1;
+        break;
+    case UNDOFS_OP_READ:
+    case UNDOFS_OP_WRITE:
+    case UNDOFS_OP_RELEASE:
+    case UNDOFS_OP_FSYNC:
+    case UNDOFS_OP_FTRUNCATE:
+    case UNDOFS_OP_FGETATTR:
+    case UNDOFS_OP_READDIR:
+    case UNDOFS_OP_RELEASEDIR:
+        h = find_handle(e->fh, 0);
+        if(h == NULL || (h->fd < 0 && h->dir == NULL))
+            return 1;
+        break;
+    }
+
+    switch(e->op)
+    {
+    case UNDOFS_OP_GETATTR: res = lstat(path, &st); break;
+    case UNDOFS_OP_READLINK: res = readlink(path, path2, PATH_MAX) < 0 ? -1 : 0; break;
+    case UNDOFS_OP_MKNOD:
+        if(S_ISREG(e->mode))
+        {
+            res = open(path, O_CREAT | O_EXCL | O_WRONLY, e->mode & 07777);
+            if(res >= 0)
+                res = close(res);
+        }
+        else if(S_ISFIFO(e->mode))
+            res = mkfifo(path, e->mode & 07777);
+        else
+            return 1;
+        break;
+    case UNDOFS_OP_MKDIR: res = mkdir(path, e->mode); break;
+    case UNDOFS_OP_UNLINK: res = unlink(path); break;
+    case UNDOFS_OP_RMDIR: res = rmdir(path); break;
+    case UNDOFS_OP_SYMLINK:
+    {
+        size_t len = e->size > 0 && e->size < PATH_MAX ? e->size : 1;
+        memset(path2, 'x', len);
+        path2[len] = 0;
+        res = symlink(path2, path);
+        break;
+    }
+    case UNDOFS_OP_RENAME: res = e->path2 ? rename(path, path2) : 1; break;
+    case UNDOFS_OP_LINK: res = e->path2 ? link(path, path2) : 1; break;
+    case UNDOFS_OP_CHMOD: res = chmod(path, e->mode); break;
+    case UNDOFS_OP_CHOWN: res = chown(path, e->flags, e->mode); break;
+    case UNDOFS_OP_TRUNCATE: res = truncate(path, e->size); break;
+    case UNDOFS_OP_UTIME: res = utime(path, NULL); break;
+    case UNDOFS_OP_OPEN:
+    case UNDOFS_OP_CREATE:
+        // Another open of a handle that is still open shares its descriptor.
+        if(h && h->opens++ > 0)
+            break;
+        if(e->op == UNDOFS_OP_CREATE)
+            res = open(path, e->flags | O_CREAT, e->mode & 07777);
+        else
+            res = open(path, e->flags & ~(O_CREAT | O_EXCL));
+        if(h)
+            h->fd = res;
+        if(res >= 0)
+            res = 0;
+        break;
+    case UNDOFS_OP_READ:
+        res = pread(h->fd, write_buffer(e->size), e->size, e->offset) < 0 ? -1 : 0;
+        break;
+    case UNDOFS_OP_WRITE:
+        res = pwrite(h->fd, write_buffer(e->size), e->size, e->offset) < 0 ? -1 : 0;
+        break;
+    case UNDOFS_OP_STATFS:
+    {
+        struct statvfs sv;
+        res = statvfs(path, &sv);
+        break;
+    }
+    case UNDOFS_OP_RELEASE:
+        if(--h->opens > 0)
+            break;
+        res = close(h->fd);
+        forget_handle(h);
+        break;
+    case UNDOFS_OP_FSYNC: res = e->flags ? fdatasync(h->fd) : fsync(h->fd); break;
+    case UNDOFS_OP_OPENDIR:
+        if(h)
+        {
+            h->dir = opendir(path);
+            res = h->dir ? 0 : -1;
+        }
+        else
+            res = 1;
+        break;
+    case UNDOFS_OP_READDIR:
+        rewinddir(h->dir);
+        errno = 0;
+        while(readdir(h->dir) != NULL)
+            ;
+        res = errno ? -1 : 0;
+        break;
+    case UNDOFS_OP_RELEASEDIR:
+        res = closedir(h->dir);
+        forget_handle(h);
+        break;
+    case UNDOFS_OP_ACCESS: res = access(path, e->flags); break;
+    case UNDOFS_OP_FTRUNCATE: res = ftruncate(h->fd, e->size); break;
+    case UNDOFS_OP_FGETATTR: res = fstat(h->fd, &st); break;
+    default:
+        // flush and fsyncdir have no system call of their own.
+        return 1;
+    }
+
+    return res < 0 ? -errno : res;
+}
+
+static int replay(const capture *c, const char *target, double speed)
+{
+    latencies recorded[UNDOFS_OP_COUNT], replayed[UNDOFS_OP_COUNT];
+    size_t i, skipped = 0, mismatched = 0;
+    uint64_t base = monotonic_ns();
+
+    memset(recorded, 0, sizeof(recorded));
+    memset(replayed, 0, sizeof(replayed));
+    handles = calloc(handles_size, sizeof(handle));
+
+    for(i = 0; i < c->count; i++)
+    {
+        const capture_entry *e = &c->entries[i];
+
+        if(speed > 0)
+        {
+            uint64_t due = base + (uint64_t) (e->start_ns / speed), now = monotonic_ns();
+            if(due > now)
+            {
+                struct timespec ts = { (due - now) / 1000000000ULL, (due - now) % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        uint64_t start = monotonic_ns();
+        int res = replay_one(e, target);
+        uint64_t duration = monotonic_ns() - start;
+
+        if(res == 1)
+        {
+            skipped++;
+            continue;
+        }
+        if((res < 0) != (e->result < 0))
+            mismatched++;
+
+        add_latency(&recorded[e->op], e->duration_ns);
+        add_latency(&replayed[e->op], duration);
+    }
+
+    report("recorded (in undofs)", recorded, "replayed (client side)", replayed);
+    printf("%zu operations replayed in %.3fs, %zu skipped, %zu with a different outcome.\n",
+           c->count - skipped, (monotonic_ns() - base) / 1e9, skipped, mismatched);
+    return 0;
+}
+
+static int compare_captures(const capture *a, const char *a_name, const capture *b, const char *b_name)
+{
+    latencies la[UNDOFS_OP_COUNT], lb[UNDOFS_OP_COUNT];
+    size_t i;
+
+    memset(la, 0, sizeof(la));
+    memset(lb, 0, sizeof(lb));
+    for(i = 0; i < a->count; i++)
+        add_latency(&la[a->entries[i].op], a->entries[i].duration_ns);
+    for(i = 0; i < b->count; i++)
+        add_latency(&lb[b->entries[i].op], b->entries[i].duration_ns);
+
+    report(a_name, la, b_name, lb);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1;
+    int opt, do_prepare = 1, diff = 0;
+    capture c;
+
+    while((opt = getopt(argc, argv, "s:nd")) != -1)
+    {
+        switch(opt)
+        {
+        case 's': speed = atof(optarg); break;
+        case 'n': do_prepare = 0; break;
+        case 'd': diff = 1; break;
+        default: usage();
+        }
+    }
+    if(optind != argc - 2)
+        usage();
+
+    load_capture(&c, argv[optind]);
+
+    if(diff)
+    {
+        capture other;
+        load_capture(&other, argv[optind + 1]);
+        return compare_captures(&c, argv[optind], &other, argv[optind + 1]);
+    }
+
+    if(do_prepare)
+        prepare(&c, argv[optind + 1]);
+    return replay(&c, argv[optind + 1], speed);
+}
@@ -0,0 +1,259 @@
+#include "undofs_scan.h"
+#include "undofs_syscount.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Large enough to read a directory of 100k versions in a handful of calls.
+#define SCAN_BUFFER_SIZE (256 * 1024)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Scan buffers are expensive to allocate, so each thread keeps a couple
+// around: one for a directory listing and one for the nodes inside it.
+#define SPARE_BUFFERS 2
+static __thread char *spare_buffers[SPARE_BUFFERS];
+static __thread int spares_kept = 0;
+static pthread_key_t spares_key;
+static pthread_once_t spares_once = PTHREAD_ONCE_INIT;
+
+static void free_spares(void *spares)
+{
+    int i;
+    for(i = 0; i < SPARE_BUFFERS; i++)
+        free(((char **) spares)[i]);
+}
+
+static void make_spares_key()
+{
+    pthread_key_create(&spares_key, free_spares);
+}
+
+static char *get_buffer()
+{
+    int i;
+    for(i = 0; i < SPARE_BUFFERS; i++)
+    {
+        if(spare_buffers[i] != NULL)
+        {
+            char *buf = spare_buffers[i];
+            spare_buffers[i] = NULL;
+            return buf;
+        }
+    }
+    return malloc(SCAN_BUFFER_SIZE);
+}
+
+static void put_buffer(char *buf)
+{
+    int i;
+
+    if(! spares_kept)
+    {
+        // Threads come and go, the spares are freed when this one exits.
+        pthread_once(&spares_once, make_spares_key);
+        if(pthread_setspecific(spares_key, spare_buffers) != 0)
+        {
+            free(buf);
+            return;
+        }
+        spares_kept = 1;
+    }
+    for(i = 0; i < SPARE_BUFFERS; i++)
+    {
+        if(spare_buffers[i] == NULL)
+        {
+            spare_buffers[i] = buf;
+            return;
+        }
+    }
+    free(buf);
+}
+
+int undofs_dirscan_start(undofs_dirscan *scan, int fd)
+{
+    scan->fd = fd;
+    scan->len = scan->pos = 0;
+    scan->buf = get_buffer();
+    if(scan->buf == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+const char *undofs_dirscan_next(undofs_dirscan *scan, unsigned char *d_type)
+{
+    for(;;)
+    {
+        if(scan->pos >= scan->len)
+        {
+            scan->len = sys_getdents64(scan->fd, scan->buf, SCAN_BUFFER_SIZE);
+            scan->pos = 0;
+            if(scan->len <= 0)
+            {
+                if(scan->len == 0)
+                    errno = 0;
+                return NULL;
+            }
+        }
+
+        struct linux_dirent64 *entry = (struct linux_dirent64 *) (scan->buf + scan->pos);
+        scan->pos += entry->d_reclen;
+
+        const char *name = entry->d_name;
+        if(name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+
+        if(d_type)
+            *d_type = entry->d_type;
+        return name;
+    }
+}
+
+void undofs_dirscan_end(undofs_dirscan *scan)
+{
+    if(scan->buf)
+        put_buffer(scan->buf);
+    scan->buf = NULL;
+}
+
+long undofs_parse_version(const char *name)
+{
+    long version = 0;
+    int digits = 0;
+
+    // Versions are written by snprintf("%ld"), so there are no signs,
+    // spaces or leading zeros to worry about, except for version 0.
+    for(; *name; name++, digits++)
+    {
+        unsigned d = (unsigned char) *name - '0';
+        if(d > 9 || digits >= 18)
+            return -1;
+        version = version * 10 + d;
+    }
+    return digits ? version : -1;
+}
+
+int undofs_scan_node(int dirfd, const char *name, undofs_node_info *info)
+{
+    undofs_dirscan scan;
+    const char *entry;
+    int fd, saved_errno;
+
+    info->latest = -1;
+    info->is_dir = 0;
+    info->deleted = 0;
+    info->ino = 0;
+    info->purge_gen = info->born = 0;
+
+    fd = sys_openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    // A directory node holds all of its children, don't list those.
+    if(sys_faccessat(fd, "dir", F_OK, 0) == 0)
+    {
+        info->is_dir = 1;
+        info->deleted = (sys_faccessat(fd, "deleted", F_OK, 0) == 0);
+        info->purge_gen = undofs_read_generation(fd, UNDOFS_PURGE_MARKER);
+        info->born = undofs_read_generation(fd, UNDOFS_BORN_MARKER);
+        sys_close(fd);
+        return 0;
+    }
+
+    struct stat st;
+    if(sys_fstat(fd, &st) != 0 || undofs_dirscan_start(&scan, fd) != 0)
+    {
+        saved_errno = errno;
+        sys_close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    info->ino = st.st_ino;
+
+    while((entry = undofs_dirscan_next(&scan, NULL)) != NULL)
+    {
+        if(entry[0] >= '0' && entry[0] <= '9')
+        {
+            long version = undofs_parse_version(entry);
+            if(version > info->latest)
+                info->latest = version;
+        }
+        else if(strcmp(entry, "deleted") == 0)
+            info->deleted = 1;
+        else if(strcmp(entry, UNDOFS_BORN_MARKER) == 0)
+            info->born = undofs_read_generation(fd, entry);
+        else if(strcmp(entry, UNDOFS_INODE_MARKER) == 0)
+            undofs_read_number(fd, entry, &info->ino);
+    }
+    saved_errno = errno;
+
+    undofs_dirscan_end(&scan);
+    sys_close(fd);
+
+    errno = saved_errno;
+    return saved_errno ? -1 : 0;
+}
+
+int undofs_read_number(int dirfd, const char *marker, uint64_t *number)
+{
+    char target[24];
+    ssize_t len = sys_readlinkat(dirfd, marker, target, sizeof(target) - 1);
+    if(len <= 0)
+        return 0;
+    target[len] = 0;
+    long value = undofs_parse_version(target);
+    if(value < 0)
+        return 0;
+    *number = value;
+    return 1;
+}
+
+uint32_t undofs_read_generation(int dirfd, const char *marker)
+{
+    uint64_t gen;
+    if(! undofs_read_number(dirfd, marker, &gen) || gen > UINT32_MAX)
+        return 0;
+    return gen;
+}
+
+int undofs_scan_purged(uint32_t purge_gen, const undofs_node_info *child)
+{
+    return child->born < purge_gen;
+}
+
+int undofs_stat_type(int dirfd, const char *name, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+#ifdef STATX_TYPE
+    static int have_statx = 1;
+    if(have_statx)
+    {
+        struct statx stx;
+        if(sys_statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                 STATX_TYPE | STATX_MODE | STATX_INO, &stx) == 0)
+        {
+            st->st_mode = stx.stx_mode;
+            st->st_ino = stx.stx_ino;
+            return 0;
+        }
+        if(errno != ENOSYS)
+            return -1;
+        have_statx = 0;
+    }
+#endif
+    return sys_fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
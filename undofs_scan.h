@@ -0,0 +1,148 @@
+#ifndef __UNDOFS_SCAN_H_
+#define __UNDOFS_SCAN_H_
+#include "config.h"
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/*
+ * Bulk directory scanning for the store.
+ *
+ * Entries are read straight from getdents64 into a large per-thread
+ * buffer, version numbers are parsed without strtol, and everything is
+ * looked up relative to an open directory instead of by absolute path.
+ * Nothing in here depends on fuse, so the benchmarks can link it.
+ */
+
+/**
+ * State of a directory being scanned.
+ */
+typedef struct {
+    int fd;
+    char *buf;
+    long len, pos;
+} undofs_dirscan;
+
+/**
+ * What a single scan of a node directory tells about the node.
+ */
+typedef struct {
+    long latest;    // highest version number, -1 if there are none
+    int is_dir;     // has a "dir" marker
+    int deleted;    // has a "deleted" marker
+    uint64_t ino;   // files: the inode number reported for the node, see UNDOFS_INODE_MARKER
+    uint32_t purge_gen; // directories: how many times their subtree was deleted, see UNDOFS_PURGE_MARKER
+    uint32_t born;      // the purge_gen of the parent when the node last came to life
+} undofs_node_info;
+
+/*
+ * A file node reports the inode number of its node directory, which stays
+ * the same across versions. Renaming a file copies it to another node, so
+ * the two nodes swap their numbers, and a node that holds another node's
+ * number has an "inode" marker, a symbolic link to the number. Swapping
+ * keeps the numbers unique: node directories are never removed, so none
+ * are reused, and the node the file left gives up its number before the
+ * other one takes it. Until it gets the other number it holds 0, for none;
+ * it is deleted by then, so nothing reports it.
+ *
+ * Names made by link() share a version file until one of them is written,
+ * which copies it. They aren't hard links as far as POSIX goes, so each
+ * keeps a number of its own and files report a link count of 1.
+ */
+#define UNDOFS_INODE_MARKER "inode"
+
+/*
+ * Deleting a subtree only marks its directory, the children find out when
+ * they are looked up again. Every subtree delete advances the purge
+ * generation of the directory, and a node that is created, undeleted or
+ * moved into a directory is born in the generation the directory is in.
+ * Children born before the latest subtree delete went with it. Both are
+ * symbolic links to the number like the inode marker, so reading one is a
+ * single readlink, and a missing marker means generation 0.
+ */
+#define UNDOFS_PURGE_MARKER "purged"
+#define UNDOFS_BORN_MARKER "born"
+
+/**
+ * Start scanning a directory.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param scan the scan state to initialize.
+ * @param fd an open directory. The scan reads from its current offset, and doesn't close it.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_dirscan_start(undofs_dirscan *scan, int fd);
+
+/**
+ * Get the next entry of a directory scan.
+ * "." and ".." are skipped.
+ * @param scan the scan state.
+ * @param d_type if not NULL, receives the entry type (DT_*, may be DT_UNKNOWN).
+ * @return the entry name, valid until the next call, or NULL at the end or on error (errno is set on error).
+ */
+const char *undofs_dirscan_next(undofs_dirscan *scan, unsigned char *d_type);
+
+/**
+ * Release the resources of a directory scan. The directory is not closed.
+ * @param scan the scan state.
+ */
+void undofs_dirscan_end(undofs_dirscan *scan);
+
+/**
+ * Parse a version file name.
+ * @param name a directory entry name.
+ * @return the version number, or -1 if the name is not a version number.
+ */
+long undofs_parse_version(const char *name);
+
+/**
+ * Find the latest version and the markers of a node.
+ * Directory nodes are recognized by their marker, without scanning their children,
+ * and their ino is left 0: the node directory itself is what they report.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param dirfd directory to resolve name against, or AT_FDCWD.
+ * @param name the node directory, relative to dirfd or absolute.
+ * @param info receives what was found.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_scan_node(int dirfd, const char *name, undofs_node_info *info);
+
+/**
+ * Read a marker that holds a number, a symbolic link to it.
+ * @param dirfd the node directory.
+ * @param marker the marker name.
+ * @param number receives the number.
+ * @return 1 if the marker is there, 0 if not.
+ */
+int undofs_read_number(int dirfd, const char *marker, uint64_t *number);
+
+/**
+ * Read a generation marker of a node.
+ * @param dirfd the node directory.
+ * @param marker UNDOFS_PURGE_MARKER or UNDOFS_BORN_MARKER.
+ * @return the generation, 0 if there is no marker.
+ */
+uint32_t undofs_read_generation(int dirfd, const char *marker);
+
+/**
+ * Check if a child of a directory node was deleted along with its subtree.
+ * @param purge_gen the purge generation of the directory.
+ * @param child the child node.
+ * @return 1 if the child was deleted with the subtree, 0 otherwise.
+ */
+int undofs_scan_purged(uint32_t purge_gen, const undofs_node_info *child);
+
+/**
+ * Get the type, mode and inode number of a file, and nothing else.
+ * Uses statx with a minimal mask where available.
+ * @param dirfd directory to resolve name against, or AT_FDCWD.
+ * @param name the file.
+ * @param st receives st_mode and st_ino, other fields are zeroed.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_stat_type(int dirfd, const char *name, struct stat *st);
+
+#endif
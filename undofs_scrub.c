@@ -0,0 +1,468 @@
+#include "undofs_scrub.h"
+#include "undofs_cache.h"
+#include "undofs_meta.h"
+#include "undofs_scan.h"
+#include "undofs_util.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// The thread has no fuse context, so nothing in here may use PRIVATE_DATA.
+
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t scrub_thread;
+static int running = 0, stopping = 0;
+
+static char *source_root = NULL;
+static int rootfd = -1;
+static uint64_t rate_bytes;     // per second
+static int quarantine_corrupt;
+static char *buf = NULL;        // UNDOFS_SCRUB_CHUNK, aligned for O_DIRECT
+
+// Bandwidth accounting for the current pass.
+static uint64_t budget_start_ns, budget_bytes;
+
+static struct {
+    unsigned long long passes, versions, hashed, verified, corrupt, quarantined, errors, bytes;
+    int64_t pass_started, last_pass_done;
+} stats;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Sleep until time_ns on the monotonic clock, or until stopped.
+static int wait_until(uint64_t time_ns)
+{
+    struct timespec deadline;
+    int stop;
+
+    // Condition variables wait on the realtime clock.
+    uint64_t real_ns = clock_ns(CLOCK_REALTIME) + (time_ns - clock_ns(CLOCK_MONOTONIC));
+    deadline.tv_sec = real_ns / 1000000000ULL;
+    deadline.tv_nsec = real_ns % 1000000000ULL;
+
+    pthread_mutex_lock(&scrub_lock);
+    while(! stopping && clock_ns(CLOCK_MONOTONIC) < time_ns)
+        if(pthread_cond_timedwait(&scrub_wakeup, &scrub_lock, &deadline) != 0)
+            break;
+    stop = stopping;
+    pthread_mutex_unlock(&scrub_lock);
+    return stop;
+}
+
+static int throttle(size_t bytes)
+{
+    budget_bytes += bytes;
+    return wait_until(budget_start_ns + budget_bytes * 1000000000ULL / rate_bytes);
+}
+
+/*
+ * A 64 bit hash in the style of XXH64: four independent lanes over 32 byte
+ * stripes, so it keeps up with any disk. It only has to catch corruption,
+ * not withstand anyone trying to forge a collision.
+ */
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+typedef struct {
+    uint64_t lane[4];
+    uint64_t total;
+} hash_state;
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    return rotl(acc + input * P2, 31) * P1;
+}
+
+static void hash_init(hash_state *h)
+{
+    h->lane[0] = P1 + P2;
+    h->lane[1] = P2;
+    h->lane[2] = 0;
+    h->lane[3] = -P1;
+    h->total = 0;
+}
+
+// Hash the whole stripes in len bytes, and return how many bytes were used.
+static size_t hash_stripes(hash_state *h, const char *p, size_t len)
+{
+    size_t done = 0;
+    for(; done + 32 <= len; done += 32)
+    {
+        h->lane[0] = hash_round(h->lane[0], read64(p + done));
+        h->lane[1] = hash_round(h->lane[1], read64(p + done + 8));
+        h->lane[2] = hash_round(h->lane[2], read64(p + done + 16));
+        h->lane[3] = hash_round(h->lane[3], read64(p + done + 24));
+    }
+    h->total += done;
+    return done;
+}
+
+static uint64_t hash_final(hash_state *h, const char *p, size_t len)
+{
+    uint64_t hash;
+    int i;
+
+    p += hash_stripes(h, p, len);
+    len %= 32;
+    h->total += len;
+
+    if(h->total >= 32)
+    {
+        hash = rotl(h->lane[0], 1) + rotl(h->lane[1], 7) + rotl(h->lane[2], 12) + rotl(h->lane[3], 18);
+        for(i = 0; i < 4; i++)
+            hash = (hash ^ hash_round(0, h->lane[i])) * P1 + P4;
+    } else
+        hash = h->lane[2] + P5;
+    hash += h->total;
+
+    for(; len >= 8; p += 8, len -= 8)
+        hash = rotl(hash ^ hash_round(0, read64(p)), 27) * P1 + P4;
+    for(; len > 0; p++, len--)
+        hash = rotl(hash ^ (uint64_t) (unsigned char) *p * P5, 11) * P1;
+
+    hash ^= hash >> 33;
+    hash *= P2;
+    hash ^= hash >> 29;
+    hash *= P3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static int64_t ns(struct timespec ts)
+{
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Hash a version file. Returns 1 when stopped halfway.
+static int hash_file(int dirfd, const char *name, struct stat *st, uint64_t *hash)
+{
+    hash_state h;
+    off_t offset = 0;
+    int direct = 1, stop = 0, saved_errno;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_DIRECT);
+    if(fd < 0 && errno == EINVAL)
+    {
+        // Filesystems without direct I/O, tmpfs for one.
+        direct = 0;
+        fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    }
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, st) != 0)
+        goto error;
+    if(! direct)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Without the page cache there is no kernel read-ahead either, so the
+    // reads are large enough to keep the disk busy on their own.
+    hash_init(&h);
+    for(;;)
+    {
+        ssize_t got = pread(fd, buf, UNDOFS_SCRUB_CHUNK, offset);
+        if(got < 0 && errno == EINVAL && direct && offset == 0)
+        {
+            // Some filesystems accept O_DIRECT at open time only.
+            close(fd);
+            fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+            if(fd < 0)
+                return -1;
+            direct = 0;
+            continue;
+        }
+        if(got < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            goto error;
+        }
+        if(! direct)
+            posix_fadvise(fd, offset, got, POSIX_FADV_DONTNEED);
+        __atomic_add_fetch(&stats.bytes, got, __ATOMIC_RELAXED);
+        if(got < UNDOFS_SCRUB_CHUNK)
+            *hash = hash_final(&h, buf, got);
+        else
+            hash_stripes(&h, buf, got);
+        offset += got;
+        stop = throttle(got);
+        if(stop || got < UNDOFS_SCRUB_CHUNK)
+            break;
+    }
+    close(fd);
+    return stop;
+
+error:
+    saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+}
+
+// Move a corrupt version out of its node, to <store>/quarantine/<node path>.<version>.
+// A node needs a version to be found at all, so the last one is replaced
+// by an empty file with its attributes.
+static void quarantine(int dirfd, const char *rel, const char *name, const struct stat *st)
+{
+    char target[PATH_MAX], nodedir[PATH_MAX], *c;
+    undofs_node_info info;
+
+    snprintf(target, PATH_MAX, "%s/%s.%s", UNDOFS_SCRUB_QUARANTINE, rel, name);
+    for(c = target + sizeof(UNDOFS_SCRUB_QUARANTINE); *c; c++)
+        if(*c == '/')
+            *c = '%';
+    if(renameat(dirfd, name, rootfd, target) != 0)
+    {
+        LOG_ERROR("Failed to quarantine %s/%s", rel, name);
+        return;
+    }
+    snprintf(nodedir, PATH_MAX, "%s/%s", source_root, rel);
+    if(undofs_scan_node(dirfd, ".", &info) == 0 && info.latest < 0)
+    {
+        int fd = openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, st->st_mode & 07777);
+        if(fd < 0 || fchown(fd, st->st_uid, st->st_gid) != 0)
+        {
+            LOG_ERROR("Failed to replace %s/%s with an empty version", rel, name);
+        } else {
+            LOG("[error] %s/%s had no other version, left an empty one in its place.", rel, name);
+        }
+        if(fd >= 0)
+            close(fd);
+    }
+    undofs_cache_invalidate(nodedir);
+    __atomic_add_fetch(&stats.quarantined, 1, __ATOMIC_RELAXED);
+    LOG("Quarantined %s/%s as %s/%s.", rel, name, source_root, target);
+}
+
+// The hashes of one node directory, read once for all of its versions.
+typedef struct {
+    int loaded;
+    undofs_meta_hash_record *records;
+    size_t count;
+} node_hashes;
+
+static int by_version(const void *key, const void *member)
+{
+    long version = *(const long *) key;
+    const undofs_meta_hash_record *record = member;
+    return version < record->version ? -1 : version > record->version;
+}
+
+static int scrub_version(int dirfd, const char *rel, const char *name, long version,
+                         node_hashes *hashes)
+{
+    char nodedir[PATH_MAX];
+    undofs_meta_hash_record record;
+    const undofs_meta_hash_record *found;
+    struct stat before, after;
+    uint64_t hash;
+    int retval;
+
+    if(fstatat(dirfd, name, &before, AT_SYMLINK_NOFOLLOW) != 0 || ! S_ISREG(before.st_mode))
+        return 0;
+    // A version that is still being written can't be judged yet.
+    if(ns(before.st_mtim) > (int64_t) clock_ns(CLOCK_REALTIME) - UNDOFS_SCRUB_SETTLE_S * 1000000000LL)
+        return 0;
+
+    __atomic_add_fetch(&stats.versions, 1, __ATOMIC_RELAXED);
+    snprintf(nodedir, PATH_MAX, "%s/%s", source_root, rel);
+    if(! hashes->loaded)
+    {
+        if(undofs_meta_read_hashes(nodedir, &hashes->records, &hashes->count) != 0)
+        {
+            LOG_ERROR("Failed to read the hashes of %s", rel);
+            return -1;
+        }
+        hashes->loaded = 1;
+    }
+    found = bsearch(&version, hashes->records, hashes->count, sizeof(*hashes->records), by_version);
+
+    retval = hash_file(dirfd, name, &before, &hash);
+    if(retval != 0)
+        return retval;
+    if(fstatat(dirfd, name, &after, AT_SYMLINK_NOFOLLOW) != 0
+       || after.st_size != before.st_size || ns(after.st_mtim) != ns(before.st_mtim))
+        return 0;   // changed while it was read
+
+    if(found && (uint64_t) before.st_size == found->size && ns(before.st_mtim) == found->mtime_ns)
+    {
+        if(hash == found->hash)
+        {
+            __atomic_add_fetch(&stats.verified, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        __atomic_add_fetch(&stats.corrupt, 1, __ATOMIC_RELAXED);
+        LOG("[error] Version %s/%s is corrupt: hash %016llx, expected %016llx.", rel, name,
+            (unsigned long long) hash, (unsigned long long) found->hash);
+        if(quarantine_corrupt)
+            quarantine(dirfd, rel, name, &before);
+        return 0;
+    }
+
+    // Never hashed, or legitimately changed since (truncate and attribute
+    // changes work on the latest version in place).
+    memset(&record, 0, sizeof(record));
+    record.version = version;
+    record.size = before.st_size;
+    record.mtime_ns = ns(before.st_mtim);
+    record.hash = hash;
+    if(undofs_meta_log_hash(nodedir, &record) != 0)
+    {
+        LOG_ERROR("Failed to log the hash of %s/%s", rel, name);
+        return -1;
+    }
+    __atomic_add_fetch(&stats.hashed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Scrub a node directory and everything below it. Returns 1 when stopped.
+static int scrub_node(int dirfd, const char *rel)
+{
+    undofs_dirscan scan;
+    node_hashes hashes = { 0, NULL, 0 };
+    const char *name;
+    char child[PATH_MAX];
+    int stop = 0;
+
+    if(undofs_dirscan_start(&scan, dirfd) != 0)
+        return -1;
+    while(! stop && (name = undofs_dirscan_next(&scan, NULL)) != NULL)
+    {
+        long version = undofs_parse_version(name);
+        size_t len = strlen(name);
+
+        if(version >= 0)
+        {
+            int retval = scrub_version(dirfd, rel, name, version, &hashes);
+            if(retval < 0)
+                __atomic_add_fetch(&stats.errors, 1, __ATOMIC_RELAXED);
+            stop = retval > 0;
+        }
+        else if(len > 5 && strcmp(name + len - 5, ".node") == 0)
+        {
+            int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+            if(fd < 0)
+                continue;   // renamed or removed since it was listed
+            snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name);
+            stop = scrub_node(fd, child) > 0;
+            close(fd);
+        }
+    }
+    undofs_dirscan_end(&scan);
+    free(hashes.records);
+    return stop;
+}
+
+static void *scrub_main(void *arg)
+{
+    for(;;)
+    {
+        uint64_t start = clock_ns(CLOCK_MONOTONIC);
+
+        stats.pass_started = clock_ns(CLOCK_REALTIME);
+        budget_start_ns = start;
+        budget_bytes = 0;
+        // The root stays open between passes, so its listing starts over.
+        lseek(rootfd, 0, SEEK_SET);
+        if(scrub_node(rootfd, "") > 0)
+            break;
+        stats.passes++;
+        stats.last_pass_done = clock_ns(CLOCK_REALTIME);
+        LOG("Scrub pass done: %llu versions, %llu corrupt.", stats.versions, stats.corrupt);
+
+        if(wait_until(start + UNDOFS_SCRUB_INTERVAL_S * 1000000000ULL))
+            break;
+    }
+    return NULL;
+}
+
+int undofs_scrub_start(const char *rootdir, unsigned long rate_mb, int quarantine)
+{
+    char path[PATH_MAX];
+
+    rootfd = open(rootdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(rootfd < 0 || posix_memalign((void **) &buf, 4096, UNDOFS_SCRUB_CHUNK) != 0)
+    {
+        LOG_ERROR("Failed to set up the scrubber");
+        return -1;
+    }
+    source_root = strdup(rootdir);
+    rate_bytes = (uint64_t) rate_mb * 1024 * 1024;
+    quarantine_corrupt = quarantine;
+    snprintf(path, PATH_MAX, "%s/%s", rootdir, UNDOFS_SCRUB_QUARANTINE);
+    if(quarantine && mkdir(path, S_IRWXU) != 0 && errno != EEXIST)
+        LOG_ERROR("Failed to create the quarantine directory %s", path);
+
+    stopping = 0;
+    if(pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0)
+    {
+        LOG_ERROR("Failed to start the scrubber thread");
+        return -1;
+    }
+    running = 1;
+    LOG("Scrubbing the store at %lu MiB/s.", rate_mb);
+    return 0;
+}
+
+void undofs_scrub_stop()
+{
+    if(! running)
+        return;
+
+    pthread_mutex_lock(&scrub_lock);
+    stopping = 1;
+    pthread_cond_signal(&scrub_wakeup);
+    pthread_mutex_unlock(&scrub_lock);
+    pthread_join(scrub_thread, NULL);
+    running = 0;
+    close(rootfd);
+    free(buf);
+}
+
+size_t undofs_scrub_stats(char *buf, size_t size)
+{
+    int len = snprintf(buf, size,
+                       "scrub_enabled %d\n"
+                       "scrub_passes %llu\n"
+                       "scrub_pass_started %lld\n"
+                       "scrub_last_pass_done %lld\n"
+                       "scrub_versions %llu\n"
+                       "scrub_hashed %llu\n"
+                       "scrub_verified %llu\n"
+                       "scrub_corrupt %llu\n"
+                       "scrub_quarantined %llu\n"
+                       "scrub_errors %llu\n"
+                       "scrub_bytes %llu\n",
+                       running, stats.passes,
+                       (long long) (stats.pass_started / 1000000000LL),
+                       (long long) (stats.last_pass_done / 1000000000LL),
+                       stats.versions, stats.hashed, stats.verified, stats.corrupt,
+                       stats.quarantined, stats.errors, stats.bytes);
+    return len < 0 ? 0 : (size_t) len >= size ? size - 1 : (size_t) len;
+}
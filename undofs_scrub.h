@@ -0,0 +1,52 @@
+#ifndef __UNDOFS_SCRUB_H_
+#define __UNDOFS_SCRUB_H_
+#include "config.h"
+
+#include <stddef.h>
+
+/*
+ * Background integrity scrubbing of stored versions.
+ *
+ * A thread walks the store and re-reads every data version at a limited
+ * bandwidth. The first time it sees a version it logs a content hash in
+ * the node's meta file; later passes check the version against it. A
+ * version whose size and mtime still match its hash but whose contents
+ * don't has been corrupted: it is reported, and with quarantine moved out
+ * of its node into the quarantine directory of the store, so the version
+ * before it becomes the latest again. A corrupt version that is the only
+ * one of its file is replaced by an empty version instead, so the file
+ * stays there, empty, until it is restored.
+ *
+ * Versions are read with O_DIRECT where the filesystem allows it, so
+ * scrubbing doesn't push the files in use out of the page cache. Versions
+ * changed in the last minute are left for the next pass.
+ */
+
+#define UNDOFS_SCRUB_CHUNK (1024 * 1024)
+#define UNDOFS_SCRUB_INTERVAL_S (24 * 3600)   // from the start of one pass to the next
+#define UNDOFS_SCRUB_SETTLE_S 60
+#define UNDOFS_SCRUB_QUARANTINE "quarantine"
+
+/**
+ * Start the scrubber thread.
+ * @param rootdir the store root.
+ * @param rate_mb the bandwidth to read at, in MiB/s.
+ * @param quarantine non-zero to move corrupted versions out of their node.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_scrub_start(const char *rootdir, unsigned long rate_mb, int quarantine);
+
+/**
+ * Stop the scrubber thread, in the middle of a pass if need be.
+ */
+void undofs_scrub_stop();
+
+/**
+ * Describe the state of the scrubber, one "name value" pair per line.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_scrub_stats(char *buf, size_t size);
+
+#endif
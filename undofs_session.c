@@ -0,0 +1,234 @@
+#include "undofs_session.h"
+#include "undofs_scan.h"
+#include "undofs_span.h"
+#include "undofs_syscount.h"
+#include "undofs_util.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct undofs_session {
+    struct undofs_session *next;
+    int creating;               // its version is still being made
+    dev_t dev;                  // the node directory, which moves with renames
+    ino_t ino;
+    long version;
+    char nodedir[PATH_MAX];     // where it was started, finds it while creating
+    char path[PATH_MAX];        // for the log
+    int refs;
+} undofs_session;
+
+// Only guards the list and the descriptor table. Versions are made and
+// opened outside of it, a session that is still creating its version
+// makes the other writers of the file wait on sessions_ready.
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sessions_ready = PTHREAD_COND_INITIALIZER;
+static undofs_session *sessions = NULL;
+
+// Sessions indexed by file descriptor, so release doesn't depend on the
+// (possibly renamed) path.
+static undofs_session **fd_sessions = NULL;
+static int fd_sessions_size = 0;
+
+// node is NULL when the node directory doesn't exist yet.
+static undofs_session *find_session(const char *nodedir, const struct stat *node)
+{
+    undofs_session *s;
+    for(s = sessions; s != NULL; s = s->next)
+    {
+        if(s->creating ? strcmp(s->nodedir, nodedir) == 0
+           : node != NULL && s->dev == node->st_dev && s->ino == node->st_ino)
+            return s;
+    }
+    return NULL;
+}
+
+// Take a session off the list, its writers keep it until they're done.
+static void detach_session(undofs_session *session)
+{
+    undofs_session **s;
+    for(s = &sessions; *s != NULL; s = &(*s)->next)
+    {
+        if(*s == session)
+        {
+            *s = session->next;
+            break;
+        }
+    }
+}
+
+static void remove_session(undofs_session *session)
+{
+    detach_session(session);
+    free(session);
+}
+
+// Whether new writers may still join a session: its version has to be the
+// latest of a live node. Once the file was deleted or renamed away, or got
+// a newer version, the name belongs to another file.
+static int session_live(const undofs_session *session, const char *path, const char *nodedir)
+{
+    return ! is_deleted(nodedir) && undofs_latest_version(path) == session->version;
+}
+
+static int register_fd(int fd, undofs_session *session)
+{
+    if(fd >= fd_sessions_size)
+    {
+        int new_size = fd_sessions_size ? fd_sessions_size : 64;
+        while(new_size <= fd)
+            new_size *= 2;
+
+        undofs_session **grown = realloc(fd_sessions, new_size * sizeof(*grown));
+        if(grown == NULL)
+            return -1;
+        memset(grown + fd_sessions_size, 0, (new_size - fd_sessions_size) * sizeof(*grown));
+        fd_sessions = grown;
+        fd_sessions_size = new_size;
+    }
+    fd_sessions[fd] = session;
+    return 0;
+}
+
+// Drop a reference that has no descriptor, with sessions_lock held.
+static void unref_session(undofs_session *session)
+{
+    if(--session->refs == 0)
+        remove_session(session);
+}
+
+// Start a session with a new version, the caller holds its only reference.
+// Called with sessions_lock held, returns without it. Returns the version
+// file in fpath, NULL on failure.
+static undofs_session *start_session(const char *path, const char *nodedir, int flags, char fpath[PATH_MAX])
+{
+    struct stat node;
+    int saved_errno;
+    undofs_session *session = calloc(1, sizeof(undofs_session));
+
+    if(session == NULL)
+    {
+        pthread_mutex_unlock(&sessions_lock);
+        return NULL;
+    }
+    session->creating = 1;
+    session->refs = 1;
+    snprintf(session->nodedir, PATH_MAX, "%s", nodedir);
+    snprintf(session->path, PATH_MAX, "%s", path);
+    session->next = sessions;
+    sessions = session;
+    pthread_mutex_unlock(&sessions_lock);
+
+    // This copies the latest version, which takes a while for big files.
+    if(undofs_new_write_path(fpath, path, flags & O_TRUNC) != 0 || sys_stat(nodedir, &node) != 0)
+    {
+        saved_errno = errno;
+        pthread_mutex_lock(&sessions_lock);
+        remove_session(session);
+        pthread_cond_broadcast(&sessions_ready);
+        pthread_mutex_unlock(&sessions_lock);
+        errno = saved_errno;
+        return NULL;
+    }
+    undofs_version_created(fpath);
+
+    pthread_mutex_lock(&sessions_lock);
+    session->dev = node.st_dev;
+    session->ino = node.st_ino;
+    session->version = undofs_parse_version(strrchr(fpath, '/') + 1);
+    session->creating = 0;
+    pthread_cond_broadcast(&sessions_ready);
+    pthread_mutex_unlock(&sessions_lock);
+    LOG("Started writer session for %s at %s", path, fpath);
+    return session;
+}
+
+int undofs_session_open(const char *path, int flags, mode_t mode)
+{
+    int fd, saved_errno;
+    char nodedir[PATH_MAX], fpath[PATH_MAX];
+    struct stat node;
+    undofs_session *session;
+
+    if(undofs_versiondir_path(nodedir, path) != 0)
+        return -1;
+
+    for(;;)
+    {
+        // A node that doesn't exist yet has no session either, unless one
+        // is creating it.
+        int exists = sys_stat(nodedir, &node) == 0;
+
+        pthread_mutex_lock(&sessions_lock);
+        session = find_session(nodedir, exists ? &node : NULL);
+        if(session == NULL)
+        {
+            session = start_session(path, nodedir, flags, fpath);
+            if(session == NULL)
+                return -1;
+            break;
+        }
+        if(session->creating)
+        {
+            pthread_cond_wait(&sessions_ready, &sessions_lock);
+            pthread_mutex_unlock(&sessions_lock);
+            continue;
+        }
+        session->refs++;
+        pthread_mutex_unlock(&sessions_lock);
+
+        if(session_live(session, path, nodedir))
+        {
+            snprintf(fpath, PATH_MAX, "%s/%ld", nodedir, session->version);
+            LOG("Joining writer session for %s at %s", path, fpath);
+            break;
+        }
+        LOG("Writer session for %s at version %ld is stale, starting another", path, session->version);
+        pthread_mutex_lock(&sessions_lock);
+        detach_session(session);
+        unref_session(session);
+        pthread_mutex_unlock(&sessions_lock);
+    }
+
+    int span = undofs_span_begin(UNDOFS_SPAN_OPEN);
+    fd = sys_open(fpath, flags, mode);
+    undofs_span_end(span);
+    saved_errno = errno;
+
+    pthread_mutex_lock(&sessions_lock);
+    if(fd >= 0 && register_fd(fd, session) != 0)
+    {
+        saved_errno = errno;
+        sys_close(fd);
+        fd = -1;
+    }
+    if(fd < 0)
+    {
+        LOG_ERROR("Failed to open %s for writing", fpath);
+        unref_session(session);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    errno = saved_errno;
+    return fd;
+}
+
+int undofs_session_close(int fd)
+{
+    pthread_mutex_lock(&sessions_lock);
+    if(fd >= 0 && fd < fd_sessions_size && fd_sessions[fd] != NULL)
+    {
+        undofs_session *session = fd_sessions[fd];
+        fd_sessions[fd] = NULL;
+        if(session->refs == 1)
+            LOG("Sealed version %ld of %s", session->version, session->path);
+        unref_session(session);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    // The slot is clear, so whoever gets the descriptor next can register it.
+    return sys_close(fd);
+}
@@ -0,0 +1,41 @@
+#ifndef __UNDOFS_SESSION_H_
+#define __UNDOFS_SESSION_H_
+#include "config.h"
+
+#include <sys/types.h>
+
+/*
+ * Writer sessions tie version creation to the open/flush/release lifecycle
+ * of a file: the first open for writing creates a new version, every other
+ * writer that opens the same file before the last one is released joins
+ * that version, and the last release seals it.  Flushes never start a new
+ * version, no matter how often they are called.
+ *
+ * Sessions belong to the node of the file rather than its path, so writers
+ * keep sharing a version when a directory above the file is renamed.  A
+ * renamed file is copied to another node, and writers that open it after
+ * that start a session there.
+ */
+
+/**
+ * Open a file for writing, starting or joining its writer session.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param path the relative path of the file, provided by FUSE.
+ * @param flags open flags. With O_TRUNC, a new version is created empty instead of as a copy.
+ * @param mode permissions used when the file is created.
+ * @return a file descriptor for the session's version, or -1 on error.
+ */
+int undofs_session_open(const char *path, int flags, mode_t mode);
+
+/**
+ * Close a file descriptor opened for writing, ending its writer session if
+ * it was the last one. File descriptors not belonging to a session are
+ * simply closed, read-only ones don't need to come through here.
+ * @param fd the file descriptor to close.
+ * @return the return value of close().
+ */
+int undofs_session_close(int fd);
+
+#endif
@@ -0,0 +1,167 @@
+#include "undofs_span.h"
+#include "undofs_trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    uint8_t step;
+    uint8_t depth;
+    uint64_t start_ns;      // since the operation started
+    uint64_t duration_ns;
+} span_record;
+
+typedef struct {
+    struct timespec when;   // wall clock time the operation started
+    uint64_t duration_ns;
+    int op;
+    int result;
+    int nspans;
+    int dropped;            // spans past UNDOFS_SLOW_OP_SPANS
+    char path[256];
+    span_record spans[UNDOFS_SLOW_OP_SPANS];
+} slow_op;
+
+#define UNDOFS_SPAN_NAME(id, name) #name,
+static const char * const step_names[] = {
+    UNDOFS_SPAN_STEPS(UNDOFS_SPAN_NAME)
+};
+#undef UNDOFS_SPAN_NAME
+
+static uint64_t threshold_ns = 0;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static slow_op ring[UNDOFS_SLOW_OPS];
+static uint64_t ring_next = 0;      // slow operations kept so far
+
+// The operation the calling thread is recording, if active.
+static __thread int active = 0;
+static __thread int depth = 0;
+static __thread uint64_t op_start_ns;
+static __thread slow_op current;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void undofs_span_set_threshold(uint64_t ns)
+{
+    __atomic_store_n(&threshold_ns, ns, __ATOMIC_RELAXED);
+}
+
+void undofs_span_op_begin(int op)
+{
+    active = __atomic_load_n(&threshold_ns, __ATOMIC_RELAXED) != 0;
+    if(! active)
+        return;
+    depth = 0;
+    current.op = op;
+    current.nspans = current.dropped = 0;
+    clock_gettime(CLOCK_REALTIME, &current.when);
+    op_start_ns = monotonic_ns();
+}
+
+void undofs_span_op_end(const char *path, int result)
+{
+    uint64_t threshold = __atomic_load_n(&threshold_ns, __ATOMIC_RELAXED);
+
+    if(! active)
+        return;
+    active = 0;
+    current.duration_ns = monotonic_ns() - op_start_ns;
+    if(threshold == 0 || current.duration_ns < threshold)
+        return;
+
+    current.result = result;
+    snprintf(current.path, sizeof(current.path), "%s", path ? path : "-");
+    pthread_mutex_lock(&ring_lock);
+    // Only the spans in use are copied.
+    memcpy(&ring[ring_next % UNDOFS_SLOW_OPS], &current,
+           offsetof(slow_op, spans) + current.nspans * sizeof(span_record));
+    ring_next++;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+int undofs_span_begin(int step)
+{
+    span_record *span;
+
+    if(! active)
+        return -1;
+    depth++;
+    if(current.nspans == UNDOFS_SLOW_OP_SPANS)
+    {
+        current.dropped++;
+        return UNDOFS_SLOW_OP_SPANS;
+    }
+    span = &current.spans[current.nspans];
+    span->step = step;
+    span->depth = depth - 1;
+    span->start_ns = monotonic_ns() - op_start_ns;
+    span->duration_ns = 0;
+    return current.nspans++;
+}
+
+void undofs_span_end(int span)
+{
+    if(! active || span < 0)
+        return;
+    depth--;
+    if(span < current.nspans)
+        current.spans[span].duration_ns = monotonic_ns() - op_start_ns - current.spans[span].start_ns;
+}
+
+size_t undofs_span_stats(char *buf, size_t size)
+{
+    int len = snprintf(buf, size,
+                       "slow_threshold_us %llu\n"
+                       "slow_ops %llu\n",
+                       (unsigned long long) __atomic_load_n(&threshold_ns, __ATOMIC_RELAXED) / 1000,
+                       (unsigned long long) __atomic_load_n(&ring_next, __ATOMIC_RELAXED));
+    return len < 0 ? 0 : (size_t) len >= size ? size - 1 : (size_t) len;
+}
+
+size_t undofs_span_slow_ops(char *buf, size_t size)
+{
+    size_t len = 0;
+    uint64_t n;
+
+#define APPEND(...) do { \
+        int n_ = snprintf(buf + len, size - len, __VA_ARGS__); \
+        if(n_ < 0 || (size_t) n_ >= size - len) \
+            goto full; \
+        len += n_; \
+    } while(0)
+
+    if(size == 0)
+        return 0;
+    buf[0] = 0;
+    pthread_mutex_lock(&ring_lock);
+    for(n = ring_next; n > 0 && ring_next - n < UNDOFS_SLOW_OPS; n--)
+    {
+        const slow_op *op = &ring[(n - 1) % UNDOFS_SLOW_OPS];
+        int i;
+
+        APPEND("%lld.%06ld %s %llu us result %d %s\n", (long long) op->when.tv_sec, op->when.tv_nsec / 1000,
+               op->op >= 0 && op->op < UNDOFS_OP_COUNT ? undofs_trace_op_names[op->op] : "unknown",
+               (unsigned long long) op->duration_ns / 1000, op->result, op->path);
+        for(i = 0; i < op->nspans; i++)
+        {
+            const span_record *span = &op->spans[i];
+            APPEND("  %*s%s +%llu us %llu us\n", 2 * span->depth, "",
+                   span->step < UNDOFS_SPAN_STEP_COUNT ? step_names[span->step] : "unknown",
+                   (unsigned long long) span->start_ns / 1000, (unsigned long long) span->duration_ns / 1000);
+        }
+        if(op->dropped)
+            APPEND("  %d more spans\n", op->dropped);
+    }
+full:
+    pthread_mutex_unlock(&ring_lock);
+#undef APPEND
+    return len;
+}
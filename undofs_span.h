@@ -0,0 +1,95 @@
+#ifndef __UNDOFS_SPAN_H_
+#define __UNDOFS_SPAN_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Tracer for slow operations.
+ *
+ * The steps operations are made of record timed spans: turning a path into
+ * a node directory, scanning a node for its latest version, checking
+ * markers, creating and cloning versions, and opening version files. Spans
+ * nest, so a clone shows up inside the new version it makes. When an
+ * operation took longer than the threshold, it is kept along with its spans
+ * in a ring of the last UNDOFS_SLOW_OPS slow operations, to tell which step
+ * a latency spike came from.
+ *
+ * Spans are kept per thread while an operation runs, so recording takes no
+ * lock; only slow operations take one, to enter the ring. Nothing is
+ * recorded while the threshold is 0.
+ *
+ * Nothing in here depends on fuse.
+ */
+
+// X-macro listing every kind of span, in enum order.
+#define UNDOFS_SPAN_STEPS(X) \
+    X(MANGLE, mangle)       \
+    X(SCAN, scan)           \
+    X(MARKER, marker)       \
+    X(VERSION, version)     \
+    X(CLONE, clone)         \
+    X(OPEN, open)
+
+#define UNDOFS_SPAN_ENUM(id, name) UNDOFS_SPAN_##id,
+enum undofs_span_step {
+    UNDOFS_SPAN_STEPS(UNDOFS_SPAN_ENUM)
+    UNDOFS_SPAN_STEP_COUNT
+};
+#undef UNDOFS_SPAN_ENUM
+
+#define UNDOFS_SLOW_OPS 64          // slow operations kept
+#define UNDOFS_SLOW_OP_SPANS 32     // spans kept of each
+
+/**
+ * Set how long an operation takes before it is kept as slow.
+ * @param ns the threshold in nanoseconds, 0 to record nothing.
+ */
+void undofs_span_set_threshold(uint64_t ns);
+
+/**
+ * Start recording an operation on the calling thread.
+ * @param op an enum undofs_trace_op.
+ */
+void undofs_span_op_begin(int op);
+
+/**
+ * Finish an operation, keeping it if it was slow.
+ * @param path the path it worked on, may be NULL.
+ * @param result its result.
+ */
+void undofs_span_op_end(const char *path, int result);
+
+/**
+ * Start a span in the operation of the calling thread.
+ * @param step an enum undofs_span_step.
+ * @return the span, for undofs_span_end(), or -1 if nothing is recorded.
+ */
+int undofs_span_begin(int step);
+
+/**
+ * End a span.
+ * @param span from undofs_span_begin().
+ */
+void undofs_span_end(int span);
+
+/**
+ * Describe the tracer, one "name value" pair per line.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_span_stats(char *buf, size_t size);
+
+/**
+ * Describe the slow operations kept, newest first: a
+ * "<unix time> <op> <us> us result <result> <path>" line each, followed
+ * by a "<step> +<us> us <us> us" line per span, indented by depth.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_span_slow_ops(char *buf, size_t size);
+
+#endif
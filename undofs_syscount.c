@@ -0,0 +1,201 @@
+#include "undofs_syscount.h"
+#include "undofs_trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Calls made outside of an operation are charged to the slot after the last one.
+#define BACKGROUND UNDOFS_OP_COUNT
+#define SLOTS (UNDOFS_OP_COUNT + 1)
+
+typedef struct syscount_counters {
+    struct syscount_counters *next;
+    int in_use;
+    uint64_t ops[SLOTS];
+    uint64_t calls[SLOTS][UNDOFS_SYS_COUNT];
+    uint64_t ns[SLOTS][UNDOFS_SYS_COUNT];
+} syscount_counters;
+
+#define UNDOFS_SYSCALL_NAME(id, name) #name,
+static const char * const syscall_names[] = {
+    UNDOFS_SYSCALLS(UNDOFS_SYSCALL_NAME)
+};
+#undef UNDOFS_SYSCALL_NAME
+
+int undofs_syscount_enabled = 0;
+
+// Counters of every thread that ever counted. They are never freed, so the
+// totals survive the thread: when it exits, its counters go to the next
+// thread that starts counting, which adds to them. The list grows only to
+// the most threads that counted at the same time.
+static syscount_counters *all_counters = NULL;
+static pthread_key_t counters_key;
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+
+static __thread syscount_counters *counters = NULL;
+static __thread int current = BACKGROUND;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void release_counters(void *c)
+{
+    counters = NULL;
+    __atomic_store_n(&((syscount_counters *) c)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_counters_key()
+{
+    pthread_key_create(&counters_key, release_counters);
+}
+
+static syscount_counters *thread_counters()
+{
+    syscount_counters *c;
+
+    if(counters != NULL)
+        return counters;
+    pthread_once(&counters_once, make_counters_key);
+    for(c = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE); c != NULL; c = c->next)
+    {
+        int expected = 0;
+        if(__atomic_compare_exchange_n(&c->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if(c == NULL)
+    {
+        c = calloc(1, sizeof(syscount_counters));
+        if(c == NULL)
+            return NULL;
+        c->in_use = 1;
+        c->next = __atomic_load_n(&all_counters, __ATOMIC_RELAXED);
+        while(! __atomic_compare_exchange_n(&all_counters, &c->next, c, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    counters = c;
+    pthread_setspecific(counters_key, c);
+    return c;
+}
+
+// Only the thread holding the counters writes them, readers may see them a bit late.
+static void bump(uint64_t *counter, uint64_t by)
+{
+    __atomic_store_n(counter, *counter + by, __ATOMIC_RELAXED);
+}
+
+void undofs_syscount_enable(int enabled)
+{
+    __atomic_store_n(&undofs_syscount_enabled, enabled != 0, __ATOMIC_RELAXED);
+}
+
+void undofs_syscount_op(int op)
+{
+    syscount_counters *c;
+
+    current = op >= 0 && op < UNDOFS_OP_COUNT ? op : BACKGROUND;
+    if(current == BACKGROUND || ! __atomic_load_n(&undofs_syscount_enabled, __ATOMIC_RELAXED))
+        return;
+    c = thread_counters();
+    if(c != NULL)
+        bump(&c->ops[current], 1);
+}
+
+uint64_t undofs_syscount_start()
+{
+    if(! __atomic_load_n(&undofs_syscount_enabled, __ATOMIC_RELAXED))
+        return 0;
+    return monotonic_ns();
+}
+
+void undofs_syscount_done(int call, uint64_t start)
+{
+    syscount_counters *c;
+
+    if(start == 0 || call < 0 || call >= UNDOFS_SYS_COUNT)
+        return;
+    c = thread_counters();
+    if(c == NULL)
+        return;
+    bump(&c->calls[current][call], 1);
+    bump(&c->ns[current][call], monotonic_ns() - start);
+}
+
+void undofs_syscount_read(int op, uint64_t *ops, uint64_t *calls, uint64_t *ns)
+{
+    syscount_counters *c;
+    int slot = op >= 0 && op < UNDOFS_OP_COUNT ? op : BACKGROUND;
+    int i;
+
+    if(ops != NULL)
+        *ops = 0;
+    for(i = 0; i < UNDOFS_SYS_COUNT; i++)
+    {
+        calls[i] = 0;
+        if(ns != NULL)
+            ns[i] = 0;
+    }
+    for(c = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE); c != NULL; c = c->next)
+    {
+        if(ops != NULL)
+            *ops += __atomic_load_n(&c->ops[slot], __ATOMIC_RELAXED);
+        for(i = 0; i < UNDOFS_SYS_COUNT; i++)
+        {
+            calls[i] += __atomic_load_n(&c->calls[slot][i], __ATOMIC_RELAXED);
+            if(ns != NULL)
+                ns[i] += __atomic_load_n(&c->ns[slot][i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+size_t undofs_syscount_stats(char *buf, size_t size)
+{
+    size_t len = 0;
+    int op, i;
+
+#define APPEND(...) do { \
+        int n_ = snprintf(buf + len, size - len, __VA_ARGS__); \
+        if(n_ < 0 || (size_t) n_ >= size - len) \
+            return len; \
+        len += n_; \
+    } while(0)
+
+    if(size == 0)
+        return 0;
+    buf[0] = '\0';
+    APPEND("syscall_stats %d\n", __atomic_load_n(&undofs_syscount_enabled, __ATOMIC_RELAXED));
+    for(op = 0; op < SLOTS; op++)
+    {
+        const char *name = op == BACKGROUND ? "background" : undofs_trace_op_names[op];
+        uint64_t ops, calls[UNDOFS_SYS_COUNT], ns[UNDOFS_SYS_COUNT];
+        uint64_t total_calls = 0, total_ns = 0;
+
+        undofs_syscount_read(op == BACKGROUND ? -1 : op, &ops, calls, ns);
+        for(i = 0; i < UNDOFS_SYS_COUNT; i++)
+        {
+            total_calls += calls[i];
+            total_ns += ns[i];
+        }
+        if(ops == 0 && total_calls == 0)
+            continue;
+
+        if(op != BACKGROUND)
+            APPEND("sys_%s_ops %llu\n", name, (unsigned long long) ops);
+        APPEND("sys_%s_calls %llu\n", name, (unsigned long long) total_calls);
+        APPEND("sys_%s_ns %llu\n", name, (unsigned long long) total_ns);
+        for(i = 0; i < UNDOFS_SYS_COUNT; i++)
+            if(calls[i] != 0)
+            {
+                APPEND("sys_%s_%s_calls %llu\n", name, syscall_names[i], (unsigned long long) calls[i]);
+                APPEND("sys_%s_%s_ns %llu\n", name, syscall_names[i], (unsigned long long) ns[i]);
+            }
+    }
+#undef APPEND
+    return len;
+}
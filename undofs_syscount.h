@@ -0,0 +1,215 @@
+#ifndef __UNDOFS_SYSCOUNT_H_
+#define __UNDOFS_SYSCOUNT_H_
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+/*
+ * Accounting of the system calls undofs makes on the store.
+ *
+ * Every call is counted and timed, and charged to the fuse operation the
+ * calling thread is handling, so the cost of an operation in system calls
+ * shows up in the stats. Calls made outside of an operation (background
+ * threads, the benchmarks) are charged to "background".
+ *
+ * Counters are per thread and only written by their thread, so counting
+ * takes no lock and shares no cache lines. Nothing is counted until
+ * accounting is enabled.
+ *
+ * The store is reached through the sys_* functions at the end, which make
+ * the system call of the same name and count it.
+ *
+ * Nothing in here depends on fuse.
+ */
+
+// X-macro listing every kind of counted call, in enum order.
+#define UNDOFS_SYSCALLS(X)  \
+    X(OPEN, open)           \
+    X(CLOSE, close)         \
+    X(STAT, stat)           \
+    X(ACCESS, access)       \
+    X(GETDENTS, getdents)   \
+    X(READ, read)           \
+    X(WRITE, write)         \
+    X(LINK, link)           \
+    X(UNLINK, unlink)       \
+    X(RENAME, rename)       \
+    X(MKDIR, mkdir)         \
+    X(ATTR, attr)           \
+    X(SYNC, sync)           \
+    X(OTHER, other)
+
+#define UNDOFS_SYSCALL_ENUM(id, name) UNDOFS_SYS_##id,
+enum undofs_syscall {
+    UNDOFS_SYSCALLS(UNDOFS_SYSCALL_ENUM)
+    UNDOFS_SYS_COUNT
+};
+#undef UNDOFS_SYSCALL_ENUM
+
+extern int undofs_syscount_enabled;
+
+/**
+ * Start or stop counting.
+ * @param enabled non-zero to count.
+ */
+void undofs_syscount_enable(int enabled);
+
+/**
+ * Charge the calls of the calling thread to an operation from now on.
+ * @param op the operation, an enum undofs_trace_op, or -1 when it is done.
+ */
+void undofs_syscount_op(int op);
+
+/**
+ * @return a start time for undofs_syscount_done(), 0 if nothing is counted.
+ */
+uint64_t undofs_syscount_start();
+
+/**
+ * Count a call that just returned.
+ * @param call the kind of call, an enum undofs_syscall.
+ * @param start from undofs_syscount_start(), before the call.
+ */
+void undofs_syscount_done(int call, uint64_t start);
+
+/**
+ * Add up the counters of all threads.
+ * @param op an enum undofs_trace_op, or -1 for background calls.
+ * @param ops receives the number of times the operation ran, may be NULL.
+ * @param calls receives the number of calls of each kind, UNDOFS_SYS_COUNT of them.
+ * @param ns receives the time spent in calls of each kind, may be NULL.
+ */
+void undofs_syscount_read(int op, uint64_t *ops, uint64_t *calls, uint64_t *ns);
+
+/**
+ * Describe the counters, one "name value" pair per line, for the
+ * operations that ran or made calls.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_syscount_stats(char *buf, size_t size);
+
+// Define sys_<call>(params), which makes the call with args and counts it
+// as kind. errno is left as the call set it.
+#define UNDOFS_SYSCOUNT_CALL(kind, type, call, params, args) \
+    static inline type sys_##call params \
+    { \
+        uint64_t start = undofs_syscount_start(); \
+        type res = call args; \
+        int saved_errno = errno; \
+        undofs_syscount_done(UNDOFS_SYS_##kind, start); \
+        errno = saved_errno; \
+        return res; \
+    }
+
+static inline int syscount_open_mode(int flags)
+{
+#ifdef O_TMPFILE
+    return (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE;
+#else
+    return (flags & O_CREAT) != 0;
+#endif
+}
+
+static inline int sys_openat(int dirfd, const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if(syscount_open_mode(flags))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    uint64_t start = undofs_syscount_start();
+    int res = openat(dirfd, path, flags, mode);
+    int saved_errno = errno;
+    undofs_syscount_done(UNDOFS_SYS_OPEN, start);
+    errno = saved_errno;
+    return res;
+}
+
+// Not every libc has a getdents64().
+static inline long sys_getdents64(int fd, void *buf, size_t size)
+{
+    uint64_t start = undofs_syscount_start();
+    long res = syscall(SYS_getdents64, fd, buf, size);
+    int saved_errno = errno;
+    undofs_syscount_done(UNDOFS_SYS_GETDENTS, start);
+    errno = saved_errno;
+    return res;
+}
+
+static inline int sys_open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    if(syscount_open_mode(flags))
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    return sys_openat(AT_FDCWD, path, flags, mode);
+}
+
+UNDOFS_SYSCOUNT_CALL(CLOSE, int, close, (int fd), (fd))
+UNDOFS_SYSCOUNT_CALL(STAT, int, stat, (const char *path, struct stat *st), (path, st))
+UNDOFS_SYSCOUNT_CALL(STAT, int, lstat, (const char *path, struct stat *st), (path, st))
+UNDOFS_SYSCOUNT_CALL(STAT, int, fstat, (int fd, struct stat *st), (fd, st))
+UNDOFS_SYSCOUNT_CALL(STAT, int, fstatat, (int dirfd, const char *path, struct stat *st, int flags), (dirfd, path, st, flags))
+UNDOFS_SYSCOUNT_CALL(STAT, int, statx, (int dirfd, const char *path, int flags, unsigned int mask, struct statx *stx),
+                     (dirfd, path, flags, mask, stx))
+UNDOFS_SYSCOUNT_CALL(STAT, int, statvfs, (const char *path, struct statvfs *st), (path, st))
+UNDOFS_SYSCOUNT_CALL(ACCESS, int, access, (const char *path, int mode), (path, mode))
+UNDOFS_SYSCOUNT_CALL(ACCESS, int, faccessat, (int dirfd, const char *path, int mode, int flags), (dirfd, path, mode, flags))
+UNDOFS_SYSCOUNT_CALL(READ, ssize_t, read, (int fd, void *buf, size_t size), (fd, buf, size))
+UNDOFS_SYSCOUNT_CALL(READ, ssize_t, pread, (int fd, void *buf, size_t size, off_t offset), (fd, buf, size, offset))
+UNDOFS_SYSCOUNT_CALL(READ, ssize_t, readlink, (const char *path, char *buf, size_t size), (path, buf, size))
+UNDOFS_SYSCOUNT_CALL(READ, ssize_t, readlinkat, (int dirfd, const char *path, char *buf, size_t size), (dirfd, path, buf, size))
+UNDOFS_SYSCOUNT_CALL(WRITE, ssize_t, write, (int fd, const void *buf, size_t size), (fd, buf, size))
+UNDOFS_SYSCOUNT_CALL(WRITE, ssize_t, pwrite, (int fd, const void *buf, size_t size, off_t offset), (fd, buf, size, offset))
+UNDOFS_SYSCOUNT_CALL(WRITE, ssize_t, copy_file_range, (int in, loff_t *in_offset, int out, loff_t *out_offset, size_t size, unsigned int flags),
+                     (in, in_offset, out, out_offset, size, flags))
+UNDOFS_SYSCOUNT_CALL(LINK, int, link, (const char *target, const char *path), (target, path))
+UNDOFS_SYSCOUNT_CALL(LINK, int, symlink, (const char *target, const char *path), (target, path))
+UNDOFS_SYSCOUNT_CALL(UNLINK, int, unlink, (const char *path), (path))
+UNDOFS_SYSCOUNT_CALL(UNLINK, int, unlinkat, (int dirfd, const char *path, int flags), (dirfd, path, flags))
+UNDOFS_SYSCOUNT_CALL(UNLINK, int, rmdir, (const char *path), (path))
+UNDOFS_SYSCOUNT_CALL(RENAME, int, rename, (const char *from, const char *to), (from, to))
+UNDOFS_SYSCOUNT_CALL(MKDIR, int, mkdir, (const char *path, mode_t mode), (path, mode))
+UNDOFS_SYSCOUNT_CALL(MKDIR, int, mknod, (const char *path, mode_t mode, dev_t dev), (path, mode, dev))
+UNDOFS_SYSCOUNT_CALL(MKDIR, int, mkfifo, (const char *path, mode_t mode), (path, mode))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, chmod, (const char *path, mode_t mode), (path, mode))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, chown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, lchown, (const char *path, uid_t uid, gid_t gid), (path, uid, gid))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, fchown, (int fd, uid_t uid, gid_t gid), (fd, uid, gid))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, utime, (const char *path, const struct utimbuf *times), (path, times))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, utimensat, (int dirfd, const char *path, const struct timespec times[2], int flags),
+                     (dirfd, path, times, flags))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, futimens, (int fd, const struct timespec times[2]), (fd, times))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, truncate, (const char *path, off_t size), (path, size))
+UNDOFS_SYSCOUNT_CALL(ATTR, int, ftruncate, (int fd, off_t size), (fd, size))
+UNDOFS_SYSCOUNT_CALL(SYNC, int, fsync, (int fd), (fd))
+UNDOFS_SYSCOUNT_CALL(SYNC, int, fdatasync, (int fd), (fd))
+UNDOFS_SYSCOUNT_CALL(OTHER, int, posix_fadvise, (int fd, off_t offset, off_t len, int advice), (fd, offset, len, advice))
+UNDOFS_SYSCOUNT_CALL(OTHER, off_t, lseek, (int fd, off_t offset, int whence), (fd, offset, whence))
+// Only ever called with an integer argument (FICLONE).
+UNDOFS_SYSCOUNT_CALL(OTHER, int, ioctl, (int fd, unsigned long request, unsigned long arg), (fd, request, arg))
+
+#undef UNDOFS_SYSCOUNT_CALL
+
+#endif
@@ -0,0 +1,134 @@
+#include "undofs_trace.h"
+#include "undofs_util.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static undofs_trace_header *trace_header = NULL;
+static undofs_trace_record *trace_records = NULL;
+static size_t trace_map_size = 0;
+
+// How far the two clocks of a trace may drift apart and still be the same
+// boot; records are decoded with the base of the file.
+#define SAME_BOOT_NS 1000000000LL
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int undofs_trace_open(const char *path, unsigned long size_mb)
+{
+    uint64_t capacity, realtime, monotonic;
+    int64_t boot_drift;
+    struct stat st;
+    void *map;
+    int fd, fresh;
+
+    if(size_mb == 0)
+        size_mb = 64;
+    capacity = ((uint64_t) size_mb * 1024 * 1024 - sizeof(undofs_trace_header)) / sizeof(undofs_trace_record);
+    trace_map_size = sizeof(undofs_trace_header) + capacity * sizeof(undofs_trace_record);
+
+    fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if(fd < 0)
+    {
+        LOG_ERROR("Failed to open trace file %s", path);
+        return -1;
+    }
+
+    if(fstat(fd, &st) != 0 || ftruncate(fd, trace_map_size) != 0)
+    {
+        LOG_ERROR("Failed to size trace file %s", path);
+        close(fd);
+        return -1;
+    }
+    fresh = (st.st_size != (off_t) trace_map_size);
+
+    map = mmap(NULL, trace_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        LOG_ERROR("Failed to map trace file %s", path);
+        return -1;
+    }
+
+    trace_header = map;
+    trace_records = (undofs_trace_record *) (trace_header + 1);
+
+    // The monotonic clock starts over at boot, so records of an earlier
+    // boot can't be placed in time next to new ones: start a new trace.
+    realtime = clock_ns(CLOCK_REALTIME);
+    monotonic = clock_ns(CLOCK_MONOTONIC);
+    boot_drift = (int64_t) (realtime - monotonic) - (int64_t) (trace_header->realtime_ns - trace_header->monotonic_ns);
+    if(! fresh && trace_header->magic == UNDOFS_TRACE_MAGIC
+       && (boot_drift > SAME_BOOT_NS || boot_drift < -SAME_BOOT_NS))
+        LOG("Trace file %s is from an earlier boot, starting it over.", path);
+
+    if(fresh
+       || trace_header->magic != UNDOFS_TRACE_MAGIC
+       || trace_header->format != UNDOFS_TRACE_FORMAT
+       || trace_header->record_size != sizeof(undofs_trace_record)
+       || trace_header->capacity != capacity
+       || boot_drift > SAME_BOOT_NS || boot_drift < -SAME_BOOT_NS)
+    {
+        memset(map, 0, trace_map_size);
+        trace_header->format = UNDOFS_TRACE_FORMAT;
+        trace_header->record_size = sizeof(undofs_trace_record);
+        trace_header->capacity = capacity;
+        trace_header->realtime_ns = realtime;
+        trace_header->monotonic_ns = monotonic;
+        __atomic_store_n(&trace_header->magic, UNDOFS_TRACE_MAGIC, __ATOMIC_RELEASE);
+    }
+    // Appending to a trace of this boot keeps its clocks, so the old
+    // records still decode to the times they were made at.
+
+    LOG("Tracing to %s, %llu records.", path, (unsigned long long) capacity);
+    return 0;
+}
+
+void undofs_trace_close()
+{
+    if(trace_header == NULL)
+        return;
+
+    msync(trace_header, trace_map_size, MS_ASYNC);
+    munmap(trace_header, trace_map_size);
+    trace_header = NULL;
+    trace_records = NULL;
+}
+
+int undofs_trace_enabled()
+{
+    return trace_header != NULL;
+}
+
+void undofs_trace_append(const undofs_trace_record *record)
+{
+    if(trace_header == NULL)
+        return;
+
+    uint64_t n = __atomic_fetch_add(&trace_header->head, 1, __ATOMIC_RELAXED);
+    undofs_trace_record *slot = &trace_records[n % trace_header->capacity];
+
+    // Invalidate the slot first, so a reader never mistakes a half-written
+    // record for a complete one.
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->start_ns = record->start_ns;
+    slot->node = record->node;
+    slot->version = record->version;
+    slot->bytes = record->bytes;
+    slot->duration_ns = record->duration_ns;
+    slot->result = record->result;
+    slot->op = record->op;
+    slot->thread = record->thread;
+    __atomic_store_n(&slot->seq, n + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,113 @@
+#ifndef __UNDOFS_TRACE_H_
+#define __UNDOFS_TRACE_H_
+#include "config.h"
+
+#include <stdint.h>
+
+/*
+ * Binary trace format, shared between undofs and undofs-tracedump.
+ *
+ * A trace file is a header followed by a fixed number of fixed-size
+ * records, used as a ring: record n is stored in slot n % capacity.  The
+ * file is memory-mapped by undofs, so appending a record costs no system
+ * calls.
+ */
+
+// X-macro listing every traced operation, in enum order.
+#define UNDOFS_TRACE_OPS(X) \
+    X(GETATTR, getattr)     \
+    X(READLINK, readlink)   \
+    X(MKNOD, mknod)         \
+    X(MKDIR, mkdir)         \
+    X(UNLINK, unlink)       \
+    X(RMDIR, rmdir)         \
+    X(SYMLINK, symlink)     \
+    X(RENAME, rename)       \
+    X(LINK, link)           \
+    X(CHMOD, chmod)         \
+    X(CHOWN, chown)         \
+    X(TRUNCATE, truncate)   \
+    X(UTIME, utime)         \
+    X(OPEN, open)           \
+    X(READ, read)           \
+    X(WRITE, write)         \
+    X(STATFS, statfs)       \
+    X(FLUSH, flush)         \
+    X(RELEASE, release)     \
+    X(FSYNC, fsync)         \
+    X(OPENDIR, opendir)     \
+    X(READDIR, readdir)     \
+    X(RELEASEDIR, releasedir) \
+    X(FSYNCDIR, fsyncdir)   \
+    X(ACCESS, access)       \
+    X(CREATE, create)       \
+    X(FTRUNCATE, ftruncate) \
+    X(FGETATTR, fgetattr)
+
+#define UNDOFS_TRACE_OP_ENUM(id, name) UNDOFS_OP_##id,
+enum undofs_trace_op {
+    UNDOFS_TRACE_OPS(UNDOFS_TRACE_OP_ENUM)
+    UNDOFS_OP_COUNT
+};
+#undef UNDOFS_TRACE_OP_ENUM
+
+#define UNDOFS_TRACE_OP_NAME(id, name) #name,
+static const char * const undofs_trace_op_names[] = {
+    UNDOFS_TRACE_OPS(UNDOFS_TRACE_OP_NAME)
+};
+#undef UNDOFS_TRACE_OP_NAME
+
+#define UNDOFS_TRACE_MAGIC 0x52544455 // "UDTR"
+#define UNDOFS_TRACE_FORMAT 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;      // number of record slots following the header
+    uint64_t head;          // number of records ever written
+    uint64_t realtime_ns;   // CLOCK_REALTIME when the file was created
+    uint64_t monotonic_ns;  // CLOCK_MONOTONIC at the same moment
+    uint64_t padding[2];
+} undofs_trace_header;
+
+typedef struct {
+    uint64_t seq;           // record number + 1, written last; 0 = slot never filled
+    uint64_t start_ns;      // CLOCK_MONOTONIC at the start of the operation
+    uint64_t node;          // hash of the path the operation was called on
+    int64_t version;        // version number touched, -1 if none
+    int64_t bytes;          // bytes transferred by read and write
+    uint32_t duration_ns;   // saturates at UINT32_MAX
+    int32_t result;         // return value of the operation
+    uint16_t op;            // enum undofs_trace_op
+    uint16_t thread;        // small per-thread number, assigned in order of first use
+    uint32_t padding;
+} undofs_trace_record;
+
+/**
+ * Open, or create, a trace file and map it into memory.
+ * An existing trace file with the same capacity is appended to.
+ * @param path location of the trace file.
+ * @param size_mb maximum size of the trace file in MiB.
+ * @return 0 on success, -1 on failure. errno will be set in case of error.
+ */
+int undofs_trace_open(const char *path, unsigned long size_mb);
+
+/**
+ * Flush and unmap the trace file, if any.
+ */
+void undofs_trace_close();
+
+/**
+ * @return non-zero when a trace file is open.
+ */
+int undofs_trace_enabled();
+
+/**
+ * Append a record to the trace ring.  Does nothing when tracing is off.
+ * Safe to call from several threads at once.
+ */
+void undofs_trace_append(const undofs_trace_record *record);
+
+#endif
@@ -0,0 +1,144 @@
+#include "config.h"
+#include "undofs_trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_CHROME };
+
+static void usage()
+{
+    fprintf(stderr, "Usage: undofs-tracedump [-f text|csv|chrome] <trace file>\n");
+    exit(1);
+}
+
+static const char *op_name(uint16_t op)
+{
+    return op < UNDOFS_OP_COUNT ? undofs_trace_op_names[op] : "unknown";
+}
+
+static void print_record(int format, const undofs_trace_header *header,
+                         const undofs_trace_record *r, int first)
+{
+    int64_t wall_ns = (int64_t) header->realtime_ns + ((int64_t) r->start_ns - (int64_t) header->monotonic_ns);
+
+    switch(format)
+    {
+    case FORMAT_TEXT:
+    {
+        char date[32];
+        time_t secs = wall_ns / 1000000000LL;
+        struct tm tm;
+        localtime_r(&secs, &tm);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%s.%06lld [t%u] %-10s node=%016llx version=%lld result=%d bytes=%lld duration=%.3fus\n",
+               date, (long long) (wall_ns % 1000000000LL) / 1000, r->thread, op_name(r->op),
+               (unsigned long long) r->node, (long long) r->version, r->result,
+               (long long) r->bytes, r->duration_ns / 1000.0);
+        break;
+    }
+    case FORMAT_CSV:
+        printf("%lld,%u,%s,%016llx,%lld,%d,%lld,%u\n",
+               (long long) wall_ns, r->thread, op_name(r->op), (unsigned long long) r->node,
+               (long long) r->version, r->result, (long long) r->bytes, r->duration_ns);
+        break;
+    case FORMAT_CHROME:
+        printf("%s{\"name\":\"%s\",\"cat\":\"undofs\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+               "\"args\":{\"node\":\"%016llx\",\"version\":%lld,\"result\":%d,\"bytes\":%lld}}",
+               first ? "\n" : ",\n", op_name(r->op), wall_ns / 1000.0, r->duration_ns / 1000.0, r->thread,
+               (unsigned long long) r->node, (long long) r->version, r->result, (long long) r->bytes);
+        break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int format = FORMAT_TEXT, opt;
+
+    while((opt = getopt(argc, argv, "f:")) != -1)
+    {
+        if(opt != 'f')
+            usage();
+        if(strcmp(optarg, "text") == 0)
+            format = FORMAT_TEXT;
+        else if(strcmp(optarg, "csv") == 0)
+            format = FORMAT_CSV;
+        else if(strcmp(optarg, "chrome") == 0)
+            format = FORMAT_CHROME;
+        else
+            usage();
+    }
+    if(optind != argc - 1)
+        usage();
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    if((size_t) st.st_size < sizeof(undofs_trace_header))
+    {
+        fprintf(stderr, "%s: not an undofs trace file\n", argv[optind]);
+        return 1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    const undofs_trace_header *header = map;
+    const undofs_trace_record *records = (const undofs_trace_record *) (header + 1);
+    if(header->magic != UNDOFS_TRACE_MAGIC
+       || header->format != UNDOFS_TRACE_FORMAT
+       || header->record_size != sizeof(undofs_trace_record)
+       || sizeof(*header) + header->capacity * sizeof(undofs_trace_record) > (size_t) st.st_size)
+    {
+        fprintf(stderr, "%s: not an undofs trace file, or an unsupported format\n", argv[optind]);
+        return 1;
+    }
+
+    // Copy head once: the file may still be written to while we read it.
+    uint64_t head = header->head;
+    uint64_t first = head > header->capacity ? head - header->capacity : 0;
+    uint64_t n, skipped = 0;
+    int printed = 0;
+
+    if(format == FORMAT_CSV)
+        printf("time_ns,thread,op,node,version,result,bytes,duration_ns\n");
+    else if(format == FORMAT_CHROME)
+        printf("{\"traceEvents\":[");
+
+    for(n = first; n < head; n++)
+    {
+        const undofs_trace_record *r = &records[n % header->capacity];
+        // Overwritten or still being written.
+        if(r->seq != n + 1)
+        {
+            skipped++;
+            continue;
+        }
+        print_record(format, header, r, !printed);
+        printed = 1;
+    }
+
+    if(format == FORMAT_CHROME)
+        printf("\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    if(skipped)
+        fprintf(stderr, "Skipped %llu incomplete records.\n", (unsigned long long) skipped);
+
+    munmap(map, st.st_size);
+    close(fd);
+    return 0;
+}
@@ -1,8 +1,20 @@
 #include "undofs_util.h"
-
-#include <dirent.h>
+#include "undofs_cache.h"
+#include "undofs_clone.h"
+#include "undofs_mangle.h"
+#include "undofs_meta.h"
+#include "undofs_mirror.h"
+#include "undofs_opwrap.h"
+#include "undofs_scan.h"
+#include "undofs_span.h"
+#include "undofs_syscount.h"
+#include "undofs_wamp.h"
+
+#include <fcntl.h>
 #include <fuse.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,12 +22,6 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-typedef struct {
-    const char* rootdir;
-} undofs_state;
-
-#define PRIVATE_DATA ((undofs_state *) fuse_get_context()->private_data)
-
 static FILE* logf = NULL;
 FILE* undofs_logfile()
 {
@@ -29,130 +35,256 @@ FILE* undofs_logfile()
     return logf;
 }
 
-void* create_private_data(const char* rootdir)
+undofs_state* create_private_data(const char* rootdir)
 {
     undofs_state* context = calloc(sizeof(undofs_state), 1);
     context->rootdir = rootdir;
+    context->clone_threads = UNDOFS_CLONE_THREADS;
     return context;
 }
 
 int undofs_versiondir_path(char* fpath, const char *path)
 {
-    if(strcmp(path, "/") == 0)
+    int span = undofs_span_begin(UNDOFS_SPAN_MANGLE);
+    int res = undofs_mangle(fpath, PRIVATE_DATA->rootdir, path);
+    undofs_span_end(span);
+    if(res)
+    {
+        LOG_ERROR("Ran out of space before finishing mangling %s, result so far: %s", path, fpath);
+        return -1;
+    }
+
+    LOG("Mangle '%s' -> '%s'.", path, fpath);
+    return 0;
+}
+
+// undofs_scan_node() through the node cache.
+static int lookup_node(const char *nodedir, undofs_node_info *info)
+{
+    switch(undofs_cache_lookup(nodedir, info))
     {
-        snprintf(fpath, PATH_MAX, "%s", PRIVATE_DATA->rootdir);
+    case 1:
         return 0;
+    case 0:
+        errno = ENOENT;
+        return -1;
     }
-    else
+
+    uint64_t ticket = undofs_cache_ticket();
+    if(undofs_scan_node(AT_FDCWD, nodedir, info) != 0)
     {
-        int i = 0;
-        const char* path_pos = path;
-        char * fpath_pos = fpath;
-        i = snprintf(fpath, PATH_MAX, "%s", PRIVATE_DATA->rootdir);
-        fpath_pos += i;
-
-        // Ignore leading '/' for mangling.
-        while(*path_pos == '/')
+        if(errno == ENOENT)
         {
-            *fpath_pos++ = *path_pos++;
-            i++;
-        }
-        
-        // 12 is reserved for inserting a .node/ + final .node\0
-        while(fpath_pos + 12 < fpath + PATH_MAX
-              && *path_pos)
-        {
-            if(*path_pos == '/')
-            {
-                *fpath_pos++ = '.';
-                *fpath_pos++ = 'n';
-                *fpath_pos++ = 'o';
-                *fpath_pos++ = 'd';
-                *fpath_pos++ = 'e';
-                // Skip double slashes in filenames.
-                while(path_pos[1] == '/') path_pos++;
-            }
-            *fpath_pos++ = *path_pos++;
+            undofs_cache_store(nodedir, NULL, ticket);
+            errno = ENOENT;
         }
+        return -1;
+    }
+    undofs_cache_store(nodedir, info, ticket);
+    return 0;
+}
 
-        if (*path_pos)
-        {
-            *fpath_pos = 0;
-            errno = ENAMETOOLONG;
-            LOG_ERROR("Ran out of space before finishing mangling %s, result so far: %s", path, fpath);
-            return -1;
-        }
-        
-        // Trailing .node need not be added for root directory.
-        if(fpath_pos - fpath > i)
-        {
-            *fpath_pos++ = '.';
-            *fpath_pos++ = 'n';
-            *fpath_pos++ = 'o';
-            *fpath_pos++ = 'd';
-            *fpath_pos++ = 'e';
-        }
-        *fpath_pos++ = '\0';
+// The same, recorded as a scan span of the operation.
+static int scan_node_cached(const char *nodedir, undofs_node_info *info)
+{
+    int span = undofs_span_begin(UNDOFS_SPAN_SCAN);
+    int res = lookup_node(nodedir, info);
+    undofs_span_end(span);
+    return res;
+}
+
+// The node directory a node is in. Fails for the root.
+static int parent_node(char parent[PATH_MAX], const char *nodedir)
+{
+    char *slash;
+
+    if(strcmp(nodedir, PRIVATE_DATA->rootdir) == 0)
+        return -1;
+    snprintf(parent, PATH_MAX, "%s", nodedir);
+    slash = strrchr(parent, '/');
+    if(slash == NULL)
+        return -1;
+    *slash = 0;
+    return 0;
+}
+
+// Children of a deleted subtree are only marked deleted when they are
+// first looked at again. info is the node, if the caller has it already.
+static int resolve_purge(const char *path, const undofs_node_info *info)
+{
+    char parent[PATH_MAX];
+    undofs_node_info dir, node;
 
-        LOG("Mangle '%s' -> '%s'.", path, fpath);
+    if(parent_node(parent, path) != 0 || lookup_node(parent, &dir) != 0 || dir.purge_gen == 0)
         return 0;
+    if(info == NULL)
+    {
+        if(lookup_node(path, &node) != 0)
+            return 0;
+        info = &node;
     }
-    
+    if(! undofs_scan_purged(dir.purge_gen, info))
+        return 0;
+
+    LOG("%s was deleted along with %s, marking it deleted.", path, parent);
+    if(info->is_dir)
+    {
+        // Its own children went with it.
+        if(undofs_mark_purged(path) != 0)
+            LOG_ERROR("Failed to pass on the subtree delete to %s", path);
+        undofs_meta_reset_children(path);
+    }
+    if(undofs_mark_deleted(path) != 0)
+        LOG_ERROR("Failed to mark %s deleted", path);
+    return 1;
 }
 
 long undofs_latest_version(const char *path)
 {
     char fpath[PATH_MAX];
-    long max_file = -1;
+    undofs_node_info info;
 
     if(undofs_versiondir_path(fpath, path))
         return -1;
 
-    DIR *dirp = opendir(fpath);
-
-    if(dirp == NULL)
+    if(scan_node_cached(fpath, &info) != 0)
     {
         if(errno != ENOENT)
             LOG_ERROR("Failed to look up file version for %s", path);
-    } else {
-        struct dirent entry, *not_end = &entry;
-        while(not_end)
-        {
-            if(readdir_r(dirp, &entry, &not_end) != 0)
-            {
-                max_file = -1;
-                break;
-            }
-            long curr_file = strtol(entry.d_name,NULL,10);
-            if(curr_file > max_file)
-                max_file = curr_file;
-        }
+        return -1;
     }
-    closedir(dirp);
 
-    LOG("Latest version of %s is %ld", path, max_file);
-    return max_file;
+    LOG("Latest version of %s is %ld", path, info.latest);
+    return info.latest;
 }
 
 int undofs_latest_path(char *fpath, const char *path)
 {
-    long version = undofs_latest_version(path);
+    long version;
+    return undofs_latest_version_path(fpath, &version, path);
+}
+
+int undofs_latest_version_path(char *fpath, long *version_out, const char *path)
+{
     char directory_path[PATH_MAX];
+    undofs_node_info info;
     if(undofs_versiondir_path(directory_path, path))
         return -1;
 
-    if(is_deleted(directory_path))
+    // One pass over the node directory finds the version and both markers.
+    if(scan_node_cached(directory_path, &info) != 0)
+    {
+        if(errno != ENOENT)
+            LOG_ERROR("Failed to look up file version for %s", path);
+        info.latest = -1;
+        info.is_dir = info.deleted = 0;
+    }
+
+    if(!info.deleted && (info.is_dir || info.latest >= 0))
+    {
+        int span = undofs_span_begin(UNDOFS_SPAN_MARKER);
+        info.deleted = resolve_purge(directory_path, &info);
+        undofs_span_end(span);
+    }
+
+    long version = info.latest;
+    if(info.deleted)
         version++;
-    if(is_directory(directory_path))
+    undofs_op_version(version);
+    if(info.is_dir)
+    {
         snprintf(fpath, PATH_MAX, "%s", directory_path);
-    else
+        *version_out = -1;
+    } else {
         snprintf(fpath, PATH_MAX, "%s/%ld", directory_path, version);
+        *version_out = version;
+    }
     return 0;
 }
 
-int undofs_new_path(char fpath[PATH_MAX], const char *path)
+// Create an empty file with the permissions and ownership of src, so a
+// truncating open doesn't need to copy data it is about to throw away.
+static int create_empty_like(const char *src, const char *dst)
+{
+    struct stat st;
+    if(sys_lstat(src, &st) != 0)
+        return -1;
+
+    if(! S_ISREG(st.st_mode))
+        return clone_file(src, dst);
+
+    int fd = sys_open(dst, O_CREAT | O_EXCL | O_WRONLY, st.st_mode & 07777);
+    if(fd < 0)
+        return -1;
+
+    // Best effort, like cp -a: only root can give files away.
+    if(sys_fchown(fd, st.st_uid, st.st_gid) != 0)
+        LOG("Could not preserve ownership of %s on %s", src, dst);
+    sys_close(fd);
+    return 0;
+}
+
+// Move a superseded tiny version into the meta file of its node, and make
+// the new version from the contents read on the way, instead of cloning.
+// Returns 1 if the version doesn't qualify and nothing was done.
+static int new_inline_version(const char *path, const char *directory_path, const char *old_path,
+                              const char *fpath, long version, int copy)
+{
+    char data[UNDOFS_META_INLINE_LIMIT];
+    struct stat st;
+    ssize_t got;
+    int fd, out;
+
+    fd = sys_open(old_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd < 0)
+        return 1;
+    // Hard links are shared with another node, which still needs the inode.
+    if(sys_fstat(fd, &st) != 0 || ! S_ISREG(st.st_mode) || st.st_nlink > 1
+       || (unsigned long) st.st_size > PRIVATE_DATA->inline_max)
+    {
+        sys_close(fd);
+        return 1;
+    }
+    got = sys_read(fd, data, st.st_size);
+    sys_close(fd);
+    if(got != st.st_size)
+        return 1;
+
+    out = sys_open(fpath, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, st.st_mode & 07777);
+    if(out < 0)
+        return -1;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    if((copy && sys_write(out, data, got) != got)
+       || (sys_fchown(out, st.st_uid, st.st_gid) != 0 && errno != EPERM)
+       || (copy && sys_futimens(out, times) != 0))
+    {
+        int saved_errno = errno;
+        sys_close(out);
+        sys_unlink(fpath);
+        errno = saved_errno;
+        return -1;
+    }
+    sys_close(out);
+    if(copy)
+        undofs_wamp_add(path, UNDOFS_WAMP_BYTES_COPIED, got);
+
+    // Until the old file is gone the version exists twice, which is harmless.
+    if(undofs_meta_log_inline(directory_path, version, &st, data, got) != 0)
+    {
+        LOG_ERROR("Failed to store version %ld of %s inline, keeping its file", version, directory_path);
+    } else if(sys_unlink(old_path) != 0) {
+        LOG_ERROR("Failed to remove %s after storing it inline", old_path);
+    } else {
+        LOG("Stored version %ld of %s inline (%zd bytes)", version, directory_path, got);
+        undofs_wamp_add(path, UNDOFS_WAMP_VERSIONS_INLINED, 1);
+    }
+    return 0;
+}
+
+static int make_version(char fpath[PATH_MAX], const char *path, int copy, int inline_old)
 {
     long version = undofs_latest_version(path);
+    int born = 0;
 
     char directory_path[PATH_MAX], old_path[PATH_MAX];
     if(undofs_versiondir_path(directory_path, path))
@@ -169,76 +301,124 @@ int undofs_new_path(char fpath[PATH_MAX], const char *path)
     snprintf(old_path, PATH_MAX, "%s/%ld", directory_path, version);
     snprintf(fpath, PATH_MAX, "%s/%ld", directory_path, version+1);
     LOG("Creating new version at %s", fpath);
+    undofs_op_version(version+1);
 
     if(version >= 0)
     {
         int deleted = is_deleted(directory_path);
 
-        if(deleted)
-            undelete(directory_path);
+        if(deleted && undelete(directory_path) == 0)
+        {
+            undofs_adjust_parent(directory_path, 1);
+            born = 1;
+        }
+
+        int res = 1;
+        if(!deleted && inline_old && PRIVATE_DATA->inline_max > 0)
+            res = new_inline_version(path, directory_path, old_path, fpath, version, copy);
 
-        if(!deleted)
+        if(res < 0)
+        {
+            LOG_ERROR("Failed to create a new version of '%s'", path);
+            return -1;
+        }
+        else if(res > 0 && !deleted && copy)
         {
             if(clone_file(old_path, fpath) != 0)
             {
                 LOG_ERROR("Failed to create a new version of '%s'", path);
                 return -1;
             }
+            undofs_count_copy(path, fpath);
+        }
+        else if(res > 0 && !deleted)
+        {
+            if(create_empty_like(old_path, fpath) != 0)
+            {
+                LOG_ERROR("Failed to create an empty new version of '%s'", path);
+                return -1;
+            }
         }
     } else {
-        int res = mkdir(directory_path, S_IRWXU);
-        if(res != 0)
+        // The node directory can exist without any versions in it, if an
+        // earlier attempt to create the file failed halfway.
+        int res = sys_mkdir(directory_path, S_IRWXU);
+        if(res != 0 && errno != EEXIST)
         {
             LOG_ERROR("Failed to create new directory for %s", directory_path);
             return -1;
         }
+        undofs_adjust_parent(directory_path, 1);
+        born = 1;
     }
 
+    undofs_wamp_add(path, UNDOFS_WAMP_VERSIONS_CREATED, 1);
+    undofs_cache_invalidate(directory_path);
+    if(born && undofs_mark_born(directory_path) != 0)
+        LOG_ERROR("Failed to mark %s born, a subtree delete of its directory may hide it", directory_path);
     return 0;
 }
 
+static int new_version(char fpath[PATH_MAX], const char *path, int copy, int inline_old)
+{
+    int span = undofs_span_begin(UNDOFS_SPAN_VERSION);
+    int res = make_version(fpath, path, copy, inline_old);
+    undofs_span_end(span);
+    return res;
+}
+
+void undofs_count_copy(const char *path, const char *fpath)
+{
+    struct stat st;
+    if(sys_lstat(fpath, &st) == 0 && S_ISREG(st.st_mode))
+        undofs_wamp_add(path, UNDOFS_WAMP_BYTES_COPIED, st.st_size);
+}
+
+void undofs_version_created(const char *fpath)
+{
+    char directory_path[PATH_MAX];
+    char *slash;
+
+    snprintf(directory_path, PATH_MAX, "%s", fpath);
+    slash = strrchr(directory_path, '/');
+    if(slash != NULL)
+        *slash = 0;
+    undofs_cache_invalidate(directory_path);
+}
+
+int undofs_new_path(char fpath[PATH_MAX], const char *path)
+{
+    return new_version(fpath, path, 1, 0);
+}
+
+int undofs_new_empty_path(char fpath[PATH_MAX], const char *path)
+{
+    return new_version(fpath, path, 0, 0);
+}
+
+int undofs_new_write_path(char fpath[PATH_MAX], const char *path, int truncate)
+{
+    return new_version(fpath, path, !truncate, 1);
+}
+
+void undofs_adjust_parent(const char *nodedir, int delta)
+{
+    char parent[PATH_MAX];
+
+    if(parent_node(parent, nodedir) != 0)
+        return;
+
+    if(undofs_meta_adjust_children(parent, delta) != 0)
+        LOG_ERROR("Failed to update the child count of %s", parent);
+    undofs_mirror_parent(nodedir);
+}
+
 int undofs_clean_name(char* name, const char *mangled)
 {
-    // TODO: ENAMETOOLONG
-    char *name_pos = name;
-    const char *mangled_pos = mangled;
-    int demangled_last_char = 1, retval = 0;
-
-    // Ignore leading rootdir
-    size_t rootdir_len = strlen(PRIVATE_DATA->rootdir);
-    if(strncmp(PRIVATE_DATA->rootdir, mangled, rootdir_len) == 0)
-        mangled_pos += rootdir_len;
-    
-    // Ignore leading '/' for demangling.
-    if(*mangled_pos == '/')
-        *name_pos++ = *mangled_pos++;
-
-    while(*mangled_pos)
-    {
-        // Skip .node at end of string or before path separator.
-        if(strncmp(mangled_pos, ".node", 5) == 0 &&
-           (mangled_pos[5] == '/' || mangled_pos[5] == '\0'))
-        {
-            demangled_last_char = 1;
-            mangled_pos += 5;
-        } else {
-            if(*mangled_pos == '/' && demangled_last_char == 0)
-            {
-                retval = -1;
-                *name_pos = 0; // Null-terminate for print
-                LOG("Warning: filename '%s' is not fully mangled (at '%s').", mangled, name);
-            }
-            *name_pos++ = *mangled_pos++;
-            demangled_last_char = 0;
-        }
-    }
-    *name_pos = 0;
+    int retval = undofs_demangle(name, PRIVATE_DATA->rootdir, mangled);
 
-    if (demangled_last_char == 0)
-    {
-        retval = -1;
-        LOG("Warning: filename '%s' is not fully mangled (at '%s').", mangled, name);
-    }
+    if(retval)
+        LOG("Warning: filename '%s' is not fully mangled (demangled to '%s').", mangled, name);
 
     LOG("Demangle '%s' -> '%s'", mangled, name);
     return retval;
@@ -247,40 +427,221 @@ int undofs_clean_name(char* name, const char *mangled)
 int is_directory(const char *path)
 {
     char directory_path[PATH_MAX];
+    int span = undofs_span_begin(UNDOFS_SPAN_MARKER);
     snprintf(directory_path, PATH_MAX, "%s/dir", path);
-    return (access(directory_path, F_OK) == 0);
+    int res = sys_access(directory_path, F_OK) == 0;
+    undofs_span_end(span);
+    return res;
 }
 
 int is_deleted(const char *path)
 {
     char deleted_path[PATH_MAX];
+    int span = undofs_span_begin(UNDOFS_SPAN_MARKER);
     snprintf(deleted_path, PATH_MAX, "%s/deleted", path);
-    return (access(deleted_path, F_OK) == 0);
+    int res = sys_access(deleted_path, F_OK) == 0 || resolve_purge(path, NULL);
+    undofs_span_end(span);
+    return res;
+}
+
+// Deleted markers are hard links to one empty file, so deleting many files
+// doesn't allocate an inode for each of them.
+static pthread_mutex_t marker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int new_marker_template(const char *template_path)
+{
+    char new_path[PATH_MAX];
+    int fd, retval = 0;
+
+    pthread_mutex_lock(&marker_lock);
+    snprintf(new_path, PATH_MAX, "%s.new", template_path);
+    fd = sys_open(new_path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, S_IRUSR);
+    if(fd < 0 || sys_rename(new_path, template_path) != 0)
+        retval = -1;
+    if(fd >= 0)
+        sys_close(fd);
+    pthread_mutex_unlock(&marker_lock);
+    return retval;
+}
+
+// Create an empty marker file. Fails with EEXIST if it is already there.
+static int make_marker(const char *marker)
+{
+    char template_path[PATH_MAX];
+    int attempt;
+
+    snprintf(template_path, PATH_MAX, "%s/marker.template", PRIVATE_DATA->rootdir);
+
+    for(attempt = 0; attempt < 2; attempt++)
+    {
+        if(sys_link(template_path, marker) == 0)
+            return 0;
+        // A missing template is created, a full one replaced.
+        if(attempt > 0 || (errno != ENOENT && errno != EMLINK))
+            break;
+        if(new_marker_template(template_path) != 0)
+            break;
+    }
+
+    if(errno == EEXIST)
+        return -1;
+    LOG("Could not link %s to the marker template, creating it.", marker);
+    return touch(marker);
+}
+
+int undofs_mark_deleted(const char *path)
+{
+    char marker[PATH_MAX];
+    int retval;
+
+    snprintf(marker, PATH_MAX, "%s/deleted", path);
+    retval = make_marker(marker);
+    if(retval == 0 || errno != EEXIST)
+        undofs_cache_invalidate(path);
+    return retval;
+}
+
+static int remove_marker(const char *nodedir, const char *marker)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, PATH_MAX, "%s/%s", nodedir, marker);
+    return sys_unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+// Markers holding a number are replaced through a temporary link, so the
+// number can always be read.
+static int set_number(const char *nodedir, const char *marker, uint64_t number)
+{
+    char path[PATH_MAX], tmp[PATH_MAX], target[24];
+    int retval;
+
+    snprintf(path, PATH_MAX, "%s/%s", nodedir, marker);
+    snprintf(tmp, PATH_MAX, "%s.new", path);
+    snprintf(target, sizeof(target), "%" PRIu64, number);
+    pthread_mutex_lock(&marker_lock);
+    sys_unlink(tmp);
+    retval = sys_symlink(target, tmp);
+    if(retval == 0 && (retval = sys_rename(tmp, path)) != 0)
+        sys_unlink(tmp);
+    pthread_mutex_unlock(&marker_lock);
+    return retval;
+}
+
+static int set_generation(const char *nodedir, const char *marker, uint32_t gen)
+{
+    if(gen == 0)
+        return remove_marker(nodedir, marker);
+    return set_number(nodedir, marker, gen);
+}
+
+int undofs_mark_purged(const char *nodedir)
+{
+    undofs_node_info info;
+    int retval;
+
+    if(undofs_scan_node(AT_FDCWD, nodedir, &info) != 0)
+        return -1;
+    retval = set_generation(nodedir, UNDOFS_PURGE_MARKER, info.purge_gen + 1);
+    undofs_cache_invalidate(nodedir);
+    return retval;
+}
+
+int undofs_mark_born(const char *nodedir)
+{
+    char parent[PATH_MAX];
+    undofs_node_info dir, info;
+    int retval;
+
+    if(parent_node(parent, nodedir) != 0)
+        return 0;
+    if(lookup_node(parent, &dir) != 0 || lookup_node(nodedir, &info) != 0)
+        return -1;
+    if(info.born == dir.purge_gen)
+        return 0;
+    retval = set_generation(nodedir, UNDOFS_BORN_MARKER, dir.purge_gen);
+    undofs_cache_invalidate(nodedir);
+    return retval;
+}
+
+uint64_t undofs_node_ino(const char *path)
+{
+    char nodedir[PATH_MAX];
+    undofs_node_info info;
+
+    if(undofs_versiondir_path(nodedir, path) || scan_node_cached(nodedir, &info) != 0)
+        return 0;
+    return info.ino;
+}
+
+// Give a node the inode number ino, 0 for none.
+static int set_node_ino(const char *nodedir, uint64_t ino)
+{
+    struct stat st;
+
+    if(sys_stat(nodedir, &st) != 0)
+        return -1;
+    if(ino == (uint64_t) st.st_ino)
+        return remove_marker(nodedir, UNDOFS_INODE_MARKER);
+    return set_number(nodedir, UNDOFS_INODE_MARKER, ino);
+}
+
+int undofs_swap_inodes(const char *nodedir, const char *newnodedir)
+{
+    undofs_node_info from, to;
+    int retval = -1;
+
+    if(undofs_scan_node(AT_FDCWD, nodedir, &from) != 0 || undofs_scan_node(AT_FDCWD, newnodedir, &to) != 0)
+        return -1;
+    if(from.is_dir || to.is_dir)
+    {
+        errno = EISDIR;
+        return -1;
+    }
+    // The file left nodedir, so it gives up its number first and no two
+    // nodes ever share one, even if we stop half way.
+    if(set_node_ino(nodedir, 0) == 0 && set_node_ino(newnodedir, from.ino) == 0)
+        retval = set_node_ino(nodedir, to.ino);
+    undofs_cache_invalidate(newnodedir);
+    undofs_cache_invalidate(nodedir);
+    return retval;
 }
 
 int undelete(const char *path)
 {
     char deleted_path[PATH_MAX];
     snprintf(deleted_path, PATH_MAX, "%s/deleted", path);
-    return unlink(deleted_path);
+    int retval = sys_unlink(deleted_path);
+    undofs_cache_invalidate(path);
+    return retval;
 }
 
 int touch(const char *path)
 {
     LOG("Touching %s", path);
-    int retstat = open(path, O_CREAT | O_EXCL | O_WRONLY);
+    int retstat = sys_open(path, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR);
     if (retstat < 0)
         return -1;
 
-    close(retstat);
+    sys_close(retstat);
     return 0;
 }
 
-int clone_file(const char *src, const char *dst)
+static int clone_any(const char *src, const char *dst)
 {
     int childExitStatus;
     pid_t pid;
 
+    // Regular files are copied in-process, in parallel when they're large.
+    // Symbolic links and special files still go through cp.
+    if(undofs_clone(src, dst, PRIVATE_DATA->clone_threads) == 0)
+        return 0;
+    if(errno != EINVAL)
+    {
+        LOG_ERROR("Failed to clone %s to %s", src, dst);
+        return -1;
+    }
+
     pid = fork();
 
     if(pid == 0)
@@ -313,3 +674,11 @@ int clone_file(const char *src, const char *dst)
     LOG_ERROR("Reached end of clone_file while copying %s to %s", src, dst);
     return -1;
 }
+
+int clone_file(const char *src, const char *dst)
+{
+    int span = undofs_span_begin(UNDOFS_SPAN_CLONE);
+    int res = clone_any(src, dst);
+    undofs_span_end(span);
+    return res;
+}
@@ -2,8 +2,10 @@
 #define __UNDOFS_UTILS_H_
 #include "config.h"
 
+#include <fuse.h>
 #include <sys/wait.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
@@ -16,6 +18,29 @@
 #define LOG_ERROR(fmt, ...)
 #endif
 
+/**
+ * Mount-wide state, passed to fuse as private data.
+ */
+typedef struct {
+    const char* rootdir;
+    char* trace_path;
+    unsigned long trace_size_mb;
+    char* capture_path;
+    int syscall_stats;          // count system calls per operation, see undofs_syscount.h
+    unsigned long slow_ms;      // keep operations slower than this, see undofs_span.h
+    int clone_threads;
+    char* clone_method;         // a name for undofs_clone_method_parse(), NULL to probe
+    char* clone_cache;          // a name for undofs_clone_cache_parse(), NULL to keep
+    char* cache_policy;         // a name for undofs_cachepolicy_parse(), NULL for both
+    char* cache_rules;          // per path cache policies, see undofs_cachepolicy.h
+    char* mirror_path;
+    unsigned long scrub_rate_mb;
+    int scrub_quarantine;
+    unsigned long inline_max;   // superseded versions up to this size move into the meta file
+} undofs_state;
+
+#define PRIVATE_DATA ((undofs_state *) fuse_get_context()->private_data)
+
 FILE* undofs_logfile();
 
 /**
@@ -23,7 +48,7 @@ FILE* undofs_logfile();
  * @param rootdir The root directory to use for data storage.
  * @return pointer to be used as private data by fuse.
  */
-void* create_private_data(const char* rootdir);
+undofs_state* create_private_data(const char* rootdir);
 
 /**
  * Convert a relative path to the absolute directory path containing the different revisions of a file.
@@ -49,6 +74,15 @@ long undofs_latest_version(const char *path);
  */
 int undofs_latest_path(char* fpath, const char *path);
 
+/**
+ * Like undofs_latest_path(), but also return the version number.
+ * @param fpath container for the absolute file path.
+ * @param version receives the version number, or -1 for directories.
+ * @param path original relative path provided by FUSE.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_latest_version_path(char* fpath, long *version, const char *path);
+
 /**
  * Convert an undofs mangled filename to a clean name.
  * @param name container for the clean filename.
@@ -65,15 +99,110 @@ int undofs_clean_name(char* name, const char *mangled);
  */
 int undofs_new_path(char* fpath, const char *path);
 
+/**
+ * Create a new, empty revision of a file, without copying the latest version.
+ * Used when the caller is about to truncate the file anyway.
+ * @param fpath container for the absolute path to the new version.
+ * @param path the relative path of the file, provided by FUSE.
+ * @return return 0 on succes, or a negative number on error.
+ */
+int undofs_new_empty_path(char* fpath, const char *path);
+
+/**
+ * Create a new revision of a file for a writer session, see undofs_session.h.
+ * Nothing else writes to the version it supersedes any more, so with
+ * inline_max set a tiny one is moved into the meta file of the node.
+ * @param fpath container for the absolute path to the new version.
+ * @param path the relative path of the file, provided by FUSE.
+ * @param truncate non-zero to create the new version empty instead of as a copy.
+ * @return return 0 on succes, or a negative number on error.
+ */
+int undofs_new_write_path(char* fpath, const char *path, int truncate);
+
+/**
+ * Let the node cache know a version was created, after creating the file
+ * returned by undofs_new_path() or undofs_new_empty_path().
+ * @param fpath the absolute path of the new version.
+ */
+void undofs_version_created(const char *fpath);
+
+/**
+ * Count a version that was made as a copy, see undofs_wamp.h.
+ * @param path the relative path of the file, provided by FUSE.
+ * @param fpath the absolute path of the new version.
+ */
+void undofs_count_copy(const char *path, const char *fpath);
+
+/**
+ * Get the stable inode number of a file, the one getattr reports.
+ * @param path original relative path provided by FUSE.
+ * @return the inode number, or 0 if the path is a directory or can't be looked up.
+ */
+uint64_t undofs_node_ino(const char *path);
+
+/**
+ * Swap the inode numbers of two file nodes, after a file was renamed by
+ * copying it from one to the other, so the file keeps its number.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node the file was renamed from, as returned by undofs_versiondir_path().
+ * @param newnodedir the node it was renamed to.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_swap_inodes(const char *nodedir, const char *newnodedir);
+
+/**
+ * Update the live children counter of the directory containing a node,
+ * after the node was created, deleted or undeleted. Failures are logged.
+ * @param nodedir the node path, as returned by undofs_versiondir_path().
+ * @param delta the change in live children of its parent.
+ */
+void undofs_adjust_parent(const char *nodedir, int delta);
+
 /**
  * Check if a file or directory is marked as deleted.
  * A non-existent file is considered to not have been deleted.
+ * Nodes that were deleted along with a whole subtree get their marker here.
  *
  * @param path The path to the file or directory, should be the output of undofs_directory_path or undofs_versiondir_path.
  * @return 0 if the file is not marked as deleted, non-zero if it is.
  */
 int is_deleted(const char *path);
 
+/**
+ * Mark a file or directory as deleted.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param path The path to the file or directory, should be the output of undofs_versiondir_path.
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_mark_deleted(const char *path);
+
+/**
+ * Delete the whole subtree of a directory node: advance its purge
+ * generation, so its children are found deleted when they are looked up.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the directory node, as returned by undofs_versiondir_path().
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_mark_purged(const char *nodedir);
+
+/**
+ * Record that a node came to life in its directory, after it was created,
+ * undeleted or moved there, so earlier subtree deletes of the directory
+ * don't apply to it.
+ *
+ * In case of an error, errno will be set appropriately.
+ *
+ * @param nodedir the node, as returned by undofs_versiondir_path().
+ * @return 0 on success, -1 on failure.
+ */
+int undofs_mark_born(const char *nodedir);
+
 /**
  * Undelete a file.
  * @param path The path to the file or directory, should be the output of undofs_directory_path or undofs_versiondir_path.
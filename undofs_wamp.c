@@ -0,0 +1,159 @@
+#include "undofs_wamp.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int used;                       // set once name is filled in
+    char name[NAME_MAX + 1];
+    uint64_t counts[UNDOFS_WAMP_COUNTERS];
+} wamp_dir;
+
+static const char *counter_names[] = {
+    "bytes_written", "bytes_copied", "versions_created", "versions_discarded", "versions_inlined"
+};
+
+static uint64_t totals[UNDOFS_WAMP_COUNTERS];
+static wamp_dir dirs[UNDOFS_WAMP_DIRS];
+static uint64_t dirs_dropped = 0;   // updates that found the table full
+static pthread_mutex_t insert_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a over the first len bytes of name.
+static uint64_t name_hash(const char *name, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for(i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The slot of the top-level directory of a path, added if it is new, or
+// NULL if the table is full. Slots are never removed, so an open-addressed
+// table needs no lock to find them.
+static wamp_dir *find_dir(const char *path)
+{
+    const char *name;
+    size_t len, i;
+    uint64_t hash;
+
+    while(*path == '/')
+        path++;
+    len = strcspn(path, "/");
+    if(path[len] == 0)
+    {
+        name = "/";
+        len = 1;
+    } else {
+        name = path;
+    }
+    if(len > NAME_MAX)
+        return NULL;
+
+    hash = name_hash(name, len);
+    for(i = 0; i < UNDOFS_WAMP_DIRS; i++)
+    {
+        wamp_dir *dir = &dirs[(hash + i) % UNDOFS_WAMP_DIRS];
+        if(! __atomic_load_n(&dir->used, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&insert_lock);
+            if(! dir->used)
+            {
+                memcpy(dir->name, name, len);
+                dir->name[len] = 0;
+                __atomic_store_n(&dir->used, 1, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&insert_lock);
+        }
+        if(strncmp(dir->name, name, len) == 0 && dir->name[len] == 0)
+            return dir;
+    }
+    return NULL;
+}
+
+void undofs_wamp_add(const char *path, int counter, uint64_t amount)
+{
+    wamp_dir *dir;
+
+    if(counter < 0 || counter >= UNDOFS_WAMP_COUNTERS || amount == 0)
+        return;
+    __atomic_add_fetch(&totals[counter], amount, __ATOMIC_RELAXED);
+    dir = path ? find_dir(path) : NULL;
+    if(dir != NULL)
+        __atomic_add_fetch(&dir->counts[counter], amount, __ATOMIC_RELAXED);
+    else
+        __atomic_add_fetch(&dirs_dropped, 1, __ATOMIC_RELAXED);
+}
+
+size_t undofs_wamp_stats(char *buf, size_t size)
+{
+    size_t len = 0;
+    int i, n;
+
+    if(size == 0)
+        return 0;
+    buf[0] = 0;
+    for(i = 0; i < UNDOFS_WAMP_COUNTERS; i++)
+    {
+        n = snprintf(buf + len, size - len, "wamp_%s %llu\n", counter_names[i],
+                     (unsigned long long) __atomic_load_n(&totals[i], __ATOMIC_RELAXED));
+        if(n < 0 || (size_t) n >= size - len)
+            return len;
+        len += n;
+    }
+    n = snprintf(buf + len, size - len, "wamp_dirs_dropped %llu\n",
+                 (unsigned long long) __atomic_load_n(&dirs_dropped, __ATOMIC_RELAXED));
+    if(n > 0 && (size_t) n < size - len)
+        len += n;
+    return len;
+}
+
+static int by_bytes_copied(const void *a, const void *b)
+{
+    uint64_t x = (*(wamp_dir * const *) a)->counts[UNDOFS_WAMP_BYTES_COPIED];
+    uint64_t y = (*(wamp_dir * const *) b)->counts[UNDOFS_WAMP_BYTES_COPIED];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+size_t undofs_wamp_dirs(char *buf, size_t size)
+{
+    wamp_dir *used[UNDOFS_WAMP_DIRS];
+    size_t len = 0, count = 0, i;
+
+    if(size == 0)
+        return 0;
+    buf[0] = 0;
+    for(i = 0; i < UNDOFS_WAMP_DIRS; i++)
+        if(__atomic_load_n(&dirs[i].used, __ATOMIC_ACQUIRE))
+            used[count++] = &dirs[i];
+    // Counters keep moving while sorting, the order is only a hint.
+    qsort(used, count, sizeof(used[0]), by_bytes_copied);
+
+    for(i = 0; i < count; i++)
+    {
+        char name[NAME_MAX + 1];
+        unsigned long long counts[UNDOFS_WAMP_COUNTERS];
+        int c, n;
+
+        for(c = 0; used[i]->name[c]; c++)
+            name[c] = (unsigned char) used[i]->name[c] < ' ' ? '?' : used[i]->name[c];
+        name[c] = 0;
+        for(c = 0; c < UNDOFS_WAMP_COUNTERS; c++)
+            counts[c] = __atomic_load_n(&used[i]->counts[c], __ATOMIC_RELAXED);
+
+        n = snprintf(buf + len, size - len, "%llu %llu %llu %llu %llu %s\n",
+                     counts[UNDOFS_WAMP_BYTES_WRITTEN], counts[UNDOFS_WAMP_BYTES_COPIED],
+                     counts[UNDOFS_WAMP_VERSIONS_CREATED], counts[UNDOFS_WAMP_VERSIONS_DISCARDED],
+                     counts[UNDOFS_WAMP_VERSIONS_INLINED], name);
+        if(n < 0 || (size_t) n >= size - len)
+            break;
+        len += n;
+    }
+    return len;
+}
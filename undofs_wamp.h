@@ -0,0 +1,63 @@
+#ifndef __UNDOFS_WAMP_H_
+#define __UNDOFS_WAMP_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Write amplification accounting.
+ *
+ * Keeping history costs more than the data users write: a new version is
+ * a copy of the whole file, however small the edit that caused it. The
+ * counters below set the bytes written through the mount against the bytes
+ * copied to create versions, and count the version files created and
+ * removed again, for the whole mount and for each top-level directory, so
+ * the paths worth excluding or storing as deltas stand out. Files in the
+ * root directory are counted under "/".
+ *
+ * Copies count the whole size of the version, also where the filesystem
+ * shares extents instead of copying them.
+ *
+ * Counting takes no lock, except the first time a top-level directory is
+ * seen. Nothing in here depends on fuse.
+ */
+
+#define UNDOFS_WAMP_DIRS 256    // top-level directories counted on their own
+
+enum undofs_wamp_counter {
+    UNDOFS_WAMP_BYTES_WRITTEN = 0,  // written by users
+    UNDOFS_WAMP_BYTES_COPIED,       // copied into new versions
+    UNDOFS_WAMP_VERSIONS_CREATED,   // version files created
+    UNDOFS_WAMP_VERSIONS_DISCARDED, // version files created and removed again
+    UNDOFS_WAMP_VERSIONS_INLINED,   // version files moved into the meta file
+    UNDOFS_WAMP_COUNTERS
+};
+
+/**
+ * Add to a counter.
+ * @param path the relative path of the file, provided by FUSE.
+ * @param counter an enum undofs_wamp_counter.
+ * @param amount what to add.
+ */
+void undofs_wamp_add(const char *path, int counter, uint64_t amount);
+
+/**
+ * Describe the counters of the mount, one "name value" pair per line.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_wamp_stats(char *buf, size_t size);
+
+/**
+ * Describe the counters of each top-level directory, most bytes copied
+ * first, one "<written> <copied> <created> <discarded> <inlined> <name>"
+ * line each. Control characters in names are replaced by '?'.
+ * @param buf receives the text.
+ * @param size the size of buf.
+ * @return the length of the text.
+ */
+size_t undofs_wamp_dirs(char *buf, size_t size);
+
+#endif